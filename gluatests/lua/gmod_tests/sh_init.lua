@@ -24,6 +24,60 @@ function HolyLib_IsModuleEnabled(name)
 	return GetConVar("holylib_enable_" .. name):GetBool()
 end
 
+--- Makes a large nested table used by the util serialization tests, roughly 10MB as JSON
+--- @param count number? The number of entries (default 4000)
+MakeTestDataTable = function( count )
+    local tbl = {}
+    for i = 1, count or 4000 do
+        local entry = {
+            name = "Entry" .. i,
+            health = i * 1.5,
+            alive = i % 2 == 0,
+            pos = Vector( i, i * 2, i * 3 ),
+            ang = Angle( 0, i % 360, 0 ),
+            items = {},
+        }
+
+        for j = 1, 50 do
+            entry.items[j] = { id = j, amount = j * 0.25, label = "Item number " .. j }
+        end
+
+        tbl[i] = entry
+    end
+
+    return tbl
+end
+
+--- Compares two tables recursively
+--- @return string? The path of the first difference or nil if both are equal
+FindTestTableDifference = function( a, b, path )
+    path = path or "root"
+    if type( a ) ~= type( b ) then
+        return path .. " (" .. type( a ) .. " ~= " .. type( b ) .. ")"
+    end
+
+    if not istable( a ) then
+        if a ~= b then
+            return path .. " (" .. tostring( a ) .. " ~= " .. tostring( b ) .. ")"
+        end
+
+        return nil
+    end
+
+    for key, value in pairs( a ) do
+        local difference = FindTestTableDifference( value, b[key], path .. "." .. tostring( key ) )
+        if difference then return difference end
+    end
+
+    for key in pairs( b ) do
+        if a[key] == nil then
+            return path .. "." .. tostring( key ) .. " (missing)"
+        end
+    end
+
+    return nil
+end
+
 if SERVER then
     --- Makes an entity for test purposes
     --- @param class string? The class of the entity
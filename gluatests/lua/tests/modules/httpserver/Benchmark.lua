@@ -0,0 +1,82 @@
+local benchmarkPort = 32100
+local benchmarkRequests = 2000
+
+local function PrintResults( name, results )
+    print( string.format( "httpserver.Benchmark - %s: %i requests (%i failed) in %.2fs | %.0f req/s | avg %.3fms | p50 %.3fms | p99 %.3fms | max %.3fms",
+        name, results.requests, results.failed, results.duration, results.requestsPerSecond, results.average, results.p50, results.p99, results.max ) )
+end
+
+return {
+    groupName = "httpserver.Benchmark",
+    cases = {
+        {
+            name = "Function exists globally",
+            when = HolyLib_IsModuleEnabled( "httpserver" ),
+            func = function()
+                expect( httpserver ).to.beA( "table" )
+                expect( httpserver.Benchmark ).to.beA( "function" )
+            end
+        },
+        {
+            name = "Function doesn't exists globally",
+            when = not HolyLib_IsModuleEnabled( "httpserver" ),
+            func = function()
+                expect( httpserver ).to.beA( "nil" )
+            end
+        },
+        {
+            name = "Benchmarks Lua, prepared and static routes",
+            when = HolyLib_IsModuleEnabled( "httpserver" ),
+            async = true,
+            timeout = 30,
+            func = function()
+                local server = httpserver.Create()
+                server:SetName( "Benchmark" )
+                server:Get( "/lua", function( _, response )
+                    response:SetContent( "Hello World", "text/plain" )
+                end, false )
+
+                server:Get( "/prepared", function( _, response )
+                    response:SetContent( "Not prepared", "text/plain" )
+                end, false )
+
+                for _ = 1, benchmarkRequests do
+                    server:AddPreparedResponse( -1, "/prepared", "GET", {}, function( response )
+                        response:SetContent( "Hello World", "text/plain" )
+                    end )
+                end
+
+                server:AddStaticRoute( "/static", "Hello World", 0, "text/plain" )
+                server:Start( "127.0.0.1", benchmarkPort )
+
+                local routes = { "/lua", "/prepared", "/static" }
+                local function RunNext( index )
+                    local path = routes[index]
+                    if not path then
+                        server:Stop()
+                        done()
+                        return
+                    end
+
+                    httpserver.Benchmark( {
+                        port = benchmarkPort,
+                        path = path,
+                        connections = 4,
+                        requests = benchmarkRequests,
+                    }, function( results )
+                        PrintResults( path, results )
+
+                        expect( results.failed ).to.equal( 0 )
+                        expect( results.requests ).to.equal( benchmarkRequests )
+
+                        RunNext( index + 1 )
+                    end )
+                end
+
+                timer.Simple( 0.5, function() -- Give the server thread time to bind.
+                    RunNext( 1 )
+                end )
+            end
+        },
+    }
+}
@@ -0,0 +1,70 @@
+return {
+    groupName = "LuaInterface:Call",
+    cases = {
+        {
+            name = "Errors on an unknown function",
+            when = HolyLib_IsModuleEnabled( "luathreads" ),
+            func = function()
+                local thread = luathreads.CreateInterface()
+                expect( thread.Call, thread, "Unknown" ).to.err()
+            end
+        },
+        {
+            name = "Works without a callback",
+            when = HolyLib_IsModuleEnabled( "luathreads" ) and HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local thread = luathreads.CreateInterface()
+                thread:LoadFunction( "Nothing", "return" )
+                expect( thread.Call, thread, "Nothing" ).to.succeed()
+            end
+        },
+        {
+            name = "Calls a loaded function and updates its stats",
+            when = HolyLib_IsModuleEnabled( "luathreads" ) and HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 5,
+            func = function()
+                local thread = luathreads.CreateInterface( 2 )
+                thread:LoadFunction( "Sum", [[
+                    local a, b = ...
+                    return a + b, "done"
+                ]] )
+
+                local calls = 0
+                local function OnResult( success, sum, text )
+                    calls = calls + 1
+                    expect( success ).to.beTrue()
+                    expect( text ).to.equal( "done" )
+                    if calls < 10 then return end
+
+                    local stats = thread:GetFunctionStats( "Sum" )
+                    expect( stats.calls ).to.equal( 10 )
+                    expect( stats.errors ).to.equal( 0 )
+                    expect( stats.time ).to.beA( "number" )
+                    expect( thread:GetFunctionStats().Sum ).to.beA( "table" )
+                    done()
+                end
+
+                for i = 1, 10 do
+                    thread:Call( "Sum", OnResult, i, 1 )
+                end
+            end
+        },
+        {
+            name = "Passes errors to the callback",
+            when = HolyLib_IsModuleEnabled( "luathreads" ) and HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 5,
+            func = function()
+                local thread = luathreads.CreateInterface()
+                thread:LoadFunction( "Fail", "error( 'HolyLib' )" )
+                thread:Call( "Fail", function( success, err )
+                    expect( success ).to.equal( false )
+                    expect( err ).to.beA( "string" )
+                    expect( thread:GetFunctionStats( "Fail" ).errors ).to.equal( 1 )
+                    done()
+                end )
+            end
+        },
+    }
+}
@@ -0,0 +1,50 @@
+return {
+    groupName = "luathreads.CreateInterface",
+    cases = {
+        {
+            name = "Function exists globally",
+            when = HolyLib_IsModuleEnabled( "luathreads" ),
+            func = function()
+                expect( luathreads ).to.beA( "table" )
+                expect( luathreads.CreateInterface ).to.beA( "function" )
+            end
+        },
+        {
+            name = "Errors on an invalid number of states",
+            when = HolyLib_IsModuleEnabled( "luathreads" ),
+            func = function()
+                expect( luathreads.CreateInterface, 0 ).to.err()
+                expect( luathreads.CreateInterface, 65 ).to.err()
+            end
+        },
+        {
+            name = "Messages are processed by multiple states",
+            when = HolyLib_IsModuleEnabled( "luathreads" ) and HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 5,
+            func = function()
+                local thread = luathreads.CreateInterface( 4 )
+                thread:RunString( [[
+                    luathreads.SetReceiveCallback( function( number )
+                        luathreads.Send( number * 2 )
+                    end )
+                ]] )
+
+                local sum = 0
+                local received = 0
+                thread:SetReceiveCallback( function( number )
+                    sum = sum + number
+                    received = received + 1
+                    if received < 20 then return end
+
+                    expect( sum ).to.equal( 420 ) -- (1 + ... + 20) * 2
+                    done()
+                end )
+
+                for i = 1, 20 do
+                    thread:Send( i )
+                end
+            end
+        },
+    }
+}
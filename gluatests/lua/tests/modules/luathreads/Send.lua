@@ -0,0 +1,77 @@
+return {
+    groupName = "LuaInterface:Send",
+    cases = {
+        {
+            name = "Functions exist",
+            when = HolyLib_IsModuleEnabled( "luathreads" ),
+            func = function()
+                expect( luathreads.Send ).to.beA( "function" )
+                expect( luathreads.Receive ).to.beA( "function" )
+                expect( luathreads.SetReceiveCallback ).to.beA( "function" )
+            end
+        },
+        {
+            name = "luathreads.Send errors outside of a LuaInterface",
+            when = HolyLib_IsModuleEnabled( "luathreads" ),
+            func = function()
+                expect( luathreads.Send, 1 ).to.err()
+            end
+        },
+        {
+            name = "Sends values to the thread and back",
+            when = HolyLib_IsModuleEnabled( "luathreads" ) and HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 5,
+            func = function()
+                local thread = luathreads.CreateInterface()
+                thread:RunString( [[
+                    luathreads.SetReceiveCallback( function( tbl, text, buffer )
+                        luathreads.Send( tbl.a + tbl.b, text .. "!", buffer )
+                    end )
+                ]] )
+
+                local buffer = util.CreateByteBuffer( "HolyLib" )
+                thread:SetReceiveCallback( function( sum, text, receivedBuffer )
+                    expect( sum ).to.equal( 3 )
+                    expect( text ).to.equal( "Hello!" )
+                    expect( receivedBuffer:ToString() ).to.equal( "HolyLib" )
+                    done()
+                end )
+
+                thread:Send( { a = 1, b = 2 }, "Hello", buffer )
+            end
+        },
+        {
+            name = "Sends ByteBuffers inside of tables",
+            when = HolyLib_IsModuleEnabled( "luathreads" ) and HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 5,
+            func = function()
+                local thread = luathreads.CreateInterface()
+                thread:RunString( [[
+                    luathreads.SetReceiveCallback( function( tbl )
+                        luathreads.Send( { tbl.buffers[2], key = tbl.key } )
+                    end )
+                ]] )
+
+                thread:SetReceiveCallback( function( tbl )
+                    expect( tbl[1]:IsValid() ).to.beTrue()
+                    expect( tbl[1]:ToString() ).to.equal( "Lib" )
+                    expect( tbl.key:ToString() ).to.equal( "Key" )
+                    done()
+                end )
+
+                local buffer = util.CreateByteBuffer( "HolyLib" )
+                thread:Send( { buffers = { buffer:Slice( 0, 4 ), buffer:Slice( 4 ) }, key = util.CreateByteBuffer( "Key" ) } )
+            end
+        },
+        {
+            name = "Receive returns false without a message",
+            when = HolyLib_IsModuleEnabled( "luathreads" ),
+            func = function()
+                local thread = luathreads.CreateInterface()
+                expect( thread:Receive() ).to.equal( false )
+            end
+        },
+    }
+}
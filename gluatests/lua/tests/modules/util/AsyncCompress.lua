@@ -0,0 +1,118 @@
+local testData = string.rep( "HolyLib compression test data. ", 100000 ) -- ~3MB so that we get multiple chunks
+
+local function TestRoundTrip( options )
+    util.AsyncCompress( testData, function( compressed )
+        expect( compressed ).to.beA( "string" )
+        expect( #compressed ).to.beLessThan( #testData )
+
+        util.AsyncDecompress( compressed, function( decompressed )
+            expect( decompressed ).to.equal( testData )
+            done()
+        end )
+    end, options )
+end
+
+return {
+    groupName = "util.AsyncCompress",
+    cases = {
+        {
+            name = "Function exists globally",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                expect( util.AsyncCompress ).to.beA( "function" )
+                expect( util.AsyncDecompress ).to.beA( "function" )
+            end
+        },
+        {
+            name = "Chunked lzma round trip",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 30,
+            func = function()
+                TestRoundTrip( { codec = "lzma", chunkSize = 65536 * 4 } )
+            end
+        },
+        {
+            name = "Chunked lz4 round trip",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 10,
+            func = function()
+                TestRoundTrip( { codec = "lz4", chunkSize = 65536 * 4 } )
+            end
+        },
+        {
+            name = "Chunked lz4hc round trip",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 10,
+            func = function()
+                TestRoundTrip( { codec = "lz4hc" } )
+            end
+        },
+        {
+            name = "Returns ByteBuffers if requested",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 10,
+            func = function()
+                util.AsyncCompress( testData, function( compressed )
+                    expect( compressed:IsValid() ).to.beTrue()
+                    expect( compressed:GetSize() ).to.beLessThan( #testData )
+
+                    util.AsyncDecompress( compressed, function( decompressed )
+                        expect( decompressed:IsValid() ).to.beTrue()
+                        expect( decompressed:ToString() ).to.equal( testData )
+                        done()
+                    end, 0.98, true )
+                end, { codec = "lz4", byteBuffer = true } )
+            end
+        },
+        {
+            name = "Invalid chunked data returns nil",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 5,
+            func = function()
+                util.AsyncDecompress( "HLCZ" .. string.rep( "\0", 32 ), function( decompressed )
+                    expect( decompressed ).to.beNil()
+                    done()
+                end )
+            end
+        },
+        {
+            name = "Errors on unknown codec",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                expect( util.AsyncCompress, testData, function() end, { codec = "zip" } ).to.err()
+            end
+        },
+        {
+            name = "Runs only holylib_jobs_callbacks callbacks per think",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 10,
+            func = function()
+                local oldCallbacks = GetConVar( "holylib_jobs_callbacks" ):GetString()
+                RunConsoleCommand( "holylib_jobs_callbacks", "1" )
+
+                timer.Simple( 0, function() -- Wait for the ConVar change to apply.
+                    local ticks = {}
+                    local function OnCompressed()
+                        table.insert( ticks, engine.TickCount() )
+                        if #ticks < 3 then return end
+
+                        RunConsoleCommand( "holylib_jobs_callbacks", oldCallbacks )
+                        expect( ticks[1] ).to.beLessThan( ticks[2] )
+                        expect( ticks[2] ).to.beLessThan( ticks[3] )
+                        done()
+                    end
+
+                    for _ = 1, 3 do
+                        util.AsyncCompress( "HolyLib", OnCompressed )
+                    end
+                end )
+            end
+        },
+    }
+}
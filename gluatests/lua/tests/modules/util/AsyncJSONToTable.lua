@@ -0,0 +1,68 @@
+return {
+    groupName = "util.AsyncJSONToTable",
+    cases = {
+        {
+            name = "Function exists globally",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                expect( util.AsyncJSONToTable ).to.beA( "function" )
+            end
+        },
+        {
+            name = "Parses nested arrays, objects and vectors",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 5,
+            func = function()
+                util.AsyncJSONToTable( "[{\"a\":1,\"b\":[1,2,[3]],\"pos\":\"[1 2 3]\"},\"text\",true,null,5]", function( tbl )
+                    expect( tbl[1].a ).to.equal( 1 )
+                    expect( tbl[1].b[2] ).to.equal( 2 )
+                    expect( tbl[1].b[3][1] ).to.equal( 3 )
+                    expect( tbl[1].pos ).to.equal( Vector( 1, 2, 3 ) )
+                    expect( tbl[2] ).to.equal( "text" )
+                    expect( tbl[3] ).to.beTrue()
+                    expect( tbl[4] ).to.beNil()
+                    expect( tbl[5] ).to.equal( 5 )
+                    done()
+                end )
+            end
+        },
+        {
+            name = "Calls the callback with nil for invalid json",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 5,
+            func = function()
+                util.AsyncJSONToTable( "{\"a\":", function( tbl )
+                    expect( tbl ).to.beNil()
+                    done()
+                end )
+            end
+        },
+        {
+            name = "Creates large tables over multiple ticks",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            async = true,
+            timeout = 60,
+            func = function()
+                local json = util.TableToJSON( MakeTestDataTable() )
+                local expected = util.JSONToTable( json )
+                local oldNodes = GetConVar( "holylib_util_jsonnodespertick" ):GetString()
+                RunConsoleCommand( "holylib_util_jsonnodespertick", "20000" )
+
+                timer.Simple( 0, function() -- Wait for the ConVar change to apply.
+                    local startTick = engine.TickCount()
+                    local startTime = SysTime()
+                    util.AsyncJSONToTable( json, function( tbl )
+                        print( string.format( "util.AsyncJSONToTable - %.2fMB in %.2fms over %i ticks", #json / 1024 / 1024, ( SysTime() - startTime ) * 1000, engine.TickCount() - startTick ) )
+                        RunConsoleCommand( "holylib_util_jsonnodespertick", oldNodes )
+
+                        expect( engine.TickCount() - startTick ).to.beGreaterThan( 1 )
+                        expect( FindTestTableDifference( tbl, expected ) ).to.beNil()
+                        done()
+                    end )
+                end )
+            end
+        },
+    }
+}
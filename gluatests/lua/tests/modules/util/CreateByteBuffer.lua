@@ -0,0 +1,50 @@
+return {
+    groupName = "util.CreateByteBuffer",
+    cases = {
+        {
+            name = "Function exists globally",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                expect( util.CreateByteBuffer ).to.beA( "function" )
+            end
+        },
+        {
+            name = "Creates, slices and copies buffers",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local buffer = util.CreateByteBuffer( "Hello World" )
+                expect( buffer:IsValid() ).to.beTrue()
+                expect( buffer:GetSize() ).to.equal( 11 )
+                expect( buffer:ToString() ).to.equal( "Hello World" )
+
+                local slice = buffer:Slice( 6 )
+                expect( slice:ToString() ).to.equal( "World" )
+                expect( slice:Slice( 1, 3 ):ToString() ).to.equal( "orl" )
+                expect( slice:Copy():ToString() ).to.equal( "World" )
+
+                expect( buffer.Slice, buffer, 12 ).to.err()
+                expect( buffer.Slice, buffer, 6, 6 ).to.err()
+            end
+        },
+        {
+            name = "Can be read by bitbuf.CreateReadBuffer",
+            when = HolyLib_IsModuleEnabled( "util" ) and HolyLib_IsModuleEnabled( "bitbuf" ),
+            func = function()
+                local bf = bitbuf.CreateReadBuffer( util.CreateByteBuffer( "HolyLib\0" ) )
+                expect( bf:ReadString() ).to.equal( "HolyLib" )
+            end
+        },
+        {
+            name = "Can be used by util.CompressLZ4",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local data = string.rep( "ByteBuffer ", 1000 )
+                local compressed = util.CompressLZ4( util.CreateByteBuffer( data ), 1, true )
+                expect( compressed:GetSize() ).to.beLessThan( #data )
+
+                local decompressed = util.DecompressLZ4( compressed )
+                expect( decompressed ).to.equal( data )
+            end
+        },
+    }
+}
@@ -0,0 +1,89 @@
+return {
+    groupName = "util.FancyJSONToTable",
+    cases = {
+        {
+            name = "Function exists globally",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                expect( util.FancyJSONToTable ).to.beA( "function" )
+            end
+        },
+        {
+            name = "Parses nested arrays and objects",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local tbl = util.FancyJSONToTable( "[{\"a\":1,\"b\":[1,2,[3]]},\"text\",true,null,5]" )
+                expect( tbl[1].a ).to.equal( 1 )
+                expect( tbl[1].b[2] ).to.equal( 2 )
+                expect( tbl[1].b[3][1] ).to.equal( 3 )
+                expect( tbl[2] ).to.equal( "text" )
+                expect( tbl[3] ).to.beTrue()
+                expect( tbl[4] ).to.beNil()
+                expect( tbl[5] ).to.equal( 5 )
+
+                expect( table.Count( util.FancyJSONToTable( "5" ) ) ).to.equal( 0 )
+                expect( util.FancyJSONToTable, "{\"a\":" ).to.err()
+            end
+        },
+        {
+            name = "Parses vectors and angles",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local tbl = util.FancyJSONToTable( "{\"pos\":\"[1 2 3]\",\"ang\":\"{4 5 6}\",\"text\":\"[not a vector]\"}" )
+                expect( tbl.pos ).to.equal( Vector( 1, 2, 3 ) )
+                expect( tbl.ang ).to.equal( Angle( 4, 5, 6 ) )
+                expect( tbl.text ).to.equal( "[not a vector]" )
+            end
+        },
+        {
+            name = "Only parses strings with 3 numbers as vectors and angles",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local tbl = util.FancyJSONToTable( "[\"[1 2]\",\"{1 2}\",\"[1 2 a]\",\"{a b c}\",\"[]\",\"[1 2 3\",\"[-1.5 2e2 3]\",\"{0 90 -180}\"]" )
+                expect( tbl[1] ).to.equal( "[1 2]" )
+                expect( tbl[2] ).to.equal( "{1 2}" )
+                expect( tbl[3] ).to.equal( "[1 2 a]" )
+                expect( tbl[4] ).to.equal( "{a b c}" )
+                expect( tbl[5] ).to.equal( "[]" )
+                expect( tbl[6] ).to.equal( "[1 2 3" )
+                expect( tbl[7] ).to.equal( Vector( -1.5, 200, 3 ) )
+                expect( tbl[8] ).to.equal( Angle( 0, 90, -180 ) )
+            end
+        },
+        {
+            name = "Keeps the array index across tables in arrays",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local tbl = util.FancyJSONToTable( "[{\"a\":[1,{\"b\":2}]},2,[3,[4]],{},[],5]" )
+                expect( tbl[1].a[1] ).to.equal( 1 )
+                expect( tbl[1].a[2].b ).to.equal( 2 )
+                expect( tbl[2] ).to.equal( 2 )
+                expect( tbl[3][1] ).to.equal( 3 )
+                expect( tbl[3][2][1] ).to.equal( 4 )
+                expect( table.Count( tbl[4] ) ).to.equal( 0 )
+                expect( table.Count( tbl[5] ) ).to.equal( 0 )
+                expect( tbl[6] ).to.equal( 5 )
+                expect( #tbl ).to.equal( 6 )
+            end
+        },
+        {
+            name = "Parses a large table like util.JSONToTable",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local json = util.TableToJSON( MakeTestDataTable() )
+
+                local start = SysTime()
+                local tbl = util.FancyJSONToTable( json )
+                local fancyTime = SysTime() - start
+
+                start = SysTime()
+                local expected = util.JSONToTable( json )
+                local gmodTime = SysTime() - start
+
+                print( string.format( "util.FancyJSONToTable: %.2fMB in %.3fms (%.2fMB/s) | util.JSONToTable: %.3fms", #json / 1024 / 1024, fancyTime * 1000, #json / 1024 / 1024 / fancyTime, gmodTime * 1000 ) )
+
+                expect( FindTestTableDifference( tbl, expected ) ).to.beNil()
+            end
+        },
+    }
+}
@@ -0,0 +1,62 @@
+return {
+    groupName = "util.FancyTableToJSON",
+    cases = {
+        {
+            name = "Function exists globally",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                expect( util.FancyTableToJSON ).to.beA( "function" )
+            end
+        },
+        {
+            name = "Writes arrays, objects and mixed tables",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                expect( util.FancyTableToJSON( { 1, 2, 3 } ) ).to.equal( "[1,2,3]" )
+                expect( util.FancyTableToJSON( { a = "b" } ) ).to.equal( "{\"a\":\"b\"}" )
+                expect( util.FancyTableToJSON( {} ) ).to.equal( "[]" )
+
+                local mixed = util.JSONToTable( util.FancyTableToJSON( { 1, 2, a = true } ) )
+                expect( mixed["1"] or mixed[1] ).to.equal( 1 )
+                expect( mixed.a ).to.beTrue()
+            end
+        },
+        {
+            name = "Handles cyclic tables",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local tbl = { a = 1 }
+                tbl.self = tbl
+
+                expect( util.FancyTableToJSON, tbl ).to.err()
+
+                local decoded = util.JSONToTable( util.FancyTableToJSON( tbl, false, true ) )
+                expect( decoded.a ).to.equal( 1 )
+                expect( decoded.self ).to.beNil()
+
+                local shared = { 1 }
+                expect( util.FancyTableToJSON( { shared, shared } ) ).to.equal( "[[1],[1]]" )
+            end
+        },
+        {
+            name = "Round trips a large table like util.TableToJSON",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local tbl = MakeTestDataTable()
+
+                local start = SysTime()
+                local json = util.FancyTableToJSON( tbl )
+                local fancyTime = SysTime() - start
+
+                start = SysTime()
+                local gmodJson = util.TableToJSON( tbl )
+                local gmodTime = SysTime() - start
+
+                print( string.format( "util.FancyTableToJSON: %.2fMB in %.3fms | util.TableToJSON: %.3fms", #json / 1024 / 1024, fancyTime * 1000, gmodTime * 1000 ) )
+
+                expect( FindTestTableDifference( util.JSONToTable( json ), tbl ) ).to.beNil()
+                expect( FindTestTableDifference( util.JSONToTable( json ), util.JSONToTable( gmodJson ) ) ).to.beNil()
+            end
+        },
+    }
+}
@@ -0,0 +1,108 @@
+return {
+    groupName = "util.TableToBinary",
+    cases = {
+        {
+            name = "Functions exists globally",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                expect( util.TableToBinary ).to.beA( "function" )
+                expect( util.BinaryToTable ).to.beA( "function" )
+                expect( util.AsyncTableToBinary ).to.beA( "function" )
+            end
+        },
+        {
+            name = "Round trips all supported types",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local tbl = {
+                    1, -5, 300, -70000, 2^31, 0.5, "text", true, false,
+                    nested = { a = "text", b = { 1, 2, 3 } },
+                    pos = Vector( 1.5, 2, 3 ),
+                    ang = Angle( 4, 5, 6 ),
+                    [5.5] = "float key",
+                    [true] = "bool key",
+                    world = game.GetWorld(),
+                    null = NULL,
+                }
+
+                local result = util.BinaryToTable( util.TableToBinary( tbl ) )
+                expect( result[1] ).to.equal( 1 )
+                expect( result[2] ).to.equal( -5 )
+                expect( result[3] ).to.equal( 300 )
+                expect( result[4] ).to.equal( -70000 )
+                expect( result[5] ).to.equal( 2^31 )
+                expect( result[6] ).to.equal( 0.5 )
+                expect( result[7] ).to.equal( "text" )
+                expect( result[8] ).to.beTrue()
+                expect( result[9] ).to.beFalse()
+                expect( result.nested.a ).to.equal( "text" )
+                expect( result.nested.b[3] ).to.equal( 3 )
+                expect( result.pos ).to.equal( Vector( 1.5, 2, 3 ) )
+                expect( result.ang ).to.equal( Angle( 4, 5, 6 ) )
+                expect( result[5.5] ).to.equal( "float key" )
+                expect( result[true] ).to.equal( "bool key" )
+                expect( result.world ).to.equal( game.GetWorld() )
+                expect( IsValid( result.null ) ).to.beFalse()
+            end
+        },
+        {
+            name = "Handles cyclic tables and invalid data",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local tbl = { a = 1 }
+                tbl.self = tbl
+
+                expect( util.TableToBinary, tbl ).to.err()
+                expect( util.BinaryToTable( util.TableToBinary( tbl, true ) ).a ).to.equal( 1 )
+
+                expect( util.BinaryToTable, "not binary" ).to.err()
+                expect( util.BinaryToTable, string.sub( util.TableToBinary( { 1, 2, 3 } ), 1, -2 ) ).to.err()
+            end
+        },
+        {
+            name = "Async version matches the sync version",
+            when = HolyLib_IsModuleEnabled( "util" ) and HolyLib_IsModuleEnabled( "luajit" ),
+            async = true,
+            timeout = 5,
+            func = function()
+                local tbl = { a = "b", 1, 2, 3 }
+                util.AsyncTableToBinary( tbl, function( data )
+                    local result = util.BinaryToTable( data )
+                    expect( result.a ).to.equal( "b" )
+                    expect( result[3] ).to.equal( 3 )
+                    done()
+                end )
+            end
+        },
+        {
+            name = "Benchmark against util.FancyTableToJSON",
+            when = HolyLib_IsModuleEnabled( "util" ),
+            func = function()
+                local tbl = MakeTestDataTable()
+
+                local start = SysTime()
+                local json = util.FancyTableToJSON( tbl )
+                local jsonWrite = SysTime() - start
+
+                start = SysTime()
+                util.FancyJSONToTable( json )
+                local jsonRead = SysTime() - start
+
+                start = SysTime()
+                local binary = util.TableToBinary( tbl )
+                local binaryWrite = SysTime() - start
+
+                start = SysTime()
+                local result = util.BinaryToTable( binary )
+                local binaryRead = SysTime() - start
+
+                print( string.format( "JSON: %.2fMB write %.3fms read %.3fms | Binary: %.2fMB write %.3fms read %.3fms",
+                    #json / 1024 / 1024, jsonWrite * 1000, jsonRead * 1000, #binary / 1024 / 1024, binaryWrite * 1000, binaryRead * 1000 ) )
+
+                expect( #binary ).to.beLessThan( #json )
+                expect( FindTestTableDifference( result, tbl ) ).to.beNil()
+                expect( FindTestTableDifference( result, util.JSONToTable( util.TableToJSON( tbl ) ) ) ).to.beNil()
+            end
+        },
+    }
+}
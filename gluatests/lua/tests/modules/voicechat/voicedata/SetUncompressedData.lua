@@ -24,5 +24,24 @@ return {
                 --expect( voiceData:SetUncompressedData("") ).to.equal( 0 )
             end
         },
+        {
+            name = "Encodes data longer than a single codec block",
+            when = HolyLib_IsModuleEnabled("voicechat"),
+            func = function()
+                local samples = {}
+                for i = 1, 24000 * 20 do -- 20 seconds, its encoded size can't fit into one uint16 length
+                    local sample = math.floor( math.sin( i / 10 ) * 8000 ) % 65536
+                    samples[i] = string.char( sample % 256, math.floor( sample / 256 ) )
+                end
+                local pcm = table.concat( samples )
+
+                local voiceData = voicechat.CreateVoiceData()
+                expect( voiceData:SetUncompressedData( pcm, 24000 ) ).to.beTrue()
+
+                local decoded = voiceData:GetUncompressedData( #pcm, 24000 )
+                expect( decoded ).to.beA( "string" )
+                expect( #decoded ).to.equal( #pcm )
+            end
+        },
     }
 }
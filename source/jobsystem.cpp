@@ -0,0 +1,205 @@
+#include "jobsystem.h"
+#include "module.h"
+#include "convar.h"
+#include "Platform.hpp"
+#include "tier0/threadtools.h"
+#include <algorithm>
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+static void OnJobThreadsChange(IConVar* convar, const char* pOldValue, float flOldValue)
+{
+	g_pModuleManager.GetJobSystem().Stop(); // The next job will start the threads again using the new value.
+}
+
+static ConVar jobs_threads("holylib_jobs_threads", "2", FCVAR_ARCHIVE, "The number of threads that run the async jobs of all modules, 0 = run them on the thread that queued them", OnJobThreadsChange);
+
+IJob::~IJob()
+{
+	// Our owner has to Cancel or Wait for us before deleting us, by now the members Execute uses are already destroyed.
+	Assert(m_iState != JobState_RUNNING);
+
+	CJobSystem* pJobSystem = m_pJobSystem; // Still queued, so just remove us.
+	if (pJobSystem)
+		pJobSystem->Cancel(this);
+}
+
+CJobSystem::~CJobSystem()
+{
+	Stop();
+}
+
+bool CJobSystem::Queue(IJob* pJob, JobPriority iPriority)
+{
+	std::unique_lock<std::mutex> lock(m_pMutex);
+	if (pJob->m_iState == JobState_QUEUED || pJob->m_iState == JobState_RUNNING)
+		return false;
+
+	pJob->m_iPriority = iPriority;
+	pJob->m_pJobSystem = this;
+	if (jobs_threads.GetInt() <= 0)
+	{
+		RunJob(pJob, lock);
+		return true;
+	}
+
+	pJob->m_iState = JobState_QUEUED;
+	m_pQueues[iPriority].push_back(pJob);
+	++m_iQueuedJobs;
+
+	if (m_iThreads == 0)
+		StartThreads();
+
+	m_pCondition.notify_one();
+	return true;
+}
+
+void CJobSystem::QueueCall(void (*pFunc)(), JobPriority iPriority)
+{
+	CFunctionJob* pJob = new CFunctionJob(pFunc);
+	pJob->m_bDeleteUs = true;
+	Queue(pJob, iPriority);
+}
+
+bool CJobSystem::Cancel(IJob* pJob)
+{
+	std::unique_lock<std::mutex> lock(m_pMutex);
+	if (pJob->m_iState == JobState_QUEUED)
+	{
+		std::deque<IJob*>& pQueue = m_pQueues[pJob->m_iPriority];
+		pQueue.erase(std::find(pQueue.begin(), pQueue.end(), pJob));
+		--m_iQueuedJobs;
+
+		pJob->m_iState = JobState_CANCELED;
+		pJob->m_pJobSystem = nullptr;
+		return true;
+	}
+
+	m_pFinishedCondition.wait(lock, [pJob] { return pJob->m_iState != JobState_RUNNING; });
+	return false;
+}
+
+void CJobSystem::Wait(IJob* pJob)
+{
+	std::unique_lock<std::mutex> lock(m_pMutex);
+	if (pJob->m_iState == JobState_QUEUED)
+	{
+		std::deque<IJob*>& pQueue = m_pQueues[pJob->m_iPriority];
+		pQueue.erase(std::find(pQueue.begin(), pQueue.end(), pJob));
+		--m_iQueuedJobs;
+
+		RunJob(pJob, lock);
+		return;
+	}
+
+	m_pFinishedCondition.wait(lock, [pJob] { return pJob->m_iState != JobState_RUNNING; });
+}
+
+void CJobSystem::Stop()
+{
+	std::unique_lock<std::mutex> lock(m_pMutex);
+	if (m_iThreads == 0)
+		return;
+
+	m_bStopping = true;
+	m_pCondition.notify_all();
+	m_pFinishedCondition.wait(lock, [this] { return m_iThreads == 0; });
+	m_bStopping = false;
+
+	if (m_iQueuedJobs > 0) // Someone queued a job after the last thread exited.
+		StartThreads();
+}
+
+int CJobSystem::GetThreadCount()
+{
+	std::unique_lock<std::mutex> lock(m_pMutex);
+	return m_iThreads;
+}
+
+int CJobSystem::GetQueuedJobs()
+{
+	std::unique_lock<std::mutex> lock(m_pMutex);
+	return m_iQueuedJobs;
+}
+
+#if ARCHITECTURE_IS_X86_64
+static long long unsigned
+#else
+static unsigned
+#endif
+JobThread(void* pData)
+{
+	((CJobSystem*)pData)->ThreadLoop();
+
+	return 0;
+}
+
+void CJobSystem::StartThreads()
+{
+	int iThreads = MAX(jobs_threads.GetInt(), 1);
+	for (int i = 0; i < iThreads; ++i)
+	{
+		++m_iThreads;
+		CreateSimpleThread((ThreadFunc_t)JobThread, this);
+	}
+}
+
+IJob* CJobSystem::PopJob()
+{
+	for (int iPriority = JobPriority_COUNT - 1; iPriority >= 0; --iPriority)
+	{
+		std::deque<IJob*>& pQueue = m_pQueues[iPriority];
+		if (pQueue.empty())
+			continue;
+
+		IJob* pJob = pQueue.front();
+		pQueue.pop_front();
+		--m_iQueuedJobs;
+		return pJob;
+	}
+
+	return NULL;
+}
+
+/*
+ * Runs the job unlocked, afterwards we never touch it again since the owner might delete it as soon as it's done.
+ */
+void CJobSystem::RunJob(IJob* pJob, std::unique_lock<std::mutex>& pLock)
+{
+	pJob->m_iState = JobState_RUNNING;
+	bool bDeleteUs = pJob->m_bDeleteUs;
+	pLock.unlock();
+
+	pJob->Execute();
+
+	pLock.lock();
+	pJob->m_iState = JobState_DONE;
+	pJob->m_pJobSystem = nullptr;
+	m_pFinishedCondition.notify_all();
+
+	if (bDeleteUs)
+	{
+		pLock.unlock();
+		delete pJob;
+		pLock.lock();
+	}
+}
+
+void CJobSystem::ThreadLoop()
+{
+	std::unique_lock<std::mutex> lock(m_pMutex);
+	while (true)
+	{
+		m_pCondition.wait(lock, [this] { return m_bStopping || m_iQueuedJobs > 0; });
+
+		IJob* pJob = PopJob();
+		if (!pJob) // We only exit once every queued job was run.
+			break;
+
+		RunJob(pJob, lock);
+	}
+
+	--m_iThreads;
+	m_pFinishedCondition.notify_all();
+}
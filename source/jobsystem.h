@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+enum JobPriority
+{
+	JobPriority_LOW = 0,
+	JobPriority_NORMAL,
+	JobPriority_HIGH,
+	JobPriority_COUNT,
+};
+
+enum JobState
+{
+	JobState_NONE = 0, // Never queued
+	JobState_QUEUED,
+	JobState_RUNNING,
+	JobState_DONE,
+	JobState_CANCELED, // Removed from the queue before it ran
+};
+
+class CJobSystem;
+
+/*
+ * A job that is run on the CJobSystem threads.
+ * The job is owned by whoever queued it and is also its cancel handle, see CJobSystem::Cancel.
+ * Before deleting a job one has to call CJobSystem::Cancel or CJobSystem::Wait,
+ * since a job that is still running would use the members of the derived class that were already destroyed.
+ */
+class IJob
+{
+public:
+	virtual ~IJob();
+	virtual void Execute() = 0;
+
+	inline JobState GetState() { return m_iState; };
+	inline JobPriority GetPriority() { return m_iPriority; };
+
+	// True if the job isn't queued or running, only then its results can be read & it can be deleted.
+	inline bool IsIdle() { JobState iState = m_iState; return iState != JobState_QUEUED && iState != JobState_RUNNING; };
+
+private:
+	friend class CJobSystem;
+	std::atomic<JobState> m_iState{JobState_NONE};
+	std::atomic<CJobSystem*> m_pJobSystem{nullptr}; // Set while we're queued or running.
+	JobPriority m_iPriority = JobPriority_NORMAL;
+	bool m_bDeleteUs = false; // Used by CJobSystem::QueueCall
+};
+
+/*
+ * A job that simply calls the given function.
+ */
+class CFunctionJob : public IJob
+{
+public:
+	CFunctionJob(void (*pFunc)()) : m_pFunc(pFunc) {};
+	virtual void Execute() { m_pFunc(); };
+
+private:
+	void (*m_pFunc)();
+};
+
+/*
+ * The threads shared by all modules for their async work, owned by the CModuleManager.
+ * Jobs with a higher priority are always run first, jobs with the same priority in the order they were queued.
+ * The threads are only created when the first job is queued, their number is set by holylib_jobs_threads.
+ */
+class CJobSystem
+{
+public:
+	~CJobSystem();
+
+	// Returns false if the job is already queued or running.
+	bool Queue(IJob* pJob, JobPriority iPriority = JobPriority_NORMAL);
+
+	// Queues a job that calls the given function, it's deleted after it ran.
+	void QueueCall(void (*pFunc)(), JobPriority iPriority = JobPriority_NORMAL);
+
+	/*
+	 * Removes the job from the queue or waits until it finished running.
+	 * Afterwards the job won't be touched by us anymore and can be deleted.
+	 * Returns true if the job was removed before it could run.
+	 */
+	bool Cancel(IJob* pJob);
+
+	// Runs the job on the calling thread if it's still queued, else it waits until it finished running.
+	void Wait(IJob* pJob);
+
+	// Runs every queued job & waits for the threads to exit, new jobs will start them again.
+	void Stop();
+
+	int GetThreadCount();
+	int GetQueuedJobs();
+
+	void ThreadLoop(); // Only called by our threads.
+
+private:
+	void StartThreads(); // m_pMutex has to be locked.
+	IJob* PopJob(); // m_pMutex has to be locked.
+	void RunJob(IJob* pJob, std::unique_lock<std::mutex>& pLock);
+
+	std::mutex m_pMutex;
+	std::condition_variable m_pCondition; // Notified when a job is queued or the threads should stop.
+	std::condition_variable m_pFinishedCondition; // Notified when a job finished or a thread exited.
+	std::deque<IJob*> m_pQueues[JobPriority_COUNT];
+	int m_iThreads = 0;
+	int m_iQueuedJobs = 0;
+	bool m_bStopping = false;
+};
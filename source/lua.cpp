@@ -7,6 +7,7 @@
 #include "detours.h"
 #include "module.h"
 #include "CLuaInterface.h"
+#include "convar.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -299,6 +300,42 @@ const std::unordered_set<Lua::StateData*>& Lua::GetAllLuaData()
 	return g_pLuaStates;
 }
 
+static ConVar jobs_callbacks("holylib_jobs_callbacks", "0", FCVAR_ARCHIVE, "The maximum number of async job callbacks that are run per think, 0 = no limit");
+static ConVar jobs_callbacktime("holylib_jobs_callbacktime", "0", FCVAR_ARCHIVE, "The maximum time in ms that is spent on async job callbacks per think, 0 = no limit");
+bool Lua::CanRunJobCallback(GarrysMod::Lua::ILuaInterface* LUA)
+{
+	Lua::StateData* pData = Lua::GetLuaData(LUA);
+	if (!pData || pData->iJobCallbacks == 0) // Always allow one callback so that jobs can't get stuck.
+	{
+		if (pData)
+			pData->fJobCallbackStart = Plat_FloatTime();
+
+		return true;
+	}
+
+	if (jobs_callbacks.GetInt() > 0 && pData->iJobCallbacks >= jobs_callbacks.GetInt())
+		return false;
+
+	if (jobs_callbacktime.GetFloat() > 0 && (Plat_FloatTime() - pData->fJobCallbackStart) * 1000 >= jobs_callbacktime.GetFloat())
+		return false;
+
+	return true;
+}
+
+void Lua::OnJobCallback(GarrysMod::Lua::ILuaInterface* LUA)
+{
+	Lua::StateData* pData = Lua::GetLuaData(LUA);
+	if (pData)
+		++pData->iJobCallbacks;
+}
+
+void Lua::ResetJobCallbacks(GarrysMod::Lua::ILuaInterface* LUA)
+{
+	Lua::StateData* pData = Lua::GetLuaData(LUA);
+	if (pData)
+		pData->iJobCallbacks = 0;
+}
+
 static void LuaCheck(const CCommand& args)
 {
 	if (!g_Lua)
@@ -70,6 +70,7 @@ namespace Lua
 		CVProfNode,
 		VProfCounter,
 		LuaInterface,
+		ByteBuffer,
 		// WavAudioFile,
 
 		TOTAL_TYPES = 255,
@@ -93,6 +94,10 @@ namespace Lua
 		LuaMetaEntry pLuaTypes[LuaTypes::TOTAL_TYPES];
 		std::unordered_map<void*, LuaUserData*> pPushedUserData; // Would love to get rid of this
 
+		// Used by Lua::CanRunJobCallback to limit the async job callbacks that are run per think.
+		int iJobCallbacks = 0;
+		double fJobCallbackStart = 0.0;
+
 		~StateData()
 		{
 			for (int i = 0; i < Lua::Internal::pMaxEntries; ++i)
@@ -164,6 +169,16 @@ namespace Lua
 	extern void RemoveLuaData(GarrysMod::Lua::ILuaInterface* LUA);
 	extern const std::unordered_set<Lua::StateData*>& GetAllLuaData();
 
+	/*
+	 * All async jobs share a budget for the callbacks that are run per think,
+	 * so that many jobs finishing at the same time won't cause a lag spike.
+	 * Call CanRunJobCallback before running a callback and if it returns false, keep the job for the next think.
+	 * After the callback was run, call OnJobCallback.
+	 */
+	extern bool CanRunJobCallback(GarrysMod::Lua::ILuaInterface* LUA);
+	extern void OnJobCallback(GarrysMod::Lua::ILuaInterface* LUA);
+	extern void ResetJobCallbacks(GarrysMod::Lua::ILuaInterface* LUA); // Called by the module manager before every LuaThink.
+
 	// ToDo
 	// - EnterLockdown
 	// - LeaveLockdown
@@ -182,4 +197,5 @@ namespace RawLua {
 	extern void SetReadOnly(TValue* o, bool readOnly);
 	extern void* GetUserDataOrFFIVar(lua_State* L, int idx, bool cDataTypes[USHRT_MAX]);
 	extern uint16_t GetCDataType(lua_State* L, int idx);
+	extern const void* GetTablePointer(lua_State* L, int idx); // Returns NULL if the value isn't a table
 }
\ No newline at end of file
@@ -64,6 +64,18 @@ unsigned int COM_GetIdealDestinationCompressionBufferSize_LZ4(unsigned int uncom
 	return sizeof(lz4_header_t) + LZ4_compressBound(uncompressedSize);
 }
 
+unsigned int COM_GetUncompressedSize_LZ4(const void* source, unsigned int sourceLen)
+{
+	if (sourceLen < sizeof(lz4_header_t))
+		return 0;
+
+	const lz4_header_t* pHeader = (const lz4_header_t*)source;
+	if (pHeader->id != LZ4_ID)
+		return 0;
+
+	return pHeader->decompressedSize;
+}
+
 bool COM_BufferToBufferDecompress_LZ4(void* dest, unsigned int* destLen, const void* source, unsigned int sourceLen)
 {
 	if (sourceLen < sizeof(lz4_header_t))
@@ -4,6 +4,12 @@ extern bool COM_BufferToBufferCompress_LZ4(void* dest, unsigned int* destLen, co
 extern unsigned int COM_GetIdealDestinationCompressionBufferSize_LZ4(unsigned int uncompressedSize);
 extern bool COM_BufferToBufferDecompress_LZ4(void* dest, unsigned int* destLen, const void* source, unsigned int sourceLen);
 
+/*
+ * Returns the decompressed size stored in the header of the source or 0 if the source isn't valid LZ4 data.
+ * Use it to check data you received before decompressing it since the size is whatever the sender wrote into it.
+ */
+extern unsigned int COM_GetUncompressedSize_LZ4(const void* source, unsigned int sourceLen);
+
 /*
  * Compresses the source and returns the dest and dest length.
  * It fully handles the allocation of the dest, you provide a NULL pointer and it'll do the rest.
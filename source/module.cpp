@@ -9,6 +9,10 @@
 
 // We cannot include util.h as it breaks stuff for some magical reason.
 extern GarrysMod::Lua::ILuaInterface* g_Lua;
+namespace Lua
+{
+	extern void ResetJobCallbacks(GarrysMod::Lua::ILuaInterface* LUA);
+}
 
 static ConVar module_debug("holylib_module_debug", "0");
 
@@ -376,6 +380,7 @@ void CModuleManager::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServerIn
 
 void CModuleManager::LuaThink(GarrysMod::Lua::ILuaInterface* pLua)
 {
+	Lua::ResetJobCallbacks(pLua);
 	VCALL_LUA_ENABLED_MODULES(LuaThink(pLua));
 }
 
@@ -404,6 +409,7 @@ void CModuleManager::Shutdown()
 {
 	m_pStatus = 0;
 	CALL_ENABLED_MODULES(Shutdown());
+	m_pJobSystem.Stop(); // Every module already canceled or waited for its jobs, this only lets our threads exit.
 }
 
 void CModuleManager::ServerActivate(edict_t* pEdictList, int edictCount, int clientMax)
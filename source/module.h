@@ -4,6 +4,7 @@
 #include <vector>
 #include "unordered_set"
 #include "public/iconfigsystem.h"
+#include "jobsystem.h"
 
 class CModuleManager;
 class CModule : public IModuleWrapper
@@ -91,6 +92,7 @@ public:
 	inline std::vector<CModule*>& GetModules() { return m_pModules; };
 	inline std::unordered_set<GarrysMod::Lua::ILuaInterface*>& GetLuaInterfaces() { return m_pLuaInterfaces; };
 	inline IConfig* GetConfig() { return m_pConfig; };
+	inline CJobSystem& GetJobSystem() { return m_pJobSystem; };
 
 private:
 	std::vector<CModule*> m_pModules;
@@ -101,6 +103,7 @@ private:
 	bool m_bGhostInj = false;
 	bool m_bMarkedAsBinaryModule = false;
 	IConfig* m_pConfig = NULL; // Can be NULL at runtime so check for it!
+	CJobSystem m_pJobSystem; // Shared by all modules for their async work.
 
 private: // ServerActivate stuff
 	edict_t* m_pEdictList = NULL;
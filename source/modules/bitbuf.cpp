@@ -31,13 +31,18 @@ struct LUA_bf_read
 	{
 		if (m_bDeleteUs && m_pBuffer)
 		{
-			delete[] m_pBuffer->GetBasePointer();
+			if (m_pStorage)
+				m_pStorage->Release(); // We read directly from a ByteBuffer's data.
+			else
+				delete[] m_pBuffer->GetBasePointer();
+
 			delete m_pBuffer;
 		}
 	}
 
 	bf_read* m_pBuffer = NULL;
 	bool m_bDeleteUs = true;
+	ByteBufferStorage* m_pStorage = NULL; // Set if our data belongs to a ByteBuffer
 };
 
 Push_LuaClass(LUA_bf_read)
@@ -945,9 +950,24 @@ LUA_FUNCTION_STATIC(bitbuf_CopyReadBuffer)
 
 LUA_FUNCTION_STATIC(bitbuf_CreateReadBuffer)
 {
-	const char* pData = LUA->CheckString(1);
-	int iLength = LUA->ObjLen(1);
-	int iNewLength = CLAMP_BF(iLength);
+	ByteBuffer* pBuffer = Get_ByteBuffer(LUA, 1, false);
+	if (pBuffer && pBuffer->iLength >= MIN_BUFFER_SIZE && pBuffer->iLength <= MAX_BUFFER_SIZE && ((uintptr_t)pBuffer->GetData() & 3) == 0)
+	{
+		// A ByteBuffer's data never changes, so we can read from it directly & keep it alive with a reference.
+		bf_read* pNewBf = new bf_read;
+		pNewBf->StartReading(pBuffer->GetData(), pBuffer->iLength);
+
+		LUA_bf_read* pLuaBf = new LUA_bf_read(pNewBf, true);
+		pLuaBf->m_pStorage = pBuffer->pStorage;
+		pLuaBf->m_pStorage->AddRef();
+		Push_LUA_bf_read(LUA, pLuaBf);
+
+		return 1;
+	}
+
+	unsigned int iLength = 0;
+	const char* pData = Get_BinaryData(LUA, 1, iLength);
+	int iNewLength = CLAMP_BF((int)iLength);
 
 	unsigned char* cData = new unsigned char[iNewLength];
 	memcpy(cData, pData, iLength);
@@ -970,9 +990,9 @@ LUA_FUNCTION_STATIC(bitbuf_CreateWriteBuffer)
 
 		pNewBf->StartWriting(cData, iSize);
 	} else {
-		const char* pData = LUA->CheckString(1);
-		int iLength = LUA->ObjLen(1);
-		int iNewLength = CLAMP_BF(iLength);
+		unsigned int iLength = 0;
+		const char* pData = Get_BinaryData(LUA, 1, iLength);
+		int iNewLength = CLAMP_BF((int)iLength);
 
 		unsigned char* cData = new unsigned char[iNewLength];
 		memcpy(cData, pData, iLength);
@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <cstring>
 #include <unordered_set>
+#include <mutex>
 #include "edict.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -65,31 +66,8 @@ static ConVar holylib_filesystem_savesearchcache("holylib_filesystem_savesearchc
 // Optimization Idea: When Gmod calls GetFileTime, we could try to get the filehandle in parallel to have it ready when gmod calls it.
 // We could also cache every FULL searchpath to not have to look up a file every time.  
 
-static IThreadPool* pFileSystemPool = NULL;
-
-static void OnThreadsChange(IConVar* convar, const char* pOldValue, float flOldValue)
-{
-	ConVar* pConVar = (ConVar*)convar;
-	if (pConVar->GetInt() > 0 && !pFileSystemPool)
-		pFileSystemPool = V_CreateThreadPool();
-
-	if (pFileSystemPool)
-	{
-		pFileSystemPool->ExecuteAll();
-		pFileSystemPool->Stop();
-
-		if (pConVar->GetInt() <= 0)
-		{
-			V_DestroyThreadPool(pFileSystemPool);
-			pFileSystemPool = NULL;
-		} else {
-			Util::StartThreadPool(pFileSystemPool, pConVar->GetInt());
-		}
-	}
-}
-
-static ConVar holylib_filesystem_threads("holylib_filesystem_threads", "0", 0,
-	"The number of threads the filesystem is allowed to use. Set to 0 to disable it", OnThreadsChange);
+static ConVar holylib_filesystem_asyncsearchcache("holylib_filesystem_asyncsearchcache", "0", 0,
+	"If enabled, the search cache is read & written on the HolyLib job threads (see holylib_jobs_threads).");
 
 struct FilesystemJob
 {
@@ -440,14 +418,21 @@ static void ReadSearchCache()
 	}
 }
 
-void CFileSystemModule::ServerActivate(edict_t* pEdictList, int edictCount, int clientMax)
+static CFunctionJob pWriteSearchCacheJob(WriteSearchCache);
+static CFunctionJob pReadSearchCacheJob(ReadSearchCache);
+static void QueueWriteSearchCache()
 {
-	if (pFileSystemPool)
-		pFileSystemPool->QueueCall(WriteSearchCache);
+	if (holylib_filesystem_asyncsearchcache.GetBool())
+		g_pModuleManager.GetJobSystem().Queue(&pWriteSearchCacheJob, JobPriority_LOW);
 	else
 		WriteSearchCache();
 }
 
+void CFileSystemModule::ServerActivate(edict_t* pEdictList, int edictCount, int clientMax)
+{
+	QueueWriteSearchCache();
+}
+
 static void DumpSearchcacheCmd(const CCommand &args)
 {
 	Msg("---- Search cache ----\n");
@@ -513,10 +498,7 @@ static ConCommand showpredictionerrors("holylib_filesystem_showpredictionerrors"
 
 static void WriteSearchCacheCmd(const CCommand& args)
 {
-	if (pFileSystemPool)
-		pFileSystemPool->QueueCall(WriteSearchCache);
-	else
-		WriteSearchCache();
+	QueueWriteSearchCache();
 }
 static ConCommand writesearchcache("holylib_filesystem_writesearchcache", WriteSearchCacheCmd, "Writes the search cache into a file", 0);
 
@@ -545,8 +527,8 @@ static void InitFileSystem(IFileSystem* pFileSystem)
 
 	if (holylib_filesystem_savesearchcache.GetBool())
 	{
-		if (pFileSystemPool)
-			pFileSystemPool->QueueCall(ReadSearchCache);
+		if (holylib_filesystem_asyncsearchcache.GetBool())
+			g_pModuleManager.GetJobSystem().Queue(&pReadSearchCacheJob, JobPriority_LOW);
 		else
 			ReadSearchCache();
 	}
@@ -1680,12 +1662,6 @@ void CFileSystemModule::InitDetour(bool bPreServer)
 
 	bShutdown = false;
 #ifndef SYSTEM_WINDOWS
-	if (holylib_filesystem_threads.GetInt() > 0)
-	{
-		pFileSystemPool = V_CreateThreadPool();
-		Util::StartThreadPool(pFileSystemPool, holylib_filesystem_threads.GetInt());
-	}
-
 	if (g_pFullFileSystem != NULL)
 		InitFileSystem(g_pFullFileSystem);
 
@@ -1788,6 +1764,8 @@ struct IAsyncFile
 };
 
 std::vector<IAsyncFile*> asyncCallback;
+static std::mutex asyncCallbackMutex; // The callback is called by the filesystem threads.
+static std::vector<IAsyncFile*> asyncPendingCallbacks; // Files that still wait for their Lua callback, only used by the main thread.
 void AsyncCallback(const FileAsyncRequest_t &request, int nBytesRead, FSAsyncStatus_t err)
 {
 	IAsyncFile* async = (IAsyncFile*)request.pContext;
@@ -1799,6 +1777,8 @@ void AsyncCallback(const FileAsyncRequest_t &request, int nBytesRead, FSAsyncSta
 		std::memcpy(static_cast<void*>(content), request.pData, nBytesRead);
 		content[nBytesRead] = '\0';
 		async->content = content;
+
+		std::lock_guard<std::mutex> lock(asyncCallbackMutex);
 		asyncCallback.push_back(async);
 	} else {
 		Msg("[Luathreaded] file.AsyncRead Invalid request? (%s, %s)\n", request.pszFilename, request.pszPathID);
@@ -1834,8 +1814,17 @@ LUA_FUNCTION_STATIC(filesystem_AsyncRead)
 
 void FileAsyncReadThink(GarrysMod::Lua::ILuaInterface* pLua)
 {
-	std::vector<IAsyncFile*> files;
-	for(IAsyncFile* file : asyncCallback) {
+	{
+		std::lock_guard<std::mutex> lock(asyncCallbackMutex);
+		asyncPendingCallbacks.insert(asyncPendingCallbacks.end(), asyncCallback.begin(), asyncCallback.end());
+		asyncCallback.clear();
+	}
+
+	size_t iFinished = 0;
+	for(IAsyncFile* file : asyncPendingCallbacks) {
+		if (!Lua::CanRunJobCallback(pLua))
+			break;
+
 		Util::ReferencePush(pLua, file->callback);
 		pLua->PushString(file->req->pszFilename);
 		pLua->PushString(file->req->pszPathID);
@@ -1843,10 +1832,11 @@ void FileAsyncReadThink(GarrysMod::Lua::ILuaInterface* pLua)
 		pLua->PushString(file->content);
 		pLua->CallFunctionProtected(4, 0, true);
 		Util::ReferenceFree(pLua, file->callback, "FileAsyncReadThink");
-		files.push_back(file);
+		Lua::OnJobCallback(pLua);
+		++iFinished;
 	}
 
-	asyncCallback.clear();
+	asyncPendingCallbacks.erase(asyncPendingCallbacks.begin(), asyncPendingCallbacks.begin() + iFinished);
 }
 
 LUA_FUNCTION_STATIC(filesystem_CreateDir)
@@ -2217,12 +2207,8 @@ void CFileSystemModule::LuaShutdown(GarrysMod::Lua::ILuaInterface* pLua)
 
 void CFileSystemModule::Shutdown()
 {
-	if (pFileSystemPool)
-	{
-		pFileSystemPool->ExecuteAll();
-		V_DestroyThreadPool(pFileSystemPool);
-		pFileSystemPool = NULL;
-	}
+	g_pModuleManager.GetJobSystem().Cancel(&pReadSearchCacheJob);
+	g_pModuleManager.GetJobSystem().Cancel(&pWriteSearchCacheJob); // We write it below anyways.
 
 	WriteSearchCache();
 	ClearAbsoluteSearchCache();
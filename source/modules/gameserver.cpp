@@ -10,6 +10,9 @@
 #include "sourcesdk/net_chan.h"
 #include <framesnapshot.h>
 #include <netadr_new.h> // Better than the normal sdk one as this one actually sets stuff properly.
+#include <lz4/lz4_compression.h>
+#include "player.h"
+#include <chrono>
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -29,6 +32,8 @@ public:
 static ConVar gameserver_disablespawnsafety("holylib_gameserver_disablespawnsafety", "0", 0, "If enabled, players can spawn on slots above 128 but this WILL cause stability and many other issues!");
 static ConVar gameserver_connectionlesspackethook("holylib_gameserver_connectionlesspackethook", "1", 0, "If enabled, the HolyLib:ProcessConnectionlessPacket hook is active and will be called.");
 static ConVar sv_filter_nobanresponse("sv_filter_nobanresponse", "0", 0, "If enabled, a blocked ip won't be informed that its even blocked.");
+static ConVar gameserver_migrationtimeout("holylib_gameserver_migrationtimeout", "60", 0, "The time in seconds a received player migration is kept before it's discarded.");
+static ConVar gameserver_migrationmaxsize("holylib_gameserver_migrationmaxsize", "8388608", 0, "The maximum uncompressed size in bytes of a player migration. Bigger ones aren't sent and received ones are dropped without being decompressed.");
 
 CGameServerModule g_pGameServerModule;
 IModule* pGameServerModule = &g_pGameServerModule;
@@ -879,6 +884,203 @@ LUA_FUNCTION_STATIC(CBaseClient_GetMaxRoutablePayloadSize)
 	return 1;
 }
 
+/*
+ * Bandwidth scheduler
+ * Every tick we have a server wide uplink budget (holylib_gameserver_bandwidthbudget) that is distributed by priority.
+ * Snapshots are never throttled by us, only new fragments of the reliable stream & the waiting lists (reliable messages, big reliable data & file transfers)
+ * are held back once the client's priority share of the budget is used up. The budget is filled in priority order, not slot order.
+ */
+enum BandwidthPriority
+{
+	BANDWIDTH_SNAPSHOT = 0,
+	BANDWIDTH_RELIABLE,
+	BANDWIDTH_LUA,
+	BANDWIDTH_FILE,
+	BANDWIDTH_TOTAL,
+};
+
+// The share of the budget each priority can use.
+static constexpr float g_pBandwidthShares[BANDWIDTH_TOTAL] = {1.0f, 0.85f, 0.6f, 0.4f};
+
+struct ClientBandwidth
+{
+	CNetChan* pNetChannel = NULL; // The client's channel, registered in BandwidthScheduler::pChannelSlots
+	bool bScheduled = false; // Only set for clients of our main server, HLTV/Relay clients are never scheduled.
+	bool bAllowFragments = true;
+	float fAvgPacketBytes = 0;
+	int iPriority = BANDWIDTH_SNAPSHOT;
+	int iQueuedBytes = 0;
+	int iQueuedFragments = 0;
+	int iBytesThisTick = 0;
+	int iThrottledThisTick = 0;
+	unsigned int iThrottled = 0;
+	unsigned int iPacketsSent = 0;
+};
+
+static struct BandwidthScheduler
+{
+	int iTick = -1;
+	int iBudgetUsed = 0;
+	int iThrottledThisTick = 0;
+	unsigned int iThrottled = 0;
+	ClientBandwidth pClients[ABSOLUTE_PLAYER_LIMIT];
+	std::unordered_map<CNetChan*, int> pChannelSlots; // Net channel -> player slot so that every datagram doesn't need to search for its client
+} g_BandwidthScheduler;
+
+static ConVar gameserver_bandwidthbudget("holylib_gameserver_bandwidthbudget", "0", 0, "The server wide uplink budget in bytes per tick used by the bandwidth scheduler. 0 = disabled.");
+
+static inline ClientBandwidth* GetClientBandwidth(CBaseClient* pClient)
+{
+	if (pClient->GetServer() != Util::server) // HLTV & Relay clients use their own slots which would collide with our players.
+		return NULL;
+
+	int iSlot = pClient->GetPlayerSlot();
+	if (iSlot < 0 || iSlot >= ABSOLUTE_PLAYER_LIMIT)
+		return NULL;
+
+	return &g_BandwidthScheduler.pClients[iSlot];
+}
+
+static inline void ClearClientBandwidth(ClientBandwidth* pBandwidth)
+{
+	if (pBandwidth->pNetChannel)
+		g_BandwidthScheduler.pChannelSlots.erase(pBandwidth->pNetChannel);
+
+	*pBandwidth = ClientBandwidth();
+}
+
+static inline ClientBandwidth* GetNetChannelBandwidth(CNetChan* pNetChannel)
+{
+	auto it = g_BandwidthScheduler.pChannelSlots.find(pNetChannel);
+	if (it == g_BandwidthScheduler.pChannelSlots.end())
+		return NULL;
+
+	ClientBandwidth* pBandwidth = &g_BandwidthScheduler.pClients[it->second];
+	if (!pBandwidth->bScheduled || pBandwidth->pNetChannel != pNetChannel)
+		return NULL;
+
+	return pBandwidth;
+}
+
+static void UpdateClientBandwidth(ClientBandwidth* pBandwidth, CNetChan* pNetChannel)
+{
+	if (pBandwidth->pNetChannel != pNetChannel)
+	{
+		if (pBandwidth->pNetChannel)
+			g_BandwidthScheduler.pChannelSlots.erase(pBandwidth->pNetChannel);
+
+		pBandwidth->pNetChannel = pNetChannel;
+		g_BandwidthScheduler.pChannelSlots[pNetChannel] = (int)(pBandwidth - g_BandwidthScheduler.pClients);
+	}
+	pBandwidth->bScheduled = true;
+
+	// The reliable stream is turned into fragments of the normal stream by the next CNetChan::SendDatagram.
+	int pStreamBytes[MAX_STREAMS] = {0};
+	pStreamBytes[FRAG_NORMAL_STREAM] = pNetChannel->m_StreamReliable.GetNumBytesWritten();
+	int iQueuedFragments = 0;
+	for (int iStream = 0; iStream < MAX_STREAMS; ++iStream)
+	{
+		CUtlVector<CNetChan::dataFragments_t*>& pWaitingList = pNetChannel->m_WaitingList[iStream];
+		for (int i = 0; i < pWaitingList.Count(); ++i)
+		{
+			CNetChan::dataFragments_t* pData = pWaitingList[i];
+			if (pData->numFragments <= 0)
+				continue;
+
+			int iRemaining = pData->numFragments - pData->ackedFragments;
+			iQueuedFragments += iRemaining;
+			pStreamBytes[iStream] += (int)(((int64)pData->bytes * iRemaining) / pData->numFragments);
+		}
+	}
+	pBandwidth->iQueuedBytes = pStreamBytes[FRAG_NORMAL_STREAM] + pStreamBytes[FRAG_FILE_STREAM];
+	pBandwidth->iQueuedFragments = iQueuedFragments;
+
+	if (pNetChannel->m_WaitingList[FRAG_FILE_STREAM].Count() > 0)
+		pBandwidth->iPriority = BANDWIDTH_FILE;
+	else if (pStreamBytes[FRAG_NORMAL_STREAM] > 0)
+		// Reliable data that fits into a single packet is mostly game messages, bigger blocks mostly are net messages / SendLua bursts.
+		pBandwidth->iPriority = (pStreamBytes[FRAG_NORMAL_STREAM] <= (int)pNetChannel->m_MaxReliablePayloadSize) ? BANDWIDTH_RELIABLE : BANDWIDTH_LUA;
+	else
+		pBandwidth->iPriority = BANDWIDTH_SNAPSHOT;
+}
+
+/*
+ * Called once per tick before any snapshot is sent.
+ * Collects every client's priority and then fills the budget starting with the highest priority
+ * using the average size of the client's previous packets.
+ */
+static void BandwidthScheduler_Update(int iTick)
+{
+	if (g_BandwidthScheduler.iTick == iTick)
+		return;
+
+	g_BandwidthScheduler.iTick = iTick;
+	g_BandwidthScheduler.iBudgetUsed = 0;
+	g_BandwidthScheduler.iThrottledThisTick = 0;
+	for (ClientBandwidth& pBandwidth : g_BandwidthScheduler.pClients)
+	{
+		pBandwidth.bScheduled = false;
+		pBandwidth.bAllowFragments = true;
+		pBandwidth.iBytesThisTick = 0;
+		pBandwidth.iThrottledThisTick = 0;
+	}
+
+	int iBudget = gameserver_bandwidthbudget.GetInt();
+	if (iBudget <= 0 || !Util::server || !Util::server->IsActive())
+		return;
+
+	int iClientCount = MIN(Util::server->GetClientCount(), ABSOLUTE_PLAYER_LIMIT);
+	for (int iClientIndex = 0; iClientIndex < iClientCount; ++iClientIndex)
+	{
+		CBaseClient* pClient = (CBaseClient*)Util::server->GetClient(iClientIndex);
+		if (!pClient->IsConnected() || pClient->IsFakeClient() || !pClient->GetNetChannel())
+			continue;
+
+		ClientBandwidth* pBandwidth = GetClientBandwidth(pClient);
+		if (pBandwidth)
+			UpdateClientBandwidth(pBandwidth, (CNetChan*)pClient->GetNetChannel());
+	}
+
+	for (int iPriority = BANDWIDTH_SNAPSHOT; iPriority < BANDWIDTH_TOTAL; ++iPriority)
+	{
+		float fShare = iBudget * g_pBandwidthShares[iPriority];
+		for (ClientBandwidth& pBandwidth : g_BandwidthScheduler.pClients)
+		{
+			if (!pBandwidth.bScheduled || pBandwidth.iPriority != iPriority)
+				continue;
+
+			int iCost = (int)pBandwidth.fAvgPacketBytes;
+			if (iPriority != BANDWIDTH_SNAPSHOT && (g_BandwidthScheduler.iBudgetUsed + iCost) > fShare)
+			{
+				pBandwidth.bAllowFragments = false;
+				continue;
+			}
+
+			g_BandwidthScheduler.iBudgetUsed += iCost;
+		}
+	}
+}
+
+LUA_FUNCTION_STATIC(CBaseClient_GetBandwidthStats)
+{
+	CBaseClient* pClient = Get_CBaseClient(LUA, 1, true);
+	ClientBandwidth* pBandwidth = GetClientBandwidth(pClient);
+	if (!pBandwidth)
+		return 0;
+
+	LUA->CreateTable();
+		Util::AddValue(LUA, pBandwidth->iPriority, "priority");
+		Util::AddValue(LUA, pBandwidth->iQueuedBytes, "queuedBytes");
+		Util::AddValue(LUA, pBandwidth->iQueuedFragments, "queuedFragments");
+		Util::AddValue(LUA, pBandwidth->fAvgPacketBytes, "avgPacketBytes");
+		Util::AddValue(LUA, pBandwidth->iBytesThisTick, "bytesThisTick");
+		Util::AddValue(LUA, pBandwidth->iThrottledThisTick, "throttledThisTick");
+		Util::AddValue(LUA, pBandwidth->iThrottled, "throttled");
+		Util::AddValue(LUA, pBandwidth->iPacketsSent, "packetsSent");
+
+	return 1;
+}
+
 // Added for CHLTVClient to inherit functions.
 void Push_CBaseClientMeta(GarrysMod::Lua::ILuaInterface* pLua)
 {
@@ -962,6 +1164,7 @@ void Push_CBaseClientMeta(GarrysMod::Lua::ILuaInterface* pLua)
 	Util::AddFunc(pLua, CBaseClient_SetMaxBufferSize, "SetMaxBufferSize");
 	//Util::AddFunc(pLua, CBaseClient_HasQueuedPackets, "HasQueuedPackets");
 	Util::AddFunc(pLua, CBaseClient_GetMaxRoutablePayloadSize, "GetMaxRoutablePayloadSize");
+	Util::AddFunc(pLua, CBaseClient_GetBandwidthStats, "GetBandwidthStats");
 }
 
 LUA_FUNCTION_STATIC(CGameClient__tostring)
@@ -1404,6 +1607,7 @@ void hook_CNetChan_D2(CNetChan* pNetChan)
 }
 
 class NET_LuaNetChanMessage;
+class NET_PlayerMigrationMessage;
 class ILuaNetMessageHandler : INetChannelHandler
 {
 public:
@@ -1422,10 +1626,12 @@ public:
 	virtual bool ShouldAcceptFile(const char *fileName, unsigned int transferID);
 
 	virtual bool ProcessLuaNetChanMessage( [[maybe_unused]] NET_LuaNetChanMessage *msg );
+	virtual bool ProcessPlayerMigrationMessage( [[maybe_unused]] NET_PlayerMigrationMessage *msg );
 
 public:
 	CNetChan* m_pChan = NULL;
 	NET_LuaNetChanMessage* m_pLuaNetChanMessage = NULL;
+	NET_PlayerMigrationMessage* m_pPlayerMigrationMessage = NULL;
 	int m_iMessageCallbackFunction = -1;
 	int m_iConnectionStartFunction = -1;
 	int m_iConnectionClosingFunction = -1;
@@ -1473,11 +1679,59 @@ public:
 	bf_read m_DataIn;
 };
 
+/*
+ * Carries a LZ4 compressed player snapshot created by CNetChan:SendPlayerMigration.
+ * It's always sent reliably so the CNetChan takes care of fragmenting it.
+ */
+#define net_PlayerMigrationMessage 34
+class NET_PlayerMigrationMessage : public CNetMessage
+{
+public:
+	bool ReadFromBuffer( bf_read &buffer )
+	{
+		unsigned int iLength = buffer.ReadUBitLong( 32 );
+		if ( buffer.IsOverflowed() || iLength == 0 || iLength > (unsigned int)buffer.GetNumBytesLeft() )
+		{
+			m_iLength = 0;
+			return false; // The peer sent a length we can't possibly have received.
+		}
+
+		m_iLength = (int)iLength;
+		m_DataIn = buffer;
+
+		return buffer.SeekRelative( m_iLength * 8 );
+	};
+
+	bool WriteToBuffer( bf_write &buffer )
+	{
+		buffer.WriteUBitLong( GetType(), NETMSG_TYPE_BITS );
+		buffer.WriteUBitLong( m_iLength, 32 );
+		return buffer.WriteBytes( m_pData, m_iLength );
+	};
+
+	const char *ToString() const { return PROJECT_NAME ":PlayerMigrationMessage"; };
+	int GetType() const { return net_PlayerMigrationMessage; }
+	const char *GetName() const { return "NET_PlayerMigrationMessage"; }
+
+	ILuaNetMessageHandler *m_pMessageHandler = NULL;
+	bool Process() { return m_pMessageHandler->ProcessPlayerMigrationMessage( this ); };
+
+	NET_PlayerMigrationMessage() { m_bReliable = true; }
+
+	int	GetGroup() const { return INetChannelInfo::GENERIC; }
+
+	int m_iLength = 0; // In bytes
+	const void* m_pData = NULL;
+	bf_read m_DataIn;
+};
+
 static std::unordered_set<ILuaNetMessageHandler*> g_pNetMessageHandlers;
 ILuaNetMessageHandler::ILuaNetMessageHandler(GarrysMod::Lua::ILuaInterface* pLua)
 {
 	m_pLuaNetChanMessage = new NET_LuaNetChanMessage;
 	m_pLuaNetChanMessage->m_pMessageHandler = this;
+	m_pPlayerMigrationMessage = new NET_PlayerMigrationMessage;
+	m_pPlayerMigrationMessage->m_pMessageHandler = this;
 	g_pNetMessageHandlers.insert(this);
 	m_pLua = pLua;
 }
@@ -1490,6 +1744,12 @@ ILuaNetMessageHandler::~ILuaNetMessageHandler()
 		m_pLuaNetChanMessage = NULL;
 	}
 
+	if (m_pPlayerMigrationMessage)
+	{
+		delete m_pPlayerMigrationMessage;
+		m_pPlayerMigrationMessage = NULL;
+	}
+
 	g_pNetMessageHandlers.erase(this);
 
 	if (!ThreadInMainThread())
@@ -1652,6 +1912,526 @@ LUA_FUNCTION_STATIC(CNetChan_SendMessage)
 	return 1;
 }
 
+/*
+ * Player migration
+ * A player snapshot is serialized in C++ into a compact binary form, compressed using LZ4
+ * and sent over the reliable stream of the net channel which also handles fragmentation for us.
+ * The receiving server stores it until Lua fetches it using gameserver.GetPlayerMigration.
+ */
+#define PLAYERMIGRATION_VERSION 1
+#define PLAYERMIGRATION_MAXDEPTH 32
+enum PlayerMigrationTag : unsigned char
+{
+	MIGRATION_NIL = 0,
+	MIGRATION_FALSE,
+	MIGRATION_TRUE,
+	MIGRATION_NUMBER,
+	MIGRATION_STRING,
+	MIGRATION_TABLE,
+	MIGRATION_TABLEEND,
+	MIGRATION_VECTOR,
+	MIGRATION_ANGLE,
+};
+
+struct PlayerMigration
+{
+	uint64 iSteamID = 0;
+	std::string strName;
+	Vector vecOrigin;
+	QAngle angAngles;
+	std::string strInventory; // Encoded, we only decode it into a Lua table when it's requested.
+	std::string strNetworkedVars;
+
+	double fReceiveTime = 0; // Plat_FloatTime when we received it.
+	double fBuildTime = 0; // All times are in milliseconds
+	double fTransitTime = 0;
+	double fDecodeTime = 0;
+	unsigned int iRawSize = 0;
+	unsigned int iCompressedSize = 0;
+};
+static std::unordered_map<uint64, PlayerMigration*> g_pPlayerMigrations;
+
+static inline double GetMigrationTimestamp() // Unix time in milliseconds which is comparable across servers.
+{
+	return (double)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count() / 1000.0;
+}
+
+template<typename T>
+static inline void WriteMigrationValue(std::string& buffer, const T& value)
+{
+	buffer.append((const char*)&value, sizeof(T));
+}
+
+template<typename T>
+static inline bool ReadMigrationValue(const char*& pData, const char* pEnd, T& value)
+{
+	if (pEnd - pData < (int)sizeof(T))
+		return false;
+
+	memcpy(&value, pData, sizeof(T));
+	pData += sizeof(T);
+	return true;
+}
+
+static inline void WriteMigrationString(std::string& buffer, const char* pStr, unsigned int iLength)
+{
+	WriteMigrationValue<unsigned int>(buffer, iLength);
+	buffer.append(pStr, iLength);
+}
+
+static inline bool ReadMigrationString(const char*& pData, const char* pEnd, std::string& strOut)
+{
+	unsigned int iLength = 0;
+	if (!ReadMigrationValue<unsigned int>(pData, pEnd, iLength) || (unsigned int)(pEnd - pData) < iLength)
+		return false;
+
+	strOut.assign(pData, iLength);
+	pData += iLength;
+	return true;
+}
+
+// Writes the value at -1 into the buffer, unsupported types are written as nil.
+static void WriteMigrationLuaValue(GarrysMod::Lua::ILuaInterface* pLua, std::string& buffer, int iDepth)
+{
+	switch (pLua->GetType(-1))
+	{
+		case GarrysMod::Lua::Type::Bool:
+			buffer.push_back((char)(pLua->GetBool(-1) ? MIGRATION_TRUE : MIGRATION_FALSE));
+			break;
+		case GarrysMod::Lua::Type::Number:
+			buffer.push_back((char)MIGRATION_NUMBER);
+			WriteMigrationValue<double>(buffer, pLua->GetNumber(-1));
+			break;
+		case GarrysMod::Lua::Type::String:
+			buffer.push_back((char)MIGRATION_STRING);
+			WriteMigrationString(buffer, pLua->GetString(-1), pLua->ObjLen(-1));
+			break;
+		case GarrysMod::Lua::Type::Vector:
+			{
+				Vector* vec = Get_Vector(pLua, -1, true);
+				buffer.push_back((char)MIGRATION_VECTOR);
+				WriteMigrationValue<Vector>(buffer, *vec);
+			}
+			break;
+		case GarrysMod::Lua::Type::Angle:
+			{
+				QAngle* ang = Get_QAngle(pLua, -1, true);
+				buffer.push_back((char)MIGRATION_ANGLE);
+				WriteMigrationValue<QAngle>(buffer, *ang);
+			}
+			break;
+		case GarrysMod::Lua::Type::Table:
+			{
+				if (iDepth >= PLAYERMIGRATION_MAXDEPTH)
+				{
+					pLua->ThrowError("Player migration table is nested too deep! (Cyclic reference?)");
+					return;
+				}
+
+				buffer.push_back((char)MIGRATION_TABLE);
+				pLua->PushNil();
+				while (pLua->Next(-2))
+				{
+					int iKeyType = pLua->GetType(-2);
+					if (iKeyType != GarrysMod::Lua::Type::String && iKeyType != GarrysMod::Lua::Type::Number && iKeyType != GarrysMod::Lua::Type::Bool)
+					{
+						pLua->Pop(1);
+						continue;
+					}
+
+					pLua->Push(-2);
+					WriteMigrationLuaValue(pLua, buffer, iDepth + 1);
+					pLua->Pop(1);
+
+					WriteMigrationLuaValue(pLua, buffer, iDepth + 1);
+					pLua->Pop(1);
+				}
+				buffer.push_back((char)MIGRATION_TABLEEND);
+			}
+			break;
+		default:
+			buffer.push_back((char)MIGRATION_NIL);
+			break;
+	}
+}
+
+// Pushes exactly one value. Returns false if the data was malformed, the pushed value will be nil in that case.
+static bool ReadMigrationLuaValue(GarrysMod::Lua::ILuaInterface* pLua, const char*& pData, const char* pEnd, int iDepth)
+{
+	unsigned char iTag = MIGRATION_NIL;
+	if (!ReadMigrationValue<unsigned char>(pData, pEnd, iTag))
+	{
+		pLua->PushNil();
+		return false;
+	}
+
+	switch (iTag)
+	{
+		case MIGRATION_NIL:
+			pLua->PushNil();
+			return true;
+		case MIGRATION_FALSE:
+		case MIGRATION_TRUE:
+			pLua->PushBool(iTag == MIGRATION_TRUE);
+			return true;
+		case MIGRATION_NUMBER:
+			{
+				double value = 0;
+				bool bSuccess = ReadMigrationValue<double>(pData, pEnd, value);
+				pLua->PushNumber(value);
+				return bSuccess;
+			}
+		case MIGRATION_STRING:
+			{
+				unsigned int iLength = 0;
+				if (!ReadMigrationValue<unsigned int>(pData, pEnd, iLength) || (unsigned int)(pEnd - pData) < iLength)
+				{
+					pLua->PushNil();
+					return false;
+				}
+
+				pLua->PushString(pData, iLength);
+				pData += iLength;
+				return true;
+			}
+		case MIGRATION_VECTOR:
+			{
+				Vector vec;
+				bool bSuccess = ReadMigrationValue<Vector>(pData, pEnd, vec);
+				pLua->PushVector(vec);
+				return bSuccess;
+			}
+		case MIGRATION_ANGLE:
+			{
+				QAngle ang;
+				bool bSuccess = ReadMigrationValue<QAngle>(pData, pEnd, ang);
+				pLua->PushAngle(ang);
+				return bSuccess;
+			}
+		case MIGRATION_TABLE:
+			{
+				if (iDepth >= PLAYERMIGRATION_MAXDEPTH)
+				{
+					pLua->PushNil();
+					return false;
+				}
+
+				pLua->CreateTable();
+				while (pData < pEnd)
+				{
+					if (*pData == (char)MIGRATION_TABLEEND)
+					{
+						++pData;
+						return true;
+					}
+
+					if (!ReadMigrationLuaValue(pLua, pData, pEnd, iDepth + 1))
+					{
+						pLua->Pop(1);
+						return false;
+					}
+
+					if (!ReadMigrationLuaValue(pLua, pData, pEnd, iDepth + 1))
+					{
+						pLua->Pop(2);
+						return false;
+					}
+
+					if (pLua->IsType(-2, GarrysMod::Lua::Type::Nil))
+					{
+						pLua->Pop(2);
+						continue;
+					}
+
+					pLua->SetTable(-3);
+				}
+
+				return false; // Missing the table end
+			}
+		default:
+			pLua->PushNil();
+			return false;
+	}
+}
+
+static void PushMigrationTable(GarrysMod::Lua::ILuaInterface* pLua, const std::string& strData)
+{
+	const char* pData = strData.data();
+	const char* pEnd = pData + strData.size();
+	if (strData.empty() || !ReadMigrationLuaValue(pLua, pData, pEnd, 0))
+	{
+		if (!strData.empty())
+			pLua->Pop(1);
+
+		pLua->CreateTable();
+	}
+}
+
+static void RemoveExpiredPlayerMigrations()
+{
+	double fTime = Plat_FloatTime();
+	double fTimeout = gameserver_migrationtimeout.GetFloat();
+	for (auto it = g_pPlayerMigrations.begin(); it != g_pPlayerMigrations.end(); )
+	{
+		if ((fTime - it->second->fReceiveTime) > fTimeout)
+		{
+			delete it->second;
+			it = g_pPlayerMigrations.erase(it);
+		} else {
+			it++;
+		}
+	}
+}
+
+bool ILuaNetMessageHandler::ProcessPlayerMigrationMessage(NET_PlayerMigrationMessage *msg)
+{
+	if (!ThreadInMainThread())
+	{
+		Warning(PROJECT_NAME ": Trying to process a player migration message outside the main thread!\n");
+		return false;
+	}
+
+	double fStartTime = Plat_FloatTime();
+	if (msg->m_iLength <= 0)
+		return true;
+
+	char* pCompressed = new char[msg->m_iLength];
+	msg->m_DataIn.ReadBytes(pCompressed, msg->m_iLength);
+
+	// The size is whatever the peer wrote into the header, so never let it decide how much we allocate.
+	unsigned int iExpectedSize = COM_GetUncompressedSize_LZ4(pCompressed, msg->m_iLength);
+	if (iExpectedSize > (unsigned int)gameserver_migrationmaxsize.GetInt())
+	{
+		Warning(PROJECT_NAME ": Dropped a player migration from %s since it's too big! (%u bytes)\n", m_pChan ? m_pChan->GetName() : "NULL", iExpectedSize);
+		delete[] pCompressed;
+		return true;
+	}
+
+	void* pRaw = NULL;
+	unsigned int iRawSize = 0;
+	bool bSuccess = COM_Decompress_LZ4(pCompressed, msg->m_iLength, &pRaw, &iRawSize);
+	delete[] pCompressed;
+	if (!bSuccess)
+	{
+		Warning(PROJECT_NAME ": Failed to decompress a player migration from %s!\n", m_pChan ? m_pChan->GetName() : "NULL");
+		return true;
+	}
+
+	PlayerMigration* pMigration = new PlayerMigration;
+	const char* pData = (const char*)pRaw;
+	const char* pEnd = pData + iRawSize;
+	unsigned char iVersion = 0;
+	double fSentTime = 0;
+	float fBuildTime = 0;
+	bSuccess = ReadMigrationValue<unsigned char>(pData, pEnd, iVersion) && iVersion == PLAYERMIGRATION_VERSION
+		&& ReadMigrationValue<uint64>(pData, pEnd, pMigration->iSteamID)
+		&& ReadMigrationValue<double>(pData, pEnd, fSentTime)
+		&& ReadMigrationValue<float>(pData, pEnd, fBuildTime)
+		&& ReadMigrationValue<Vector>(pData, pEnd, pMigration->vecOrigin)
+		&& ReadMigrationValue<QAngle>(pData, pEnd, pMigration->angAngles)
+		&& ReadMigrationString(pData, pEnd, pMigration->strName)
+		&& ReadMigrationString(pData, pEnd, pMigration->strInventory)
+		&& ReadMigrationString(pData, pEnd, pMigration->strNetworkedVars);
+	free(pRaw);
+
+	if (!bSuccess)
+	{
+		Warning(PROJECT_NAME ": Received a invalid player migration from %s! (version %i)\n", m_pChan ? m_pChan->GetName() : "NULL", (int)iVersion);
+		delete pMigration;
+		return true;
+	}
+
+	pMigration->fReceiveTime = Plat_FloatTime();
+	pMigration->fBuildTime = fBuildTime;
+	pMigration->fTransitTime = GetMigrationTimestamp() - fSentTime;
+	pMigration->fDecodeTime = (pMigration->fReceiveTime - fStartTime) * 1000.0;
+	pMigration->iRawSize = iRawSize;
+	pMigration->iCompressedSize = msg->m_iLength;
+
+	RemoveExpiredPlayerMigrations();
+	auto it = g_pPlayerMigrations.find(pMigration->iSteamID);
+	if (it != g_pPlayerMigrations.end())
+	{
+		delete it->second; // A newer migration replaces the old one.
+		it->second = pMigration;
+	} else {
+		g_pPlayerMigrations[pMigration->iSteamID] = pMigration;
+	}
+
+	if (g_pGameServerModule.InDebug())
+		Msg(PROJECT_NAME ": Received player migration for %llu (%u -> %u bytes, transit %.2fms, decode %.2fms)\n", pMigration->iSteamID, pMigration->iCompressedSize, pMigration->iRawSize, pMigration->fTransitTime, pMigration->fDecodeTime);
+
+	if (Lua::PushHook("HolyLib:OnPlayerMigrationReceived", m_pLua))
+	{
+		Push_CNetChan(m_pLua, m_pChan);
+		m_pLua->PushString(std::to_string(pMigration->iSteamID).c_str());
+		m_pLua->CallFunctionProtected(3, 0, true);
+	}
+
+	return true;
+}
+
+LUA_FUNCTION_STATIC(CNetChan_SendPlayerMigration)
+{
+	CNetChan* pNetChannel = Get_CNetChan(LUA, 1, true);
+	CBasePlayer* pPlayer = Util::Get_Player(LUA, 2, true);
+	CBaseClient* pClient = Util::GetClientByPlayer(pPlayer);
+	if (!pClient)
+		LUA->ThrowError("Failed to get the CBaseClient of the player!");
+
+	ILuaNetMessageHandler* pHandler = (ILuaNetMessageHandler*)pNetChannel->m_MessageHandler;
+	if (!pHandler || !pHandler->m_pPlayerMigrationMessage)
+		LUA->ThrowError("Tried to use a CNetChan that wasn't created by gameserver.CreateNetChannel!");
+
+	double fStartTime = Plat_FloatTime();
+
+	std::string strInventory;
+	if (LUA->IsType(3, GarrysMod::Lua::Type::Table))
+	{
+		LUA->Push(3);
+		WriteMigrationLuaValue(LUA, strInventory, 0);
+		LUA->Pop(1);
+	}
+
+	std::string strNetworkedVars;
+	if (LUA->IsType(4, GarrysMod::Lua::Type::Table))
+	{
+		LUA->Push(4);
+		WriteMigrationLuaValue(LUA, strNetworkedVars, 0);
+		LUA->Pop(1);
+	}
+
+	const char* pName = pClient->GetClientName();
+	std::string strRaw;
+	strRaw.reserve(64 + strInventory.size() + strNetworkedVars.size());
+	WriteMigrationValue<unsigned char>(strRaw, PLAYERMIGRATION_VERSION);
+	WriteMigrationValue<uint64>(strRaw, pClient->m_SteamID.ConvertToUint64());
+	size_t iTimeOffset = strRaw.size(); // Filled in after compressing
+	WriteMigrationValue<double>(strRaw, 0.0);
+	WriteMigrationValue<float>(strRaw, 0.0f);
+	WriteMigrationValue<Vector>(strRaw, pPlayer->GetAbsOrigin());
+	WriteMigrationValue<QAngle>(strRaw, pPlayer->GetAbsAngles());
+	WriteMigrationString(strRaw, pName, V_strlen(pName));
+	WriteMigrationString(strRaw, strInventory.data(), strInventory.size());
+	WriteMigrationString(strRaw, strNetworkedVars.data(), strNetworkedVars.size());
+
+	double fSentTime = GetMigrationTimestamp();
+	float fBuildTime = (float)((Plat_FloatTime() - fStartTime) * 1000.0);
+	memcpy(&strRaw[iTimeOffset], &fSentTime, sizeof(double));
+	memcpy(&strRaw[iTimeOffset + sizeof(double)], &fBuildTime, sizeof(float));
+
+	if (strRaw.size() > (size_t)gameserver_migrationmaxsize.GetInt())
+	{
+		Warning(PROJECT_NAME ": Player migration for %s is too big! (%u bytes)\n", pName, (unsigned int)strRaw.size());
+		LUA->PushBool(false);
+		return 1;
+	}
+
+	void* pCompressed = NULL;
+	unsigned int iCompressedSize = 0;
+	if (!COM_Compress_LZ4(strRaw.data(), strRaw.size(), &pCompressed, &iCompressedSize))
+	{
+		LUA->PushBool(false);
+		return 1;
+	}
+
+	NET_PlayerMigrationMessage* msg = pHandler->m_pPlayerMigrationMessage;
+	msg->m_pData = pCompressed;
+	msg->m_iLength = iCompressedSize;
+	bool bSuccess = pNetChannel->SendNetMsg(*msg, true);
+	msg->m_pData = NULL;
+	free(pCompressed);
+
+	if (g_pGameServerModule.InDebug())
+		Msg(PROJECT_NAME ": Sent player migration for %s (%u -> %u bytes, took %.2fms)\n", pName, (unsigned int)strRaw.size(), iCompressedSize, (Plat_FloatTime() - fStartTime) * 1000.0);
+
+	LUA->PushBool(bSuccess);
+	LUA->PushNumber(iCompressedSize);
+	return 2;
+}
+
+static PlayerMigration* GetPlayerMigration(GarrysMod::Lua::ILuaInterface* pLua, int iStackPos, bool bRemove)
+{
+	uint64 iSteamID = 0;
+	if (pLua->IsType(iStackPos, GarrysMod::Lua::Type::String))
+	{
+		iSteamID = strtoull(pLua->GetString(iStackPos), NULL, 0);
+	} else {
+		CBaseClient* pClient = Util::GetClientByPlayer(Util::Get_Player(pLua, iStackPos, true));
+		if (!pClient)
+			return NULL;
+
+		iSteamID = pClient->m_SteamID.ConvertToUint64();
+	}
+
+	RemoveExpiredPlayerMigrations();
+	auto it = g_pPlayerMigrations.find(iSteamID);
+	if (it == g_pPlayerMigrations.end())
+		return NULL;
+
+	PlayerMigration* pMigration = it->second;
+	if (bRemove)
+		g_pPlayerMigrations.erase(it);
+
+	return pMigration;
+}
+
+LUA_FUNCTION_STATIC(gameserver_GetPlayerMigration)
+{
+	bool bKeep = LUA->GetBool(2);
+	PlayerMigration* pMigration = GetPlayerMigration(LUA, 1, !bKeep);
+	if (!pMigration)
+		return 0;
+
+	double fStartTime = Plat_FloatTime();
+	LUA->CreateTable();
+		LUA->PushString(std::to_string(pMigration->iSteamID).c_str());
+		LUA->SetField(-2, "steamID64");
+
+		LUA->PushString(pMigration->strName.c_str(), pMigration->strName.size());
+		LUA->SetField(-2, "name");
+
+		LUA->PushVector(pMigration->vecOrigin);
+		LUA->SetField(-2, "origin");
+
+		LUA->PushAngle(pMigration->angAngles);
+		LUA->SetField(-2, "angles");
+
+		PushMigrationTable(LUA, pMigration->strInventory);
+		LUA->SetField(-2, "inventory");
+
+		PushMigrationTable(LUA, pMigration->strNetworkedVars);
+		LUA->SetField(-2, "networkedVars");
+
+		Util::AddValue(LUA, pMigration->fBuildTime, "buildTime");
+		Util::AddValue(LUA, pMigration->fTransitTime, "transitTime");
+		Util::AddValue(LUA, pMigration->fDecodeTime + ((Plat_FloatTime() - fStartTime) * 1000.0), "decodeTime");
+		Util::AddValue(LUA, pMigration->iRawSize, "rawSize");
+		Util::AddValue(LUA, pMigration->iCompressedSize, "compressedSize");
+		Util::AddValue(LUA, Plat_FloatTime() - pMigration->fReceiveTime, "age");
+
+	if (!bKeep)
+		delete pMigration;
+
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(gameserver_HasPlayerMigration)
+{
+	LUA->PushBool(GetPlayerMigration(LUA, 1, false) != NULL);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(gameserver_RemovePlayerMigration)
+{
+	PlayerMigration* pMigration = GetPlayerMigration(LUA, 1, true);
+	if (pMigration)
+		delete pMigration;
+
+	LUA->PushBool(pMigration != NULL);
+	return 1;
+}
+
 LUA_FUNCTION_STATIC(CNetChan_SetMessageCallback)
 {
 	CNetChan* pNetChannel = Get_CNetChan(LUA, 1, true);
@@ -2155,6 +2935,7 @@ LUA_FUNCTION_STATIC(gameserver_CreateNetChannel)
 	ILuaNetMessageHandler* pHandler = new ILuaNetMessageHandler(LUA);
 	CNetChan* pNetChannel = NET_CreateHolyLibNetChannel(nSocket, &adr, adr.ToString(), (INetChannelHandler*)pHandler, true, nProtocolVersion);
 	pNetChannel->RegisterMessage(pHandler->m_pLuaNetChanMessage);
+	pNetChannel->RegisterMessage(pHandler->m_pPlayerMigrationMessage);
 	pHandler->m_pChan = pNetChannel;
 
 	Push_CNetChan(LUA, pNetChannel);
@@ -2194,6 +2975,17 @@ LUA_FUNCTION_STATIC(gameserver_GetCreatedNetChannels)
 	return 1;
 }
 
+LUA_FUNCTION_STATIC(gameserver_GetBandwidthStats)
+{
+	LUA->CreateTable();
+		Util::AddValue(LUA, gameserver_bandwidthbudget.GetInt(), "budget");
+		Util::AddValue(LUA, g_BandwidthScheduler.iBudgetUsed, "used");
+		Util::AddValue(LUA, g_BandwidthScheduler.iThrottledThisTick, "throttledThisTick");
+		Util::AddValue(LUA, g_BandwidthScheduler.iThrottled, "throttled");
+
+	return 1;
+}
+
 extern CGlobalVars* gpGlobals;
 static ConVar* sv_stressbots;
 void CGameServerModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServerInit)
@@ -2262,6 +3054,7 @@ void CGameServerModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServe
 		Util::AddFunc(pLua, CNetChan_SetMaxBufferSize, "SetMaxBufferSize");
 		Util::AddFunc(pLua, CNetChan_GetMaxRoutablePayloadSize, "GetMaxRoutablePayloadSize");
 		Util::AddFunc(pLua, CNetChan_SendMessage, "SendMessage");
+		Util::AddFunc(pLua, CNetChan_SendPlayerMigration, "SendPlayerMigration");
 		Util::AddFunc(pLua, CNetChan_Shutdown, "Shutdown");
 
 		// Callbacks
@@ -2310,10 +3103,19 @@ void CGameServerModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServe
 		Util::AddFunc(pLua, gameserver_CreateNetChannel, "CreateNetChannel");
 		Util::AddFunc(pLua, gameserver_RemoveNetChannel, "RemoveNetChannel");
 		Util::AddFunc(pLua, gameserver_GetCreatedNetChannels, "GetCreatedNetChannels");
+		Util::AddFunc(pLua, gameserver_GetPlayerMigration, "GetPlayerMigration");
+		Util::AddFunc(pLua, gameserver_HasPlayerMigration, "HasPlayerMigration");
+		Util::AddFunc(pLua, gameserver_RemovePlayerMigration, "RemovePlayerMigration");
+		Util::AddFunc(pLua, gameserver_GetBandwidthStats, "GetBandwidthStats");
 
 		Util::AddValue(pLua, NS_CLIENT, "NS_CLIENT");
 		Util::AddValue(pLua, NS_SERVER, "NS_SERVER");
 		Util::AddValue(pLua, NS_HLTV, "NS_HLTV");
+
+		Util::AddValue(pLua, BANDWIDTH_SNAPSHOT, "BANDWIDTH_SNAPSHOT");
+		Util::AddValue(pLua, BANDWIDTH_RELIABLE, "BANDWIDTH_RELIABLE");
+		Util::AddValue(pLua, BANDWIDTH_LUA, "BANDWIDTH_LUA");
+		Util::AddValue(pLua, BANDWIDTH_FILE, "BANDWIDTH_FILE");
 	Util::FinishTable(pLua, "gameserver");
 }
 
@@ -2323,6 +3125,14 @@ void CGameServerModule::LuaShutdown(GarrysMod::Lua::ILuaInterface* pLua)
 
 	DeleteAll_CBaseClient(pLua);
 	DeleteAll_CNetChan(pLua);
+
+	if (pLua == g_Lua)
+	{
+		for (auto& [_, pMigration] : g_pPlayerMigrations)
+			delete pMigration;
+
+		g_pPlayerMigrations.clear();
+	}
 }
 
 static Detouring::Hook detour_CServerGameClients_GetPlayerLimit;
@@ -2458,6 +3268,9 @@ static bool hook_GModDataPack_IsSingleplayer(void* dataPack)
 static Detouring::Hook detour_CBaseClient_ShouldSendMessages;
 static bool hook_CBaseClient_ShouldSendMessages(CBaseClient* cl)
 {
+	// Never chokes a client, it only decides which clients can send fragments in hook_CNetChan_SendDatagram.
+	BandwidthScheduler_Update(gpGlobals->tickcount);
+
 	if ( !cl->IsConnected() )
 		return false;
 
@@ -2526,11 +3339,18 @@ static void hook_CBaseServer_CheckTimeouts(CBaseServer* srv)
 	}
 
 	VPROF_BUDGET( "CBaseServer::CheckTimeouts", VPROF_BUDGETGROUP_OTHER_NETWORKING );
-	// Don't timeout in _DEBUG builds
-	int i;
 
-#if !defined( _DEBUG )
-	for (i=0 ; i< srv->m_Clients.Count() ; i++ )
+	/*
+	 * We walk the clients only once and collect everyone that timed out or overflowed.
+	 * Lua is only touched if we actually collected someone, so a normal frame won't do any hook lookups.
+	 */
+	CBaseClient* pTimedOut[ABSOLUTE_PLAYER_LIMIT];
+	CBaseClient* pOverflowed[ABSOLUTE_PLAYER_LIMIT];
+	int iTimedOut = 0;
+	int iOverflowed = 0;
+
+	int iClientCount = MIN(srv->m_Clients.Count(), ABSOLUTE_PLAYER_LIMIT);
+	for (int i=0 ; i<iClientCount ; ++i)
 	{
 		IClient	*cl = srv->GetClient(i);
 		
@@ -2538,53 +3358,109 @@ static void hook_CBaseServer_CheckTimeouts(CBaseServer* srv)
 			continue;
 
 		INetChannel *netchan = cl->GetNetChannel();
-
 		if ( !netchan )
 			continue;
 
+		// Don't timeout in _DEBUG builds
+#if !defined( _DEBUG )
 		if ( netchan->IsTimedOut() )
 		{
-			if (Lua::PushHook("HolyLib:OnClientTimeout"))
+			pTimedOut[iTimedOut++] = (CBaseClient*)cl;
+			continue; // The engine would drop him anyways so there is no point in checking for a overflow.
+		}
+#endif
+
+		if ( netchan->IsOverflowed() )
+			pOverflowed[iOverflowed++] = (CBaseClient*)cl;
+	}
+
+	if (iTimedOut > 0)
+	{
+		float pTimeoutIncrease[ABSOLUTE_PLAYER_LIMIT] = {0};
+		if (Lua::PushHook("HolyLib:OnClientsTimeout"))
+		{
+			g_Lua->CreateTable();
+				for (int i=0; i<iTimedOut; ++i)
+				{
+					Push_CBaseClient(g_Lua, pTimedOut[i]);
+					Util::RawSetI(g_Lua, -2, i+1);
+				}
+
+			if (g_Lua->CallFunctionProtected(2, 1, true))
 			{
-				Push_CBaseClient(g_Lua, (CBaseClient*)cl);
-				if (g_Lua->CallFunctionProtected(2, 1, true))
+				if (g_Lua->IsType(-1, GarrysMod::Lua::Type::Number))
 				{
-					float timeoutIncrease = (float)g_Lua->CheckNumberOpt(-1, 0);
-					g_Lua->Pop(1);
-					if (timeoutIncrease > 0)
+					float timeoutIncrease = (float)g_Lua->GetNumber(-1);
+					for (int i=0; i<iTimedOut; ++i)
+						pTimeoutIncrease[i] = timeoutIncrease;
+				} else if (g_Lua->IsType(-1, GarrysMod::Lua::Type::Table)) {
+					for (int i=0; i<iTimedOut; ++i)
 					{
-						netchan->SetTimeout(netchan->GetTimeoutSeconds() + timeoutIncrease);
-						continue;
+						Util::RawGetI(g_Lua, -1, i+1);
+						if (g_Lua->IsType(-1, GarrysMod::Lua::Type::Number))
+							pTimeoutIncrease[i] = (float)g_Lua->GetNumber(-1);
+						g_Lua->Pop(1);
 					}
 				}
+				g_Lua->Pop(1);
+			}
+		}
+
+		for (int i=0; i<iTimedOut; ++i)
+		{
+			CBaseClient* cl = pTimedOut[i];
+			if ( !cl->IsConnected() ) // Lua might have already dropped him.
+				continue;
+
+			INetChannel* netchan = cl->GetNetChannel();
+			if ( netchan && pTimeoutIncrease[i] > 0 )
+			{
+				netchan->SetTimeout(netchan->GetTimeoutSeconds() + pTimeoutIncrease[i]);
+				continue;
 			}
+
 			cl->Disconnect( CLIENTNAME_TIMED_OUT, cl->GetClientName() );
 		}
 	}
-#endif
 
-	for (i=0 ; i< srv->m_Clients.Count() ; i++ )
+	if (iOverflowed > 0)
 	{
-		IClient	*cl = srv->GetClient(i);
-		
-		if ( cl->IsFakeClient() || !cl->IsConnected() )
-			continue;
-		
-		if ( cl->GetNetChannel() && cl->GetNetChannel()->IsOverflowed() )
+		bool pCancel[ABSOLUTE_PLAYER_LIMIT] = {0};
+		if (Lua::PushHook("HolyLib:OnChannelsOverflow"))
 		{
-			if (Lua::PushHook("HolyLib:OnChannelOverflow"))
+			g_Lua->CreateTable();
+				for (int i=0; i<iOverflowed; ++i)
+				{
+					Push_CBaseClient(g_Lua, pOverflowed[i]);
+					Util::RawSetI(g_Lua, -2, i+1);
+				}
+
+			if (g_Lua->CallFunctionProtected(2, 1, true))
 			{
-				Push_CBaseClient(g_Lua, (CBaseClient*)cl);
-				if (g_Lua->CallFunctionProtected(2, 1, true))
+				if (g_Lua->IsType(-1, GarrysMod::Lua::Type::Bool))
 				{
 					bool bCancel = g_Lua->GetBool(-1);
-					g_Lua->Pop(1);
-					if (bCancel)
-						continue;
+					for (int i=0; i<iOverflowed; ++i)
+						pCancel[i] = bCancel;
+				} else if (g_Lua->IsType(-1, GarrysMod::Lua::Type::Table)) {
+					for (int i=0; i<iOverflowed; ++i)
+					{
+						Util::RawGetI(g_Lua, -1, i+1);
+						pCancel[i] = g_Lua->GetBool(-1);
+						g_Lua->Pop(1);
+					}
 				}
+				g_Lua->Pop(1);
 			}
+		}
+
+		for (int i=0; i<iOverflowed; ++i)
+		{
+			CBaseClient* cl = pOverflowed[i];
+			if ( pCancel[i] || !cl->IsConnected() )
+				continue;
 
-			cl->Disconnect( "Client %d overflowed reliable channel.", i );
+			cl->Disconnect( "Client %d overflowed reliable channel.", cl->GetPlayerSlot() );
 		}
 	}
 }
@@ -2776,6 +3652,10 @@ void CGameServerModule::OnClientDisconnect(CBaseClient* pClient)
 	if (pClient->GetServer() != Util::server) // Not our main server
 		return;
 
+	ClientBandwidth* pBandwidth = GetClientBandwidth(pClient);
+	if (pBandwidth)
+		ClearClientBandwidth(pBandwidth);
+
 	if (g_Lua)
 	{
 		if (Lua::PushHook("HolyLib:OnClientDisconnect"))
@@ -2793,8 +3673,49 @@ void CGameServerModule::OnClientDisconnect(CBaseClient* pClient)
 static Detouring::Hook detour_CNetChan_SendDatagram;
 int hook_CNetChan_SendDatagram(CNetChan* chan, bf_write *datagram)
 {
+	ClientBandwidth* pBandwidth = gameserver_bandwidthbudget.GetInt() > 0 ? GetNetChannelBandwidth(chan) : NULL;
+	int iHeldSubChannels = 0;
+	if (pBandwidth && !pBandwidth->bAllowFragments)
+	{
+		// CNetChan::UpdateSubChannels only adds new fragments into a free subchannel, so while they're reserved it behaves like all of them are in use.
+		// The fragment bookkeeping is never touched, subchannels that are waiting to be (re)sent and the snapshot itself still go through.
+		for (int i = 0; i < MAX_SUBCHANNELS; ++i)
+		{
+			CNetChan::subChannel_s* subchan = &chan->m_SubChannels[i];
+			if (subchan->state != SUBCHANNEL_FREE)
+				continue;
+
+			subchan->state = SUBCHANNEL_DIRTY;
+			iHeldSubChannels |= 1 << i;
+		}
+	}
+
+	int iTotalOut = pBandwidth ? chan->GetTotalData(FLOW_OUTGOING) : 0;
 	int sequenceNr = detour_CNetChan_SendDatagram.GetTrampoline<Symbols::CNetChan_SendDatagram>()(chan, datagram);
 
+	if (pBandwidth)
+	{
+		if (iHeldSubChannels != 0)
+		{
+			for (int i = 0; i < MAX_SUBCHANNELS; ++i)
+				if ((iHeldSubChannels & (1 << i)) && chan->m_SubChannels[i].state == SUBCHANNEL_DIRTY)
+					chan->m_SubChannels[i].state = SUBCHANNEL_FREE;
+
+			++pBandwidth->iThrottled;
+			++pBandwidth->iThrottledThisTick;
+			++g_BandwidthScheduler.iThrottled;
+			++g_BandwidthScheduler.iThrottledThisTick;
+		}
+
+		int iSent = chan->GetTotalData(FLOW_OUTGOING) - iTotalOut; // The exact size of this packet including the UDP header.
+		if (iSent > 0)
+		{
+			pBandwidth->fAvgPacketBytes = (pBandwidth->fAvgPacketBytes > 0) ? ((pBandwidth->fAvgPacketBytes * FLOW_AVG) + (iSent * (1.0f - FLOW_AVG))) : iSent;
+			pBandwidth->iBytesThisTick += iSent;
+			++pBandwidth->iPacketsSent;
+		}
+	}
+
 	// NOTE: This code has to be here as moving it into it's own lua function breaks stuff?
 	if (g_bFreeSubChannels)
 	{
@@ -2,10 +2,17 @@
 #include "LuaInterface.h"
 #include "module.h"
 #include "lua.h"
+#include "Bootil/Bootil.h"
+#include <lz4/lz4_compression.h>
 #include <baseclient.h>
 #include <inetchannel.h>
 #include <netadr.h>
 #include "unordered_set"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <algorithm>
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -15,7 +22,11 @@ class CHTTPServerModule : public IModule
 public:
 	virtual void LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServerInit) OVERRIDE;
 	virtual void LuaShutdown(GarrysMod::Lua::ILuaInterface* pLua) OVERRIDE;
+	virtual void LuaThink(GarrysMod::Lua::ILuaInterface* pLua) OVERRIDE;
 	virtual void Think(bool bSimulating) OVERRIDE;
+	virtual void Shutdown() OVERRIDE;
+	virtual void OnClientConnect(CBaseClient* pClient) OVERRIDE;
+	virtual void OnClientDisconnect(CBaseClient* pClient) OVERRIDE;
 	virtual const char* Name() { return "httpserver"; };
 	virtual int Compatibility() { return LINUX32 | LINUX64 | WINDOWS32 | WINDOWS64; };
 	virtual bool SupportsMultipleLuaStates() { return true; };
@@ -35,6 +46,13 @@ struct HttpResponse {
 	std::string m_strRedirect = "";
 	std::unordered_map<std::string, std::string> m_pHeaders;
 
+	// Throws away everything Lua did and only responds with the given status code.
+	inline void Reset(int iStatusCode)
+	{
+		*this = HttpResponse();
+		m_iStatusCode = iStatusCode;
+	}
+
 	inline void DoResponse(httplib::Response& pResponse)
 	{
 		if (m_bSetContent)
@@ -92,13 +110,116 @@ struct PreparedHttpResponse {
 	}
 };
 
+/*
+ * A response that is served directly on httplib's worker threads without ever touching Lua.
+ * Entries are immutable once they were added to the cache, updating one replaces the entire entry.
+ */
+struct HttpCachedResponse {
+	std::string m_strContent = "";
+	std::string m_strContentType = "text/plain";
+	std::string m_strDeflateContent = ""; // Empty if it wasn't compressed / compression wasn't worth it.
+	std::string m_strLZ4Content = "";
+	std::string m_strETag = "";
+	double m_fExpireTime = 0; // Plat_FloatTime at which the entry expires, 0 = never.
+
+	inline bool IsExpired(double fTime) const
+	{
+		return m_fExpireTime != 0 && fTime >= m_fExpireTime;
+	}
+
+	void Prepare(double fTTL, bool bDeflate, bool bLZ4, size_t iMinCompressSize)
+	{
+		char pETag[48];
+		unsigned long iCRC = Bootil::Hasher::CRC32::Easy(m_strContent.data(), (unsigned int)m_strContent.size());
+		V_snprintf(pETag, sizeof(pETag), "\"%08lx-%zx\"", iCRC, m_strContent.size());
+		m_strETag = pETag;
+
+		if (fTTL > 0)
+			m_fExpireTime = Plat_FloatTime() + fTTL;
+
+		if (m_strContent.size() < iMinCompressSize)
+			return;
+
+		if (bDeflate)
+		{
+			Bootil::AutoBuffer pBuffer;
+			if (Bootil::Compression::GZip::Compress(m_strContent.data(), (unsigned int)m_strContent.size(), pBuffer) && pBuffer.GetWritten() < m_strContent.size())
+				m_strDeflateContent.assign((const char*)pBuffer.GetBase(), pBuffer.GetWritten());
+		}
+
+		if (bLZ4)
+		{
+			void* pDest = NULL;
+			unsigned int iDestLen = 0;
+			if (COM_Compress_LZ4(m_strContent.data(), (unsigned int)m_strContent.size(), &pDest, &iDestLen))
+			{
+				if (iDestLen < m_strContent.size())
+					m_strLZ4Content.assign((const char*)pDest, iDestLen);
+
+				free(pDest);
+			}
+		}
+	}
+
+	static void DoResponse(const std::shared_ptr<HttpCachedResponse>& pEntry, const httplib::Request& pRequest, httplib::Response& pResponse)
+	{
+		pResponse.set_header("ETag", pEntry->m_strETag);
+		if (!pEntry->m_strDeflateContent.empty() || !pEntry->m_strLZ4Content.empty())
+			pResponse.set_header("Vary", "Accept-Encoding");
+
+		if (pRequest.has_header("If-None-Match"))
+		{
+			std::string strMatch = pRequest.get_header_value("If-None-Match");
+			if (strMatch == "*" || strMatch.find(pEntry->m_strETag) != std::string::npos)
+			{
+				pResponse.status = 304;
+				return;
+			}
+		}
+
+		const std::string* pContent = &pEntry->m_strContent;
+		std::string strEncoding = pRequest.get_header_value("Accept-Encoding");
+		if (!pEntry->m_strLZ4Content.empty() && strEncoding.find("lz4") != std::string::npos)
+		{
+			pContent = &pEntry->m_strLZ4Content;
+			pResponse.set_header("Content-Encoding", "lz4");
+		} else if (!pEntry->m_strDeflateContent.empty() && strEncoding.find("deflate") != std::string::npos) {
+			pContent = &pEntry->m_strDeflateContent;
+			pResponse.set_header("Content-Encoding", "deflate");
+		}
+
+		// The entry is kept alive by the content provider so we don't need to copy the content for every request.
+		pResponse.set_content_provider(pContent->size(), pEntry->m_strContentType, [pEntry, pContent](size_t iOffset, size_t iLength, httplib::DataSink& pSink) {
+			pSink.write(pContent->data() + iOffset, iLength);
+			return true;
+		});
+	}
+};
+
+struct HttpServeDirectory {
+	std::string m_strURLPrefix = "";
+	std::string m_strFolder = "";
+	std::string m_strPathID = "GAME";
+	double m_fTTL = 60;
+};
+
 struct HttpRequest {
 	~HttpRequest();
 	void MarkHandled();
-
-	bool m_bHandled = false;
-	bool m_bDelete = false; // We only delete from the main thread.
-	int m_iFunction = -1;
+	void WaitUntilHandled();
+
+	bool m_bHandled = false; // Only written by the main thread while holding m_pHandledMutex.
+	std::atomic<bool> m_bDelete = false; // Set by the worker thread once it's done, we only delete from the main thread.
+	std::mutex m_pHandledMutex;
+	std::condition_variable m_pHandledCondition;
+	HttpRequest* m_pNext = NULL; // Used by the HttpRequestQueue.
+	double m_fQueueTime = 0; // Plat_FloatTime when the worker thread queued the request.
+	double m_fDeferredTime = 0; // Plat_FloatTime when the Lua handler returned true, 0 = it wasn't deferred.
+	int m_iFunction = -1; // -1 = The main thread should only read m_strFilePath for a ServeDirectory route.
+	bool m_bFileFound = false;
+	std::string m_strFilePath;
+	std::string m_strFilePathID;
+	std::string m_strFileContent;
 	std::string m_strPath;
 	HttpResponse m_pResponseData;
 	httplib::Response m_pResponse;
@@ -107,14 +228,214 @@ struct HttpRequest {
 	GarrysMod::Lua::ILuaInterface* m_pLua = NULL;
 };
 
+/*
+ * Lock-free multi producer single consumer queue.
+ * httplib's worker threads push requests into it and only the main thread pops them in HttpServer::Think.
+ */
+class HttpRequestQueue
+{
+public:
+	void Push(HttpRequest* pRequest)
+	{
+		HttpRequest* pHead = m_pHead.load(std::memory_order_relaxed);
+		do {
+			pRequest->m_pNext = pHead;
+		} while (!m_pHead.compare_exchange_weak(pHead, pRequest, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	// Takes all queued requests and returns them as a linked list in the order they were pushed.
+	HttpRequest* PopAll()
+	{
+		HttpRequest* pHead = m_pHead.exchange(NULL, std::memory_order_acquire);
+		HttpRequest* pOrdered = NULL;
+		while (pHead)
+		{
+			HttpRequest* pNext = pHead->m_pNext;
+			pHead->m_pNext = pOrdered;
+			pOrdered = pHead;
+			pHead = pNext;
+		}
+
+		return pOrdered;
+	}
+
+	inline bool IsEmpty()
+	{
+		return m_pHead.load(std::memory_order_relaxed) == NULL;
+	}
+
+private:
+	std::atomic<HttpRequest*> m_pHead = NULL;
+};
+
+/*
+ * Latency histogram using fixed buckets(in ms).
+ * It's written to by httplib's worker threads and the main thread so everything is atomic.
+ */
+static constexpr double g_pHttpLatencyBuckets[] = {0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000};
+#define HTTPSERVER_LATENCY_BUCKETS ((sizeof(g_pHttpLatencyBuckets) / sizeof(double)) + 1) // The last bucket contains everything above 5000ms
+struct HttpLatencyHistogram
+{
+	HttpLatencyHistogram()
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		for (int i = 0; i < (int)HTTPSERVER_LATENCY_BUCKETS; ++i)
+			m_iBuckets[i].store(0, std::memory_order_relaxed);
+
+		m_iCount.store(0, std::memory_order_relaxed);
+		m_iTotalMicroseconds.store(0, std::memory_order_relaxed);
+		m_iMaxMicroseconds.store(0, std::memory_order_relaxed);
+	}
+
+	void Add(double fSeconds)
+	{
+		if (fSeconds < 0)
+			fSeconds = 0;
+
+		double fMilliseconds = fSeconds * 1000.0;
+		int iBucket = 0;
+		while (iBucket < (int)HTTPSERVER_LATENCY_BUCKETS - 1 && fMilliseconds > g_pHttpLatencyBuckets[iBucket])
+			++iBucket;
+
+		uint64_t iMicroseconds = (uint64_t)(fSeconds * 1000000.0);
+		m_iBuckets[iBucket].fetch_add(1, std::memory_order_relaxed);
+		m_iCount.fetch_add(1, std::memory_order_relaxed);
+		m_iTotalMicroseconds.fetch_add(iMicroseconds, std::memory_order_relaxed);
+
+		uint64_t iMax = m_iMaxMicroseconds.load(std::memory_order_relaxed);
+		while (iMicroseconds > iMax && !m_iMaxMicroseconds.compare_exchange_weak(iMax, iMicroseconds, std::memory_order_relaxed));
+	}
+
+	// Returns the upper bound of the bucket containing the given percentile(0-1) in ms.
+	double GetPercentile(double fPercentile)
+	{
+		uint64_t iCount = m_iCount.load(std::memory_order_relaxed);
+		if (iCount == 0)
+			return 0;
+
+		uint64_t iTarget = (uint64_t)(fPercentile * iCount);
+		if (iTarget == 0)
+			iTarget = 1;
+
+		uint64_t iSeen = 0;
+		for (int i = 0; i < (int)HTTPSERVER_LATENCY_BUCKETS - 1; ++i)
+		{
+			iSeen += m_iBuckets[i].load(std::memory_order_relaxed);
+			if (iSeen >= iTarget)
+				return g_pHttpLatencyBuckets[i];
+		}
+
+		return m_iMaxMicroseconds.load(std::memory_order_relaxed) / 1000.0;
+	}
+
+	void PushTable(GarrysMod::Lua::ILuaInterface* pLua)
+	{
+		uint64_t iCount = m_iCount.load(std::memory_order_relaxed);
+		pLua->CreateTable();
+			Util::AddValue(pLua, (double)iCount, "count");
+			Util::AddValue(pLua, iCount > 0 ? (m_iTotalMicroseconds.load(std::memory_order_relaxed) / 1000.0) / iCount : 0, "average");
+			Util::AddValue(pLua, m_iMaxMicroseconds.load(std::memory_order_relaxed) / 1000.0, "max");
+			Util::AddValue(pLua, GetPercentile(0.5), "p50");
+			Util::AddValue(pLua, GetPercentile(0.9), "p90");
+			Util::AddValue(pLua, GetPercentile(0.99), "p99");
+
+			pLua->PreCreateTable(HTTPSERVER_LATENCY_BUCKETS, 0);
+			for (int i = 0; i < (int)HTTPSERVER_LATENCY_BUCKETS; ++i)
+			{
+				pLua->PreCreateTable(0, 2);
+					Util::AddValue(pLua, i < (int)HTTPSERVER_LATENCY_BUCKETS - 1 ? g_pHttpLatencyBuckets[i] : HUGE_VAL, "max");
+					Util::AddValue(pLua, (double)m_iBuckets[i].load(std::memory_order_relaxed), "count");
+				Util::RawSetI(pLua, -2, i + 1);
+			}
+			pLua->SetField(-2, "buckets");
+	}
+
+	std::atomic<uint64_t> m_iBuckets[HTTPSERVER_LATENCY_BUCKETS];
+	std::atomic<uint64_t> m_iCount;
+	std::atomic<uint64_t> m_iTotalMicroseconds;
+	std::atomic<uint64_t> m_iMaxMicroseconds;
+};
+
+struct HttpConnectionCounters
+{
+	std::atomic<int> m_iActiveConnections = 0; // Connections currently being processed by a thread.
+	std::atomic<int> m_iQueuedConnections = 0; // Connections waiting for a free thread.
+	std::atomic<uint64_t> m_iRejectedConnections = 0; // Connections closed since too many were queued.
+};
+
+/*
+ * Wraps httplib's ThreadPool so that we can count the connections.
+ * Every acceptor thread creates its own task queue.
+ */
+class HttpServerTaskQueue : public httplib::TaskQueue
+{
+public:
+	HttpServerTaskQueue(HttpConnectionCounters* pCounters, size_t iThreads, size_t iMaxQueued)
+		: m_pPool(iThreads, iMaxQueued), m_pCounters(pCounters)
+	{
+	}
+
+	virtual bool enqueue(std::function<void()> fn) OVERRIDE
+	{
+		HttpConnectionCounters* pCounters = m_pCounters;
+		pCounters->m_iQueuedConnections.fetch_add(1, std::memory_order_relaxed);
+		bool bQueued = m_pPool.enqueue([pCounters, fn = std::move(fn)]() {
+			pCounters->m_iQueuedConnections.fetch_sub(1, std::memory_order_relaxed);
+			pCounters->m_iActiveConnections.fetch_add(1, std::memory_order_relaxed);
+			fn();
+			pCounters->m_iActiveConnections.fetch_sub(1, std::memory_order_relaxed);
+		});
+
+		if (!bQueued)
+		{
+			pCounters->m_iQueuedConnections.fetch_sub(1, std::memory_order_relaxed);
+			pCounters->m_iRejectedConnections.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		return bQueued;
+	}
+
+	virtual void shutdown() OVERRIDE
+	{
+		m_pPool.shutdown();
+	}
+
+	virtual void on_idle() OVERRIDE
+	{
+		m_pPool.on_idle();
+	}
+
+private:
+	httplib::ThreadPool m_pPool;
+	HttpConnectionCounters* m_pCounters;
+};
+
 enum
 {
 	HTTPSERVER_ONLINE,
 	HTTPSERVER_OFFLINE
 };
 
+/*
+ * Every acceptor is its own httplib::Server with its own listening socket, they are all bound to the same port using SO_REUSEPORT
+ * (httplib sets it by default) so the kernel distributes the connections between them.
+ * httplib doesn't support listening multiple times on the same httplib::Server so each one only listens once.
+ */
+struct HttpAcceptor
+{
+	httplib::Server m_pServer;
+	std::atomic<bool> m_bRunning = false; // Set until its thread returned from listen_after_bind.
+};
+
+typedef std::function<void(httplib::Server&)> HttpServerSetup;
+
 class HttpServer;
 static std::unordered_set<HttpServer*> g_pHttpServers;
+static std::vector<HttpServer*> g_pShutdownHttpServers; // HttpServers that were destroyed but whose threads are still running.
 class HttpServer
 {
 public:
@@ -125,6 +446,7 @@ public:
 		SetName("NONAME");
 	}
 
+	// Only deleted after Shutdown once FinishStop returned true, so no thread uses us anymore.
 	~HttpServer()
 	{
 		if (!ThreadInMainThread())
@@ -133,13 +455,10 @@ public:
 			return;
 		}
 
-		if (!m_pLua)
-			return;
-
-		for (auto& ref : m_pHandlerReferences)
-			Util::ReferenceFree(m_pLua, ref, "HttpServer::~HttpServer - Handler references");
+		for (HttpRequest* pRequest : m_pRequests)
+			delete pRequest;
 
-		m_pHandlerReferences.clear();
+		m_pRequests.clear();
 
 		// Should we lock the mutex?
 		// Naaa it should be fine as the httpserver should NOT be running anymore.
@@ -151,57 +470,177 @@ public:
 			}
 		}
 		m_pPreparedResponses.clear();
-
-		g_pHttpServers.erase(this);
 	}
 
 	void Start(const char* address, unsigned short port);
 	void Stop();
+	void Shutdown();
 	void Think();
 
 #if ARCHITECTURE_IS_X86_64
-	static long long unsigned Server(void* params)
+	static long long unsigned Acceptor(void* params)
 #else
-	static unsigned Server(void* params)
+	static unsigned Acceptor(void* params)
 #endif
 	{
-		HttpServer* pServer = (HttpServer*)params;
-		pServer->GetServer().listen(pServer->GetAddress(), pServer->GetPort());
+		HttpAcceptor* pAcceptor = (HttpAcceptor*)params;
+		pAcceptor->m_pServer.listen_after_bind();
+		pAcceptor->m_bRunning.store(false, std::memory_order_release);
 
 		return 0;
 	}
 
 	void Get(const char* path, int func, bool ipWhitelist)
 	{
-		m_pServer.Get(path, CreateHandler(path, func, ipWhitelist));
+		Configure(NULL, [strPath = std::string(path), pHandler = CreateHandler(path, func, ipWhitelist)](httplib::Server& pServer) {
+			pServer.Get(strPath, pHandler);
+		});
 	}
 
 	void Post(const char* path, int func, bool ipWhitelist)
 	{
-		m_pServer.Post(path, CreateHandler(path, func, ipWhitelist));
+		Configure(NULL, [strPath = std::string(path), pHandler = CreateHandler(path, func, ipWhitelist)](httplib::Server& pServer) {
+			pServer.Post(strPath, pHandler);
+		});
 	}
 
 	void Put(const char* path, int func, bool ipWhitelist)
 	{
-		m_pServer.Put(path, CreateHandler(path, func, ipWhitelist));
+		Configure(NULL, [strPath = std::string(path), pHandler = CreateHandler(path, func, ipWhitelist)](httplib::Server& pServer) {
+			pServer.Put(strPath, pHandler);
+		});
 	}
 
 	void Patch(const char* path, int func, bool ipWhitelist)
 	{
-		m_pServer.Patch(path, CreateHandler(path, func, ipWhitelist));
+		Configure(NULL, [strPath = std::string(path), pHandler = CreateHandler(path, func, ipWhitelist)](httplib::Server& pServer) {
+			pServer.Patch(strPath, pHandler);
+		});
 	}
 
 	void Delete(const char* path, int func, bool ipWhitelist)
 	{
-		m_pServer.Delete(path, CreateHandler(path, func, ipWhitelist));
+		Configure(NULL, [strPath = std::string(path), pHandler = CreateHandler(path, func, ipWhitelist)](httplib::Server& pServer) {
+			pServer.Delete(strPath, pHandler);
+		});
 	}
 
 	void Options(const char* path, int func, bool ipWhitelist)
 	{
-		m_pServer.Options(path, CreateHandler(path, func, ipWhitelist));
+		Configure(NULL, [strPath = std::string(path), pHandler = CreateHandler(path, func, ipWhitelist)](httplib::Server& pServer) {
+			pServer.Options(strPath, pHandler);
+		});
+	}
+
+	/*
+	 * Applies the setup to every acceptor and remembers it for the acceptors created by Start.
+	 * If a name is given it replaces the previous setup with the same name, so that setting something repeatedly won't pile up.
+	 */
+	void Configure(const char* pName, HttpServerSetup pSetup)
+	{
+		for (HttpAcceptor* pAcceptor : m_pAcceptors)
+			pSetup(pAcceptor->m_pServer);
+
+		if (pName)
+		{
+			for (auto& [strName, pOldSetup] : m_pServerSetup)
+			{
+				if (strName == pName)
+				{
+					pOldSetup = std::move(pSetup);
+					return;
+				}
+			}
+		}
+
+		m_pServerSetup.emplace_back(pName ? pName : "", std::move(pSetup));
 	}
 
 	httplib::Server::Handler CreateHandler(const char* path, int func, bool ipWhitelist);
+	httplib::Server::HandlerResponse PreRouting(const httplib::Request& req, httplib::Response& res);
+	void ReadDirectoryFile(HttpRequest* pRequest);
+
+	std::shared_ptr<HttpCachedResponse> FindCachedResponse(const std::string& strKey)
+	{
+		double fTime = Plat_FloatTime();
+		m_pCacheMutex.Lock();
+		auto it = m_pCache.find(strKey);
+		if (it == m_pCache.end())
+		{
+			m_pCacheMutex.Unlock();
+			return nullptr;
+		}
+
+		std::shared_ptr<HttpCachedResponse> pEntry = it->second;
+		if (pEntry->IsExpired(fTime))
+		{
+			m_pCache.erase(it);
+			pEntry.reset();
+		}
+		m_pCacheMutex.Unlock();
+
+		return pEntry;
+	}
+
+	void UpdateCachedResponse(const std::string& strMethod, const std::string& strPath, std::shared_ptr<HttpCachedResponse> pEntry)
+	{
+		std::string strKey = strMethod + " " + strPath;
+		m_pCacheMutex.Lock();
+		if (pEntry)
+		{
+			m_pCache[strKey] = pEntry;
+			m_bUsesCache = true;
+		}
+		else
+			m_pCache.erase(strKey);
+		m_pCacheMutex.Unlock();
+	}
+
+	std::shared_ptr<HttpCachedResponse> CreateCachedResponse(std::string&& strContent, const char* pContentType, double fTTL)
+	{
+		std::shared_ptr<HttpCachedResponse> pEntry = std::make_shared<HttpCachedResponse>();
+		pEntry->m_strContent = std::move(strContent);
+		pEntry->m_strContentType = pContentType;
+		pEntry->Prepare(fTTL, m_bCacheDeflate, m_bCacheLZ4, m_iCacheMinCompressSize);
+
+		return pEntry;
+	}
+
+	void ClearCache()
+	{
+		m_pCacheMutex.Lock();
+		m_pCache.clear();
+		m_pCacheMutex.Unlock();
+	}
+
+	void ServeDirectory(const HttpServeDirectory& pDirectory)
+	{
+		m_pCacheMutex.Lock();
+		m_pDirectories.push_back(pDirectory);
+		m_bUsesCache = true;
+		m_pCacheMutex.Unlock();
+	}
+
+	void SetThreadCount(int iThreads, int iAcceptors)
+	{
+		m_iThreadCount = iThreads;
+		m_iAcceptorCount = iAcceptors;
+	};
+	void SetMaxQueuedConnections(int iMaxQueued) { m_iMaxQueuedConnections = iMaxQueued; };
+	void SetMaxQueuedRequests(int iMaxQueued) { m_iMaxQueuedRequests = iMaxQueued; };
+	void SetDeferredLimit(int iLimit) { m_iDeferredLimit = iLimit; };
+	void SetDeferredTimeout(double fTimeout) { m_fDeferredTimeout = fTimeout; };
+	void FinishDeferredRequest(HttpRequest* pRequest, int iStatusCode);
+	void ReleaseRequests(int iStatusCode);
+	bool FinishStop();
+	void CloseSockets();
+
+	void SetCacheCompression(bool bDeflate, bool bLZ4, unsigned int iMinSize)
+	{
+		m_bCacheDeflate = bDeflate;
+		m_bCacheLZ4 = bLZ4;
+		m_iCacheMinCompressSize = iMinSize;
+	}
 
 	void AddPreparedResponse(int userID, PreparedHttpResponse* pResponse)
 	{
@@ -222,11 +661,11 @@ public:
 	}
 
 public:
-	httplib::Server& GetServer() { return m_pServer; };
+	bool IsInUpdate() { return m_bInUpdate; };
+	void DeleteAfterUpdate() { m_bDeleteAfterUpdate = true; };
 	unsigned char GetStatus() { return m_iStatus; };
 	std::string& GetAddress() { return m_strAddress; };
 	unsigned short GetPort() { return m_iPort; };
-	void SetThreadSleep(unsigned int threadSleep) { m_iThreadSleep = threadSleep; };
 	const char* GetName() { return m_strName; };
 	void SetName(const char* strName)
 	{
@@ -241,9 +680,13 @@ public:
 
 	void ClearDisconnectedClient(int userID)
 	{
+		m_pPreparedResponsesMutex.Lock();
 		auto it = m_pPreparedResponses.find(userID);
 		if (it == m_pPreparedResponses.end())
+		{
+			m_pPreparedResponsesMutex.Unlock();
 			return;
+		}
 
 		for (auto& pPreparedResponse : it->second)
 		{
@@ -251,24 +694,95 @@ public:
 		}
 
 		m_pPreparedResponses.erase(it);
+		m_pPreparedResponsesMutex.Unlock();
+	}
+
+	void PushStats(GarrysMod::Lua::ILuaInterface* pLua)
+	{
+		pLua->CreateTable();
+			Util::AddValue(pLua, (double)m_iTotalRequests.load(std::memory_order_relaxed), "requests");
+			Util::AddValue(pLua, (double)m_iPreparedResponsesSent.load(std::memory_order_relaxed), "preparedResponses");
+			Util::AddValue(pLua, (double)m_iPendingRequests.load(std::memory_order_relaxed), "pending");
+			Util::AddValue(pLua, (double)m_iCacheHits.load(std::memory_order_relaxed), "cacheHits");
+			Util::AddValue(pLua, (double)m_iRejectedRequests.load(std::memory_order_relaxed), "rejectedRequests");
+			Util::AddValue(pLua, m_pConnections.m_iActiveConnections.load(std::memory_order_relaxed), "activeConnections");
+			Util::AddValue(pLua, m_pConnections.m_iQueuedConnections.load(std::memory_order_relaxed), "queuedConnections");
+			Util::AddValue(pLua, (double)m_pConnections.m_iRejectedConnections.load(std::memory_order_relaxed), "rejectedConnections");
+			Util::AddValue(pLua, m_iDeferredRequests, "deferred");
+			Util::AddValue(pLua, (double)m_iDeferredTimeouts, "deferredTimeouts");
+			Util::AddValue(pLua, (double)m_iDeferredRejected, "deferredRejected");
+
+			m_pQueueWait.PushTable(pLua);
+			pLua->SetField(-2, "queueWait");
+
+			m_pHandlerTime.PushTable(pLua);
+			pLua->SetField(-2, "handler");
+
+			m_pTotalTime.PushTable(pLua);
+			pLua->SetField(-2, "total");
+	}
+
+	void ResetStats()
+	{
+		m_iTotalRequests.store(0, std::memory_order_relaxed);
+		m_iPreparedResponsesSent.store(0, std::memory_order_relaxed);
+		m_iCacheHits.store(0, std::memory_order_relaxed);
+		m_iRejectedRequests.store(0, std::memory_order_relaxed);
+		m_pConnections.m_iRejectedConnections.store(0, std::memory_order_relaxed);
+		m_iDeferredTimeouts = 0;
+		m_iDeferredRejected = 0;
+		m_pQueueWait.Reset();
+		m_pHandlerTime.Reset();
+		m_pTotalTime.Reset();
 	}
 
 private:
 	unsigned char m_iStatus = HTTPSERVER_OFFLINE;
 	unsigned short m_iPort = 0;
-	unsigned int m_iThreadSleep = 5; // How long the threads sleep / wait for a request to be handled
-	bool m_bUpdate = false;
 	bool m_bInUpdate = false;
+	bool m_bDeleteAfterUpdate = false; // httpserver.Destroy was called inside one of our handlers.
+	bool m_bFinishStop = false; // Stop was called and FinishStop didn't delete all stopped acceptors yet.
+	int m_iThreadCount = CPPHTTPLIB_THREAD_POOL_COUNT; // Threads of each acceptor.
+	int m_iAcceptorCount = 1;
+	int m_iMaxQueuedConnections = 0; // How many connections can wait for a free thread, 0 = no limit.
+	std::atomic<int> m_iMaxQueuedRequests = 0; // How many requests can wait for the main thread, 0 = no limit.
+	int m_iDeferredLimit = -1; // How many requests can be deferred at once, -1 = no limit.
+	int m_iDeferredRequests = 0; // Only used by the main thread.
+	double m_fDeferredTimeout = 30; // Seconds after which a deferred request is answered with a 504, 0 = never.
 	std::string m_strAddress = "";
-	std::vector<HttpRequest*> m_pRequests;
+	HttpRequestQueue m_pQueue; // Requests pushed by the worker threads that the main thread didn't pick up yet.
+	std::vector<HttpRequest*> m_pRequests; // Only used by the main thread. Requests that were picked up and are waiting to be handled/deleted.
 	std::vector<int> m_pHandlerReferences; // Contains the Lua references to the handler functions.
-	httplib::Server m_pServer;
+	std::vector<HttpAcceptor*> m_pAcceptors; // Only used by the main thread, created by Start.
+	std::vector<HttpAcceptor*> m_pStoppedAcceptors; // Acceptors whose socket was closed by Stop, deleted by FinishStop once they returned.
+	std::vector<std::pair<std::string, HttpServerSetup>> m_pServerSetup; // Handlers & settings applied to every new acceptor.
 	char m_strName[64] = {0};
 
 	// userID - Response pairs.
 	std::unordered_map<int, std::vector<PreparedHttpResponse*>> m_pPreparedResponses;
 	CThreadFastMutex m_pPreparedResponsesMutex;
 
+	// "METHOD target" - Response pairs served by PreRouting. m_pCacheMutex also guards m_pDirectories.
+	std::unordered_map<std::string, std::shared_ptr<HttpCachedResponse>> m_pCache;
+	std::vector<HttpServeDirectory> m_pDirectories;
+	CThreadFastMutex m_pCacheMutex;
+	std::atomic<bool> m_bUsesCache = false; // Allows PreRouting to skip everything if nothing was ever cached.
+	std::atomic<bool> m_bCacheDeflate = false;
+	std::atomic<bool> m_bCacheLZ4 = false;
+	std::atomic<unsigned int> m_iCacheMinCompressSize = 1024;
+
+	std::atomic<uint64_t> m_iTotalRequests = 0;
+	std::atomic<uint64_t> m_iPreparedResponsesSent = 0;
+	std::atomic<uint64_t> m_iCacheHits = 0;
+	std::atomic<uint64_t> m_iRejectedRequests = 0;
+	HttpConnectionCounters m_pConnections;
+	uint64_t m_iDeferredTimeouts = 0; // Only used by the main thread.
+	uint64_t m_iDeferredRejected = 0; // Only used by the main thread.
+	std::atomic<int> m_iPendingRequests = 0;
+	HttpLatencyHistogram m_pQueueWait; // Time between a worker thread queuing the request and the main thread picking it up.
+	HttpLatencyHistogram m_pHandlerTime; // Time the Lua handler took.
+	HttpLatencyHistogram m_pTotalTime; // Time from the request being received until the response was set.
+
 	GarrysMod::Lua::ILuaInterface* m_pLua = NULL;
 };
 
@@ -280,15 +794,36 @@ Get_LuaClass(HttpRequest, "HttpRequest")
 
 HttpRequest::~HttpRequest()
 {
-	Delete_HttpRequest(m_pLua, this);
-	Delete_HttpResponse(m_pLua , &this->m_pResponseData);
+	if (m_pLua) // NULL if our HttpServer was shut down.
+	{
+		Delete_HttpRequest(m_pLua, this);
+		Delete_HttpResponse(m_pLua , &this->m_pResponseData);
+	}
 }
 
 void HttpRequest::MarkHandled()
 {
-	m_bHandled = true;
-	Delete_HttpRequest(m_pLua, this);
-	Delete_HttpResponse(m_pLua, &m_pResponseData);
+	if (m_pLua)
+	{
+		Delete_HttpRequest(m_pLua, this);
+		Delete_HttpResponse(m_pLua, &m_pResponseData);
+	}
+
+	if (m_bHandled)
+		return;
+
+	{
+		std::lock_guard<std::mutex> pLock(m_pHandledMutex);
+		m_bHandled = true;
+	}
+	m_pHandledCondition.notify_one();
+}
+
+// Called by the worker thread, blocks until the main thread marked the request as handled.
+void HttpRequest::WaitUntilHandled()
+{
+	std::unique_lock<std::mutex> pLock(m_pHandledMutex);
+	m_pHandledCondition.wait(pLock, [this] { return m_bHandled; });
 }
 
 LUA_FUNCTION_STATIC(HttpResponse__tostring)
@@ -518,7 +1053,7 @@ LUA_FUNCTION_STATIC(HttpRequest_MarkHandled)
 	return 0;
 }
 
-void CallFunc(GarrysMod::Lua::ILuaInterface* pLua, int callbackFunction, HttpRequest* request, HttpResponse* response)
+static void CallFunc(GarrysMod::Lua::ILuaInterface* pLua, int callbackFunction, HttpRequest* request, HttpResponse* response)
 {
 	Util::ReferencePush(pLua, callbackFunction);
 
@@ -548,8 +1083,43 @@ void HttpServer::Start(const char* address, unsigned short port)
 
 	m_strAddress = address;
 	m_iPort = port;
-	CreateSimpleThread((ThreadFunc_t)HttpServer::Server, this);
-	m_iStatus = HTTPSERVER_ONLINE;
+
+	int iAcceptors = m_iAcceptorCount;
+#ifndef SO_REUSEPORT
+	iAcceptors = 1; // Without SO_REUSEPORT only a single socket can listen on the port.
+#endif
+
+	HttpConnectionCounters* pCounters = &m_pConnections;
+	size_t iThreads = (size_t)MAX(m_iThreadCount, 1);
+	size_t iMaxQueued = (size_t)MAX(m_iMaxQueuedConnections, 0);
+	for (int i = 0; i < iAcceptors; ++i)
+	{
+		HttpAcceptor* pAcceptor = new HttpAcceptor;
+		httplib::Server& pServer = pAcceptor->m_pServer;
+		pServer.set_pre_routing_handler([this](const httplib::Request& req, httplib::Response& res) {
+			return PreRouting(req, res);
+		});
+		pServer.new_task_queue = [pCounters, iThreads, iMaxQueued] {
+			return new HttpServerTaskQueue(pCounters, iThreads, iMaxQueued);
+		};
+
+		for (auto& [_, pSetup] : m_pServerSetup)
+			pSetup(pServer);
+
+		if (!pServer.bind_to_port(m_strAddress, m_iPort))
+		{
+			Warning(PROJECT_NAME ": HttpServer \"%s\" failed to bind to %s:%i!\n", GetName(), m_strAddress.c_str(), (int)m_iPort);
+			delete pAcceptor;
+			break;
+		}
+
+		pAcceptor->m_bRunning.store(true, std::memory_order_relaxed);
+		m_pAcceptors.push_back(pAcceptor);
+		CreateSimpleThread((ThreadFunc_t)HttpServer::Acceptor, pAcceptor);
+	}
+
+	if (!m_pAcceptors.empty())
+		m_iStatus = HTTPSERVER_ONLINE;
 }
 
 void HttpServer::Stop()
@@ -557,27 +1127,116 @@ void HttpServer::Stop()
 	if (m_iStatus == HTTPSERVER_OFFLINE)
 		return;
 
-	m_pServer.stop();
+	CloseSockets();
+	m_pStoppedAcceptors.insert(m_pStoppedAcceptors.end(), m_pAcceptors.begin(), m_pAcceptors.end());
+	m_pAcceptors.clear();
 	m_iStatus = HTTPSERVER_OFFLINE;
+	m_bFinishStop = true;
+}
+
+/*
+ * Deletes the stopped acceptors whose thread returned and while we're offline answers every request with a 503.
+ * httplib joins all worker threads before an acceptor returns and a slow client can block one for up to the read timeout,
+ * so instead of waiting for them this is called by every Think until it returns true.
+ */
+bool HttpServer::FinishStop()
+{
+	for (auto it = m_pStoppedAcceptors.begin(); it != m_pStoppedAcceptors.end();)
+	{
+		if ((*it)->m_bRunning.load(std::memory_order_acquire))
+		{
+			++it;
+			continue;
+		}
+
+		delete *it;
+		it = m_pStoppedAcceptors.erase(it);
+	}
+
+	if (m_iStatus == HTTPSERVER_OFFLINE)
+		ReleaseRequests(503);
+
+	m_bFinishStop = !m_pStoppedAcceptors.empty();
+	return !m_bFinishStop;
+}
+
+/*
+ * Stops us and frees everything that uses our Lua state.
+ * We are deleted by CHTTPServerModule::Think once FinishStop returned true since our threads might still use us until then.
+ */
+void HttpServer::Shutdown()
+{
+	Stop();
+	ReleaseRequests(503);
+	for (HttpRequest* pRequest : m_pRequests)
+		pRequest->m_pLua = NULL; // They can outlive our Lua state now.
+
+	for (auto& ref : m_pHandlerReferences)
+		Util::ReferenceFree(m_pLua, ref, "HttpServer::Shutdown - Handler references");
+
+	m_pHandlerReferences.clear();
+	m_pLua = NULL;
+
+	g_pHttpServers.erase(this);
+	g_pShutdownHttpServers.push_back(this);
+}
+
+/*
+ * httplib::Server::stop does nothing if the acceptor didn't start listening yet, so we first wait for it to start.
+ * Afterwards its listening socket is closed which makes it return once its worker threads finished.
+ */
+void HttpServer::CloseSockets()
+{
+	for (HttpAcceptor* pAcceptor : m_pAcceptors)
+	{
+		while (pAcceptor->m_bRunning.load(std::memory_order_acquire) && !pAcceptor->m_pServer.is_running())
+			ThreadSleep(1);
+
+		pAcceptor->m_pServer.stop();
+	}
+}
+
+// Answers every request that wasn't handled yet with only the given status code, deferred ones included.
+void HttpServer::ReleaseRequests(int iStatusCode)
+{
+	HttpRequest* pRequest = m_pQueue.PopAll();
+	while (pRequest)
+	{
+		HttpRequest* pNext = pRequest->m_pNext;
+		pRequest->m_pNext = NULL;
+		if (!m_pLua) // A worker thread might have queued it while we were shutting down.
+			pRequest->m_pLua = NULL;
+
+		m_pRequests.push_back(pRequest);
+		pRequest = pNext;
+	}
+
+	for (HttpRequest* pEntry : m_pRequests)
+	{
+		if (!pEntry->m_bHandled)
+			FinishDeferredRequest(pEntry, iStatusCode);
+	}
 }
 
 void HttpServer::Think()
 {
-	if (m_iStatus == HTTPSERVER_OFFLINE || !m_bUpdate)
+	if (m_bInUpdate)
 		return;
 
-	/*
-	 * BUG: If for some reason a request remain unhandled, they might end up stuck until a second one comes in.
-	 * The function below should probably just always run instead, but I fear for my precious performance.
-	 * 
-	 * Verify: Is this still a thing? Probably.
-	 */
+	if (m_bFinishStop)
+		FinishStop();
+
+	if (m_pRequests.empty() && m_pQueue.IsEmpty())
+		return;
 
 	m_bInUpdate = true;
+
+	double fTime = Plat_FloatTime();
+	int iDeferredRequests = 0;
 	for (auto it = m_pRequests.begin(); it != m_pRequests.end();)
 	{
 		auto pEntry = *it;
-		if (pEntry->m_bDelete)
+		if (pEntry->m_bDelete.load(std::memory_order_acquire))
 		{
 			it = m_pRequests.erase(it);
 			delete pEntry;
@@ -585,47 +1244,217 @@ void HttpServer::Think()
 		}
 
 		if (!pEntry->m_bHandled)
-			CallFunc(m_pLua, pEntry->m_iFunction, pEntry, &pEntry->m_pResponseData);
+		{
+			if (m_fDeferredTimeout > 0 && (fTime - pEntry->m_fDeferredTime) >= m_fDeferredTimeout)
+			{
+				FinishDeferredRequest(pEntry, 504);
+				++m_iDeferredTimeouts;
+			} else {
+				++iDeferredRequests;
+			}
+		}
 
 		++it;
 	}
 
-	m_bUpdate = false;
+	// Every request is only passed to its handler once, if it returns true it stays in m_pRequests until its marked as handled.
+	HttpRequest* pRequest = m_pQueue.PopAll();
+	while (pRequest)
+	{
+		HttpRequest* pNext = pRequest->m_pNext;
+		pRequest->m_pNext = NULL;
+		m_pRequests.push_back(pRequest);
+
+		double fCallTime = Plat_FloatTime();
+		m_pQueueWait.Add(fCallTime - pRequest->m_fQueueTime);
+		if (m_iStatus == HTTPSERVER_OFFLINE) // Stop was called by one of the previous handlers.
+		{
+			FinishDeferredRequest(pRequest, 503);
+		} else if (pRequest->m_iFunction == -1) {
+			ReadDirectoryFile(pRequest);
+		} else {
+			CallFunc(m_pLua, pRequest->m_iFunction, pRequest, &pRequest->m_pResponseData);
+
+			double fFinishTime = Plat_FloatTime();
+			m_pHandlerTime.Add(fFinishTime - fCallTime);
+			if (!pRequest->m_bHandled)
+			{
+				// The httplib thread stays blocked while a request is deferred, so we limit how many can be deferred at once.
+				if (m_iDeferredLimit >= 0 && iDeferredRequests >= m_iDeferredLimit)
+				{
+					if (g_pHttpServerModule.InDebug())
+						Msg("holylib - httpserver: Rejected deferred request as the limit of %i was reached\n", m_iDeferredLimit);
+
+					FinishDeferredRequest(pRequest, 503);
+					++m_iDeferredRejected;
+				} else {
+					pRequest->m_fDeferredTime = fFinishTime;
+					++iDeferredRequests;
+				}
+			}
+		}
+
+		pRequest = pNext;
+	}
+
+	m_iDeferredRequests = iDeferredRequests;
 	m_bInUpdate = false;
+
+	if (m_bDeleteAfterUpdate)
+		Shutdown();
 }
 
+// Answers a deferred request with only the given status code, anything Lua set on the HttpResponse is discarded.
+void HttpServer::FinishDeferredRequest(HttpRequest* pRequest, int iStatusCode)
+{
+	pRequest->m_pResponseData.Reset(iStatusCode);
+	pRequest->MarkHandled();
+}
+
+/*
+ * The filesystem isn't safe to use from httplib's worker threads (our filesystem module's caches aren't either)
+ * so the main thread reads the file and the worker thread builds & compresses the cache entry.
+ */
+void HttpServer::ReadDirectoryFile(HttpRequest* pRequest)
+{
+	FileHandle_t pHandle = g_pFullFileSystem->Open(pRequest->m_strFilePath.c_str(), "rb", pRequest->m_strFilePathID.c_str());
+	if (pHandle)
+	{
+		unsigned int iSize = g_pFullFileSystem->Size(pHandle);
+		pRequest->m_strFileContent.resize(iSize);
+		pRequest->m_bFileFound = iSize == 0 || g_pFullFileSystem->Read(pRequest->m_strFileContent.data(), iSize, pHandle) == (int)iSize;
+		g_pFullFileSystem->Close(pHandle);
+	}
+
+	pRequest->MarkHandled();
+}
+
+httplib::Server::HandlerResponse HttpServer::PreRouting(const httplib::Request& req, httplib::Response& res)
+{
+	if (!m_bUsesCache.load(std::memory_order_relaxed))
+		return httplib::Server::HandlerResponse::Unhandled;
+
+	double fReceiveTime = Plat_FloatTime();
+	const std::string strMethod = req.method == "HEAD" ? "GET" : req.method;
+	std::shared_ptr<HttpCachedResponse> pEntry = FindCachedResponse(strMethod + " " + req.target);
+	if (!pEntry && req.target != req.path)
+		pEntry = FindCachedResponse(strMethod + " " + req.path);
+
+	if (pEntry)
+	{
+		HttpCachedResponse::DoResponse(pEntry, req, res);
+		m_iCacheHits.fetch_add(1, std::memory_order_relaxed);
+		m_pTotalTime.Add(Plat_FloatTime() - fReceiveTime);
+		return httplib::Server::HandlerResponse::Handled;
+	}
+
+	if (strMethod != "GET")
+		return httplib::Server::HandlerResponse::Unhandled;
+
+	HttpServeDirectory pDirectory;
+	bool bFoundDirectory = false;
+	m_pCacheMutex.Lock();
+	for (auto& pServeDirectory : m_pDirectories)
+	{
+		const std::string& strPrefix = pServeDirectory.m_strURLPrefix;
+		if (req.path.size() > strPrefix.size() && req.path.compare(0, strPrefix.size(), strPrefix) == 0 && req.path[strPrefix.size()] == '/')
+		{
+			pDirectory = pServeDirectory;
+			bFoundDirectory = true;
+			break;
+		}
+	}
+	m_pCacheMutex.Unlock();
+
+	if (!bFoundDirectory)
+		return httplib::Server::HandlerResponse::Unhandled;
+
+	std::string strSubPath = req.path.substr(pDirectory.m_strURLPrefix.size() + 1);
+	if (strSubPath.empty() || strSubPath.back() == '/' || !httplib::detail::is_valid_path(strSubPath))
+		return httplib::Server::HandlerResponse::Unhandled;
+
+	HttpRequest* request = new HttpRequest;
+	request->m_strFilePath = pDirectory.m_strFolder + "/" + strSubPath;
+	request->m_strFilePathID = pDirectory.m_strPathID;
+	request->m_pLua = m_pLua;
+	request->m_fQueueTime = fReceiveTime;
+	m_iPendingRequests.fetch_add(1, std::memory_order_relaxed);
+	m_pQueue.Push(request);
+	request->WaitUntilHandled();
+
+	bool bFound = request->m_bFileFound;
+	std::string strContent = std::move(request->m_strFileContent);
+	m_iPendingRequests.fetch_sub(1, std::memory_order_relaxed);
+	request->m_bDelete.store(true, std::memory_order_release);
+
+	if (!bFound)
+		return httplib::Server::HandlerResponse::Unhandled;
+
+	std::string strContentType = httplib::detail::find_content_type(strSubPath, {}, "application/octet-stream");
+	pEntry = CreateCachedResponse(std::move(strContent), strContentType.c_str(), pDirectory.m_fTTL);
+	UpdateCachedResponse("GET", req.path, pEntry);
+
+	HttpCachedResponse::DoResponse(pEntry, req, res);
+	m_pTotalTime.Add(Plat_FloatTime() - fReceiveTime);
+	return httplib::Server::HandlerResponse::Handled;
+}
+
+/*
+ * IP -> userID index used to find the client of a request.
+ * It's only ever rebuilt on the main thread and then published as a new immutable snapshot,
+ * so the worker threads never touch a CBaseClient or its INetChannel which could be nuked while they use it.
+ */
+typedef std::unordered_map<std::string, int> HttpClientAddressMap;
+static std::shared_ptr<const HttpClientAddressMap> g_pClientAddresses; // Only accessed using std::atomic_load/std::atomic_store
+static bool g_bClientAddressesDirty = true; // Starts dirty since we could be loaded while clients are already connected.
 static std::string localAddr = "127.0.0.1";
 static std::string loopBack = "loopback";
+static void RebuildClientAddresses(CBaseClient* pIgnoreClient = NULL)
+{
+	if (!Util::server)
+		return;
+
+	std::shared_ptr<HttpClientAddressMap> pAddresses = std::make_shared<HttpClientAddressMap>();
+	for (auto& pClient : Util::GetClients())
+	{
+		if (pClient == pIgnoreClient || !pClient->IsConnected())
+			continue;
+
+		INetChannel* pChannel = pClient->GetNetChannel();
+		if (!pChannel)
+			continue; // Probably a fake client.
+
+		std::string strAddress = pChannel->GetRemoteAddress().ToString(true);
+		if (strAddress == loopBack)
+			strAddress = localAddr;
+
+		pAddresses->emplace(std::move(strAddress), pClient->GetUserID()); // If multiple clients share an IP, the first one wins like it always did.
+	}
+
+	std::atomic_store(&g_pClientAddresses, std::shared_ptr<const HttpClientAddressMap>(std::move(pAddresses)));
+	g_bClientAddressesDirty = false;
+}
+
+static int FindUserIDByAddress(const std::string& strAddress)
+{
+	std::shared_ptr<const HttpClientAddressMap> pAddresses = std::atomic_load(&g_pClientAddresses);
+	if (!pAddresses)
+		return -1;
+
+	auto it = pAddresses->find(strAddress);
+	if (it == pAddresses->end())
+		return -1;
+
+	return it->second;
+}
+
 httplib::Server::Handler HttpServer::CreateHandler(const char* path, int func, bool ipWhitelist)
 {
 	m_pHandlerReferences.push_back(func);
 
 	return [=](const httplib::Request& req, httplib::Response& res)
 	{
-		int userID = -1;
-		for (auto& pClient : Util::GetClients())
-		{
-			// NOTE: Currently we assume pClient is always valid, and this is true as long as our httpServer doesn't persist across map changes
-			// This is because the engine by default reuses CBaseClient's but they are potentially nuked when the server shuts down
-			// so on map changes if a HttpServer would run, it would have possible bugs.
-			if (!pClient->IsConnected())
-				continue;
-
-			INetChannel* pChannel = pClient->GetNetChannel();
-			if (!pChannel)
-				continue; // Probably a fake client.
-
-			// ToDo: Could this possibly end up as a race condition?
-			// What if pClient disconnects right here and their INetChannel is nuked?
-			const netadr_s& addr = pChannel->GetRemoteAddress();
-			std::string address = addr.ToString();
-			size_t port_pos = address.find(":");
-			if (address.substr(0, port_pos) == req.remote_addr || (req.remote_addr == localAddr && address.substr(0, port_pos) == loopBack))
-			{
-				userID = pClient->GetUserID();
-				break;
-			}
-		}
+		int userID = FindUserIDByAddress(req.remote_addr);
 
 		if (ipWhitelist && userID == -1)
 		{
@@ -635,25 +1464,42 @@ httplib::Server::Handler HttpServer::CreateHandler(const char* path, int func, b
 			return;
 		}
 
+		double fReceiveTime = Plat_FloatTime();
 		m_pPreparedResponsesMutex.Lock();
 		auto it = m_pPreparedResponses.find(userID);
 		if (it != m_pPreparedResponses.end())
 		{
-			for (auto vecIT = it->second.begin(); vecIT != it->second.end(); it++)
+			for (auto vecIT = it->second.begin(); vecIT != it->second.end(); ++vecIT)
 			{
 				auto pPrepared = *vecIT;
 				if (!pPrepared->ShouldRespond(req))
 					continue;
 
-				pPrepared->DoResponse(res);
-				delete pPrepared;
 				it->second.erase(vecIT);
 				m_pPreparedResponsesMutex.Unlock();
+
+				// Prepared responses are fully handled on the worker thread, no need to bother the main thread.
+				pPrepared->DoResponse(res);
+				delete pPrepared;
+				m_iPreparedResponsesSent.fetch_add(1, std::memory_order_relaxed);
+				m_pTotalTime.Add(Plat_FloatTime() - fReceiveTime);
 				return;
 			}
 		}
 		m_pPreparedResponsesMutex.Unlock();
 
+		int iMaxQueuedRequests = m_iMaxQueuedRequests.load(std::memory_order_relaxed);
+		if (iMaxQueuedRequests > 0 && m_iPendingRequests.load(std::memory_order_relaxed) >= iMaxQueuedRequests)
+		{
+			if (g_pHttpServerModule.InDebug())
+				Msg("holylib - httpserver: Rejected request as too many requests are waiting for the main thread\n");
+
+			res.status = 503;
+			res.set_header("Retry-After", "1");
+			m_iRejectedRequests.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+
 		if (g_pHttpServerModule.InDebug())
 			Msg("holylib - httpserver: Waiting for Main thread to pick up request\n");
 
@@ -664,14 +1510,17 @@ httplib::Server::Handler HttpServer::CreateHandler(const char* path, int func, b
 		request->m_pResponse = res;
 		request->m_pClientUserID = userID;
 		request->m_pLua = m_pLua; // Inherit the Lua interface.
-		m_pRequests.push_back(request); // We should add a check here since we could write to it from multiple threads?
-		m_bUpdate = true;
-		while (!request->m_bHandled)
-			ThreadSleep(m_iThreadSleep);
+		request->m_fQueueTime = fReceiveTime;
+		m_iPendingRequests.fetch_add(1, std::memory_order_relaxed);
+		m_pQueue.Push(request);
+		request->WaitUntilHandled();
 
 		request->m_pResponseData.DoResponse(res);
+		m_iTotalRequests.fetch_add(1, std::memory_order_relaxed);
+		m_iPendingRequests.fetch_sub(1, std::memory_order_relaxed);
+		m_pTotalTime.Add(Plat_FloatTime() - fReceiveTime);
 
-		request->m_bDelete = true;
+		request->m_bDelete.store(true, std::memory_order_release); // The main thread may delete the request from now on so we can't touch it anymore.
 
 		if (g_pHttpServerModule.InDebug())
 			Msg("holylib - httpserver: Finished request\n");
@@ -814,7 +1663,8 @@ LUA_FUNCTION_STATIC(HttpServer_IsRunning)
 LUA_FUNCTION_STATIC(HttpServer_SetTCPnodelay)
 {
 	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
-	pServer->GetServer().set_tcp_nodelay(CheckBool(LUA, 2));
+	bool bNoDelay = CheckBool(LUA, 2);
+	pServer->Configure("tcp_nodelay", [bNoDelay](httplib::Server& pHttpServer) { pHttpServer.set_tcp_nodelay(bNoDelay); });
 
 	return 0;
 }
@@ -822,7 +1672,9 @@ LUA_FUNCTION_STATIC(HttpServer_SetTCPnodelay)
 LUA_FUNCTION_STATIC(HttpServer_SetReadTimeout)
 {
 	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
-	pServer->GetServer().set_read_timeout((time_t)LUA->CheckNumber(2), (time_t)LUA->CheckNumber(3));
+	time_t iSec = (time_t)LUA->CheckNumber(2);
+	time_t iUSec = (time_t)LUA->CheckNumber(3);
+	pServer->Configure("read_timeout", [iSec, iUSec](httplib::Server& pHttpServer) { pHttpServer.set_read_timeout(iSec, iUSec); });
 
 	return 0;
 }
@@ -830,7 +1682,9 @@ LUA_FUNCTION_STATIC(HttpServer_SetReadTimeout)
 LUA_FUNCTION_STATIC(HttpServer_SetWriteTimeout)
 {
 	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
-	pServer->GetServer().set_write_timeout((time_t)LUA->CheckNumber(2), (time_t)LUA->CheckNumber(3));
+	time_t iSec = (time_t)LUA->CheckNumber(2);
+	time_t iUSec = (time_t)LUA->CheckNumber(3);
+	pServer->Configure("write_timeout", [iSec, iUSec](httplib::Server& pHttpServer) { pHttpServer.set_write_timeout(iSec, iUSec); });
 
 	return 0;
 }
@@ -838,7 +1692,8 @@ LUA_FUNCTION_STATIC(HttpServer_SetWriteTimeout)
 LUA_FUNCTION_STATIC(HttpServer_SetPayloadMaxLength)
 {
 	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
-	pServer->GetServer().set_payload_max_length((size_t)LUA->CheckNumber(2));
+	size_t iLength = (size_t)LUA->CheckNumber(2);
+	pServer->Configure("payload_max_length", [iLength](httplib::Server& pHttpServer) { pHttpServer.set_payload_max_length(iLength); });
 
 	return 0;
 }
@@ -846,7 +1701,8 @@ LUA_FUNCTION_STATIC(HttpServer_SetPayloadMaxLength)
 LUA_FUNCTION_STATIC(HttpServer_SetKeepAliveTimeout)
 {
 	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
-	pServer->GetServer().set_keep_alive_timeout((time_t)LUA->CheckNumber(2));
+	time_t iTimeout = (time_t)LUA->CheckNumber(2);
+	pServer->Configure("keep_alive_timeout", [iTimeout](httplib::Server& pHttpServer) { pHttpServer.set_keep_alive_timeout(iTimeout); });
 
 	return 0;
 }
@@ -854,7 +1710,8 @@ LUA_FUNCTION_STATIC(HttpServer_SetKeepAliveTimeout)
 LUA_FUNCTION_STATIC(HttpServer_SetKeepAliveMaxCount)
 {
 	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
-	pServer->GetServer().set_keep_alive_max_count((size_t)LUA->CheckNumber(2));
+	size_t iCount = (size_t)LUA->CheckNumber(2);
+	pServer->Configure("keep_alive_max_count", [iCount](httplib::Server& pHttpServer) { pHttpServer.set_keep_alive_max_count(iCount); });
 
 	return 0;
 }
@@ -862,7 +1719,9 @@ LUA_FUNCTION_STATIC(HttpServer_SetKeepAliveMaxCount)
 LUA_FUNCTION_STATIC(HttpServer_SetMountPoint)
 {
 	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
-	pServer->GetServer().set_mount_point(LUA->CheckString(2), LUA->CheckString(3));
+	std::string strMountPoint = LUA->CheckString(2);
+	std::string strDir = LUA->CheckString(3);
+	pServer->Configure(("mount_point " + strMountPoint).c_str(), [strMountPoint, strDir](httplib::Server& pHttpServer) { pHttpServer.set_mount_point(strMountPoint, strDir); });
 
 	return 0;
 }
@@ -870,7 +1729,8 @@ LUA_FUNCTION_STATIC(HttpServer_SetMountPoint)
 LUA_FUNCTION_STATIC(HttpServer_RemoveMountPoint)
 {
 	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
-	pServer->GetServer().remove_mount_point(LUA->CheckString(2));
+	std::string strMountPoint = LUA->CheckString(2);
+	pServer->Configure(("mount_point " + strMountPoint).c_str(), [strMountPoint](httplib::Server& pHttpServer) { pHttpServer.remove_mount_point(strMountPoint); });
 
 	return 0;
 }
@@ -895,10 +1755,74 @@ LUA_FUNCTION_STATIC(HttpServer_Stop)
 }
 
 LUA_FUNCTION_STATIC(HttpServer_SetThreadSleep)
+{
+	Get_HttpServer(LUA, 1, true);
+	LUA->CheckNumber(2);
+
+	// Does nothing anymore as worker threads are now woken up as soon as their request was handled.
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_SetThreadCount)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+	int iThreads = (int)LUA->CheckNumber(2);
+	int iAcceptors = (int)LUA->CheckNumberOpt(3, 1);
+	if (iThreads < 1)
+		LUA->ArgError(2, "threads needs to be at least 1");
+
+	if (iAcceptors < 1)
+		LUA->ArgError(3, "acceptors needs to be at least 1");
+
+	pServer->SetThreadCount(iThreads, iAcceptors);
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_SetMaxQueuedConnections)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+
+	pServer->SetMaxQueuedConnections((int)LUA->CheckNumberOpt(2, 0));
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_SetMaxQueuedRequests)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+
+	pServer->SetMaxQueuedRequests((int)LUA->CheckNumberOpt(2, 0));
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_SetDeferredLimit)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+
+	pServer->SetDeferredLimit((int)LUA->CheckNumberOpt(2, -1));
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_SetDeferredTimeout)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+
+	pServer->SetDeferredTimeout(LUA->CheckNumber(2));
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_GetStats)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+
+	pServer->PushStats(LUA);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_ResetStats)
 {
 	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
-	pServer->SetThreadSleep((unsigned int)LUA->CheckNumber(2));
 
+	pServer->ResetStats();
 	return 0;
 }
 
@@ -970,6 +1894,273 @@ LUA_FUNCTION_STATIC(HttpServer_AddPreparedResponse)
 	return 0;
 }
 
+LUA_FUNCTION_STATIC(HttpServer_AddStaticRoute)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+	const char* pPath = LUA->CheckString(2);
+	const char* pContent = LUA->CheckString(3);
+	std::string strContent(pContent, LUA->ObjLen(3));
+	double fTTL = LUA->CheckNumberOpt(4, 0);
+	const char* pContentType = LUA->CheckStringOpt(5, "text/plain");
+
+	pServer->UpdateCachedResponse("GET", pPath, pServer->CreateCachedResponse(std::move(strContent), pContentType, fTTL));
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_UpdateCachedResponse)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+	const char* pMethod = LUA->CheckString(2);
+	const char* pPath = LUA->CheckString(3);
+	if (LUA->IsType(4, GarrysMod::Lua::Type::Nil))
+	{
+		pServer->UpdateCachedResponse(pMethod, pPath, nullptr);
+		return 0;
+	}
+
+	const char* pContent = LUA->CheckString(4);
+	std::string strContent(pContent, LUA->ObjLen(4));
+	double fTTL = LUA->CheckNumberOpt(5, 0);
+	const char* pContentType = LUA->CheckStringOpt(6, "text/plain");
+
+	pServer->UpdateCachedResponse(pMethod, pPath, pServer->CreateCachedResponse(std::move(strContent), pContentType, fTTL));
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_ClearCache)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+
+	pServer->ClearCache();
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_ServeDirectory)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+
+	HttpServeDirectory pDirectory;
+	pDirectory.m_strURLPrefix = LUA->CheckString(2);
+	pDirectory.m_strFolder = LUA->CheckString(3);
+	pDirectory.m_strPathID = LUA->CheckStringOpt(4, "GAME");
+	pDirectory.m_fTTL = LUA->CheckNumberOpt(5, 60);
+
+	while (!pDirectory.m_strURLPrefix.empty() && pDirectory.m_strURLPrefix.back() == '/')
+		pDirectory.m_strURLPrefix.pop_back();
+
+	while (!pDirectory.m_strFolder.empty() && (pDirectory.m_strFolder.back() == '/' || pDirectory.m_strFolder.back() == '\\'))
+		pDirectory.m_strFolder.pop_back();
+
+	pServer->ServeDirectory(pDirectory);
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(HttpServer_SetCacheCompression)
+{
+	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
+	bool bDeflate = LUA->GetBool(2);
+	bool bLZ4 = LUA->GetBool(3);
+	unsigned int iMinSize = (unsigned int)LUA->CheckNumberOpt(4, 1024);
+
+	pServer->SetCacheCompression(bDeflate, bLZ4, iMinSize);
+	return 0;
+}
+
+/*
+ * Loopback load generator used by httpserver.Benchmark.
+ * Every connection runs on its own thread using httplib's client, they share one request counter.
+ */
+struct HttpBenchmark
+{
+	~HttpBenchmark()
+	{
+		if (m_iCallback != -1)
+			Util::ReferenceFree(m_pLua, m_iCallback, "HttpBenchmark::~HttpBenchmark - Callback");
+	}
+
+	std::string m_strAddress = "127.0.0.1";
+	int m_iPort = 0;
+	std::string m_strPath = "/";
+	std::string m_strMethod = "GET";
+	std::string m_strBody = "";
+	int m_iConnections = 4;
+	int m_iRequests = 1000;
+
+	std::atomic<int> m_iNextRequest = 0;
+	std::atomic<int> m_iFailed = 0;
+	std::atomic<int> m_iFinishedThreads = 0;
+	std::atomic<bool> m_bAbort = false;
+	double m_fStartTime = 0;
+	std::atomic<double> m_fEndTime = 0;
+	std::mutex m_pLatencyMutex; // Also guards m_pClients.
+	std::condition_variable m_pFinishedCondition;
+	std::vector<double> m_pLatencies; // In ms
+	std::vector<httplib::Client*> m_pClients; // The clients of the running connection threads, used to abort them.
+
+	int m_iCallback = -1;
+	GarrysMod::Lua::ILuaInterface* m_pLua = NULL;
+
+	inline bool IsFinished()
+	{
+		return m_iFinishedThreads.load(std::memory_order_acquire) >= m_iConnections;
+	}
+
+#if ARCHITECTURE_IS_X86_64
+	static long long unsigned Connection(void* params)
+#else
+	static unsigned Connection(void* params)
+#endif
+	{
+		HttpBenchmark* pBenchmark = (HttpBenchmark*)params;
+		httplib::Client pClient(pBenchmark->m_strAddress, pBenchmark->m_iPort);
+		pClient.set_keep_alive(true);
+		pClient.set_connection_timeout(1, 0);
+		pClient.set_read_timeout(5, 0);
+
+		{
+			std::lock_guard<std::mutex> pLock(pBenchmark->m_pLatencyMutex);
+			pBenchmark->m_pClients.push_back(&pClient);
+		}
+
+		std::vector<double> pLatencies;
+		while (!pBenchmark->m_bAbort.load(std::memory_order_relaxed))
+		{
+			if (pBenchmark->m_iNextRequest.fetch_add(1, std::memory_order_relaxed) >= pBenchmark->m_iRequests)
+				break;
+
+			double fStartTime = Plat_FloatTime();
+			httplib::Result pResult = pBenchmark->m_strMethod == "POST"
+				? pClient.Post(pBenchmark->m_strPath, pBenchmark->m_strBody, "text/plain")
+				: pClient.Get(pBenchmark->m_strPath);
+
+			if (!pResult || pResult->status >= 500)
+			{
+				pBenchmark->m_iFailed.fetch_add(1, std::memory_order_relaxed);
+				continue;
+			}
+
+			pLatencies.push_back((Plat_FloatTime() - fStartTime) * 1000.0);
+		}
+
+		{
+			std::lock_guard<std::mutex> pLock(pBenchmark->m_pLatencyMutex);
+			pBenchmark->m_pClients.erase(std::find(pBenchmark->m_pClients.begin(), pBenchmark->m_pClients.end(), &pClient));
+			pBenchmark->m_pLatencies.insert(pBenchmark->m_pLatencies.end(), pLatencies.begin(), pLatencies.end());
+			pBenchmark->m_fEndTime.store(Plat_FloatTime(), std::memory_order_relaxed);
+			pBenchmark->m_iFinishedThreads.fetch_add(1, std::memory_order_release);
+		}
+		pBenchmark->m_pFinishedCondition.notify_all();
+
+		return 0;
+	}
+
+	/*
+	 * Shuts down the socket of every connection so that requests waiting on a Lua route
+	 * fail instantly instead of running into the read timeout, then waits for all connection threads.
+	 */
+	void Abort()
+	{
+		m_bAbort = true;
+
+		std::unique_lock<std::mutex> pLock(m_pLatencyMutex);
+		for (httplib::Client* pClient : m_pClients)
+			pClient->stop();
+
+		m_pFinishedCondition.wait(pLock, [this] { return IsFinished(); });
+	}
+
+	inline double GetPercentile(double fPercentile)
+	{
+		if (m_pLatencies.empty())
+			return 0;
+
+		size_t iIndex = (size_t)(fPercentile * (m_pLatencies.size() - 1));
+		return m_pLatencies[iIndex];
+	}
+
+	void PushResults(GarrysMod::Lua::ILuaInterface* pLua)
+	{
+		std::sort(m_pLatencies.begin(), m_pLatencies.end());
+
+		double fTotal = 0;
+		for (double fLatency : m_pLatencies)
+			fTotal += fLatency;
+
+		double fDuration = m_fEndTime.load(std::memory_order_relaxed) - m_fStartTime;
+		pLua->CreateTable();
+			Util::AddValue(pLua, (double)m_pLatencies.size(), "requests");
+			Util::AddValue(pLua, m_iFailed.load(std::memory_order_relaxed), "failed");
+			Util::AddValue(pLua, fDuration, "duration");
+			Util::AddValue(pLua, fDuration > 0 ? m_pLatencies.size() / fDuration : 0, "requestsPerSecond");
+			Util::AddValue(pLua, m_pLatencies.empty() ? 0 : fTotal / m_pLatencies.size(), "average");
+			Util::AddValue(pLua, GetPercentile(0.5), "p50");
+			Util::AddValue(pLua, GetPercentile(0.9), "p90");
+			Util::AddValue(pLua, GetPercentile(0.99), "p99");
+			Util::AddValue(pLua, m_pLatencies.empty() ? 0 : m_pLatencies.back(), "max");
+	}
+};
+static std::vector<HttpBenchmark*> g_pHttpBenchmarks;
+
+LUA_FUNCTION_STATIC(httpserver_Benchmark)
+{
+	LUA->CheckType(1, GarrysMod::Lua::Type::Table);
+	LUA->CheckType(2, GarrysMod::Lua::Type::Function);
+
+	HttpBenchmark* pBenchmark = new HttpBenchmark;
+	LUA->GetField(1, "address");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+			pBenchmark->m_strAddress = LUA->GetString(-1);
+	LUA->Pop(1);
+
+	LUA->GetField(1, "port");
+		pBenchmark->m_iPort = (int)LUA->GetNumber(-1);
+	LUA->Pop(1);
+
+	LUA->GetField(1, "path");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+			pBenchmark->m_strPath = LUA->GetString(-1);
+	LUA->Pop(1);
+
+	LUA->GetField(1, "method");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+			pBenchmark->m_strMethod = LUA->GetString(-1);
+	LUA->Pop(1);
+
+	LUA->GetField(1, "body");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::String))
+			pBenchmark->m_strBody = LUA->GetString(-1);
+	LUA->Pop(1);
+
+	LUA->GetField(1, "connections");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+			pBenchmark->m_iConnections = MAX((int)LUA->GetNumber(-1), 1);
+	LUA->Pop(1);
+
+	LUA->GetField(1, "requests");
+		if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+			pBenchmark->m_iRequests = MAX((int)LUA->GetNumber(-1), 0);
+	LUA->Pop(1);
+
+	if (pBenchmark->m_iPort <= 0 || pBenchmark->m_iPort > 65535)
+	{
+		delete pBenchmark;
+		LUA->ArgError(1, "port needs to be a valid port");
+		return 0;
+	}
+
+	LUA->Push(2);
+	pBenchmark->m_iCallback = Util::ReferenceCreate(LUA, "httpserver.Benchmark - Callback");
+	pBenchmark->m_pLua = LUA;
+	pBenchmark->m_fStartTime = Plat_FloatTime();
+	pBenchmark->m_fEndTime = pBenchmark->m_fStartTime;
+	g_pHttpBenchmarks.push_back(pBenchmark);
+
+	for (int i = 0; i < pBenchmark->m_iConnections; ++i)
+		CreateSimpleThread((ThreadFunc_t)HttpBenchmark::Connection, pBenchmark);
+
+	return 0;
+}
+
 LUA_FUNCTION_STATIC(httpserver_Create)
 {
 	Push_HttpServer(LUA, new HttpServer(LUA));
@@ -980,11 +2171,15 @@ LUA_FUNCTION_STATIC(httpserver_Destroy)
 {
 	HttpServer* pServer = Get_HttpServer(LUA, 1, true);
 
-	if (pServer->GetStatus() == HTTPSERVER_ONLINE)
+	Delete_HttpServer(LUA, pServer);
+	if (pServer->IsInUpdate())
+	{
 		pServer->Stop();
+		pServer->DeleteAfterUpdate(); // Think still uses it.
+		return 0;
+	}
 
-	Delete_HttpServer(LUA, pServer);
-	delete pServer;
+	pServer->Shutdown(); // Deleted once all its threads returned.
 
 	return 0;
 }
@@ -1021,9 +2216,16 @@ LUA_FUNCTION_STATIC(httpserver_FindByName)
 	return 1;
 }
 
-void HttpServer_OnClientDisconnect(CBaseClient* pClient)
+void CHTTPServerModule::OnClientConnect(CBaseClient* pClient)
+{
+	// The client's INetChannel might not be setup yet so we rebuild it on the next Think.
+	g_bClientAddressesDirty = true;
+}
+
+void CHTTPServerModule::OnClientDisconnect(CBaseClient* pClient)
 {
-	// Verify: As stated above in the HttpServer class, should we add a mutex for this?
+	RebuildClientAddresses(pClient);
+
 	int userID = pClient->GetUserID();
 	for (auto& server : g_pHttpServers)
 	{
@@ -1055,6 +2257,11 @@ void CHTTPServerModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServe
 		Util::AddFunc(pLua, HttpServer_SetKeepAliveTimeout, "SetKeepAliveTimeout");
 		Util::AddFunc(pLua, HttpServer_SetKeepAliveMaxCount, "SetKeepAliveMaxCount");
 		Util::AddFunc(pLua, HttpServer_SetThreadSleep, "SetThreadSleep");
+		Util::AddFunc(pLua, HttpServer_SetThreadCount, "SetThreadCount");
+		Util::AddFunc(pLua, HttpServer_SetMaxQueuedConnections, "SetMaxQueuedConnections");
+		Util::AddFunc(pLua, HttpServer_SetMaxQueuedRequests, "SetMaxQueuedRequests");
+		Util::AddFunc(pLua, HttpServer_SetDeferredLimit, "SetDeferredLimit");
+		Util::AddFunc(pLua, HttpServer_SetDeferredTimeout, "SetDeferredTimeout");
 
 		Util::AddFunc(pLua, HttpServer_SetMountPoint, "SetMountPoint");
 		Util::AddFunc(pLua, HttpServer_RemoveMountPoint, "RemoveMountPoint");
@@ -1072,6 +2279,14 @@ void CHTTPServerModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServe
 		Util::AddFunc(pLua, HttpServer_SetName, "SetName");
 
 		Util::AddFunc(pLua, HttpServer_AddPreparedResponse, "AddPreparedResponse");
+		Util::AddFunc(pLua, HttpServer_GetStats, "GetStats");
+		Util::AddFunc(pLua, HttpServer_ResetStats, "ResetStats");
+
+		Util::AddFunc(pLua, HttpServer_AddStaticRoute, "AddStaticRoute");
+		Util::AddFunc(pLua, HttpServer_UpdateCachedResponse, "UpdateCachedResponse");
+		Util::AddFunc(pLua, HttpServer_ClearCache, "ClearCache");
+		Util::AddFunc(pLua, HttpServer_ServeDirectory, "ServeDirectory");
+		Util::AddFunc(pLua, HttpServer_SetCacheCompression, "SetCacheCompression");
 	pLua->Pop(1);
 
 	Lua::GetLuaData(pLua)->RegisterMetaTable(Lua::HttpResponse, pLua->CreateMetaTable("HttpResponse"));
@@ -1119,30 +2334,112 @@ void CHTTPServerModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServe
 		Util::AddFunc(pLua, httpserver_Destroy, "Destroy");
 		Util::AddFunc(pLua, httpserver_GetAll, "GetAll");
 		Util::AddFunc(pLua, httpserver_FindByName, "FindByName");
+		Util::AddFunc(pLua, httpserver_Benchmark, "Benchmark");
 	Util::FinishTable(pLua, "httpserver");
 }
 
+void CHTTPServerModule::LuaThink(GarrysMod::Lua::ILuaInterface* pLua)
+{
+	if (g_pHttpBenchmarks.empty())
+		return;
+
+	VPROF_BUDGET("HolyLib - CHTTPServerModule::LuaThink", VPROF_BUDGETGROUP_HOLYLIB);
+
+	std::vector<HttpBenchmark*> pFinished;
+	for (auto it = g_pHttpBenchmarks.begin(); it != g_pHttpBenchmarks.end();)
+	{
+		HttpBenchmark* pBenchmark = *it;
+		if (pBenchmark->m_pLua != pLua || !pBenchmark->IsFinished())
+		{
+			++it;
+			continue;
+		}
+
+		pFinished.push_back(pBenchmark);
+		it = g_pHttpBenchmarks.erase(it);
+	}
+
+	// Callbacks are called after the loop as they could start a new benchmark.
+	for (HttpBenchmark* pBenchmark : pFinished)
+	{
+		Util::ReferencePush(pLua, pBenchmark->m_iCallback);
+		pBenchmark->PushResults(pLua);
+		pLua->CallFunctionProtected(1, 0, true);
+
+		delete pBenchmark;
+	}
+}
+
 void CHTTPServerModule::LuaShutdown(GarrysMod::Lua::ILuaInterface* pLua)
 {
 	Util::NukeTable(pLua, "httpserver");
 
+	for (auto it = g_pHttpBenchmarks.begin(); it != g_pHttpBenchmarks.end();)
+	{
+		HttpBenchmark* pBenchmark = *it;
+		if (pBenchmark->m_pLua != pLua)
+		{
+			++it;
+			continue;
+		}
+
+		// The connection threads still use it so we need to wait for them.
+		pBenchmark->Abort();
+
+		delete pBenchmark;
+		it = g_pHttpBenchmarks.erase(it);
+	}
+
 	// HttpServers WILL persist across map changes.
 	DeleteAll_HttpResponse(pLua);
 	DeleteAll_HttpRequest(pLua);
 	DeleteAll_HttpServer(pLua);
 
-	std::vector<HttpServer*> httpServers; // Copy of g_pHttpServers as when deleting we can't iterate over it.
+	std::vector<HttpServer*> httpServers; // Copy of g_pHttpServers as Shutdown removes them from it.
 	for (auto server : g_pHttpServers)
 		httpServers.push_back(server);
 
 	for (auto server : httpServers)
-		delete server;
+		server->Shutdown();
 }
 
 void CHTTPServerModule::Think(bool simulating)
 {
 	VPROF_BUDGET("HolyLib - CHTTPServerModule::Think", VPROF_BUDGETGROUP_HOLYLIB);
 
-	for (auto& httpserver : g_pHttpServers)
+	if (g_bClientAddressesDirty)
+		RebuildClientAddresses();
+
+	std::vector<HttpServer*> httpServers; // Copy of g_pHttpServers as a server can be destroyed inside its own Think.
+	for (auto server : g_pHttpServers)
+		httpServers.push_back(server);
+
+	for (auto& httpserver : httpServers)
 		httpserver->Think();
+
+	for (auto it = g_pShutdownHttpServers.begin(); it != g_pShutdownHttpServers.end();)
+	{
+		HttpServer* pServer = *it;
+		if (!pServer->FinishStop())
+		{
+			++it;
+			continue;
+		}
+
+		delete pServer;
+		it = g_pShutdownHttpServers.erase(it);
+	}
+}
+
+void CHTTPServerModule::Shutdown()
+{
+	// We are being unloaded so we have to wait for their threads.
+	for (HttpServer* pServer : g_pShutdownHttpServers)
+	{
+		while (!pServer->FinishStop())
+			ThreadSleep(1);
+
+		delete pServer;
+	}
+	g_pShutdownHttpServers.clear();
 }
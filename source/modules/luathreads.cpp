@@ -5,6 +5,16 @@
 #include "player.h"
 #include "unordered_set"
 #include "lua/CLuaInterface.h"
+#include "tier0/tslist.h"
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <ctime>
+#include <unordered_map>
+#include "lua.hpp"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -14,6 +24,7 @@ class CLuaThreadsModule : public IModule
 public:
 	virtual void LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServerInit) OVERRIDE;
 	virtual void LuaShutdown(GarrysMod::Lua::ILuaInterface* pLua) OVERRIDE;
+	virtual void LuaThink(GarrysMod::Lua::ILuaInterface* pLua) OVERRIDE;
 	virtual const char* Name() { return "luathreads"; };
 	virtual int Compatibility() { return LINUX32; };
 	virtual bool SupportsMultipleLuaStates() { return true; };
@@ -29,59 +40,452 @@ enum InterfaceStatus
 	INTERFACE_STOPPING = 2, // This should be set if you request it to stop.
 };
 
-struct LuaInterface;
+/*
+ * A message sent using LuaInterface:Send or luathreads.Send.
+ * All arguments are put into a table that is serialized using the util.TableToBinary format.
+ * ByteBuffers (also inside of tables) are passed separately so that their data isn't copied.
+ */
+struct LuaThreadMessage
+{
+	~LuaThreadMessage()
+	{
+		for (ByteBuffer* pBuffer : pBuffers)
+			delete pBuffer;
+	}
+
+	int iArgs = 0;
+	std::string strData;
+	std::vector<ByteBuffer*> pBuffers; // Referenced by their index in strData
+};
+
+struct LuaInterfaceState;
 class InterfaceTask
 {
 public:
 	virtual ~InterfaceTask() = default;
-	virtual void DoTask(LuaInterface* pData) = 0;
+	virtual void DoTask(LuaInterfaceState* pState) = 0;
+};
+
+/*
+ * Metrics of a function loaded by LuaInterface:LoadFunction, updated by all states.
+ */
+struct LuaFunctionStats
+{
+	std::atomic<unsigned int> iCalls{0};
+	std::atomic<unsigned int> iErrors{0};
+	std::atomic<uint64_t> iTime{0}; // CPU time in microseconds
+};
+
+/*
+ * The result of LuaInterface:Call that is passed to the callback in the Lua state that owns the interface.
+ */
+struct LuaCallResult
+{
+	~LuaCallResult()
+	{
+		if (pMessage)
+			delete pMessage;
+	}
+
+	int iCallback = -1;
+	bool bSuccess = false;
+	std::string strError;
+	LuaThreadMessage* pMessage = NULL; // The return values
+};
+
+struct LuaInterface;
+struct LuaInterfaceState // A single Lua state of a LuaInterface with its own thread.
+{
+	LuaInterface* pOwnerInterface = NULL;
+	CLuaInterface* pInterface = NULL;
+	ThreadHandle_t pThreadID;
+	InterfaceStatus iStatus = InterfaceStatus::INTERFACE_STOPPED;
+	std::vector<InterfaceTask*> pTasks; // Guarded by LuaInterface::pMutex
 };
 
 struct LuaInterface
 {
 	~LuaInterface()
 	{
-		if (iStatus != INTERFACE_STOPPED)
 		{
-			iStatus = INTERFACE_STOPPING;
-			while (iStatus != INTERFACE_STOPPED)
+			std::lock_guard<std::mutex> lock(pMutex);
+			for (LuaInterfaceState* pState : pStates)
+			{
+				if (pState->iStatus != INTERFACE_STOPPED)
+					pState->iStatus = INTERFACE_STOPPING;
+			}
+		}
+		pCondition.notify_all();
+
+		for (LuaInterfaceState* pState : pStates)
+		{
+			while (pState->iStatus != INTERFACE_STOPPED)
 			{
 				ThreadSleep(0);
 			}
 		}
 
-		if (pTasks.size() > 0)
+		for (LuaInterfaceState* pState : pStates)
 		{
-			for (auto& task : pTasks)
+			for (auto& task : pState->pTasks)
 				delete task;
 
-			pTasks.clear();
+			pState->pTasks.clear();
 		}
 
-		g_pModuleManager.LuaShutdown(pInterface);
-		Lua::DestroyInterface(pInterface);
+		for (auto& task : pSharedTasks)
+			delete task;
+
+		pSharedTasks.clear();
+
+		LuaCallResult* pResult;
+		while (pResults.PopItem(&pResult))
+		{
+			if (pOwner)
+				Util::ReferenceFree(pOwner, pResult->iCallback, "LuaInterface::~LuaInterface - CallResult");
+
+			delete pResult;
+		}
+
+		DeleteMessages(pToThread);
+		DeleteMessages(pFromThread);
+
+		if (pOwner && iReceiveCallback != -1)
+		{
+			Util::ReferenceFree(pOwner, iReceiveCallback, "LuaInterface::~LuaInterface - ReceiveCallback");
+			iReceiveCallback = -1;
+		}
+
+		for (LuaInterfaceState* pState : pStates)
+		{
+			g_pModuleManager.LuaShutdown(pState->pInterface);
+			Lua::DestroyInterface(pState->pInterface);
+			delete pState;
+		}
+		pStates.clear();
 	}
 
-	CLuaInterface* pInterface;
-	ThreadHandle_t pThreadID;
-	InterfaceStatus iStatus = InterfaceStatus::INTERFACE_STOPPED;
-	unsigned int iSleepTime = 1; // Time in ms to sleep
-	std::vector<InterfaceTask*> pTasks;
-	CThreadFastMutex pMutex;
+	static void DeleteMessages(CTSQueue<LuaThreadMessage*>& pQueue)
+	{
+		LuaThreadMessage* pMessage;
+		while (pQueue.PopItem(&pMessage))
+			delete pMessage;
+	}
+
+	// Wakes up the threads, the lock ensures that a thread can't miss it while it's about to wait.
+	inline void WakeUp(bool bAll)
+	{
+		{
+			std::lock_guard<std::mutex> lock(pMutex);
+		}
+
+		if (bAll)
+			pCondition.notify_all();
+		else
+			pCondition.notify_one();
+	}
+
+	// Adds a task to every state, used for things that every state needs like LuaInterface:RunString
+	template<class T>
+	void AddTaskToAll(const T& pTask)
+	{
+		{
+			std::lock_guard<std::mutex> lock(pMutex);
+			for (LuaInterfaceState* pState : pStates)
+				pState->pTasks.push_back(new T(pTask));
+		}
+
+		pCondition.notify_all();
+	}
+
+	// Adds a task that is run by only one state, used by LuaInterface:Call
+	void AddSharedTask(InterfaceTask* pTask)
+	{
+		{
+			std::lock_guard<std::mutex> lock(pMutex);
+			pSharedTasks.push_back(pTask);
+		}
+
+		pCondition.notify_one();
+	}
+
+	std::vector<LuaInterfaceState*> pStates;
+	GarrysMod::Lua::ILuaInterface* pOwner = NULL; // The Lua state that created this interface
+	CTSQueue<LuaThreadMessage*> pToThread; // LuaInterface:Send -> luathreads.Receive, shared by all states
+	CTSQueue<LuaThreadMessage*> pFromThread; // luathreads.Send -> LuaInterface:Receive
+	int iReceiveCallback = -1; // LuaInterface:SetReceiveCallback, referenced in pOwner
+	std::deque<InterfaceTask*> pSharedTasks; // Guarded by pMutex
+	CTSQueue<LuaCallResult*> pResults;
+	std::unordered_map<std::string, std::unique_ptr<LuaFunctionStats>> pFunctions; // Only used by pOwner
+	std::mutex pMutex;
+	std::condition_variable pCondition; // Notified when a task or message was added or the threads should stop.
 };
 
 class RunStringTask : public InterfaceTask
 {
 public:
-	virtual void DoTask(LuaInterface* pData)
+	virtual void DoTask(LuaInterfaceState* pState)
 	{
-		pData->pInterface->RunString("RunString", "", strCode.c_str(), true, true);
+		pState->pInterface->RunString("RunString", "", strCode.c_str(), true, true);
 	}
 
 public:
 	std::string strCode;
 };
 
+class LuaThreadsModuleData : public Lua::ModuleData
+{
+public:
+	LuaInterface* pInterface = NULL; // Set if this Lua state belongs to a LuaInterface
+	int iReceiveCallback = -1; // luathreads.SetReceiveCallback
+	std::unordered_map<std::string, int> pFunctions; // LuaInterface:LoadFunction, name -> reference
+	std::vector<LuaInterface*> pInterfaces; // All interfaces created by this Lua state
+};
+
+static inline LuaThreadsModuleData* GetLuaData(GarrysMod::Lua::ILuaInterface* pLua)
+{
+	if (!pLua)
+		return NULL;
+
+	return (LuaThreadsModuleData*)Lua::GetLuaData(pLua)->GetModuleData(g_pLuaThreadsModule.m_pID);
+}
+
+/*
+ * Creates a message containing all values starting at the given stack position.
+ * Returns NULL if a value can't be serialized.
+ */
+static LuaThreadMessage* CreateMessage(GarrysMod::Lua::ILuaInterface* LUA, int iStartPos)
+{
+	LuaThreadMessage* pMessage = new LuaThreadMessage;
+	pMessage->iArgs = MAX(LUA->Top() - iStartPos + 1, 0);
+
+	LUA->PreCreateTable(pMessage->iArgs, 0);
+	for (int i = 0; i < pMessage->iArgs; ++i)
+	{
+		LUA->Push(iStartPos + i);
+		Util::RawSetI(LUA, -2, i + 1);
+	}
+
+	bool bSuccess = BinaryWriteTable(LUA, -1, pMessage->strData, &pMessage->pBuffers);
+	LUA->Pop(1);
+
+	if (!bSuccess)
+	{
+		delete pMessage;
+		return NULL;
+	}
+
+	return pMessage;
+}
+
+static LuaThreadMessage* CheckMessage(GarrysMod::Lua::ILuaInterface* LUA, int iStartPos)
+{
+	LuaThreadMessage* pMessage = CreateMessage(LUA, iStartPos);
+	if (!pMessage)
+		LUA->ThrowError("Failed to serialize the message! (Cyclic reference or the util module is disabled)");
+
+	return pMessage;
+}
+
+/*
+ * Pushes all values of the given message and returns how many were pushed.
+ * Returns -1 if the message couldn't be read, in which case nothing is pushed.
+ */
+static int PushMessage(GarrysMod::Lua::ILuaInterface* LUA, LuaThreadMessage* pMessage)
+{
+	if (!BinaryPushTable(LUA, pMessage->strData.data(), (unsigned int)pMessage->strData.size(), &pMessage->pBuffers))
+		return -1;
+
+	for (int i = 1; i <= pMessage->iArgs; ++i)
+		Util::RawGetI(LUA, -i, i); // The table moves down with every value we push.
+
+	LUA->Remove(-(pMessage->iArgs + 1));
+	return pMessage->iArgs;
+}
+
+static void ReceiveMessages(GarrysMod::Lua::ILuaInterface* pLua, CTSQueue<LuaThreadMessage*>& pQueue, int iCallback)
+{
+	LuaThreadMessage* pMessage;
+	while (Lua::CanRunJobCallback(pLua) && pQueue.PopItem(&pMessage))
+	{
+		Util::ReferencePush(pLua, iCallback);
+		int iArgs = PushMessage(pLua, pMessage);
+		delete pMessage;
+
+		if (iArgs < 0)
+		{
+			pLua->Pop(1);
+			Warning(PROJECT_NAME " - luathreads: Failed to read a message!\n");
+			continue;
+		}
+
+		pLua->CallFunctionProtected(iArgs, 0, true);
+		Lua::OnJobCallback(pLua);
+	}
+}
+
+// Returns true, ... if a message was received or false if there was none.
+static int ReceiveMessage(GarrysMod::Lua::ILuaInterface* LUA, CTSQueue<LuaThreadMessage*>& pQueue)
+{
+	LuaThreadMessage* pMessage;
+	if (!pQueue.PopItem(&pMessage))
+	{
+		LUA->PushBool(false);
+		return 1;
+	}
+
+	LUA->PushBool(true);
+	int iArgs = PushMessage(LUA, pMessage);
+	delete pMessage;
+
+	if (iArgs < 0)
+		LUA->ThrowError("Failed to read the message!");
+
+	return iArgs + 1;
+}
+
+static inline uint64_t GetThreadCPUTime() // In microseconds
+{
+#if SYSTEM_LINUX
+	timespec pTime;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &pTime);
+	return (uint64_t)pTime.tv_sec * 1000000 + pTime.tv_nsec / 1000;
+#else
+	return (uint64_t)(Plat_FloatTime() * 1000000);
+#endif
+}
+
+class LoadFunctionTask : public InterfaceTask
+{
+public:
+	virtual void DoTask(LuaInterfaceState* pState)
+	{
+		CLuaInterface* pLua = pState->pInterface;
+		LuaThreadsModuleData* pData = GetLuaData(pLua);
+
+		auto it = pData->pFunctions.find(strName);
+		if (it != pData->pFunctions.end())
+		{
+			Util::ReferenceFree(pLua, it->second, "LoadFunctionTask - Old function");
+			pData->pFunctions.erase(it);
+		}
+
+		lua_State* L = pLua->GetState();
+		if (luaL_loadbuffer(L, strCode.c_str(), strCode.length(), strName.c_str()) != 0)
+		{
+			Warning(PROJECT_NAME " - luathreads: Failed to compile function \"%s\": %s\n", strName.c_str(), pLua->GetString(-1));
+			pLua->Pop(1);
+			return;
+		}
+
+		pData->pFunctions[strName] = Util::ReferenceCreate(pLua, "LoadFunctionTask - Function");
+	}
+
+public:
+	std::string strName;
+	std::string strCode;
+};
+
+class CallTask : public InterfaceTask
+{
+public:
+	virtual ~CallTask()
+	{
+		if (pMessage)
+			delete pMessage;
+
+		if (iCallback != -1 && pOwner) // We were never run, which only happens when the LuaInterface is deleted.
+			Util::ReferenceFree(pOwner, iCallback, "CallTask::~CallTask - Callback");
+	}
+
+	virtual void DoTask(LuaInterfaceState* pState)
+	{
+		CLuaInterface* pLua = pState->pInterface;
+		LuaCallResult* pResult = new LuaCallResult;
+		pResult->iCallback = iCallback;
+		iCallback = -1; // The result owns it now.
+
+		auto it = GetLuaData(pLua)->pFunctions.find(strName);
+		if (it == GetLuaData(pLua)->pFunctions.end())
+		{
+			pResult->strError = "Function \"" + strName + "\" isn't loaded!";
+			++pStats->iErrors;
+		} else {
+			int iTop = pLua->Top();
+			Util::ReferencePush(pLua, it->second);
+			int iArgs = PushMessage(pLua, pMessage);
+			if (iArgs < 0)
+			{
+				pResult->strError = "Failed to read the arguments!";
+				++pStats->iErrors;
+			} else {
+				uint64_t iStartTime = GetThreadCPUTime();
+				bool bSuccess = pLua->PCall(iArgs, LUA_MULTRET, 0) == 0;
+				pStats->iTime += GetThreadCPUTime() - iStartTime;
+				++pStats->iCalls;
+
+				if (!bSuccess)
+				{
+					const char* pError = pLua->GetString(-1);
+					pResult->strError = pError ? pError : "Unknown error";
+					++pStats->iErrors;
+				} else if (pResult->iCallback != -1) {
+					pResult->pMessage = CreateMessage(pLua, iTop + 1);
+					if (pResult->pMessage)
+						pResult->bSuccess = true;
+					else
+						pResult->strError = "Failed to serialize the return values!";
+				}
+			}
+			pLua->Pop(pLua->Top() - iTop);
+		}
+
+		if (pResult->iCallback != -1)
+			pState->pOwnerInterface->pResults.PushItem(pResult);
+		else
+			delete pResult;
+	}
+
+public:
+	std::string strName;
+	LuaThreadMessage* pMessage = NULL;
+	LuaFunctionStats* pStats = NULL;
+	int iCallback = -1;
+	GarrysMod::Lua::ILuaInterface* pOwner = NULL;
+};
+
+static void FinishCallResults(GarrysMod::Lua::ILuaInterface* pLua, LuaInterface* pInterface)
+{
+	LuaCallResult* pResult;
+	while (Lua::CanRunJobCallback(pLua) && pInterface->pResults.PopItem(&pResult))
+	{
+		Util::ReferencePush(pLua, pResult->iCallback);
+		int iArgs = -1;
+		if (pResult->bSuccess)
+		{
+			pLua->PushBool(true);
+			iArgs = PushMessage(pLua, pResult->pMessage);
+			if (iArgs < 0)
+			{
+				pLua->Pop(1);
+				pResult->strError = "Failed to read the return values!";
+			}
+		}
+
+		if (iArgs < 0)
+		{
+			pLua->PushBool(false);
+			pLua->PushString(pResult->strError.c_str());
+			iArgs = 1;
+		}
+
+		pLua->CallFunctionProtected(iArgs + 1, 0, true);
+		Util::ReferenceFree(pLua, pResult->iCallback, "FinishCallResults - Callback");
+		delete pResult;
+		Lua::OnJobCallback(pLua);
+	}
+}
+
 PushReferenced_LuaClass(LuaInterface)
 Get_LuaClass(LuaInterface, "LuaInterface")
 
@@ -95,7 +499,7 @@ LUA_FUNCTION_STATIC(LuaInterface__tostring)
 	}
 
 	char szBuf[64] = {};
-	V_snprintf(szBuf, sizeof(szBuf), "LuaInterface [%s]", pData->pInterface->GetPath());
+	V_snprintf(szBuf, sizeof(szBuf), "LuaInterface [%s]", pData->pStates[0]->pInterface->GetPath());
 	LUA->PushString(szBuf);
 	return 1;
 }
@@ -114,16 +518,135 @@ LUA_FUNCTION_STATIC(LuaInterface_IsValid)
 LUA_FUNCTION_STATIC(LuaInterface_RunString)
 {
 	LuaInterface* pData = Get_LuaInterface(LUA, 1, true);
-	RunStringTask* pTask = new RunStringTask;
-	pTask->strCode = LUA->CheckString(2);
+	RunStringTask pTask;
+	pTask.strCode = LUA->CheckString(2);
+
+	pData->AddTaskToAll(pTask);
+
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(LuaInterface_Send)
+{
+	LuaInterface* pData = Get_LuaInterface(LUA, 1, true);
+	pData->pToThread.PushItem(CheckMessage(LUA, 2));
+	pData->WakeUp(false); // Only one state will receive it.
+
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(LuaInterface_Receive)
+{
+	LuaInterface* pData = Get_LuaInterface(LUA, 1, true);
 
-	pData->pMutex.Lock();
-	pData->pTasks.push_back(pTask);
-	pData->pMutex.Unlock();
+	return ReceiveMessage(LUA, pData->pFromThread);
+}
+
+LUA_FUNCTION_STATIC(LuaInterface_SetReceiveCallback)
+{
+	LuaInterface* pData = Get_LuaInterface(LUA, 1, true);
+	if (pData->iReceiveCallback != -1)
+	{
+		Util::ReferenceFree(LUA, pData->iReceiveCallback, "LuaInterface:SetReceiveCallback");
+		pData->iReceiveCallback = -1;
+	}
+
+	if (LUA->IsType(2, GarrysMod::Lua::Type::Function))
+	{
+		LUA->Push(2);
+		pData->iReceiveCallback = Util::ReferenceCreate(LUA, "LuaInterface:SetReceiveCallback");
+	}
 
 	return 0;
 }
 
+LUA_FUNCTION_STATIC(LuaInterface_LoadFunction)
+{
+	LuaInterface* pData = Get_LuaInterface(LUA, 1, true);
+	LoadFunctionTask pTask;
+	pTask.strName = LUA->CheckString(2);
+	pTask.strCode = LUA->CheckString(3);
+
+	std::unique_ptr<LuaFunctionStats>& pStats = pData->pFunctions[pTask.strName];
+	if (!pStats)
+		pStats.reset(new LuaFunctionStats);
+
+	pData->AddTaskToAll(pTask);
+
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(LuaInterface_Call)
+{
+	LuaInterface* pData = Get_LuaInterface(LUA, 1, true);
+	const char* pName = LUA->CheckString(2);
+	if (LUA->GetType(3) > GarrysMod::Lua::Type::Nil) // A missing callback is none, not nil.
+		LUA->CheckType(3, GarrysMod::Lua::Type::Function);
+
+	auto it = pData->pFunctions.find(pName);
+	if (it == pData->pFunctions.end())
+		LUA->ThrowError("Unknown function! Load it first using LuaInterface:LoadFunction");
+
+	CallTask* pTask = new CallTask;
+	pTask->strName = pName;
+	pTask->pStats = it->second.get();
+	pTask->pMessage = CreateMessage(LUA, 4);
+	if (!pTask->pMessage)
+	{
+		delete pTask;
+		LUA->ThrowError("Failed to serialize the arguments! (Cyclic reference or the util module is disabled)");
+	}
+
+	if (LUA->IsType(3, GarrysMod::Lua::Type::Function))
+	{
+		LUA->Push(3);
+		pTask->iCallback = Util::ReferenceCreate(LUA, "LuaInterface:Call - Callback");
+		pTask->pOwner = LUA;
+	}
+
+	pData->AddSharedTask(pTask);
+
+	return 0;
+}
+
+static void PushFunctionStats(GarrysMod::Lua::ILuaInterface* LUA, LuaFunctionStats* pStats)
+{
+	LUA->PreCreateTable(0, 3);
+		LUA->PushNumber(pStats->iCalls);
+		LUA->SetField(-2, "calls");
+
+		LUA->PushNumber(pStats->iErrors);
+		LUA->SetField(-2, "errors");
+
+		LUA->PushNumber((double)pStats->iTime / 1000000);
+		LUA->SetField(-2, "time");
+}
+
+LUA_FUNCTION_STATIC(LuaInterface_GetFunctionStats)
+{
+	LuaInterface* pData = Get_LuaInterface(LUA, 1, true);
+	if (LUA->IsType(2, GarrysMod::Lua::Type::String))
+	{
+		auto it = pData->pFunctions.find(LUA->GetString(2));
+		if (it == pData->pFunctions.end())
+			return 0;
+
+		PushFunctionStats(LUA, it->second.get());
+		return 1;
+	}
+
+	LUA->PreCreateTable(0, (int)pData->pFunctions.size());
+	for (auto& pFunction : pData->pFunctions)
+	{
+		PushFunctionStats(LUA, pFunction.second.get());
+		LUA->SetField(-2, pFunction.first.c_str());
+	}
+
+	return 1;
+}
+
+static ConVar luathreads_thinktime("holylib_luathreads_thinktime", "10", FCVAR_ARCHIVE, "The time in ms a luathreads state waits for a task or message before it runs the think code of the modules");
+
 #if ARCHITECTURE_IS_X86_64
 static long long unsigned
 #else
@@ -131,46 +654,129 @@ static unsigned
 #endif
 LuaThread(void* data)
 {
-	LuaInterface* pData = (LuaInterface*)data;
-	pData->iStatus = INTERFACE_RUNNING;
-	while (pData->iStatus == INTERFACE_RUNNING)
+	LuaInterfaceState* pState = (LuaInterfaceState*)data;
+	LuaInterface* pData = pState->pOwnerInterface;
+	LuaThreadsModuleData* pModuleData = GetLuaData(pState->pInterface);
+	std::vector<InterfaceTask*> pTasks;
+	while (true)
 	{
-		// Execute all tasks first
-		pData->pMutex.Lock();
-		for (auto& task : pData->pTasks)
 		{
-			task->DoTask(pData);
-			delete task;
+			// Sleep until we got something to do or it's time for the next think.
+			std::unique_lock<std::mutex> lock(pData->pMutex);
+			pData->pCondition.wait_for(lock, std::chrono::milliseconds(MAX(luathreads_thinktime.GetInt(), 1)), [&] {
+				return pState->iStatus != INTERFACE_RUNNING || !pState->pTasks.empty() || !pData->pSharedTasks.empty() || (pModuleData->iReceiveCallback != -1 && pData->pToThread.Count() > 0);
+			});
+
+			if (pState->iStatus != INTERFACE_RUNNING)
+				break;
+
+			pTasks.swap(pState->pTasks); // We run them unlocked so that nobody has to wait for us.
+			if (!pData->pSharedTasks.empty()) // Only take one so that the other states can do the rest.
+			{
+				pTasks.push_back(pData->pSharedTasks.front());
+				pData->pSharedTasks.pop_front();
+			}
 		}
-		pData->pTasks.clear();
-		pData->pMutex.Unlock();
 
-		// Execute any module's think code
-		g_pModuleManager.LuaThink(pData->pInterface);
+		for (auto& task : pTasks)
+		{
+			task->DoTask(pState);
+			delete task;
+		}
+		pTasks.clear();
 
-		// eep
-		ThreadSleep(pData->iSleepTime);
+		// Execute any module's think code, this also calls our receive callback.
+		g_pModuleManager.LuaThink(pState->pInterface);
 	}
-	pData->iStatus = INTERFACE_STOPPED;
+	pState->iStatus = INTERFACE_STOPPED;
 	
 	return 0;
 }
 
 LUA_FUNCTION_STATIC(luathreads_CreateInterface)
 {
+	int iStates = (int)LUA->CheckNumberOpt(1, 1);
+	if (iStates < 1 || iStates > 64)
+		LUA->ThrowError("The number of states has to be between 1 and 64!");
+
 	LuaInterface* pData = new LuaInterface;
-	pData->pInterface = (CLuaInterface*)Lua::CreateLuaInterface(true);
-	pData->pThreadID = CreateSimpleThread((ThreadFunc_t)LuaThread, pData);
+	pData->pOwner = LUA;
+	for (int i = 0; i < iStates; ++i)
+	{
+		LuaInterfaceState* pState = new LuaInterfaceState;
+		pState->pOwnerInterface = pData;
+		pState->pInterface = (CLuaInterface*)Lua::CreateInterface();
+
+		// Add all supported HolyLib modules into the new interface like HolyLua does.
+		g_pModuleManager.LuaInit(pState->pInterface, false);
+		g_pModuleManager.LuaInit(pState->pInterface, true);
+		GetLuaData(pState->pInterface)->pInterface = pData;
+
+		pData->pStates.push_back(pState);
+	}
+	GetLuaData(LUA)->pInterfaces.push_back(pData);
+
+	for (LuaInterfaceState* pState : pData->pStates)
+	{
+		pState->iStatus = INTERFACE_RUNNING; // Set before the thread starts so that we'll always wait for it to stop.
+		pState->pThreadID = CreateSimpleThread((ThreadFunc_t)LuaThread, pState);
+	}
 
 	Push_LuaInterface(LUA, pData);
 	return 1;
 }
 
+static LuaInterface* GetOwnInterface(GarrysMod::Lua::ILuaInterface* LUA)
+{
+	LuaInterface* pInterface = GetLuaData(LUA)->pInterface;
+	if (!pInterface)
+		LUA->ThrowError("This function can only be used inside a LuaInterface!");
+
+	return pInterface;
+}
+
+LUA_FUNCTION_STATIC(luathreads_Send)
+{
+	LuaInterface* pInterface = GetOwnInterface(LUA);
+	pInterface->pFromThread.PushItem(CheckMessage(LUA, 1));
+
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(luathreads_Receive)
+{
+	LuaInterface* pInterface = GetOwnInterface(LUA);
+
+	return ReceiveMessage(LUA, pInterface->pToThread);
+}
+
+LUA_FUNCTION_STATIC(luathreads_SetReceiveCallback)
+{
+	GetOwnInterface(LUA);
+
+	LuaThreadsModuleData* pData = GetLuaData(LUA);
+	if (pData->iReceiveCallback != -1)
+	{
+		Util::ReferenceFree(LUA, pData->iReceiveCallback, "luathreads.SetReceiveCallback");
+		pData->iReceiveCallback = -1;
+	}
+
+	if (LUA->IsType(1, GarrysMod::Lua::Type::Function))
+	{
+		LUA->Push(1);
+		pData->iReceiveCallback = Util::ReferenceCreate(LUA, "luathreads.SetReceiveCallback");
+	}
+
+	return 0;
+}
+
 void CLuaThreadsModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServerInit)
 {
 	if (bServerInit)
 		return;
 
+	Lua::GetLuaData(pLua)->SetModuleData(m_pID, new LuaThreadsModuleData);
+
 	Lua::GetLuaData(pLua)->RegisterMetaTable(Lua::LuaInterface, pLua->CreateMetaTable("LuaInterface"));
 		Util::AddFunc(pLua, LuaInterface__tostring, "__tostring");
 		Util::AddFunc(pLua, LuaInterface__index, "__index");
@@ -178,10 +784,19 @@ void CLuaThreadsModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServe
 		Util::AddFunc(pLua, LuaInterface_GetTable, "GetTable");
 		Util::AddFunc(pLua, LuaInterface_IsValid, "IsValid");
 		Util::AddFunc(pLua, LuaInterface_RunString, "RunString");
+		Util::AddFunc(pLua, LuaInterface_Send, "Send");
+		Util::AddFunc(pLua, LuaInterface_Receive, "Receive");
+		Util::AddFunc(pLua, LuaInterface_SetReceiveCallback, "SetReceiveCallback");
+		Util::AddFunc(pLua, LuaInterface_LoadFunction, "LoadFunction");
+		Util::AddFunc(pLua, LuaInterface_Call, "Call");
+		Util::AddFunc(pLua, LuaInterface_GetFunctionStats, "GetFunctionStats");
 	pLua->Pop(1);
 
 	Util::StartTable(pLua);
 		Util::AddFunc(pLua, luathreads_CreateInterface, "CreateInterface");
+		Util::AddFunc(pLua, luathreads_Send, "Send");
+		Util::AddFunc(pLua, luathreads_Receive, "Receive");
+		Util::AddFunc(pLua, luathreads_SetReceiveCallback, "SetReceiveCallback");
 	Util::FinishTable(pLua, "luathreads");
 }
 
@@ -189,5 +804,38 @@ void CLuaThreadsModule::LuaShutdown(GarrysMod::Lua::ILuaInterface* pLua)
 {
 	Util::NukeTable(pLua, "luathreads");
 
-	DeleteAll_LuaInterface(pLua); // Memory leak! ToDo: Clean things up properly.
+	LuaThreadsModuleData* pData = GetLuaData(pLua);
+	if (pData->iReceiveCallback != -1)
+	{
+		Util::ReferenceFree(pLua, pData->iReceiveCallback, "CLuaThreadsModule::LuaShutdown - ReceiveCallback");
+		pData->iReceiveCallback = -1;
+	}
+
+	// Stops the threads of our interfaces & shuts down their states which also deletes the interfaces they created.
+	for (LuaInterface* pInterface : pData->pInterfaces)
+	{
+		Delete_LuaInterface(pLua, pInterface);
+		delete pInterface;
+	}
+	pData->pInterfaces.clear();
+
+	for (auto& pFunction : pData->pFunctions)
+		Util::ReferenceFree(pLua, pFunction.second, "CLuaThreadsModule::LuaShutdown - Function");
+	pData->pFunctions.clear();
+}
+
+void CLuaThreadsModule::LuaThink(GarrysMod::Lua::ILuaInterface* pLua)
+{
+	LuaThreadsModuleData* pData = GetLuaData(pLua);
+	if (pData->pInterface && pData->iReceiveCallback != -1)
+		ReceiveMessages(pLua, pData->pInterface->pToThread, pData->iReceiveCallback);
+
+	for (size_t i = 0; i < pData->pInterfaces.size(); ++i) // A callback could create a new interface
+	{
+		LuaInterface* pInterface = pData->pInterfaces[i];
+		if (pInterface->iReceiveCallback != -1)
+			ReceiveMessages(pLua, pInterface->pFromThread, pInterface->iReceiveCallback);
+
+		FinishCallResults(pLua, pInterface);
+	}
 }
\ No newline at end of file
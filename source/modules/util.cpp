@@ -3,13 +3,21 @@
 #include "lua.h"
 #include "Bootil/Bootil.h"
 #include <lz4/lz4_compression.h>
+#include <lz4/lz4.h>
+#include <lz4/lz4hc.h>
+#include <atomic>
+#include <unordered_set>
+#include <cmath>
 
 #include "bootil/src/3rdParty/rapidjson/rapidjson.h"
-#include "bootil/src/3rdParty/rapidjson/document.h"
+#include "bootil/src/3rdParty/rapidjson/reader.h"
 #include "bootil/src/3rdParty/rapidjson/stringbuffer.h"
 #include "bootil/src/3rdParty/rapidjson/prettywriter.h"
 #include "bootil/src/3rdParty/rapidjson/writer.h"
 
+#include "basehandle.h"
+#include "eiface.h"
+
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
@@ -19,7 +27,6 @@ public:
 	virtual void LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServerInit) OVERRIDE;
 	virtual void LuaShutdown(GarrysMod::Lua::ILuaInterface* pLua) OVERRIDE;
 	virtual void LuaThink(GarrysMod::Lua::ILuaInterface* pLua) OVERRIDE;
-	virtual void Shutdown() OVERRIDE;
 	virtual const char* Name() { return "util"; };
 	virtual int Compatibility() { return LINUX32 | LINUX64 | WINDOWS32 | WINDOWS64; };
 	virtual bool SupportsMultipleLuaStates() { return true; };
@@ -28,53 +35,44 @@ public:
 static CUtilModule g_pUtilModule;
 IModule* pUtilModule = &g_pUtilModule;
 
-static IThreadPool* pJsonPool = NULL;
-static IThreadPool* pCompressPool = NULL;
-static IThreadPool* pDecompressPool = NULL;
-static void OnCompressThreadsChange(IConVar* convar, const char* pOldValue, float flOldValue)
-{
-	if (!pCompressPool)
-		return;
-
-	pCompressPool->ExecuteAll(); // ToDo: Do we need to do this?
-	pCompressPool->Stop();
-	Util::StartThreadPool(pCompressPool, ((ConVar*)convar)->GetInt());
-}
-
-static void OnDecompressThreadsChange(IConVar* convar, const char* pOldValue, float flOldValue)
-{
-	if (!pDecompressPool)
-		return;
-
-	pDecompressPool->ExecuteAll();
-	pDecompressPool->Stop();
-	Util::StartThreadPool(pDecompressPool, ((ConVar*)convar)->GetInt());
-}
-
-static void OnJsonThreadsChange(IConVar* convar, const char* pOldValue, float flOldValue)
-{
-	if (!pJsonPool)
-		return;
-
-	pJsonPool->ExecuteAll();
-	pJsonPool->Stop();
-	Util::StartThreadPool(pJsonPool, ((ConVar*)convar)->GetInt());
-}
-
-static ConVar compressthreads("holylib_util_compressthreads", "1", FCVAR_ARCHIVE, "The number of threads to use for util.AsyncCompress", OnCompressThreadsChange);
-static ConVar decompressthreads("holylib_util_decompressthreads", "1", FCVAR_ARCHIVE, "The number of threads to use for util.AsyncDecompress", OnDecompressThreadsChange);
-static ConVar jsonthreads("holylib_util_jsonthreads", "1", FCVAR_ARCHIVE, "The number of threads to use for util.AsyncTableToJSON & util.AsyncJSONToTable", OnJsonThreadsChange);
-
-class IJobEntry
+class IJobEntry : public IJob
 {
 public:
 	virtual ~IJobEntry() = default;
 	virtual bool OnThink(GarrysMod::Lua::ILuaInterface* pLua) = 0;
 
+	// Called before the entry is deleted while it might still be queued or running.
+	virtual void CancelJob()
+	{
+		m_bCancel = true;
+		g_pModuleManager.GetJobSystem().Cancel(this);
+	}
+
+	// Our job might still be running for a moment after it set its status, so OnThink is only called once this is true.
+	virtual bool IsJobIdle() { return IsIdle(); }
+
 	bool m_bCancel = false;
 	GarrysMod::Lua::ILuaInterface* m_pLua = NULL;
 };
 
+/*
+ * AutoBuffer which can hand its malloc'd memory over to a ByteBuffer,
+ * this way the async results don't have to be copied when a ByteBuffer is requested.
+ */
+class DetachableBuffer : public Bootil::AutoBuffer
+{
+public:
+	void* Detach()
+	{
+		void* pBuffer = m_pData;
+		m_pData = NULL;
+		m_iSize = 0;
+		m_iWritten = 0;
+		m_iPos = 0;
+		return pBuffer;
+	}
+};
+
 class CompressEntry : public IJobEntry
 {
 public:
@@ -107,6 +105,9 @@ public:
 		if (iStatus == -1)
 		{
 			pLua->PushNil();
+		} else if (bByteBuffer) {
+			unsigned int iWritten = buffer.GetWritten();
+			Push_ByteBuffer(pLua, buffer.Detach(), iWritten); // The ByteBuffer takes over our memory, no copy needed.
 		} else {
 			pLua->PushString((const char*)buffer.GetBase(), buffer.GetWritten());
 		}
@@ -115,8 +116,11 @@ public:
 		return true;
 	}
 
+	virtual void Execute();
+
 	int iCallback = -1;
 	bool bCompress = true;
+	bool bByteBuffer = false; // If true, the callback receives a ByteBuffer instead of a string.
 	char iStatus = 0; // -1 = Failed | 0 = Running | 1 = Done
 
 	const char* pData = NULL;
@@ -126,7 +130,7 @@ public:
 	int iLevel = 7;
 	int iDictSize = 65536;
 	double iRatio = 99.98;
-	Bootil::AutoBuffer buffer;
+	DetachableBuffer buffer;
 };
 
 class LuaUtilModuleData : public Lua::ModuleData
@@ -135,10 +139,22 @@ public:
 	std::vector<IJobEntry*> pEntries;
 
 	// Lua Table recursive dependencies
-	int iRecursiveStartTop = -1;
 	bool bRecursiveNoError = false;
-	std::vector<int> pRecursiveTableScope;
+	std::unordered_set<const void*> pRecursiveTables;
 	char buffer[128];
+	rapidjson::StringBuffer pJsonBuffer; // Reused by util.FancyTableToJSON
+
+	// util.FancyJSONToTable
+	std::vector<char> pJsonReadBuffer;
+	std::vector<int> pJsonArrayIndex; // The next index of every table we are inside of, 0 for objects.
+	std::vector<int> pJsonArraySizeHints; // The size of the last array on every depth
+	std::vector<int> pJsonObjectSizeHints; // The size of the last object on every depth
+
+	// util.TableToBinary & util.BinaryToTable
+	std::string pBinaryBuffer;
+	std::unordered_map<const char*, unsigned int> pBinaryStrings;
+	std::vector<std::pair<const char*, unsigned int>> pBinaryReadStrings;
+	std::vector<ByteBuffer*>* pBinaryBuffers = NULL; // Set by BinaryWriteTable & BinaryPushTable to pass ByteBuffers without copying them.
 };
 
 static inline LuaUtilModuleData* GetLuaData(GarrysMod::Lua::ILuaInterface* pLua)
@@ -149,7 +165,7 @@ static inline LuaUtilModuleData* GetLuaData(GarrysMod::Lua::ILuaInterface* pLua)
 	return (LuaUtilModuleData*)Lua::GetLuaData(pLua)->GetModuleData(g_pUtilModule.m_pID);
 }
 
-static void CompressJob(CompressEntry*& entry)
+static void CompressJob(CompressEntry* entry)
 {
 	if (entry->m_bCancel) // No Lua? We stop.
 		return;
@@ -161,44 +177,352 @@ static void CompressJob(CompressEntry*& entry)
 	}
 }
 
+void CompressEntry::Execute()
+{
+	CompressJob(this);
+}
+
+/*
+ * Chunked format used by util.AsyncCompress when it's given an options table.
+ * Every chunk is compressed on it's own so that they can be spread across the threadpool,
+ * and util.AsyncDecompress can do the same since the header contains the size of every chunk.
+ * Layout: ChunkedHeader | ChunkedBlock[iChunks] | chunk data...
+ */
+#define CHUNKED_ID ( ('Z' << 24) | ('C' << 16) | ('L' << 8) | 'H' )
+#define CHUNKED_VERSION 1
+enum ChunkedCodec
+{
+	CHUNKED_CODEC_LZMA = 0,
+	CHUNKED_CODEC_LZ4 = 1,
+	CHUNKED_CODEC_LZ4HC = 2,
+};
+
+#pragma pack(push, 1)
+struct ChunkedHeader
+{
+	unsigned int iID = CHUNKED_ID;
+	unsigned char iVersion = CHUNKED_VERSION;
+	unsigned char iCodec = CHUNKED_CODEC_LZMA;
+	unsigned short iReserved = 0;
+	unsigned int iChunks = 0;
+	unsigned int iSize = 0; // Decompressed size of everything
+};
+
+struct ChunkedBlock
+{
+	unsigned int iCompressedSize;
+	unsigned int iSize;
+};
+#pragma pack(pop)
+
+class ChunkedCompressEntry;
+struct CompressChunk : public IJob
+{
+	virtual void Execute();
+
+	ChunkedCompressEntry* pEntry = NULL;
+	const char* pData = NULL;
+	unsigned int iLength = 0;
+	unsigned int iSize = 0; // Expected decompressed size
+	bool bSuccess = false;
+	Bootil::AutoBuffer buffer;
+};
+
+class ChunkedCompressEntry : public CompressEntry
+{
+public:
+	virtual ~ChunkedCompressEntry()
+	{
+		if (pChunks)
+			delete[] pChunks;
+	}
+
+	virtual void Execute() {} // Only our chunks are queued.
+
+	virtual void CancelJob()
+	{
+		m_bCancel = true;
+		for (unsigned int i = 0; i < iChunks; ++i)
+			g_pModuleManager.GetJobSystem().Cancel(&pChunks[i]);
+	}
+
+	virtual bool IsJobIdle()
+	{
+		for (unsigned int i = 0; i < iChunks; ++i)
+			if (!pChunks[i].IsIdle())
+				return false;
+
+		return true;
+	}
+
+	unsigned char iCodec = CHUNKED_CODEC_LZMA;
+	unsigned int iChunks = 0;
+	CompressChunk* pChunks = NULL;
+	std::atomic<unsigned int> iRemainingChunks;
+};
+
+static bool CompressChunkData(ChunkedCompressEntry* entry, CompressChunk* chunk)
+{
+	if (entry->iCodec == CHUNKED_CODEC_LZMA)
+		return Bootil::Compression::LZMA::Compress(chunk->pData, chunk->iLength, chunk->buffer, entry->iLevel, entry->iDictSize);
+
+	int iBound = LZ4_compressBound(chunk->iLength);
+	if (!chunk->buffer.EnsureCapacity(iBound))
+		return false;
+
+	int iCompressedSize;
+	if (entry->iCodec == CHUNKED_CODEC_LZ4HC) {
+		iCompressedSize = LZ4_compress_HC(chunk->pData, (char*)chunk->buffer.GetBase(), chunk->iLength, iBound, entry->iLevel);
+	} else {
+		iCompressedSize = LZ4_compress_fast(chunk->pData, (char*)chunk->buffer.GetBase(), chunk->iLength, iBound, entry->iLevel);
+	}
+
+	if (iCompressedSize <= 0)
+		return false;
+
+	chunk->buffer.SetWritten(iCompressedSize);
+	return true;
+}
+
+static bool DecompressChunkData(ChunkedCompressEntry* entry, CompressChunk* chunk)
+{
+	if (entry->iCodec == CHUNKED_CODEC_LZMA)
+		return Bootil::Compression::LZMA::Extract(chunk->pData, chunk->iLength, chunk->buffer, entry->iRatio) && chunk->buffer.GetWritten() == chunk->iSize;
+
+	if (!chunk->buffer.EnsureCapacity(chunk->iSize))
+		return false;
+
+	// LZ4 & LZ4HC share the same format.
+	int iDecompressedSize = LZ4_decompress_safe(chunk->pData, (char*)chunk->buffer.GetBase(), chunk->iLength, chunk->iSize);
+	if (iDecompressedSize < 0 || (unsigned int)iDecompressedSize != chunk->iSize)
+		return false;
+
+	chunk->buffer.SetWritten(iDecompressedSize);
+	return true;
+}
+
+// Called by whichever thread finished the last chunk, puts all chunks together into the entry's buffer.
+static void FinishChunkedEntry(ChunkedCompressEntry* entry)
+{
+	if (entry->m_bCancel)
+		return;
+
+	unsigned int iTotalSize = entry->bCompress ? sizeof(ChunkedHeader) + sizeof(ChunkedBlock) * entry->iChunks : 0;
+	for (unsigned int i = 0; i < entry->iChunks; ++i)
+	{
+		if (!entry->pChunks[i].bSuccess)
+		{
+			entry->iStatus = -1;
+			return;
+		}
+
+		iTotalSize += entry->pChunks[i].buffer.GetWritten();
+	}
+
+	if (!entry->buffer.EnsureCapacity(iTotalSize))
+	{
+		entry->iStatus = -1;
+		return;
+	}
+
+	if (entry->bCompress)
+	{
+		ChunkedHeader header;
+		header.iCodec = entry->iCodec;
+		header.iChunks = entry->iChunks;
+		header.iSize = entry->iLength;
+		entry->buffer.Write(&header, sizeof(header));
+
+		for (unsigned int i = 0; i < entry->iChunks; ++i)
+		{
+			ChunkedBlock block;
+			block.iCompressedSize = entry->pChunks[i].buffer.GetWritten();
+			block.iSize = entry->pChunks[i].iLength;
+			entry->buffer.Write(&block, sizeof(block));
+		}
+	}
+
+	for (unsigned int i = 0; i < entry->iChunks; ++i)
+	{
+		entry->buffer.Write(entry->pChunks[i].buffer.GetBase(), entry->pChunks[i].buffer.GetWritten());
+		entry->pChunks[i].buffer.Clear(); // Free it now since we don't need it anymore
+	}
+
+	entry->iStatus = 1;
+}
+
+static void ChunkJob(CompressChunk* chunk)
+{
+	ChunkedCompressEntry* entry = chunk->pEntry;
+	if (!entry->m_bCancel)
+		chunk->bSuccess = entry->bCompress ? CompressChunkData(entry, chunk) : DecompressChunkData(entry, chunk);
+
+	if (entry->iRemainingChunks.fetch_sub(1) == 1)
+		FinishChunkedEntry(entry);
+}
+
+void CompressChunk::Execute()
+{
+	ChunkJob(this);
+}
+
 /*
- * If the Async function's arent used. We simply won't create the threadpools.
- * This should save a bit of CPU usage since we won't have a thread that is permantly in a while loop,
- * calling ThreadSleep every 10 milliseconds or so.
+ * Validates the header & block table and sets up the chunks of the entry.
+ * Returns false if the data is invalid or would exceed the given ratio.
  */
-inline void StartThread()
+static bool SetupChunkedDecompress(ChunkedCompressEntry* entry)
+{
+	ChunkedHeader header;
+	memcpy(&header, entry->pData, sizeof(header));
+	if (header.iVersion != CHUNKED_VERSION || header.iCodec > CHUNKED_CODEC_LZ4HC || header.iChunks == 0)
+		return false;
+
+	unsigned int iOffset = sizeof(ChunkedHeader);
+	if (header.iChunks > (entry->iLength - iOffset) / sizeof(ChunkedBlock))
+		return false;
+
+	// Same ratio check as Bootil's LZMA::Extract so that LZ4 can't explode either.
+	if (entry->iRatio <= 0 || (entry->iRatio < 1 && ((double)header.iSize / entry->iLength) > (1 / (1 - entry->iRatio))))
+		return false;
+
+	entry->iCodec = header.iCodec;
+	entry->iChunks = header.iChunks;
+	entry->pChunks = new CompressChunk[header.iChunks];
+
+	unsigned int iDataOffset = iOffset + sizeof(ChunkedBlock) * header.iChunks;
+	unsigned int iTotalSize = 0;
+	for (unsigned int i = 0; i < header.iChunks; ++i)
+	{
+		ChunkedBlock block;
+		memcpy(&block, entry->pData + iOffset + sizeof(ChunkedBlock) * i, sizeof(block));
+		if (block.iCompressedSize > (unsigned int)entry->iLength - iDataOffset || block.iSize > header.iSize - iTotalSize)
+			return false;
+
+		CompressChunk& chunk = entry->pChunks[i];
+		chunk.pEntry = entry;
+		chunk.pData = entry->pData + iDataOffset;
+		chunk.iLength = block.iCompressedSize;
+		chunk.iSize = block.iSize;
+
+		iDataOffset += block.iCompressedSize;
+		iTotalSize += block.iSize;
+	}
+
+	return iTotalSize == header.iSize;
+}
+
+static void QueueChunkedEntry(ChunkedCompressEntry* entry)
 {
-	if (pCompressPool)
+	entry->iRemainingChunks = entry->iChunks;
+	for (unsigned int i = 0; i < entry->iChunks; ++i)
+		g_pModuleManager.GetJobSystem().Queue(&entry->pChunks[i]);
+}
+
+static void ChunkedCompress(GarrysMod::Lua::ILuaInterface* LUA, const char* pData, unsigned int iLength)
+{
+	unsigned char iCodec = CHUNKED_CODEC_LZMA;
+	LUA->GetField(3, "codec");
+	const char* pCodec = LUA->GetString(-1);
+	if (pCodec)
+	{
+		if (V_stricmp(pCodec, "lzma") == 0)
+			iCodec = CHUNKED_CODEC_LZMA;
+		else if (V_stricmp(pCodec, "lz4") == 0)
+			iCodec = CHUNKED_CODEC_LZ4;
+		else if (V_stricmp(pCodec, "lz4hc") == 0)
+			iCodec = CHUNKED_CODEC_LZ4HC;
+		else
+			LUA->ArgError(3, "Unknown codec! Expected lzma, lz4 or lz4hc");
+	}
+	LUA->Pop(1);
+
+	int iDefaultLevel = iCodec == CHUNKED_CODEC_LZMA ? 5 : (iCodec == CHUNKED_CODEC_LZ4HC ? LZ4HC_CLEVEL_DEFAULT : 1);
+	LUA->GetField(3, "level");
+	int iLevel = LUA->IsType(-1, GarrysMod::Lua::Type::Number) ? (int)LUA->GetNumber(-1) : iDefaultLevel;
+	LUA->Pop(1);
+
+	LUA->GetField(3, "dictSize");
+	int iDictSize = LUA->IsType(-1, GarrysMod::Lua::Type::Number) ? (int)LUA->GetNumber(-1) : 65536;
+	LUA->Pop(1);
+
+	LUA->GetField(3, "chunkSize");
+	int iChunkSize = LUA->IsType(-1, GarrysMod::Lua::Type::Number) ? (int)LUA->GetNumber(-1) : (1 << 20);
+	LUA->Pop(1);
+
+	LUA->GetField(3, "byteBuffer");
+	bool bByteBuffer = LUA->GetBool(-1);
+	LUA->Pop(1);
+
+	if (iChunkSize < (1 << 16))
+		iChunkSize = 1 << 16; // Smaller chunks would just ruin the compression ratio.
+
+	LUA->Push(2);
+	int iCallback = Util::ReferenceCreate(LUA, "util.AsyncCompress - Callback3");
+
+	ChunkedCompressEntry* entry = new ChunkedCompressEntry;
+	entry->iCallback = iCallback;
+	entry->bByteBuffer = bByteBuffer;
+	entry->iCodec = iCodec;
+	entry->iLevel = iLevel;
+	entry->iDictSize = iDictSize;
+	entry->iLength = iLength;
+	entry->pData = pData;
+	LUA->Push(1);
+	entry->iDataReference = Util::ReferenceCreate(LUA, "util.AsyncCompress - Data");
+	entry->m_pLua = LUA;
+
+	GetLuaData(LUA)->pEntries.push_back(entry);
+
+	if (iLength == 0)
+	{
+		entry->iStatus = -1; // Nothing to compress, our callback will be called with nil in the next think.
 		return;
+	}
 
-	pCompressPool = V_CreateThreadPool();
-	Util::StartThreadPool(pCompressPool, compressthreads.GetInt());
+	entry->iChunks = (iLength + iChunkSize - 1) / iChunkSize;
+	entry->pChunks = new CompressChunk[entry->iChunks];
+	for (unsigned int i = 0; i < entry->iChunks; ++i)
+	{
+		CompressChunk& chunk = entry->pChunks[i];
+		chunk.pEntry = entry;
+		chunk.pData = pData + (i * iChunkSize);
+		chunk.iLength = MIN((unsigned int)iChunkSize, iLength - (i * iChunkSize));
+	}
 
-	pDecompressPool = V_CreateThreadPool();
-	Util::StartThreadPool(pDecompressPool, decompressthreads.GetInt());
+	QueueChunkedEntry(entry);
 }
 
 LUA_FUNCTION_STATIC(util_AsyncCompress)
 {
-	const char* pData = LUA->CheckString(1);
-	int iLength = LUA->ObjLen(1);
+	unsigned int iLength = 0;
+	const char* pData = Get_BinaryData(LUA, 1, iLength);
 	int iLevel = 5;
 	int iDictSize = 65536;
 	int iCallback = -1;
+	bool bByteBuffer = false;
 	if (LUA->IsType(2, GarrysMod::Lua::Type::Function))
 	{
+		if (LUA->IsType(3, GarrysMod::Lua::Type::Table))
+		{
+			ChunkedCompress(LUA, pData, iLength);
+			return 0;
+		}
+
+		bByteBuffer = LUA->GetBool(3);
 		LUA->Push(2);
 		iCallback = Util::ReferenceCreate(LUA, "util.AsyncCompress - Callback1");
 	} else {
 		iLevel = (int)LUA->CheckNumberOpt(2, 5);
 		iDictSize = (int)LUA->CheckNumberOpt(3, 65536);
 		LUA->CheckType(4, GarrysMod::Lua::Type::Function);
+		bByteBuffer = LUA->GetBool(5);
 		LUA->Push(4);
 		iCallback = Util::ReferenceCreate(LUA, "util.AsyncCompress - Callback2");
 	}
 
 	CompressEntry* entry = new CompressEntry;
 	entry->iCallback = iCallback;
+	entry->bByteBuffer = bByteBuffer;
 	entry->iDictSize = iDictSize;
 	entry->iLength = iLength;
 	entry->iLevel = iLevel;
@@ -209,25 +533,50 @@ LUA_FUNCTION_STATIC(util_AsyncCompress)
 
 	GetLuaData(LUA)->pEntries.push_back(entry);
 
-	StartThread();
-
-	pCompressPool->QueueCall(CompressJob, entry);
+	g_pModuleManager.GetJobSystem().Queue(entry);
 
 	return 0;
 }
 
 LUA_FUNCTION_STATIC(util_AsyncDecompress)
 {
-	const char* pData = LUA->CheckString(1);
-	int iLength = LUA->ObjLen(1);
+	unsigned int iLength = 0;
+	const char* pData = Get_BinaryData(LUA, 1, iLength);
 	LUA->CheckType(2, GarrysMod::Lua::Type::Function);
 	LUA->Push(2);
 	int iCallback = Util::ReferenceCreate(LUA, "util.AsyncDecompress - Callback");
 
 	double ratio = LUA->CheckNumberOpt(3, 0.98); // 98% ratio by default
+	bool bByteBuffer = LUA->GetBool(4);
+
+	if (iLength >= sizeof(ChunkedHeader) && *(const unsigned int*)pData == CHUNKED_ID)
+	{
+		ChunkedCompressEntry* entry = new ChunkedCompressEntry;
+		entry->bCompress = false;
+		entry->bByteBuffer = bByteBuffer;
+		entry->iCallback = iCallback;
+		entry->iLength = iLength;
+		entry->pData = pData;
+		entry->iRatio = ratio;
+		LUA->Push(1);
+		entry->iDataReference = Util::ReferenceCreate(LUA, "util.AsyncDecompress - Data");
+		entry->m_pLua = LUA;
+
+		GetLuaData(LUA)->pEntries.push_back(entry);
+
+		if (!SetupChunkedDecompress(entry))
+		{
+			entry->iStatus = -1; // Our callback will be called with nil in the next think.
+			return 0;
+		}
+
+		QueueChunkedEntry(entry);
+		return 0;
+	}
 
 	CompressEntry* entry = new CompressEntry;
 	entry->bCompress = false;
+	entry->bByteBuffer = bByteBuffer;
 	entry->iCallback = iCallback;
 	entry->iLength = iLength;
 	entry->pData = pData;
@@ -238,9 +587,7 @@ LUA_FUNCTION_STATIC(util_AsyncDecompress)
 
 	GetLuaData(LUA)->pEntries.push_back(entry);
 
-	StartThread();
-
-	pDecompressPool->QueueCall(CompressJob, entry);
+	g_pModuleManager.GetJobSystem().Queue(entry);
 
 	return 0;
 }
@@ -255,75 +602,69 @@ inline bool IsInt(float pNumber)
 	return static_cast<int>(pNumber) == pNumber && INT32_MAX >= pNumber && pNumber >= INT32_MIN;
 }
 
-extern void TableToJSONRecursive(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData, rapidjson::Value& outValue, rapidjson::Document::AllocatorType& allocator);
-void TableToJSONRecursive(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData, rapidjson::Value& outValue, rapidjson::Document::AllocatorType& allocator)
+/*
+ * Writes the table at the top of the stack directly into the given writer.
+ * We first scan the keys to know if it's an array or an object since, unlike a DOM, we can't convert it afterwards.
+ * Cyclic references are tracked using the tables we are currently inside of.
+ * Returns false if a cyclic reference was found and bRecursiveNoError is false, the caller is expected to throw the error.
+ */
+template<class Writer>
+static bool TableToJSONStream(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData, Writer& writer)
 {
-	bool bEqual = false;
-	for (int iReference : pData->pRecursiveTableScope)
+	const void* pTable = RawLua::GetTablePointer(pLua->GetState(), -1);
+	if (!pData->pRecursiveTables.insert(pTable).second)
 	{
-		Util::ReferencePush(pLua, iReference);
-		if (pLua->Equal(-1, -3))
-		{
-			bEqual = true;
-			pLua->Pop(1);
-			break;
-		}
-
-		pLua->Pop(1);
-	}
-
-	if (bEqual) {
 		if (pData->bRecursiveNoError)
 		{
-			pLua->Pop(2); // Don't forget to cleanup
-			return;
+			writer.Null();
+			return true;
 		}
 
-		pLua->Pop(pLua->Top() - pData->iRecursiveStartTop); // Since we added a unknown amount to the stack, we need to throw everything back out
-		pLua->ThrowError("attempt to serialize structure with cyclic reference");
+		return false;
 	}
 
-	pLua->Push(-2);
-	pData->pRecursiveTableScope.push_back(Util::ReferenceCreate(pLua, "TableToJSONRecursive - Scope"));
+	int iTable = pLua->Top();
 
+	// In bootil, you just don't give a child a name to indicate that it's sequentail.
+	// The table stays an array as long as the keys come in order, any other usable key turns it into an object.
+	bool bSequential = true;
 	int idx = 1;
-	bool wasSequential = true;
-	rapidjson::Value jsonObj(rapidjson::kObjectType);
-	rapidjson::Value jsonArr(rapidjson::kArrayType);
-	//int tableSize = pLua->ObjLen(-2);
-	//if (tableSize > 0)
-	//{
-	//	jsonArr.Reserve(tableSize * 8, allocator); // * 8 because we assume each key-value will take up atleast 8 bytes.
-	//}
-
-	while (pLua->Next(-2)) {
-		// In bootil, you just don't give a child a name to indicate that it's sequentail. 
-		// so we need to support that.
-		bool isSequential = false; 
+	pLua->PushNil();
+	while (pLua->Next(iTable)) {
 		int iKeyType = pLua->GetType(-2);
-		double iKey = iKeyType == GarrysMod::Lua::Type::Number ? pLua->GetNumber(-2) : 0;
-		if (iKey != 0 && iKey == idx)
+		if (iKeyType == GarrysMod::Lua::Type::Number && pLua->GetNumber(-2) == idx)
 		{
-			isSequential = true;
 			++idx;
+		} else if (iKeyType == GarrysMod::Lua::Type::String || iKeyType == GarrysMod::Lua::Type::Number || iKeyType == GarrysMod::Lua::Type::Bool) {
+			bSequential = false;
+			pLua->Pop(2);
+			break;
 		}
 
-		const char* key = NULL; // In JSON a key is ALWAYS a string
-		if (!isSequential)
+		pLua->Pop(1);
+	}
+
+	if (bSequential)
+		writer.StartArray();
+	else
+		writer.StartObject();
+
+	idx = 1;
+	pLua->PushNil();
+	while (pLua->Next(iTable)) {
+		if (!bSequential)
 		{
-			switch (iKeyType)
+			unsigned int iKeyLength = 0;
+			const char* key = NULL; // In JSON a key is ALWAYS a string
+			switch (pLua->GetType(-2))
 			{
 				case GarrysMod::Lua::Type::String:
-					key = pLua->GetString(-2); // lua_next won't nuke itself since we don't convert the value
+					key = pLua->GetString(-2, &iKeyLength); // lua_next won't nuke itself since we don't convert the value
 					break;
 				case GarrysMod::Lua::Type::Number:
-					pLua->Push(-2);
-					key = pLua->GetString(-1); // lua_next nukes itself when the key isn't an actual string
-					pLua->Pop(1);
-					break;
 				case GarrysMod::Lua::Type::Bool:
 					pLua->Push(-2);
-					key = pLua->GetString(-1); // lua_next nukes itself when the key isn't an actual string
+					key = pLua->GetString(-1, &iKeyLength); // lua_next nukes itself when the key isn't an actual string
 					pLua->Pop(1);
 					break;
 				default:
@@ -335,88 +676,110 @@ void TableToJSONRecursive(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData
 				pLua->Pop(1); // Pop the value off the stack for lua_next to work
 				continue;
 			}
+
+			writer.Key(key, iKeyLength, true);
+		} else if (pLua->GetType(-2) != GarrysMod::Lua::Type::Number || pLua->GetNumber(-2) != idx) {
+			pLua->Pop(1); // Keys we can't represent, like tables, are skipped.
+			continue;
+		} else {
+			++idx;
 		}
 
-		rapidjson::Value value;
 		switch (pLua->GetType(-1))
 		{
 			case GarrysMod::Lua::Type::String:
-				value.SetString(pLua->GetString(-1), pLua->ObjLen(-1), allocator);
+				{
+					unsigned int iLength = 0;
+					const char* pString = pLua->GetString(-1, &iLength);
+					writer.String(pString, iLength, true);
+				}
 				break;
 			case GarrysMod::Lua::Type::Number:
 				{
 					double pNumber = pLua->GetNumber(-1);
 					if (IsInt(pNumber))
-						value.SetInt(pNumber);
+						writer.Int((int)pNumber);
+					else if (std::isfinite(pNumber)) // rapidjson's Writer uses Grisu2 so we don't need our own dtoa.
+						writer.Double(pNumber);
 					else
-						value.SetDouble(pNumber);
+						writer.Null(); // The Writer would refuse to write it and leave us with invalid JSON.
 				}
 				break;
 			case GarrysMod::Lua::Type::Bool:
-				value.SetBool(pLua->GetBool(-1));
+				writer.Bool(pLua->GetBool(-1));
 				break;
 			case GarrysMod::Lua::Type::Table: // now make it recursive >:D
-				pLua->Push(-1);
-				pLua->PushNil();
-				TableToJSONRecursive(pLua, pData, value, allocator);
+				if (!TableToJSONStream(pLua, pData, writer))
+					return false; // The caller will clean up the stack.
 				break;
 			case GarrysMod::Lua::Type::Vector:
 				{
 					Vector* vec = Get_Vector(pLua, -1, true);
 					if (!vec)
+					{
+						writer.Null();
 						break;
+					}
 
 					int length = snprintf(pData->buffer, sizeof(pData->buffer), "[%.16g %.16g %.16g]", vec->x, vec->y, vec->z); // Do we even need to be this percice?
-					value.SetString(pData->buffer, length, allocator);
+					writer.String(pData->buffer, length, true);
 				}
 				break;
 			case GarrysMod::Lua::Type::Angle:
 				{
 					QAngle* ang = Get_QAngle(pLua, -1, true);
 					if (!ang)
+					{
+						writer.Null();
 						break;
+					}
 
 					int length = snprintf(pData->buffer, sizeof(pData->buffer), "{%.12g %.12g %.12g}", ang->x, ang->y, ang->z);
-					value.SetString(pData->buffer, length, allocator);
+					writer.String(pData->buffer, length, true);
 				}
 				break;
 			default:
-				break; // We should fallback to nil
-		}
-
-		if (wasSequential && !isSequential)
-		{
-			for (rapidjson::SizeType i=0; i<jsonArr.Size(); ++i)
-			{
-				char indexKey[32];
-				snprintf(indexKey, sizeof(indexKey), "%u", i + 1);
-				rapidjson::Value k(indexKey, allocator);
-				jsonObj.AddMember(k, jsonArr[i], allocator);
-			}
-			jsonArr.Clear();
-			//jsonArr.~GenericValue();
-			//new (&jsonArr) rapidjson::Value(rapidjson::kArrayType);
-			//jsonObj.Reserve(tableSize * 8, allocator); // Since we use the jsonObj now, we can instead go in and reserve space there.
-			wasSequential = false;
-		}
-
-		if (wasSequential && isSequential)
-		{
-			jsonArr.PushBack(std::move(value), allocator);
-		} else {
-			rapidjson::Value k(key, allocator);
-			jsonObj.AddMember(std::move(k), std::move(value), allocator);
+				writer.Null(); // We should fallback to nil
+				break;
 		}
 
 		pLua->Pop(1);
 	}
 
-	outValue = std::move(wasSequential ? jsonArr : jsonObj);
+	if (bSequential)
+		writer.EndArray();
+	else
+		writer.EndObject();
 
-	pLua->Pop(1);
+	pData->pRecursiveTables.erase(pTable);
+
+	return true;
+}
+
+/*
+ * Serializes the table at the top of the stack into the given buffer.
+ * The table is left on the stack, even if we fail.
+ */
+static bool TableToJSON(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData, rapidjson::StringBuffer& buffer, bool bPretty)
+{
+	int iTop = pLua->Top();
+	pData->pRecursiveTables.clear();
+
+	bool bSuccess;
+	if (bPretty)
+	{
+		rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
+		writer.SetIndent( '\t', 1 );
+		bSuccess = TableToJSONStream(pLua, pData, writer);
+	} else {
+		rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+		bSuccess = TableToJSONStream(pLua, pData, writer);
+	}
 
-	Util::ReferenceFree(pLua, pData->pRecursiveTableScope.back(), "TableToJSONRecursive - Free scope");
-	pData->pRecursiveTableScope.pop_back();
+	pLua->Pop(pLua->Top() - iTop); // When we fail, we added a unknown amount to the stack, so we need to throw everything back out
+	pData->pRecursiveTables.clear();
+
+	return bSuccess;
 }
 
 LUA_FUNCTION_STATIC(util_TableToJSON)
@@ -427,172 +790,1428 @@ LUA_FUNCTION_STATIC(util_TableToJSON)
 	auto pData = GetLuaData(LUA);
 	pData->bRecursiveNoError = LUA->GetBool(3);
 
-	pData->iRecursiveStartTop = LUA->Top();
-	LUA->Push(1);
-	LUA->PushNil();
-
-	rapidjson::Document doc;
-	TableToJSONRecursive(LUA, pData, doc, doc.GetAllocator());
+	rapidjson::StringBuffer& buffer = pData->pJsonBuffer;
+	buffer.Clear();
 
-	rapidjson::StringBuffer buffer;
-	if (bPretty)
+	LUA->Push(1);
+	if (!TableToJSON(LUA, pData, buffer, bPretty))
 	{
-		rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(buffer);
-		writer.SetIndent( '\t', 1 );
-		doc.Accept(writer);
-	} else {
-		rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
-		doc.Accept(writer);
+		buffer.Clear();
+		LUA->ThrowError("attempt to serialize structure with cyclic reference");
 	}
 
 	LUA->PushString(buffer.GetString(), buffer.GetLength());
+	buffer.Clear(); // Clear only resets the size, we keep the memory for the next call.
 	return 1;
 }
 
-// When called, we expect the top of the stack to be the main table that we will be writing into
-// noSet = If true, we expect only the value to get pushed or nil, and the key will be ignored.
-extern void JSONToTableRecursive(GarrysMod::Lua::ILuaInterface* pLua, const rapidjson::Value& jsonValue, bool noSet = false);
-void PushJSONValue(GarrysMod::Lua::ILuaInterface* pLua, const rapidjson::Value& jsonValue)
-{
-	if (jsonValue.IsObject()) {
-		pLua->CreateTable();
-		JSONToTableRecursive(pLua, jsonValue, false);
-	} else if (jsonValue.IsArray()) {
-		pLua->PreCreateTable(jsonValue.Size(), 0);
-		int idx = 1;
-		for (rapidjson::SizeType i = 0; i < jsonValue.Size(); ++i) {
-			JSONToTableRecursive(pLua, jsonValue[i], true);
-			Util::RawSetI(pLua, -2, idx++);
-		}
-	} else if (jsonValue.IsString()) {
-		const char* valueStr = jsonValue.GetString();
-		if (jsonValue.GetStringLength() > 2 && valueStr[0] == '[' && valueStr[jsonValue.GetStringLength() - 1] == ']') {
-			Vector vec;
-			sscanf(valueStr + 1, "%f %f %f", &vec.x, &vec.y, &vec.z);
-			pLua->PushVector(vec);
-		} else if (jsonValue.GetStringLength() > 2 && valueStr[0] == '{' && valueStr[jsonValue.GetStringLength() - 1] == '}') {
-			QAngle ang;
-			sscanf(valueStr + 1, "%f %f %f", &ang.x, &ang.y, &ang.z);
-			pLua->PushAngle(ang);
-		} else {
-			pLua->PushString(valueStr);
-		}
-	} else if (jsonValue.IsNumber()) {
-		pLua->PushNumber(jsonValue.GetDouble());
-	} else if (jsonValue.IsBool()) {
-		pLua->PushBool(jsonValue.GetBool());
-	} else {
-		pLua->PushNil();
+/*
+ * Parses "[x y z]" / "{p y r}" strings like Gmod's util.JSONToTable does.
+ * Returns false if the string doesn't contain 3 numbers, in which case it should stay a string.
+ */
+static bool ParseJSONVector(const char* pStr, rapidjson::SizeType iLength, float& x, float& y, float& z)
+{
+	const char* pEnd = pStr + iLength - 1; // Pointing at the closing ] or }
+	char* pNext = NULL;
+	const char* pCurrent = pStr + 1;
+	float* pValues[3] = {&x, &y, &z};
+	for (int i = 0; i < 3; ++i)
+	{
+		*pValues[i] = strtof(pCurrent, &pNext);
+		if (pNext == pCurrent || pNext > pEnd)
+			return false;
+
+		pCurrent = pNext;
 	}
+
+	return true;
 }
 
-void JSONToTableRecursive(GarrysMod::Lua::ILuaInterface* pLua, const rapidjson::Value& jsonValue, bool noSet)
+#define JSON_MAXSIZEHINT 256 // Max number of slots we preallocate for a table based on the previous one.
+
+/*
+ * SAX handler that pushes the values onto the Lua stack while rapidjson parses them, so we never build a document.
+ * The table that is being filled is always on the top of the stack, for objects the current key is pushed above it.
+ * rapidjson only tells us the size of a table once it ends, so we remember the size of the last array & object on each depth
+ * and use it to presize the next one since most JSON has a lot of similar tables next to each other.
+ */
+class JSONToTableHandler
 {
-	if (jsonValue.IsObject()) {
-		for (rapidjson::Value::ConstMemberIterator itr = jsonValue.MemberBegin(); itr != jsonValue.MemberEnd(); ++itr) {
-			const rapidjson::Value& value = itr->value;
+public:
+	JSONToTableHandler(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData) : m_pLua(pLua), m_pData(pData)
+	{
+		m_pData->pJsonArrayIndex.clear();
+		m_pData->pJsonArraySizeHints.clear();
+		m_pData->pJsonObjectSizeHints.clear();
+	}
+
+	bool Null() { m_pLua->PushNil(); return SetValue(); }
+	bool Bool(bool b) { m_pLua->PushBool(b); return SetValue(); }
+	bool Int(int i) { m_pLua->PushNumber(i); return SetValue(); }
+	bool Uint(unsigned int i) { m_pLua->PushNumber(i); return SetValue(); }
+	bool Int64(int64_t i) { m_pLua->PushNumber((double)i); return SetValue(); }
+	bool Uint64(uint64_t i) { m_pLua->PushNumber((double)i); return SetValue(); }
+	bool Double(double d) { m_pLua->PushNumber(d); return SetValue(); }
+	bool RawNumber(const char* pStr, rapidjson::SizeType iLength, bool bCopy) { return false; } // We never set kParseNumbersAsStringsFlag
 
-			if (!noSet)
+	bool String(const char* pStr, rapidjson::SizeType iLength, bool bCopy)
+	{
+		if (iLength > 2)
+		{
+			if (pStr[0] == '[' && pStr[iLength - 1] == ']')
 			{
-				if (itr->name.IsString()) {
-					pLua->PushString(itr->name.GetString());
-				} else if (itr->name.IsNumber()) {
-					pLua->PushNumber(itr->name.GetDouble());
-				} else if (itr->name.IsBool()) {
-					pLua->PushBool(itr->name.GetBool());
+				Vector vec;
+				if (ParseJSONVector(pStr, iLength, vec.x, vec.y, vec.z))
+				{
+					m_pLua->PushVector(vec);
+					return SetValue();
+				}
+			} else if (pStr[0] == '{' && pStr[iLength - 1] == '}') {
+				QAngle ang;
+				if (ParseJSONVector(pStr, iLength, ang.x, ang.y, ang.z))
+				{
+					m_pLua->PushAngle(ang);
+					return SetValue();
 				}
 			}
+		}
 
-			PushJSONValue(pLua, itr->value);
+		m_pLua->PushString(pStr, iLength);
+		return SetValue();
+	}
+
+	bool Key(const char* pStr, rapidjson::SizeType iLength, bool bCopy)
+	{
+		m_pLua->PushString(pStr, iLength); // In JSON a key is ALWAYS a string
+		return true;
+	}
+
+	bool StartObject() { return StartTable(false); }
+	bool EndObject(rapidjson::SizeType iMemberCount) { return EndTable(false, iMemberCount); }
+	bool StartArray() { return StartTable(true); }
+	bool EndArray(rapidjson::SizeType iElementCount) { return EndTable(true, iElementCount); }
+
+private:
+	bool StartTable(bool bArray)
+	{
+		if (m_bRoot) // The root table was already pushed by the caller.
+		{
+			m_bRoot = false;
+		} else {
+			size_t iDepth = m_pData->pJsonArrayIndex.size();
+			std::vector<int>& pHints = bArray ? m_pData->pJsonArraySizeHints : m_pData->pJsonObjectSizeHints;
+			int iHint = iDepth < pHints.size() ? pHints[iDepth] : 0;
+			if (bArray)
+				m_pLua->PreCreateTable(iHint, 0);
+			else
+				m_pLua->PreCreateTable(0, iHint);
+		}
+
+		m_pData->pJsonArrayIndex.push_back(bArray ? 1 : 0);
+		return true;
+	}
+
+	bool EndTable(bool bArray, rapidjson::SizeType iCount)
+	{
+		m_pData->pJsonArrayIndex.pop_back();
+
+		// Only a hint for the next table of the same type on this depth, clamped since that one might be far smaller.
+		size_t iDepth = m_pData->pJsonArrayIndex.size();
+		std::vector<int>& pHints = bArray ? m_pData->pJsonArraySizeHints : m_pData->pJsonObjectSizeHints;
+		if (iDepth >= pHints.size())
+			pHints.resize(iDepth + 1);
+		pHints[iDepth] = (int)MIN(iCount, (rapidjson::SizeType)JSON_MAXSIZEHINT);
+
+		if (iDepth == 0) // The root table stays on the stack.
+			return true;
+
+		return SetValue();
+	}
+
+	// Sets the value on the top of the stack into the current table.
+	bool SetValue()
+	{
+		if (m_pData->pJsonArrayIndex.empty()) // The JSON only contained a single value, we always return a table.
+		{
+			m_pLua->Pop(1);
+			return true;
+		}
+
+		int& iIndex = m_pData->pJsonArrayIndex.back();
+		if (iIndex != 0)
+		{
+			Util::RawSetI(m_pLua, -2, iIndex++);
+		} else {
+			m_pLua->RawSet(-3);
+		}
+
+		return true;
+	}
+
+	GarrysMod::Lua::ILuaInterface* m_pLua;
+	LuaUtilModuleData* m_pData;
+	bool m_bRoot = true;
+};
+
+LUA_FUNCTION_STATIC(util_JSONToTable)
+{
+	const char* jsonString = LUA->CheckString(1);
+	int iLength = LUA->ObjLen(1);
+
+	// We parse in-situ so strings don't have to be copied out of the JSON, this needs a writable copy of it.
+	auto pData = GetLuaData(LUA);
+	pData->pJsonReadBuffer.assign(jsonString, jsonString + iLength + 1); // + 1 for the null terminator.
+
+	int iTop = LUA->Top();
+	LUA->CreateTable();
+
+	JSONToTableHandler handler(LUA, pData);
+	rapidjson::InsituStringStream stream(pData->pJsonReadBuffer.data());
+	rapidjson::Reader reader;
+	bool bSuccess = !reader.Parse<rapidjson::kParseInsituFlag>(stream, handler).IsError();
+
+	if (pData->pJsonReadBuffer.capacity() > 1 << 20) // Don't keep huge buffers around forever.
+	{
+		pData->pJsonReadBuffer.clear();
+		pData->pJsonReadBuffer.shrink_to_fit();
+	}
+
+	if (!bSuccess)
+	{
+		LUA->Pop(LUA->Top() - iTop); // We don't know how much is left on the stack.
+		LUA->ThrowError("Invalid JSON string");
+		return 0;
+	}
+
+	return 1;
+}
+
+Push_LuaClass(ByteBuffer)
+Get_LuaClass(ByteBuffer, "ByteBuffer")
+
+LuaUserData* Push_ByteBuffer(GarrysMod::Lua::ILuaInterface* LUA, void* pData, unsigned int iLength)
+{
+	ByteBufferStorage* pStorage = new ByteBufferStorage((char*)pData, iLength);
+	ByteBuffer* pBuffer = new ByteBuffer(pStorage, 0, iLength);
+	pStorage->Release(); // Our ByteBuffer holds the only reference now.
+
+	return Push_ByteBuffer(LUA, pBuffer);
+}
+
+const char* Get_BinaryData(GarrysMod::Lua::ILuaInterface* LUA, int iStackPos, unsigned int& iLength)
+{
+	ByteBuffer* pBuffer = Get_ByteBuffer(LUA, iStackPos, false);
+	if (pBuffer)
+	{
+		iLength = pBuffer->iLength;
+		return pBuffer->GetData();
+	}
+
+	const char* pData = LUA->CheckString(iStackPos);
+	iLength = LUA->ObjLen(iStackPos);
+	return pData;
+}
+
+LUA_FUNCTION_STATIC(ByteBuffer__tostring)
+{
+	ByteBuffer* pBuffer = Get_ByteBuffer(LUA, 1, false);
+	if (!pBuffer)
+	{
+		LUA->PushString("ByteBuffer [NULL]");
+	} else {
+		char szBuf[64] = {};
+		V_snprintf(szBuf, sizeof(szBuf), "ByteBuffer [%u]", pBuffer->iLength);
+		LUA->PushString(szBuf);
+	}
+
+	return 1;
+}
+
+Default__index(ByteBuffer);
+Default__newindex(ByteBuffer);
+Default__GetTable(ByteBuffer);
+Default__gc(ByteBuffer,
+	ByteBuffer* pBuffer = (ByteBuffer*)pStoredData;
+	if (pBuffer)
+		delete pBuffer;
+)
+
+LUA_FUNCTION_STATIC(ByteBuffer_IsValid)
+{
+	LUA->PushBool(Get_ByteBuffer(LUA, 1, false) != NULL);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(ByteBuffer_GetSize)
+{
+	ByteBuffer* pBuffer = Get_ByteBuffer(LUA, 1, true);
+
+	LUA->PushNumber(pBuffer->iLength);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(ByteBuffer_Slice)
+{
+	ByteBuffer* pBuffer = Get_ByteBuffer(LUA, 1, true);
+	double iOffset = LUA->CheckNumberOpt(2, 0);
+	if (iOffset < 0 || iOffset > pBuffer->iLength)
+		LUA->ArgError(2, "offset out of range");
+
+	double iLength = LUA->CheckNumberOpt(3, pBuffer->iLength - iOffset);
+	if (iLength < 0 || iOffset + iLength > pBuffer->iLength)
+		LUA->ArgError(3, "length out of range");
+
+	Push_ByteBuffer(LUA, new ByteBuffer(pBuffer->pStorage, pBuffer->iOffset + (unsigned int)iOffset, (unsigned int)iLength));
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(ByteBuffer_Copy)
+{
+	ByteBuffer* pBuffer = Get_ByteBuffer(LUA, 1, true);
+
+	void* pData = malloc(MAX(pBuffer->iLength, 1u));
+	memcpy(pData, pBuffer->GetData(), pBuffer->iLength);
+	Push_ByteBuffer(LUA, pData, pBuffer->iLength);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(ByteBuffer_ToString)
+{
+	ByteBuffer* pBuffer = Get_ByteBuffer(LUA, 1, true);
+
+	LUA->PushString(pBuffer->GetData(), pBuffer->iLength);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(util_CreateByteBuffer)
+{
+	const char* pData = LUA->CheckString(1);
+	unsigned int iLength = LUA->ObjLen(1);
+
+	void* pBuffer = malloc(MAX(iLength, 1u)); // malloc(0) may return NULL
+	memcpy(pBuffer, pData, iLength);
+	Push_ByteBuffer(LUA, pBuffer, iLength);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(util_CompressLZ4)
+{
+	unsigned int iLength = 0;
+	const char* pData = Get_BinaryData(LUA, 1, iLength);
+	int accelerationLevel = (int)LUA->CheckNumberOpt(2, 1);
+	bool bByteBuffer = LUA->GetBool(3);
+
+	void* pDest = NULL;
+	unsigned int pDestLen = 0;
+	bool bSuccess = COM_Compress_LZ4(pData, iLength, &pDest, &pDestLen, accelerationLevel);
+	if (!bSuccess)
+	{
+		LUA->PushNil();
+		return 1;
+	}
+
+	if (bByteBuffer)
+	{
+		Push_ByteBuffer(LUA, pDest, pDestLen); // The ByteBuffer takes ownership, no copy needed.
+	} else {
+		LUA->PushString((const char*)pDest, pDestLen);
+		free(pDest);
+	}
+	
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(util_DecompressLZ4)
+{
+	unsigned int iLength = 0;
+	const char* pData = Get_BinaryData(LUA, 1, iLength);
+	bool bByteBuffer = LUA->GetBool(2);
+
+	void* pDest = NULL;
+	unsigned int pDestLen = 0;
+	bool bSuccess = COM_Decompress_LZ4(pData, iLength, &pDest, &pDestLen);
+	if (!bSuccess)
+	{
+		LUA->PushNil();
+		return 1;
+	}
+
+	if (bByteBuffer)
+	{
+		Push_ByteBuffer(LUA, pDest, pDestLen); // The ByteBuffer takes ownership, no copy needed.
+	} else {
+		LUA->PushString((const char*)pDest, pDestLen);
+		free(pDest);
+	}
+
+	return 1;
+}
+
+class JsonEntry : public IJobEntry
+{
+public:
+	virtual ~JsonEntry()
+	{
+		if (m_pLua && m_iReference != -1)
+		{
+			Util::ReferenceFree(m_pLua, m_iReference, "JsonEntry(value) - util.AsyncJson");
+		}
+
+		if (m_pLua && m_iCallback != -1)
+		{
+			Util::ReferenceFree(m_pLua, m_iCallback, "JsonEntry(callback) - util.AsyncJson");
+		}
+
+		if (m_pObject)
+		{
+			delete m_pObject;
+		}
+	}
+
+	virtual bool OnThink(GarrysMod::Lua::ILuaInterface* pLua)
+	{
+		if (!m_bIsDone)
+			return false;
+
+		if (pLua != m_pLua)
+		{
+			Error(PROJECT_NAME " - util: Somehow called OnThink for the wrong Lua Interface?!?\n");
+		}
+
+		Util::ReferencePush(pLua, m_iCallback);
+		pLua->PushString(m_strOut.GetString(), m_strOut.GetLength());
+		pLua->CallFunctionProtected(1, 0, true);
+
+		return true;
+	}
+
+	virtual void Execute();
+
+	virtual void CancelJob()
+	{
+		m_bCancel = true;
+		if (g_pModuleManager.GetJobSystem().Cancel(this))
+			RawLua::SetReadOnly(m_pObject, false); // We never ran, so nobody else will undo it.
+	}
+
+	int m_iReference = -1;
+	TValue* m_pObject = NULL;
+	bool m_bPretty = false;
+
+	bool m_bIsDone = false;
+	rapidjson::StringBuffer m_strOut;
+	int m_iCallback = -1;
+};
+
+static void JsonJob(JsonEntry* entry)
+{
+	if (entry->m_bCancel)
+	{
+		RawLua::SetReadOnly(entry->m_pObject, false);
+		return;
+	}
+
+	GarrysMod::Lua::ILuaInterface* LUA = Lua::CreateInterface();
+
+	LuaUtilModuleData pData;
+	pData.bRecursiveNoError = true;
+
+	RawLua::PushTValue(LUA->GetState(), entry->m_pObject);
+	TableToJSON(LUA, &pData, entry->m_strOut, entry->m_bPretty);
+	LUA->Pop(1);
+
+	Lua::DestroyInterface(LUA);
+	RawLua::SetReadOnly(entry->m_pObject, false);
+
+	if (!entry->m_bCancel)
+		entry->m_bIsDone = true;
+}
+
+void JsonEntry::Execute()
+{
+	JsonJob(this);
+}
+
+LUA_FUNCTION_STATIC(util_AsyncTableToJSON)
+{
+	LUA->CheckType(1, GarrysMod::Lua::Type::Table);
+	LUA->CheckType(2, GarrysMod::Lua::Type::Function);
+	bool bPretty = LUA->GetBool(3);
+
+	LUA->GetField(GarrysMod::Lua::INDEX_REGISTRY, "HOLYLIB_LUAJIT");
+	if (!LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
+	{
+		LUA->Pop(1);
+		LUA->ThrowError("This function is not functional without the luajit module enabled!");
+		return 0;
+	}
+	LUA->Pop(1);
+
+	JsonEntry* entry = new JsonEntry;
+	entry->m_bPretty = bPretty;
+
+	LUA->Push(2);
+	entry->m_iCallback = LUA->ReferenceCreate();
+
+	LUA->Push(1);
+	entry->m_pObject = RawLua::CopyTValue(LUA->GetState(), RawLua::index2adr(LUA->GetState(), -1));
+	entry->m_iReference = LUA->ReferenceCreate();
+	entry->m_pLua = LUA;
+
+	RawLua::SetReadOnly(entry->m_pObject, true);
+
+	GetLuaData(LUA)->pEntries.push_back(entry);
+
+	g_pModuleManager.GetJobSystem().Queue(entry);
+
+	return 0;
+}
+
+/*
+ * util.AsyncJSONToTable parses the JSON on the json threadpool into a flat list of nodes.
+ * The main thread then creates the Lua tables from these nodes, a limited amount per tick so that large JSON won't cause a lag spike.
+ */
+enum JsonNodeType : unsigned char
+{
+	JSONNODE_NULL,
+	JSONNODE_BOOL,
+	JSONNODE_NUMBER,
+	JSONNODE_STRING,
+	JSONNODE_VECTOR,
+	JSONNODE_ANGLE,
+	JSONNODE_OBJECT, // Followed by key & value nodes and ends with a JSONNODE_END
+	JSONNODE_ARRAY, // Followed by value nodes and ends with a JSONNODE_END
+	JSONNODE_END,
+};
+
+struct JsonNode
+{
+	JsonNodeType iType;
+	union {
+		bool bValue;
+		double dNumber;
+		float pVector[3];
+		struct {
+			unsigned int iOffset; // Offset into the JSON buffer
+			unsigned int iLength;
+		} pString;
+		unsigned int iCount; // Number of elements/members of a table
+	};
+};
+
+class JsonNodeHandler
+{
+public:
+	JsonNodeHandler(std::vector<JsonNode>& pNodes, const char* pBase) : m_pNodes(pNodes), m_pBase(pBase) {}
+
+	bool Null() { AddNode(JSONNODE_NULL); return true; }
+	bool Bool(bool b) { AddNode(JSONNODE_BOOL).bValue = b; return true; }
+	bool Int(int i) { AddNode(JSONNODE_NUMBER).dNumber = i; return true; }
+	bool Uint(unsigned int i) { AddNode(JSONNODE_NUMBER).dNumber = i; return true; }
+	bool Int64(int64_t i) { AddNode(JSONNODE_NUMBER).dNumber = (double)i; return true; }
+	bool Uint64(uint64_t i) { AddNode(JSONNODE_NUMBER).dNumber = (double)i; return true; }
+	bool Double(double d) { AddNode(JSONNODE_NUMBER).dNumber = d; return true; }
+	bool RawNumber(const char* pStr, rapidjson::SizeType iLength, bool bCopy) { return false; }
+
+	bool String(const char* pStr, rapidjson::SizeType iLength, bool bCopy)
+	{
+		if (iLength > 2)
+		{
+			float x, y, z;
+			if (pStr[0] == '[' && pStr[iLength - 1] == ']' && ParseJSONVector(pStr, iLength, x, y, z))
+			{
+				JsonNode& pNode = AddNode(JSONNODE_VECTOR);
+				pNode.pVector[0] = x; pNode.pVector[1] = y; pNode.pVector[2] = z;
+				return true;
+			} else if (pStr[0] == '{' && pStr[iLength - 1] == '}' && ParseJSONVector(pStr, iLength, x, y, z)) {
+				JsonNode& pNode = AddNode(JSONNODE_ANGLE);
+				pNode.pVector[0] = x; pNode.pVector[1] = y; pNode.pVector[2] = z;
+				return true;
+			}
+		}
+
+		return Key(pStr, iLength, bCopy);
+	}
+
+	bool Key(const char* pStr, rapidjson::SizeType iLength, bool bCopy)
+	{
+		JsonNode& pNode = AddNode(JSONNODE_STRING);
+		pNode.pString.iOffset = (unsigned int)(pStr - m_pBase);
+		pNode.pString.iLength = iLength;
+		return true;
+	}
+
+	bool StartObject() { return StartTable(JSONNODE_OBJECT); }
+	bool EndObject(rapidjson::SizeType iMemberCount) { return EndTable(iMemberCount); }
+	bool StartArray() { return StartTable(JSONNODE_ARRAY); }
+	bool EndArray(rapidjson::SizeType iElementCount) { return EndTable(iElementCount); }
+
+private:
+	inline JsonNode& AddNode(JsonNodeType iType)
+	{
+		m_pNodes.emplace_back();
+		JsonNode& pNode = m_pNodes.back();
+		pNode.iType = iType;
+		return pNode;
+	}
+
+	bool StartTable(JsonNodeType iType)
+	{
+		m_pTables.push_back(m_pNodes.size());
+		AddNode(iType);
+		return true;
+	}
+
+	bool EndTable(rapidjson::SizeType iCount)
+	{
+		m_pNodes[m_pTables.back()].iCount = iCount; // Now we know the size so we can presize the table later.
+		m_pTables.pop_back();
+		AddNode(JSONNODE_END);
+		return true;
+	}
+
+	std::vector<JsonNode>& m_pNodes;
+	std::vector<size_t> m_pTables;
+	const char* m_pBase;
+};
+
+static ConVar jsonnodespertick("holylib_util_jsonnodespertick", "50000", FCVAR_ARCHIVE, "The number of JSON values util.AsyncJSONToTable turns into Lua values per tick, 0 = no limit");
+
+class JsonToTableEntry : public IJobEntry
+{
+public:
+	virtual ~JsonToTableEntry()
+	{
+		if (m_pLua && m_iDataReference != -1)
+		{
+			Util::ReferenceFree(m_pLua, m_iDataReference, "JsonToTableEntry(data) - util.AsyncJSONToTable");
+		}
+
+		if (m_pLua && m_iCallback != -1)
+		{
+			Util::ReferenceFree(m_pLua, m_iCallback, "JsonToTableEntry(callback) - util.AsyncJSONToTable");
+		}
+
+		if (m_pLua && m_iTables != -1)
+		{
+			Util::ReferenceFree(m_pLua, m_iTables, "JsonToTableEntry(tables) - util.AsyncJSONToTable");
+		}
+	}
+
+	virtual bool OnThink(GarrysMod::Lua::ILuaInterface* pLua)
+	{
+		if (!m_bIsDone)
+			return false;
+
+		if (pLua != m_pLua)
+		{
+			Error(PROJECT_NAME " - util: Somehow called OnThink for the wrong Lua Interface?!?\n");
+		}
+
+		if (m_bFailed)
+		{
+			Util::ReferencePush(pLua, m_iCallback);
+			pLua->PushNil();
+			pLua->CallFunctionProtected(1, 0, true);
+			return true;
+		}
+
+		return BuildTables(pLua);
+	}
+
+	const char* m_pData = NULL;
+	unsigned int m_iLength = 0;
+	int m_iDataReference = -1;
+	int m_iCallback = -1;
+
+	bool m_bIsDone = false;
+	bool m_bFailed = false;
+	std::vector<char> m_pBuffer;
+	std::vector<JsonNode> m_pNodes;
+
+private:
+	// Helpers since the position of our tables table is absolute.
+	inline void SetTable(GarrysMod::Lua::ILuaInterface* pLua, int iTables, int iDepth)
+	{
+		pLua->PushNumber(iDepth);
+		pLua->Insert(-2);
+		pLua->RawSet(iTables);
+	}
+
+	inline void GetTable(GarrysMod::Lua::ILuaInterface* pLua, int iTables, int iDepth)
+	{
+		pLua->PushNumber(iDepth);
+		pLua->RawGet(iTables);
+	}
+
+	// Pushes the value of the given node, tables are also pushed but stay empty.
+	inline void PushNode(GarrysMod::Lua::ILuaInterface* pLua, const JsonNode& pNode)
+	{
+		switch (pNode.iType)
+		{
+			case JSONNODE_BOOL:
+				pLua->PushBool(pNode.bValue);
+				break;
+			case JSONNODE_NUMBER:
+				pLua->PushNumber(pNode.dNumber);
+				break;
+			case JSONNODE_STRING:
+				pLua->PushString(m_pBuffer.data() + pNode.pString.iOffset, pNode.pString.iLength);
+				break;
+			case JSONNODE_VECTOR:
+				pLua->PushVector(Vector(pNode.pVector[0], pNode.pVector[1], pNode.pVector[2]));
+				break;
+			case JSONNODE_ANGLE:
+				pLua->PushAngle(QAngle(pNode.pVector[0], pNode.pVector[1], pNode.pVector[2]));
+				break;
+			case JSONNODE_OBJECT:
+				pLua->PreCreateTable(0, pNode.iCount);
+				break;
+			case JSONNODE_ARRAY:
+				pLua->PreCreateTable(pNode.iCount, 0);
+				break;
+			default:
+				pLua->PushNil();
+				break;
+		}
+	}
+
+	/*
+	 * Continues building the tables, returns true once it's done and our callback was called.
+	 * All tables we are currently inside of are stored in m_iTables since we can't keep anything on the stack between ticks.
+	 * Between nodes the stack looks like this: m_iTables, current table
+	 */
+	bool BuildTables(GarrysMod::Lua::ILuaInterface* pLua)
+	{
+		if (m_iTables == -1)
+		{
+			pLua->CreateTable();
+			m_iTables = Util::ReferenceCreate(pLua, "JsonToTableEntry - Tables");
+		}
+
+		int iBudget = jsonnodespertick.GetInt();
+		if (iBudget <= 0)
+			iBudget = INT_MAX;
+
+		Util::ReferencePush(pLua, m_iTables);
+		int iTables = pLua->Top();
+		if (!m_pTableIndex.empty())
+			GetTable(pLua, iTables, (int)m_pTableIndex.size());
+
+		bool bFinished = false;
+		while (iBudget-- > 0)
+		{
+			if (m_iNextNode >= m_pNodes.size())
+			{
+				bFinished = true;
+				break;
+			}
+
+			const JsonNode& pNode = m_pNodes[m_iNextNode++];
+			if (m_pTableIndex.empty()) // Root value
+			{
+				if (pNode.iType != JSONNODE_OBJECT && pNode.iType != JSONNODE_ARRAY)
+				{
+					bFinished = true; // The JSON only contained a single value, we always return a table.
+					break;
+				}
+
+				PushNode(pLua, pNode);
+				pLua->Push(-1);
+				SetTable(pLua, iTables, 0); // The root table stays at 0 so that we can get it once we are done.
+				pLua->Push(-1);
+				SetTable(pLua, iTables, 1);
+				m_pTableIndex.push_back(pNode.iType == JSONNODE_ARRAY ? 1 : 0);
+				continue;
+			}
+
+			if (pNode.iType == JSONNODE_END)
+			{
+				pLua->Pop(1);
+				pLua->PushNil();
+				SetTable(pLua, iTables, (int)m_pTableIndex.size()); // Let the GC have it once we are done.
+				m_pTableIndex.pop_back();
+				if (m_pTableIndex.empty())
+				{
+					bFinished = true;
+					break;
+				}
+
+				GetTable(pLua, iTables, (int)m_pTableIndex.size());
+				continue;
+			}
+
+			int& iIndex = m_pTableIndex.back();
+			const JsonNode* pValue = &pNode;
+			if (iIndex == 0) // Objects always have a key node followed by the value node.
+			{
+				PushNode(pLua, pNode);
+				pValue = &m_pNodes[m_iNextNode++];
+			}
+
+			PushNode(pLua, *pValue);
+			bool bTable = pValue->iType == JSONNODE_OBJECT || pValue->iType == JSONNODE_ARRAY;
+			if (bTable)
+			{
+				pLua->Push(-1);
+				SetTable(pLua, iTables, (int)m_pTableIndex.size() + 1);
+			}
+
+			if (iIndex != 0)
+			{
+				if (pLua->IsType(-1, GarrysMod::Lua::Type::Nil))
+					pLua->Pop(1);
+				else
+					Util::RawSetI(pLua, -2, iIndex);
+
+				++iIndex;
+			} else {
+				pLua->RawSet(-3);
+			}
+
+			if (bTable)
+			{
+				m_pTableIndex.push_back(pValue->iType == JSONNODE_ARRAY ? 1 : 0);
+				pLua->Pop(1);
+				GetTable(pLua, iTables, (int)m_pTableIndex.size());
+			}
+		}
+
+		if (!bFinished)
+		{
+			pLua->Pop(pLua->Top() - iTables + 1);
+			return false;
+		}
+
+		pLua->Pop(pLua->Top() - iTables); // Only our tables table is left.
+		GetTable(pLua, iTables, 0);
+		if (pLua->IsType(-1, GarrysMod::Lua::Type::Nil))
+		{
+			pLua->Pop(1);
+			pLua->CreateTable();
+		}
+		pLua->Remove(-2);
+
+		Util::ReferencePush(pLua, m_iCallback);
+		pLua->Push(-2);
+		pLua->Remove(-3);
+		pLua->CallFunctionProtected(1, 0, true);
+
+		return true;
+	}
+
+	virtual void Execute();
+
+	int m_iTables = -1;
+	size_t m_iNextNode = 0;
+	std::vector<int> m_pTableIndex; // The next index of every table we are inside of, 0 for objects.
+};
+
+static void JsonToTableJob(JsonToTableEntry* entry)
+{
+	if (entry->m_bCancel)
+		return;
+
+	// The Lua string is referenced and can't change so we can safely copy it here instead of the main thread.
+	entry->m_pBuffer.assign(entry->m_pData, entry->m_pData + entry->m_iLength + 1);
+	entry->m_pNodes.reserve(entry->m_iLength / 8); // Rough guess to avoid most reallocations.
+
+	JsonNodeHandler handler(entry->m_pNodes, entry->m_pBuffer.data());
+	rapidjson::InsituStringStream stream(entry->m_pBuffer.data());
+	rapidjson::Reader reader;
+	entry->m_bFailed = reader.Parse<rapidjson::kParseInsituFlag>(stream, handler).IsError();
+
+	entry->m_bIsDone = true;
+}
+
+void JsonToTableEntry::Execute()
+{
+	JsonToTableJob(this);
+}
+
+LUA_FUNCTION_STATIC(util_AsyncJSONToTable)
+{
+	const char* pData = LUA->CheckString(1);
+	unsigned int iLength = LUA->ObjLen(1);
+	LUA->CheckType(2, GarrysMod::Lua::Type::Function);
+
+	JsonToTableEntry* entry = new JsonToTableEntry;
+	entry->m_pData = pData;
+	entry->m_iLength = iLength;
+
+	LUA->Push(1);
+	entry->m_iDataReference = Util::ReferenceCreate(LUA, "util.AsyncJSONToTable - Data");
+
+	LUA->Push(2);
+	entry->m_iCallback = Util::ReferenceCreate(LUA, "util.AsyncJSONToTable - Callback");
+	entry->m_pLua = LUA;
+
+	GetLuaData(LUA)->pEntries.push_back(entry);
+
+	g_pModuleManager.GetJobSystem().Queue(entry);
+
+	return 0;
+}
+
+/*
+ * Binary format used by util.TableToBinary & util.BinaryToTable.
+ * It starts with BINARY_ID followed by a single table.
+ * Tables are written as their array part (1 to #tbl) followed by key-value pairs that end with a nil key.
+ * Every string is added to a list so that repeated strings (mostly keys) are written as an index into it.
+ * Numbers & floats are written in the native byte order since both sides are always HolyLib.
+ */
+#define BINARY_ID "HLB\x01" // The last byte is the version
+#define BINARY_ID_LENGTH 4
+#define BINARY_MAX_DEPTH 512
+enum BinaryTag : unsigned char
+{
+	BINARY_NIL = 0x00,
+	BINARY_FALSE = 0x01,
+	BINARY_TRUE = 0x02,
+	BINARY_INT8 = 0x03,
+	BINARY_INT16 = 0x04,
+	BINARY_INT32 = 0x05,
+	BINARY_DOUBLE = 0x06,
+	BINARY_STRING = 0x07, // varint length + data
+	BINARY_STRINGREF = 0x08, // varint index into the string list
+	BINARY_TABLE = 0x09, // varint array size + array values + key-value pairs ending with BINARY_NIL
+	BINARY_VECTOR = 0x0A, // 3 floats
+	BINARY_ANGLE = 0x0B, // 3 floats
+	BINARY_ENTITY = 0x0C, // int16 entity index, -1 for NULL
+	BINARY_BYTEBUFFER = 0x0D, // varint index into the ByteBuffers passed alongside the data, only used by BinaryWriteTable
+	BINARY_FIXINT = 0x80, // 0x80 - 0xFF are the numbers 0 - 127
+};
+
+static inline bool IsBinaryType(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData, int iStackPos)
+{
+	int iType = pLua->GetType(iStackPos);
+	switch (iType)
+	{
+		case GarrysMod::Lua::Type::Bool:
+		case GarrysMod::Lua::Type::Number:
+		case GarrysMod::Lua::Type::String:
+		case GarrysMod::Lua::Type::Table:
+		case GarrysMod::Lua::Type::Vector:
+		case GarrysMod::Lua::Type::Angle:
+		case GarrysMod::Lua::Type::Entity:
+			return true;
+		default:
+			return pData->pBinaryBuffers && Get_ByteBuffer(pLua, iStackPos, false) != NULL;
+	}
+}
+
+static inline void WriteBinaryVarInt(std::string& strOut, unsigned int iValue)
+{
+	while (iValue >= 0x80)
+	{
+		strOut.push_back((char)((iValue & 0x7F) | 0x80));
+		iValue >>= 7;
+	}
+
+	strOut.push_back((char)iValue);
+}
+
+template<class T>
+static inline void WriteBinaryRaw(std::string& strOut, T value)
+{
+	strOut.append((const char*)&value, sizeof(T));
+}
+
+static bool WriteBinaryTable(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData, std::string& strOut);
+
+/*
+ * Writes the value at the top of the stack, unsupported types are written as nil.
+ * ByteBuffers are only supported if pBinaryBuffers is set, they are added to it & only their index is written.
+ * Returns false if a cyclic reference was found and bRecursiveNoError is false.
+ */
+static bool WriteBinaryValue(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData, std::string& strOut)
+{
+	switch (pLua->GetType(-1))
+	{
+		case GarrysMod::Lua::Type::Bool:
+			strOut.push_back(pLua->GetBool(-1) ? BINARY_TRUE : BINARY_FALSE);
+			break;
+		case GarrysMod::Lua::Type::Number:
+			{
+				double pNumber = pLua->GetNumber(-1);
+				if (!IsInt(pNumber))
+				{
+					strOut.push_back(BINARY_DOUBLE);
+					WriteBinaryRaw(strOut, pNumber);
+					break;
+				}
+
+				int iNumber = (int)pNumber;
+				if (iNumber >= 0 && iNumber <= 127) {
+					strOut.push_back((char)(BINARY_FIXINT | iNumber));
+				} else if (iNumber >= INT8_MIN && iNumber <= INT8_MAX) {
+					strOut.push_back(BINARY_INT8);
+					WriteBinaryRaw(strOut, (int8_t)iNumber);
+				} else if (iNumber >= INT16_MIN && iNumber <= INT16_MAX) {
+					strOut.push_back(BINARY_INT16);
+					WriteBinaryRaw(strOut, (int16_t)iNumber);
+				} else {
+					strOut.push_back(BINARY_INT32);
+					WriteBinaryRaw(strOut, (int32_t)iNumber);
+				}
+			}
+			break;
+		case GarrysMod::Lua::Type::String:
+			{
+				unsigned int iLength = 0;
+				const char* pString = pLua->GetString(-1, &iLength);
+
+				// Lua strings are interned, so the same string will always have the same pointer.
+				auto it = pData->pBinaryStrings.find(pString);
+				if (it != pData->pBinaryStrings.end())
+				{
+					strOut.push_back(BINARY_STRINGREF);
+					WriteBinaryVarInt(strOut, it->second);
+					break;
+				}
+
+				unsigned int iIndex = (unsigned int)pData->pBinaryStrings.size();
+				pData->pBinaryStrings[pString] = iIndex;
+				strOut.push_back(BINARY_STRING);
+				WriteBinaryVarInt(strOut, iLength);
+				strOut.append(pString, iLength);
+			}
+			break;
+		case GarrysMod::Lua::Type::Table:
+			return WriteBinaryTable(pLua, pData, strOut);
+		case GarrysMod::Lua::Type::Vector:
+			{
+				Vector* vec = Get_Vector(pLua, -1, true);
+				strOut.push_back(BINARY_VECTOR);
+				WriteBinaryRaw(strOut, vec->x);
+				WriteBinaryRaw(strOut, vec->y);
+				WriteBinaryRaw(strOut, vec->z);
+			}
+			break;
+		case GarrysMod::Lua::Type::Angle:
+			{
+				QAngle* ang = Get_QAngle(pLua, -1, true);
+				strOut.push_back(BINARY_ANGLE);
+				WriteBinaryRaw(strOut, ang->x);
+				WriteBinaryRaw(strOut, ang->y);
+				WriteBinaryRaw(strOut, ang->z);
+			}
+			break;
+		case GarrysMod::Lua::Type::Entity:
+			{
+				// We only read the handle so that this also works on other threads.
+				CBaseHandle* pEntHandle = pLua->GetUserType<CBaseHandle>(-1, GarrysMod::Lua::Type::Entity);
+				strOut.push_back(BINARY_ENTITY);
+				WriteBinaryRaw(strOut, (int16_t)((pEntHandle && pEntHandle->IsValid()) ? pEntHandle->GetEntryIndex() : -1));
+			}
+			break;
+		default:
+			{
+				ByteBuffer* pBuffer = pData->pBinaryBuffers ? Get_ByteBuffer(pLua, -1, false) : NULL;
+				if (!pBuffer)
+				{
+					strOut.push_back(BINARY_NIL);
+					break;
+				}
+
+				strOut.push_back(BINARY_BYTEBUFFER);
+				WriteBinaryVarInt(strOut, (unsigned int)pData->pBinaryBuffers->size());
+				pData->pBinaryBuffers->push_back(new ByteBuffer(pBuffer->pStorage, pBuffer->iOffset, pBuffer->iLength));
+			}
+			break;
+	}
+
+	return true;
+}
+
+static bool WriteBinaryTable(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData, std::string& strOut)
+{
+	const void* pTable = RawLua::GetTablePointer(pLua->GetState(), -1);
+	if (!pData->pRecursiveTables.insert(pTable).second)
+	{
+		if (pData->bRecursiveNoError)
+		{
+			strOut.push_back(BINARY_NIL);
+			return true;
+		}
+
+		return false;
+	}
+
+	int iTable = pLua->Top();
+	int iArraySize = pLua->ObjLen(iTable);
+	strOut.push_back(BINARY_TABLE);
+	WriteBinaryVarInt(strOut, iArraySize);
+	for (int i = 1; i <= iArraySize; ++i)
+	{
+		Util::RawGetI(pLua, -1, i);
+		if (!WriteBinaryValue(pLua, pData, strOut))
+			return false; // The caller will clean up the stack.
+
+		pLua->Pop(1);
+	}
 
-			if (!noSet)
+	pLua->PushNil();
+	while (pLua->Next(iTable)) {
+		int iKeyType = pLua->GetType(-2);
+		if (iKeyType == GarrysMod::Lua::Type::Number)
+		{
+			double iKey = pLua->GetNumber(-2);
+			if (iKey >= 1 && iKey <= iArraySize && (int)iKey == iKey)
 			{
-				pLua->SetTable(-3);
+				pLua->Pop(1); // Already written in the array part
+				continue;
 			}
 		}
-	} else if (jsonValue.IsArray()) {
-		int idx = 0;
-		for (rapidjson::SizeType i = 0; i < jsonValue.Size(); ++i)
+
+		if (!IsBinaryType(pLua, pData, -2) || !IsBinaryType(pLua, pData, -1))
 		{
-			JSONToTableRecursive(pLua, jsonValue[i], true);
-			Util::RawSetI(pLua, -2, ++idx);
+			pLua->Pop(1);
+			continue;
 		}
-	} else if (noSet) {
-		PushJSONValue(pLua, jsonValue);
+
+		pLua->Push(-2);
+		if (!WriteBinaryValue(pLua, pData, strOut))
+			return false;
+		pLua->Pop(1);
+
+		if (!WriteBinaryValue(pLua, pData, strOut))
+			return false;
+		pLua->Pop(1);
 	}
+
+	strOut.push_back(BINARY_NIL);
+	pData->pRecursiveTables.erase(pTable);
+
+	return true;
 }
 
-LUA_FUNCTION_STATIC(util_JSONToTable)
+/*
+ * Serializes the table at the top of the stack into the given string.
+ * The table is left on the stack, even if we fail.
+ */
+static bool TableToBinary(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData, std::string& strOut)
 {
-	const char* jsonString = LUA->CheckString(1);
+	int iTop = pLua->Top();
+	pData->pRecursiveTables.clear();
+	pData->pBinaryStrings.clear();
 
-	rapidjson::Document doc;
-	doc.Parse(jsonString);
+	strOut.append(BINARY_ID, BINARY_ID_LENGTH);
+	bool bSuccess = WriteBinaryTable(pLua, pData, strOut);
 
-	if (doc.HasParseError()) {
-		LUA->ThrowError("Invalid JSON string");
-		return 0;
-    }
+	pLua->Pop(pLua->Top() - iTop);
+	pData->pRecursiveTables.clear();
+	pData->pBinaryStrings.clear();
 
-	LUA->CreateTable();
-	JSONToTableRecursive(LUA, doc);
-	return 1;
+	return bSuccess;
 }
 
-LUA_FUNCTION_STATIC(util_CompressLZ4)
+LUA_FUNCTION_STATIC(util_TableToBinary)
 {
-	const char* pData = LUA->CheckString(1);
-	int iLength = LUA->ObjLen(1);
-	int accelerationLevel = (int)LUA->CheckNumberOpt(2, 1);
+	LUA->CheckType(1, GarrysMod::Lua::Type::Table);
 
-	void* pDest = NULL;
-	unsigned int pDestLen = 0;
-	bool bSuccess = COM_Compress_LZ4(pData, iLength, &pDest, &pDestLen, accelerationLevel);
-	if (!bSuccess)
+	auto pData = GetLuaData(LUA);
+	pData->bRecursiveNoError = LUA->GetBool(2);
+
+	std::string& strOut = pData->pBinaryBuffer;
+	strOut.clear(); // Keeps the memory for the next call.
+
+	LUA->Push(1);
+	if (!TableToBinary(LUA, pData, strOut))
 	{
-		LUA->PushNil();
-		return 1;
+		strOut.clear();
+		LUA->ThrowError("attempt to serialize structure with cyclic reference");
 	}
 
-	LUA->PushString((const char*)pDest, pDestLen);
-	free(pDest);
-	
+	LUA->PushString(strOut.data(), (unsigned int)strOut.size());
+	strOut.clear();
 	return 1;
 }
 
-LUA_FUNCTION_STATIC(util_DecompressLZ4)
+class BinaryReader
 {
-	const char* pData = LUA->CheckString(1);
-	int iLength = LUA->ObjLen(1);
+public:
+	BinaryReader(GarrysMod::Lua::ILuaInterface* pLua, LuaUtilModuleData* pData, const char* pBuffer, unsigned int iLength) : m_pLua(pLua), m_pData(pData)
+	{
+		m_pPos = (const unsigned char*)pBuffer;
+		m_pEnd = m_pPos + iLength;
+		m_pData->pBinaryReadStrings.clear();
+	}
 
-	void* pDest = NULL;
-	unsigned int pDestLen = 0;
-	bool bSuccess = COM_Decompress_LZ4(pData, iLength, &pDest, &pDestLen);
-	if (!bSuccess)
+	~BinaryReader()
 	{
-		LUA->PushNil();
-		return 1;
+		m_pData->pBinaryReadStrings.clear();
+	}
+
+	// Pushes exactly one value on success.
+	bool ReadValue(int iDepth)
+	{
+		unsigned char iTag;
+		if (!ReadRaw(iTag))
+			return false;
+
+		if (iTag & BINARY_FIXINT)
+		{
+			m_pLua->PushNumber(iTag & ~BINARY_FIXINT);
+			return true;
+		}
+
+		switch (iTag)
+		{
+			case BINARY_NIL:
+				m_pLua->PushNil();
+				return true;
+			case BINARY_FALSE:
+			case BINARY_TRUE:
+				m_pLua->PushBool(iTag == BINARY_TRUE);
+				return true;
+			case BINARY_INT8:
+				return ReadNumber<int8_t>();
+			case BINARY_INT16:
+				return ReadNumber<int16_t>();
+			case BINARY_INT32:
+				return ReadNumber<int32_t>();
+			case BINARY_DOUBLE:
+				return ReadNumber<double>();
+			case BINARY_STRING:
+				{
+					unsigned int iLength;
+					if (!ReadVarInt(iLength) || iLength > (unsigned int)(m_pEnd - m_pPos))
+						return false;
+
+					const char* pString = (const char*)m_pPos;
+					m_pPos += iLength;
+					m_pData->pBinaryReadStrings.push_back(std::make_pair(pString, iLength));
+					m_pLua->PushString(pString, iLength);
+					return true;
+				}
+			case BINARY_STRINGREF:
+				{
+					unsigned int iIndex;
+					if (!ReadVarInt(iIndex) || iIndex >= m_pData->pBinaryReadStrings.size())
+						return false;
+
+					auto& pString = m_pData->pBinaryReadStrings[iIndex];
+					m_pLua->PushString(pString.first, pString.second);
+					return true;
+				}
+			case BINARY_TABLE:
+				return ReadTable(iDepth + 1);
+			case BINARY_VECTOR:
+				{
+					Vector vec;
+					if (!ReadRaw(vec.x) || !ReadRaw(vec.y) || !ReadRaw(vec.z))
+						return false;
+
+					m_pLua->PushVector(vec);
+					return true;
+				}
+			case BINARY_ANGLE:
+				{
+					QAngle ang;
+					if (!ReadRaw(ang.x) || !ReadRaw(ang.y) || !ReadRaw(ang.z))
+						return false;
+
+					m_pLua->PushAngle(ang);
+					return true;
+				}
+			case BINARY_ENTITY:
+				{
+					int16_t iIndex;
+					if (!ReadRaw(iIndex))
+						return false;
+
+					if (m_pLua != g_Lua) // Entities only exist in the main Lua state, for example luathreads get the index instead.
+					{
+						m_pLua->PushNumber(iIndex);
+						return true;
+					}
+
+					CBaseEntity* pEntity = NULL;
+					if (iIndex >= 0 && Util::engineserver)
+						pEntity = Util::GetCBaseEntityFromEdict(Util::engineserver->PEntityOfEntIndex(iIndex));
+
+					Util::Push_Entity(m_pLua, pEntity);
+					return true;
+				}
+			case BINARY_BYTEBUFFER:
+				{
+					unsigned int iIndex;
+					if (!ReadVarInt(iIndex) || !m_pData->pBinaryBuffers || iIndex >= m_pData->pBinaryBuffers->size())
+						return false;
+
+					// The buffers stay owned by the caller, so we push a new view of the same storage.
+					ByteBuffer* pBuffer = (*m_pData->pBinaryBuffers)[iIndex];
+					Push_ByteBuffer(m_pLua, new ByteBuffer(pBuffer->pStorage, pBuffer->iOffset, pBuffer->iLength));
+					return true;
+				}
+			default:
+				return false;
+		}
+	}
+
+	bool ReadTable(int iDepth)
+	{
+		if (iDepth > BINARY_MAX_DEPTH)
+			return false;
+
+		unsigned int iArraySize;
+		if (!ReadVarInt(iArraySize) || iArraySize > (unsigned int)(m_pEnd - m_pPos)) // Every value is atleast 1 byte
+			return false;
+
+		m_pLua->PreCreateTable(iArraySize, 0);
+		for (unsigned int i = 1; i <= iArraySize; ++i)
+		{
+			if (!ReadValue(iDepth))
+				return false;
+
+			if (m_pLua->IsType(-1, GarrysMod::Lua::Type::Nil))
+				m_pLua->Pop(1);
+			else
+				Util::RawSetI(m_pLua, -2, i);
+		}
+
+		while (true)
+		{
+			if (m_pPos >= m_pEnd)
+				return false;
+
+			if (*m_pPos == BINARY_NIL)
+			{
+				++m_pPos;
+				return true;
+			}
+
+			if (!ReadValue(iDepth))
+				return false;
+
+			if (m_pLua->IsType(-1, GarrysMod::Lua::Type::Nil) || (m_pLua->IsType(-1, GarrysMod::Lua::Type::Number) && std::isnan(m_pLua->GetNumber(-1))))
+				return false; // Lua would throw an error if we tried to use them as a key.
+
+			if (!ReadValue(iDepth))
+				return false;
+
+			m_pLua->RawSet(-3);
+		}
+	}
+
+	inline bool IsAtEnd()
+	{
+		return m_pPos == m_pEnd;
+	}
+
+private:
+	template<class T>
+	inline bool ReadRaw(T& value)
+	{
+		if ((size_t)(m_pEnd - m_pPos) < sizeof(T))
+			return false;
+
+		memcpy(&value, m_pPos, sizeof(T));
+		m_pPos += sizeof(T);
+		return true;
+	}
+
+	template<class T>
+	inline bool ReadNumber()
+	{
+		T value;
+		if (!ReadRaw(value))
+			return false;
+
+		m_pLua->PushNumber((double)value);
+		return true;
 	}
 
-	LUA->PushString((const char*)pDest, pDestLen);
-	free(pDest);
+	inline bool ReadVarInt(unsigned int& iValue)
+	{
+		iValue = 0;
+		for (int iShift = 0; iShift < 35; iShift += 7)
+		{
+			if (m_pPos >= m_pEnd)
+				return false;
+
+			unsigned char iByte = *m_pPos++;
+			iValue |= (unsigned int)(iByte & 0x7F) << iShift;
+			if (!(iByte & 0x80))
+				return true;
+		}
+
+		return false;
+	}
+
+	GarrysMod::Lua::ILuaInterface* m_pLua;
+	LuaUtilModuleData* m_pData;
+	const unsigned char* m_pPos;
+	const unsigned char* m_pEnd;
+};
+
+bool BinaryPushTable(GarrysMod::Lua::ILuaInterface* LUA, const char* pData, unsigned int iLength, std::vector<ByteBuffer*>* pBuffers)
+{
+	auto pModuleData = GetLuaData(LUA);
+	if (!pModuleData)
+		return false;
+
+	if (iLength < BINARY_ID_LENGTH + 1 || memcmp(pData, BINARY_ID, BINARY_ID_LENGTH) != 0 || (unsigned char)pData[BINARY_ID_LENGTH] != BINARY_TABLE)
+		return false;
+
+	int iTop = LUA->Top();
+	bool bSuccess;
+	pModuleData->pBinaryBuffers = pBuffers;
+	{
+		BinaryReader reader(LUA, pModuleData, pData + BINARY_ID_LENGTH, iLength - BINARY_ID_LENGTH);
+		bSuccess = reader.ReadValue(0) && reader.IsAtEnd();
+	}
+	pModuleData->pBinaryBuffers = NULL;
+
+	if (!bSuccess)
+		LUA->Pop(LUA->Top() - iTop); // We don't know how much is left on the stack.
+
+	return bSuccess;
+}
+
+bool BinaryWriteTable(GarrysMod::Lua::ILuaInterface* LUA, int iStackPos, std::string& strOut, std::vector<ByteBuffer*>* pBuffers)
+{
+	auto pData = GetLuaData(LUA);
+	if (!pData)
+		return false;
+
+	pData->bRecursiveNoError = false;
+	pData->pBinaryBuffers = pBuffers;
+	LUA->Push(iStackPos);
+	bool bSuccess = TableToBinary(LUA, pData, strOut);
+	LUA->Pop(1);
+	pData->pBinaryBuffers = NULL;
+
+	return bSuccess;
+}
+
+LUA_FUNCTION_STATIC(util_BinaryToTable)
+{
+	unsigned int iLength = 0;
+	const char* pData = Get_BinaryData(LUA, 1, iLength);
+	if (!BinaryPushTable(LUA, pData, iLength))
+	{
+		LUA->ThrowError("Invalid binary data");
+		return 0;
+	}
 
 	return 1;
 }
 
-class JsonEntry : public IJobEntry
+class BinaryEntry : public IJobEntry
 {
 public:
-	virtual ~JsonEntry()
+	virtual ~BinaryEntry()
 	{
 		if (m_pLua && m_iReference != -1)
 		{
-			Util::ReferenceFree(m_pLua, m_iReference, "JsonEntry(value) - util.AsyncJson");
+			Util::ReferenceFree(m_pLua, m_iReference, "BinaryEntry(value) - util.AsyncTableToBinary");
 		}
 
 		if (m_pLua && m_iCallback != -1)
 		{
-			Util::ReferenceFree(m_pLua, m_iCallback, "JsonEntry(callback) - util.AsyncJson");
+			Util::ReferenceFree(m_pLua, m_iCallback, "BinaryEntry(callback) - util.AsyncTableToBinary");
 		}
 
 		if (m_pObject)
@@ -612,22 +2231,30 @@ public:
 		}
 
 		Util::ReferencePush(pLua, m_iCallback);
-		pLua->PushString(m_strOut.GetString(), m_strOut.GetLength());
+		pLua->PushString(m_strOut.data(), (unsigned int)m_strOut.size());
 		pLua->CallFunctionProtected(1, 0, true);
 
 		return true;
 	}
 
+	virtual void Execute();
+
+	virtual void CancelJob()
+	{
+		m_bCancel = true;
+		if (g_pModuleManager.GetJobSystem().Cancel(this))
+			RawLua::SetReadOnly(m_pObject, false); // We never ran, so nobody else will undo it.
+	}
+
 	int m_iReference = -1;
 	TValue* m_pObject = NULL;
-	bool m_bPretty = false;
 
 	bool m_bIsDone = false;
-	rapidjson::StringBuffer m_strOut;
+	std::string m_strOut;
 	int m_iCallback = -1;
 };
 
-static void JsonJob(JsonEntry*& entry)
+static void BinaryJob(BinaryEntry* entry)
 {
 	if (entry->m_bCancel)
 	{
@@ -640,50 +2267,26 @@ static void JsonJob(JsonEntry*& entry)
 	LuaUtilModuleData pData;
 	pData.bRecursiveNoError = true;
 
-	pData.iRecursiveStartTop = LUA->Top();
 	RawLua::PushTValue(LUA->GetState(), entry->m_pObject);
-	LUA->PushNil();
-
-	rapidjson::Document doc;
-	TableToJSONRecursive(LUA, &pData, doc, doc.GetAllocator());
-
-	if (entry->m_bCancel)
-	{
-		Lua::DestroyInterface(LUA);
-		RawLua::SetReadOnly(entry->m_pObject, false);
-		return;
-	}
-
-	if (entry->m_bPretty)
-	{
-		rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(entry->m_strOut);
-		writer.SetIndent('\t', 1);
-		doc.Accept(writer);
-	} else {
-		rapidjson::Writer<rapidjson::StringBuffer> writer(entry->m_strOut);
-		doc.Accept(writer);
-	}
+	TableToBinary(LUA, &pData, entry->m_strOut);
+	LUA->Pop(1);
 
 	Lua::DestroyInterface(LUA);
 	RawLua::SetReadOnly(entry->m_pObject, false);
 
-	entry->m_bIsDone = true;
+	if (!entry->m_bCancel)
+		entry->m_bIsDone = true;
 }
 
-inline void StartJsonThread()
+void BinaryEntry::Execute()
 {
-	if (pJsonPool)
-		return;
-
-	pJsonPool = V_CreateThreadPool();
-	Util::StartThreadPool(pJsonPool, jsonthreads.GetInt());
+	BinaryJob(this);
 }
 
-LUA_FUNCTION_STATIC(util_AsyncTableToJSON)
+LUA_FUNCTION_STATIC(util_AsyncTableToBinary)
 {
 	LUA->CheckType(1, GarrysMod::Lua::Type::Table);
 	LUA->CheckType(2, GarrysMod::Lua::Type::Function);
-	bool bPretty = LUA->GetBool(3);
 
 	LUA->GetField(GarrysMod::Lua::INDEX_REGISTRY, "HOLYLIB_LUAJIT");
 	if (!LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
@@ -694,24 +2297,21 @@ LUA_FUNCTION_STATIC(util_AsyncTableToJSON)
 	}
 	LUA->Pop(1);
 
-	JsonEntry* entry = new JsonEntry;
-	entry->m_bPretty = bPretty;
+	BinaryEntry* entry = new BinaryEntry;
 
 	LUA->Push(2);
-	entry->m_iCallback = LUA->ReferenceCreate();
+	entry->m_iCallback = Util::ReferenceCreate(LUA, "util.AsyncTableToBinary - Callback");
 
 	LUA->Push(1);
 	entry->m_pObject = RawLua::CopyTValue(LUA->GetState(), RawLua::index2adr(LUA->GetState(), -1));
-	entry->m_iReference = LUA->ReferenceCreate();
+	entry->m_iReference = Util::ReferenceCreate(LUA, "util.AsyncTableToBinary - Table");
 	entry->m_pLua = LUA;
 
 	RawLua::SetReadOnly(entry->m_pObject, true);
 
 	GetLuaData(LUA)->pEntries.push_back(entry);
 
-	StartJsonThread();
-
-	pJsonPool->QueueCall(JsonJob, entry);
+	g_pModuleManager.GetJobSystem().Queue(entry);
 
 	return 0;
 }
@@ -750,6 +2350,20 @@ void CUtilModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServerInit)
 
 	Lua::GetLuaData(pLua)->SetModuleData(m_pID, new LuaUtilModuleData);
 
+	Lua::GetLuaData(pLua)->RegisterMetaTable(Lua::ByteBuffer, pLua->CreateMetaTable("ByteBuffer"));
+		Util::AddFunc(pLua, ByteBuffer__tostring, "__tostring");
+		Util::AddFunc(pLua, ByteBuffer__index, "__index");
+		Util::AddFunc(pLua, ByteBuffer__newindex, "__newindex");
+		Util::AddFunc(pLua, ByteBuffer__gc, "__gc");
+		Util::AddFunc(pLua, ByteBuffer_GetSize, "__len");
+		Util::AddFunc(pLua, ByteBuffer_GetTable, "GetTable");
+		Util::AddFunc(pLua, ByteBuffer_IsValid, "IsValid");
+		Util::AddFunc(pLua, ByteBuffer_GetSize, "GetSize");
+		Util::AddFunc(pLua, ByteBuffer_Slice, "Slice");
+		Util::AddFunc(pLua, ByteBuffer_Copy, "Copy");
+		Util::AddFunc(pLua, ByteBuffer_ToString, "ToString");
+	pLua->Pop(1);
+
 	if (Util::PushTable(pLua, "util"))
 	{
 		Util::AddFunc(pLua, util_AsyncCompress, "AsyncCompress");
@@ -759,7 +2373,11 @@ void CUtilModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServerInit)
 		Util::AddFunc(pLua, util_CompressLZ4, "CompressLZ4");
 		Util::AddFunc(pLua, util_DecompressLZ4, "DecompressLZ4");
 		Util::AddFunc(pLua, util_AsyncTableToJSON, "AsyncTableToJSON");
-		// Util::AddFunc(pLua, util_AsyncJSONToTable, "AsyncJSONToTable");
+		Util::AddFunc(pLua, util_CreateByteBuffer, "CreateByteBuffer");
+		Util::AddFunc(pLua, util_TableToBinary, "TableToBinary");
+		Util::AddFunc(pLua, util_BinaryToTable, "BinaryToTable");
+		Util::AddFunc(pLua, util_AsyncTableToBinary, "AsyncTableToBinary");
+		Util::AddFunc(pLua, util_AsyncJSONToTable, "AsyncJSONToTable");
 		Util::PopTable(pLua);
 	}
 }
@@ -770,20 +2388,7 @@ void CUtilModule::LuaShutdown(GarrysMod::Lua::ILuaInterface* pLua)
 
 	for (IJobEntry* entry : pData->pEntries)
 	{
-		entry->m_bCancel = true;
-	}
-
-	if (pCompressPool)
-		pCompressPool->ExecuteAll();
-
-	if (pDecompressPool)
-		pDecompressPool->ExecuteAll();
-
-	if (pJsonPool)
-		pJsonPool->ExecuteAll();
-
-	for (IJobEntry* entry : pData->pEntries)
-	{
+		entry->CancelJob();
 		delete entry;
 	}
 	pData->pEntries.clear();
@@ -797,6 +2402,10 @@ void CUtilModule::LuaShutdown(GarrysMod::Lua::ILuaInterface* pLua)
 		Util::RemoveField(pLua, "DecompressLZ4");
 		Util::RemoveField(pLua, "AsyncTableToJSON");
 		Util::RemoveField(pLua, "AsyncJSONToTable");
+		Util::RemoveField(pLua, "CreateByteBuffer");
+		Util::RemoveField(pLua, "TableToBinary");
+		Util::RemoveField(pLua, "BinaryToTable");
+		Util::RemoveField(pLua, "AsyncTableToBinary");
 		Util::PopTable(pLua);
 	}
 }
@@ -811,26 +2420,17 @@ void CUtilModule::LuaThink(GarrysMod::Lua::ILuaInterface* pLua)
 
 	for(auto it = pData->pEntries.begin(); it != pData->pEntries.end(); )
 	{
+		if (!Lua::CanRunJobCallback(pLua))
+			break;
+
 		IJobEntry* entry = *it;
-		if (entry->OnThink(pLua))
+		if (entry->IsJobIdle() && entry->OnThink(pLua))
 		{
+			Lua::OnJobCallback(pLua);
 			delete entry;
 			it = pData->pEntries.erase(it);
 		} else {
 			it++;
 		}
 	}
-}
-
-void CUtilModule::Shutdown()
-{
-	if (pCompressPool)
-	{
-		V_DestroyThreadPool(pCompressPool);
-		V_DestroyThreadPool(pDecompressPool);
-		V_DestroyThreadPool(pJsonPool);
-		pCompressPool = NULL;
-		pDecompressPool = NULL;
-		pJsonPool = NULL;
-	}
 }
\ No newline at end of file
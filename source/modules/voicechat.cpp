@@ -9,8 +9,13 @@
 #include "steam/isteamclient.h"
 #include <isteamutils.h>
 #include "unordered_set"
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <climits>
 #include "server.h"
 #include "ivoiceserver.h"
+#include "playerinfomanager.h"
 #define private public // Try me.
 #include "shareddefs.h"
 #include "voice_gamemgr.h"
@@ -31,6 +36,7 @@ public:
 	virtual void Shutdown() OVERRIDE;
 	virtual void InitDetour(bool bPreServer) OVERRIDE;
 	virtual void LuaThink(GarrysMod::Lua::ILuaInterface* pLua) OVERRIDE;
+	virtual void OnClientDisconnect(CBaseClient* pClient) OVERRIDE;
 	virtual void PreLuaModuleLoaded(lua_State* L, const char* pFileName) OVERRIDE;
 	virtual void PostLuaModuleLoaded(lua_State* L, const char* pFileName) OVERRIDE;
 	virtual const char* Name() { return "voicechat"; };
@@ -40,19 +46,6 @@ public:
 
 static ConVar voicechat_hooks("holylib_voicechat_hooks", "1", 0);
 
-static IThreadPool* pVoiceThreadPool = NULL;
-static void OnVoiceThreadsChange(IConVar* convar, const char* pOldValue, float flOldValue)
-{
-	if (!pVoiceThreadPool)
-		return;
-
-	pVoiceThreadPool->ExecuteAll();
-	pVoiceThreadPool->Stop();
-	Util::StartThreadPool(pVoiceThreadPool, ((ConVar*)convar)->GetInt());
-}
-
-static ConVar voicechat_threads("holylib_voicechat_threads", "1", FCVAR_ARCHIVE, "The number of threads to use for voicechat.LoadVoiceStream and voicechat.SaveVoiceStream if you specify async", OnVoiceThreadsChange);
-
 static CVoiceChatModule g_pVoiceChatModule;
 IModule* pVoiceChatModule = &g_pVoiceChatModule;
 
@@ -65,10 +58,14 @@ struct VoiceData
 
 	inline void AllocData()
 	{
+		if (pData && iCapacity >= iLength)
+			return; // Our current buffer is big enough, no need to reallocate.
+
 		if (pData)
 			delete[] pData;
 
 		pData = new char[iLength]; // We won't need additional space right?
+		iCapacity = iLength;
 	}
 
 	inline void SetData(const char* pNewData, int iNewLength)
@@ -78,9 +75,20 @@ struct VoiceData
 		memcpy(pData, pNewData, iLength);
 	}
 
+	// Resets everything except our buffer so that the VoiceData can be reused.
+	inline void Reset()
+	{
+		iPlayerSlot = 0;
+		iLength = 0;
+		bProximity = true;
+	}
+
+	static VoiceData* Acquire();
+	static void Free(VoiceData* pVoiceData);
+
 	inline VoiceData* CreateCopy()
 	{
-		VoiceData* data = new VoiceData;
+		VoiceData* data = VoiceData::Acquire();
 		data->bProximity = bProximity;
 		data->iPlayerSlot = iPlayerSlot;
 		data->SetData(pData, iLength);
@@ -91,9 +99,196 @@ struct VoiceData
 	int iPlayerSlot = 0; // What if it's an invalid one ;D (It doesn't care.......)
 	char* pData = NULL;
 	int iLength = 0;
+	int iCapacity = 0; // Size of the pData buffer which can be larger than iLength
 	bool bProximity = true;
 };
 
+/*
+ * Freelist for VoiceData so that we don't allocate a new VoiceData & buffer for every copy Lua makes.
+ * It's only used on the main thread, any other thread will simply allocate/delete them normally.
+ */
+#define VOICEDATA_POOL_SIZE 256
+#define VOICEDATA_POOL_MAXBUFFER 8192 // Bigger buffers aren't kept as they were most likely created for a wave file or so.
+static std::vector<VoiceData*> g_pVoiceDataPool;
+VoiceData* VoiceData::Acquire()
+{
+	if (!ThreadInMainThread() || g_pVoiceDataPool.empty())
+		return new VoiceData;
+
+	VoiceData* pVoiceData = g_pVoiceDataPool.back();
+	g_pVoiceDataPool.pop_back();
+	return pVoiceData;
+}
+
+void VoiceData::Free(VoiceData* pVoiceData)
+{
+	if (!pVoiceData)
+		return;
+
+	if (!ThreadInMainThread() || g_pVoiceDataPool.size() >= VOICEDATA_POOL_SIZE || pVoiceData->iCapacity > VOICEDATA_POOL_MAXBUFFER)
+	{
+		delete pVoiceData;
+		return;
+	}
+
+	pVoiceData->Reset();
+	g_pVoiceDataPool.push_back(pVoiceData);
+}
+
+static void ClearVoiceDataPool()
+{
+	for (VoiceData* pVoiceData : g_pVoiceDataPool)
+		delete pVoiceData;
+
+	g_pVoiceDataPool.clear();
+}
+
+/*
+ * Native DSP kernels used for voice data.
+ * They work on raw buffers & reuse their scratch memory instead of going through copies of std::vector for every sample.
+ */
+static void VoiceDSP_LowPassFilter(const int16_t* pIn, size_t nSamples, int16_t* pOut)
+{
+	if (nSamples < 3)
+	{
+		memcpy(pOut, pIn, nSamples * sizeof(int16_t));
+		return;
+	}
+
+	pOut[0] = pIn[0];
+	for (size_t i = 1; i < nSamples - 1; ++i)
+		pOut[i] = (int16_t)(((int32_t)pIn[i - 1] + 2 * (int32_t)pIn[i] + (int32_t)pIn[i + 1]) / 4); // Can never leave the int16 range.
+
+	pOut[nSamples - 1] = pIn[nSamples - 1];
+}
+
+/*
+ * Catmull-Rom resampler.
+ * Output sample i is taken at the input position i * iInRate / iOutRate, so packets that are resampled on their own
+ * keep their timing when they're joined together. Taps outside of the input repeat the edge samples.
+ */
+static void VoiceDSP_ResampleCubic(const int16_t* pIn, size_t nSamples, int iInRate, int iOutRate, std::vector<int16_t>& pOut)
+{
+	if (nSamples == 0 || iInRate <= 0 || iOutRate <= 0)
+	{
+		pOut.clear();
+		return;
+	}
+
+	size_t nOutSamples = (size_t)((uint64_t)nSamples * iOutRate / iInRate);
+
+	// Padded copy so that the taps never need a bounds check.
+	thread_local std::vector<float> pPadded;
+	pPadded.resize(nSamples + 3);
+	for (size_t i = 0; i < nSamples; ++i)
+		pPadded[i + 1] = pIn[i];
+
+	pPadded[0] = pIn[0];
+	pPadded[nSamples + 1] = pIn[nSamples - 1];
+	pPadded[nSamples + 2] = pIn[nSamples - 1];
+
+	pOut.resize(nOutSamples);
+	const double flStep = (double)iInRate / iOutRate;
+	const float* pSrc = pPadded.data();
+	int16_t* pDst = pOut.data();
+	for (size_t i = 0; i < nOutSamples; ++i)
+	{
+		double flPos = i * flStep; // Always below nSamples
+		size_t iIdx = (size_t)flPos;
+		float t = (float)(flPos - iIdx);
+		const float* pTap = pSrc + iIdx; // pTap[1] is our sample at iIdx
+
+		float y0 = pTap[0], y1 = pTap[1], y2 = pTap[2], y3 = pTap[3];
+		float flVal = 0.5f * ((2.0f * y1) +
+			(-y0 + y2) * t +
+			(2.0f * y0 - 5.0f * y1 + 4.0f * y2 - y3) * t * t +
+			(-y0 + 3.0f * y1 - 3.0f * y2 + y3) * t * t * t);
+
+		flVal = flVal > 32767.0f ? 32767.0f : (flVal < -32768.0f ? -32768.0f : flVal);
+		pDst[i] = (int16_t)flVal;
+	}
+}
+
+/*
+ * Native Steam voice codec.
+ * Uses our bundled Opus codec instead of ISteamUser so it works without Steam.
+ * Every thread has its own codec & scratch buffers that are reused.
+ */
+#define VOICE_CODEC_SCRATCHSIZE 65536 // 32k samples, more than any voice packet sent by a client can hold. Longer ones from SetUncompressedData grow it.
+#define VOICE_CODEC_MAXFRAMEBYTES 1280 // Max opus frame size (1275) + our frame header
+struct VoiceCodecState
+{
+	SteamOpus::Opus_FrameDecoder pCodec;
+	std::vector<char> pScratch;
+	std::vector<int16_t> pResampled;
+};
+
+static VoiceCodecState& GetVoiceCodecState()
+{
+	static thread_local VoiceCodecState pState;
+	return pState;
+}
+
+/*
+ * Decodes the given Steam voice packet into 16-bit mono PCM at the given samplerate.
+ * If pCodec is given it's used instead of resetting the thread's codec, this allows one to keep the state across multiple packets.
+ * Returns false if the packet was corrupted.
+ */
+static bool VoiceCodec_Decode(const char* pData, int iLength, int iSampleRate, std::vector<int16_t>& pOut, SteamOpus::Opus_FrameDecoder* pCodec = NULL)
+{
+	VoiceCodecState& pState = GetVoiceCodecState();
+	if (!pCodec)
+	{
+		pCodec = &pState.pCodec;
+		pCodec->ResetState();
+	}
+
+	size_t nScratchSize = (size_t)SteamVoice::GetFrameCount(pData, iLength) * FRAME_SIZE_GMOD * sizeof(int16_t);
+	pState.pScratch.resize(MAX(nScratchSize, (size_t)VOICE_CODEC_SCRATCHSIZE));
+	int iBytes = SteamVoice::DecompressIntoBuffer(pCodec, pData, iLength, pState.pScratch.data(), (int)pState.pScratch.size());
+	if (iBytes < 0)
+		return false;
+
+	const int16_t* pSamples = (const int16_t*)pState.pScratch.data();
+	size_t nSamples = iBytes / sizeof(int16_t);
+	if (iSampleRate == SAMPLERATE_GMOD_OPUS)
+	{
+		pOut.assign(pSamples, pSamples + nSamples);
+	} else {
+		VoiceDSP_ResampleCubic(pSamples, nSamples, SAMPLERATE_GMOD_OPUS, iSampleRate, pOut);
+	}
+
+	return true;
+}
+
+/*
+ * Encodes the given 16-bit mono PCM into a Steam voice packet.
+ * Returns the number of bytes written into pOut or -1 on failure.
+ */
+static int VoiceCodec_Encode(uint64 steamID64, const int16_t* pSamples, size_t nSamples, int iSampleRate, std::vector<char>& pOut)
+{
+	VoiceCodecState& pState = GetVoiceCodecState();
+	if (iSampleRate != SAMPLERATE_GMOD_OPUS)
+	{
+		VoiceDSP_ResampleCubic(pSamples, nSamples, iSampleRate, SAMPLERATE_GMOD_OPUS, pState.pResampled);
+		pSamples = pState.pResampled.data();
+		nSamples = pState.pResampled.size();
+	}
+
+	pOut.resize(64 + ((nSamples / FRAME_SIZE_GMOD) + 1) * VOICE_CODEC_MAXFRAMEBYTES);
+	pState.pCodec.ResetState();
+	return SteamVoice::CompressIntoBuffer(steamID64, &pState.pCodec, (const char*)pSamples, (int)(nSamples * sizeof(int16_t)), pOut.data(), (int)pOut.size(), SAMPLERATE_GMOD_OPUS, true);
+}
+
+static uint64 GetVoiceSteamID(int iPlayerSlot)
+{
+	CBaseClient* pClient = Util::GetClientByIndex(iPlayerSlot);
+	if (!pClient)
+		return 0;
+
+	return pClient->GetNetworkID().steamid.ConvertToUint64(); // Crash any% speedrun
+}
+
 Push_LuaClass(VoiceData)
 Get_LuaClass(VoiceData, "VoiceData")
 
@@ -116,9 +311,7 @@ Default__index(VoiceData);
 Default__newindex(VoiceData);
 Default__GetTable(VoiceData);
 Default__gc(VoiceData,
-	VoiceData* pVoiceData = (VoiceData*)pStoredData;
-	if (pVoiceData)
-		delete pVoiceData;
+	VoiceData::Free((VoiceData*)pStoredData);
 )
 
 LUA_FUNCTION_STATIC(VoiceData_IsValid)
@@ -151,6 +344,17 @@ LUA_FUNCTION_STATIC(VoiceData_GetData)
 {
 	VoiceData* pData = Get_VoiceData(LUA, 1, true);
 
+	if (LUA->GetBool(2))
+	{
+		// Our buffer is reused by the VoiceData pool, so the ByteBuffer needs its own copy.
+		void* pBuffer = malloc(pData->iLength);
+		if (pData->iLength > 0)
+			memcpy(pBuffer, pData->pData, pData->iLength);
+
+		Push_ByteBuffer(LUA, pBuffer, pData->iLength);
+		return 1;
+	}
+
 	LUA->PushString(pData->pData, pData->iLength);
 
 	return 1;
@@ -159,11 +363,8 @@ LUA_FUNCTION_STATIC(VoiceData_GetData)
 LUA_FUNCTION_STATIC(VoiceData_GetUncompressedData)
 {
 	VoiceData* pData = Get_VoiceData(LUA, 1, true);
-	int iSize = (int)LUA->CheckNumberOpt(2, 20000); // How many bytes to allocate for the decompressed version. 20000 is default
-
-	ISteamUser* pSteamUser = Util::GetSteamUser();
-	if (!pSteamUser)
-		LUA->ThrowError("Failed to get SteamUser!\n");
+	int iSize = (int)LUA->CheckNumberOpt(2, 20000); // Max number of bytes we return. 20000 is default
+	int iSampleRate = (int)LUA->CheckNumberOpt(3, 44100);
 
 	if (!pData->pData || pData->iLength == 0)
 	{
@@ -171,24 +372,24 @@ LUA_FUNCTION_STATIC(VoiceData_GetUncompressedData)
 		return 1;
 	}
 
-	uint32 pDecompressedLength;
-	char* pDecompressed = new char[iSize];
-	int returnCode = pSteamUser->DecompressVoice(
-		pData->pData, pData->iLength,
-		pDecompressed, iSize,
-		&pDecompressedLength, 44100
-	);
+	if (iSampleRate <= 0)
+		LUA->ThrowError("Invalid sampleRate!");
 
-	if (returnCode != k_EVoiceResultOK)
+	thread_local std::vector<int16_t> pDecompressed;
+	if (!VoiceCodec_Decode(pData->pData, pData->iLength, iSampleRate, pDecompressed))
 	{
-		delete[] pDecompressed; // Lua will already have a copy of it.
-		LUA->PushNumber(returnCode);
+		LUA->PushNumber(k_EVoiceResultDataCorrupted);
 		return 1;
 	}
 
-	LUA->PushString(pDecompressed, pDecompressedLength);
-	delete[] pDecompressed; // Lua will already have a copy of it.
+	int iBytes = (int)(pDecompressed.size() * sizeof(int16_t));
+	if (iBytes > iSize)
+	{
+		LUA->PushNumber(k_EVoiceResultBufferTooSmall);
+		return 1;
+	}
 
+	LUA->PushString((const char*)pDecompressed.data(), iBytes);
 	return 1;
 }
 
@@ -197,35 +398,18 @@ LUA_FUNCTION_STATIC(VoiceData_SetUncompressedData)
 	VoiceData* pData = Get_VoiceData(LUA, 1, true);
 	const char* pUncompressedData = LUA->CheckString(2);
 	int iSize = LUA->ObjLen(2);
+	int iSampleRate = (int)LUA->CheckNumberOpt(3, 44100);
 
-	ISteamUser* pSteamUser = Util::GetSteamUser();
-	if (!pSteamUser)
-		LUA->ThrowError("Failed to get SteamUser!\n");
-
-	if (!pData->pData || pData->iLength == 0)
-	{
-		LUA->PushString("");
-		return 1;
-	}
-
-	char* pCompressed = new char[iSize];
-	CBaseClient* pClient = Util::GetClientByIndex(pData->iPlayerSlot);
-	uint64 steamID64 = 0;
-	if (pClient)
-	{
-		steamID64 = pClient->GetNetworkID().steamid.ConvertToUint64(); // Crash any% speedrun
-	}
+	if (iSampleRate <= 0)
+		LUA->ThrowError("Invalid sampleRate!");
 
-	SteamOpus::Opus_FrameDecoder g_pOpusDecoder;
-	int pBytes = SteamVoice::CompressIntoBuffer(steamID64, &g_pOpusDecoder, pUncompressedData, iSize, pCompressed, 20000, 44100);
+	thread_local std::vector<char> pCompressed;
+	int pBytes = VoiceCodec_Encode(GetVoiceSteamID(pData->iPlayerSlot), (const int16_t*)pUncompressedData, iSize / sizeof(int16_t), iSampleRate, pCompressed);
 	if (pBytes != -1)
 	{
-		// Instead of calling SetData which copies it, we set it directly to avoid any additional copying.
-		pData->pData = pCompressed;
-		pData->iLength = pBytes;
+		pData->SetData(pCompressed.data(), pBytes);
 		LUA->PushBool(true);
 	} else {
-		delete[] pCompressed;
 		LUA->PushBool(false);
 	}
 
@@ -263,8 +447,9 @@ LUA_FUNCTION_STATIC(VoiceData_SetData)
 {
 	VoiceData* pData = Get_VoiceData(LUA, 1, true);
 
-	const char* pStr = LUA->CheckString(2);
-	int iLength = LUA->ObjLen(2);
+	unsigned int iDataLength = 0;
+	const char* pStr = Get_BinaryData(LUA, 2, iDataLength);
+	int iLength = (int)iDataLength;
 	if (LUA->IsType(3, GarrysMod::Lua::Type::Number))
 	{
 		int iNewLength = (int)LUA->GetNumber(3);
@@ -326,15 +511,22 @@ Default__gc(WavAudioFile,
 
 static const int VOICESTREAM_VERSION_1 = 1;
 static const int VOICESTREAM_VERSION = 1; // Current version
-struct VoiceStream {
-	~VoiceStream()
-	{
-		for (auto& [_, val] : pVoiceData)
-			delete val;
+/*
+ * A single voice frame inside a VoiceStream.
+ * The payload itself lives inside the VoiceStream's arena at iOffset.
+ */
+struct VoiceFrame
+{
+	int iTick;
+	unsigned int iOffset;
+	int iLength;
+	int iPlayerSlot;
+	bool bProximity;
 
-		pVoiceData.clear();
-	}
+	inline bool operator<(const VoiceFrame& other) const { return iTick < other.iTick; }
+};
 
+struct VoiceStream {
 	/*
 	 * VoiceStream file structure:
 	 * 
@@ -349,103 +541,136 @@ struct VoiceStream {
 	 */
 	void Save(FileHandle_t fh)
 	{
-		// Create a copy so that the main thread can still party on it.
-		std::unordered_map<int, VoiceData*> voiceDataEnties = pVoiceData;
-
-		g_pFullFileSystem->Write(&VOICESTREAM_VERSION, sizeof(int), fh);
-
-		int tickRate = std::ceil(1 / gpGlobals->interval_per_tick);
-		g_pFullFileSystem->Write(&tickRate, sizeof(int), fh);
-
-		int count = (int)voiceDataEnties.size();
-		g_pFullFileSystem->Write(&count, sizeof(int), fh); // First write the total number of voice data
-
-		for (auto& [tickNumber, voiceData] : voiceDataEnties)
+		std::vector<char> pBuffer;
 		{
-			g_pFullFileSystem->Write(&tickNumber, sizeof(int), fh);
+			// We only hold the lock while serializing so that the main thread can still party on it while we write.
+			std::lock_guard<std::mutex> lock(m_pMutex);
+			pBuffer.reserve(sizeof(int) * 3 + m_pFrames.size() * sizeof(int) * 2 + m_pArena.size());
 
-			int length = voiceData->iLength;
-			char* data = voiceData->pData;
+			WriteInt(pBuffer, VOICESTREAM_VERSION);
+			WriteInt(pBuffer, (int)std::ceil(1 / gpGlobals->interval_per_tick));
+			WriteInt(pBuffer, (int)m_pFrames.size()); // First write the total number of voice data
 
-			g_pFullFileSystem->Write(&length, sizeof(int), fh);
-			g_pFullFileSystem->Write(data, length, fh);
+			for (const VoiceFrame& pFrame : m_pFrames)
+			{
+				WriteInt(pBuffer, pFrame.iTick);
+				WriteInt(pBuffer, pFrame.iLength);
+				pBuffer.insert(pBuffer.end(), m_pArena.data() + pFrame.iOffset, m_pArena.data() + pFrame.iOffset + pFrame.iLength);
+			}
 		}
+
+		g_pFullFileSystem->Write(pBuffer.data(), (int)pBuffer.size(), fh);
 	}
 
 	static VoiceStream* Load(FileHandle_t fh)
 	{
-		VoiceStream* pStream = new VoiceStream;
+		int iSize = (int)g_pFullFileSystem->Size(fh) - (int)g_pFullFileSystem->Tell(fh);
+		if (iSize < (int)sizeof(int))
+			return NULL;
+
+		std::vector<char> pBuffer(iSize);
+		iSize = g_pFullFileSystem->Read(pBuffer.data(), iSize, fh);
+
+		const char* pPos = pBuffer.data();
+		const char* pEnd = pPos + iSize;
 
 		int version;
-		g_pFullFileSystem->Read(&version, sizeof(int), fh);
+		if (!ReadInt(pPos, pEnd, version))
+			return NULL;
 
 		double scaleRate = 1;
 		int count = version;
 		if (version == VOICESTREAM_VERSION_1) // Were doing this to stay compatible with the older version in the 0.7 release.
 		{
 			int tickRate;
-			g_pFullFileSystem->Read(&tickRate, sizeof(int), fh);
+			if (!ReadInt(pPos, pEnd, tickRate) || tickRate <= 0)
+				return NULL;
 
 			int serverTickRate = std::ceil(1 / gpGlobals->interval_per_tick);
-			scaleRate = std::ceil(serverTickRate / tickRate);
+			scaleRate = (double)serverTickRate / tickRate; // Can be below 1 if the stream had a higher tickrate than us.
 
 			count = 0;
-			g_pFullFileSystem->Read(&count, sizeof(int), fh);
+			if (!ReadInt(pPos, pEnd, count))
+				return NULL;
 		} else if (version < VOICESTREAM_VERSION) {
-			delete pStream;
 			return NULL;
 		}
 
-		for (int i=0; i<count; ++i)
+		VoiceStream* pStream = new VoiceStream;
+		if (count > 0)
 		{
-			int tickNumber;
-			g_pFullFileSystem->Read(&tickNumber, sizeof(int), fh);
-
-			int length;
-			g_pFullFileSystem->Read(&length, sizeof(int), fh);
+			pStream->m_pFrames.reserve(count);
+			pStream->m_pArena.reserve(iSize); // The payload can never be bigger than the file.
+		}
 
-			char* data = new char[length];
-			g_pFullFileSystem->Read(data, length, fh);
+		for (int i=0; i<count; ++i)
+		{
+			int tickNumber, length;
+			if (!ReadInt(pPos, pEnd, tickNumber) || !ReadInt(pPos, pEnd, length) || length < 0 || length > (pEnd - pPos))
+			{
+				if (g_pVoiceChatModule.InDebug() == 1)
+				{
+					Warning(PROJECT_NAME " - voicechat - Load: truncated VoiceStream! (%i/%i entries)\n", i, count);
+				}
+				break;
+			}
 
-			VoiceData* voiceData = new VoiceData;
-			voiceData->iLength = length;
-			voiceData->pData = data;
+			VoiceFrame pFrame;
+			pFrame.iTick = (int)std::ceil(tickNumber * scaleRate);
+			pFrame.iOffset = (unsigned int)pStream->m_pArena.size();
+			pFrame.iLength = length;
+			pFrame.iPlayerSlot = 0;
+			pFrame.bProximity = true;
+			pStream->m_pArena.insert(pStream->m_pArena.end(), pPos, pPos + length);
+			pStream->m_pFrames.push_back(pFrame);
+			pPos += length;
+		}
 
-			pStream->SetIndex(std::ceil(tickNumber * scaleRate), voiceData);
+		// Sort it once instead of inserting sorted, if a tick exists multiple times the last one wins like it did with SetIndex.
+		std::stable_sort(pStream->m_pFrames.begin(), pStream->m_pFrames.end());
+		auto& pFrames = pStream->m_pFrames;
+		size_t iWrite = 0;
+		for (size_t iRead = 0; iRead < pFrames.size(); ++iRead)
+		{
+			if (iWrite > 0 && pFrames[iWrite - 1].iTick == pFrames[iRead].iTick)
+			{
+				pStream->m_iWastedBytes += pFrames[iWrite - 1].iLength;
+				pFrames[iWrite - 1] = pFrames[iRead];
+			} else {
+				pFrames[iWrite++] = pFrames[iRead];
+			}
 		}
+		pFrames.resize(iWrite);
 
 		return pStream;
 	}
 
 	/*WavAudioFile**/ void SaveWave(FileHandle_t fh)
 	{
-		ISteamUser* pSteamUser = Util::GetSteamUser();
-		if (!pSteamUser)
-			return; // NULL;
-
-		const int sampleRate = 44100;
+		const int sampleRate = SAMPLERATE_GMOD_OPUS; // Our codec's native rate, so we don't need to resample anything.
 		const int bytesPerSample = 2; // 16-bit mono
-		std::map<int, VoiceData*> sorted(pVoiceData.begin(), pVoiceData.end());
 
-		std::vector<char> wavePCM;
-		uint32_t uncompressedLength = 40000;
-		char* uncompressed = new char[uncompressedLength];
-		const float intervalPerTick = gpGlobals->interval_per_tick;
-		for (auto& [tick, voiceData] : sorted)
+		// Take a snapshot so that we don't block the main thread while decompressing everything.
+		std::vector<VoiceFrame> pFrames;
+		std::vector<char> pArena;
 		{
-			uint32_t uncompressedWritten = 0;
-			EVoiceResult res = pSteamUser->DecompressVoice(
-				voiceData->pData, voiceData->iLength,
-				uncompressed, uncompressedLength,
-				&uncompressedWritten, sampleRate
-			);
+			std::lock_guard<std::mutex> lock(m_pMutex);
+			pFrames = m_pFrames;
+			pArena = m_pArena;
+		}
 
-			if (res != k_EVoiceResultOK && res != k_EVoiceResultBufferTooSmall)
+		// One codec for the entire stream since the frames are continuous and it can then properly handle lost frames.
+		SteamOpus::Opus_FrameDecoder pCodec;
+		std::vector<int16_t> pDecompressed;
+		std::vector<char> wavePCM;
+		for (const VoiceFrame& pFrame : pFrames) // Already sorted by tick.
+		{
+			if (!VoiceCodec_Decode(pArena.data() + pFrame.iOffset, pFrame.iLength, sampleRate, pDecompressed, &pCodec))
 				continue;
 
-			wavePCM.insert(wavePCM.end(), uncompressed, uncompressed + uncompressedWritten);
+			const char* pPCM = (const char*)pDecompressed.data();
+			wavePCM.insert(wavePCM.end(), pPCM, pPCM + pDecompressed.size() * sizeof(int16_t));
 		}
-		delete[] uncompressed;
 
 		int dataSize = wavePCM.size();
 		int byteRate = sampleRate * bytesPerSample;
@@ -491,64 +716,6 @@ struct VoiceStream {
 		return; // wav;
 	}
 
-	static double CatmullRom(double y0, double y1, double y2, double y3, double t) {
-		return 0.5 * ((2 * y1) +
-			(-y0 + y2) * t +
-			(2 * y0 - 5 * y1 + 4 * y2 - y3) * t * t +
-			(-y0 + 3 * y1 - 3 * y2 + y3) * t * t * t);
-	}
-
-	static std::vector<int16_t> LowPassFilter(const std::vector<int16_t>& in) {
-		if (in.size() < 3) return in;
-
-		std::vector<int16_t> out(in.size());
-		out[0] = in[0];
-		for (size_t i = 1; i < in.size() - 1; ++i) {
-			int32_t val = (in[i - 1] + 2 * in[i] + in[i + 1]) / 4;
-			out[i] = static_cast<int16_t>(std::clamp(val, -32768, 32767));
-		}
-		out.back() = in.back();
-		return out;
-	}
-
-	static std::vector<int16_t> ResampleCubic(const std::vector<int16_t>& in, int inRate, int outRate) {
-		if (in.empty() || inRate <= 0 || outRate <= 0) return {};
-
-		double scale = static_cast<double>(outRate) / inRate;
-		size_t outCount = static_cast<size_t>(in.size() * scale);
-		if (outCount < 2) outCount = 2;
-
-		std::vector<int16_t> out(outCount);
-
-		auto getSample = [&](int64_t idx) -> int16_t {
-			if (idx < 0) return in[std::min<size_t>(-idx, in.size() - 1)];
-			if (static_cast<size_t>(idx) >= in.size())
-				return in[std::max<size_t>(2 * in.size() - idx - 2, 0)];
-			return in[idx];
-		};
-
-		double ratio = static_cast<double>(in.size() - 1) / (outCount - 1);
-
-		for (size_t i = 0; i < outCount; ++i) {
-			double src = i * ratio;
-			int64_t idx = static_cast<int64_t>(src);
-			double t = src - idx;
-
-			int16_t y0 = getSample(idx - 1);
-			int16_t y1 = getSample(idx);
-			int16_t y2 = getSample(idx + 1);
-			int16_t y3 = getSample(idx + 2);
-
-			double val = CatmullRom(y0, y1, y2, y3, t);
-			if (val > 32767.0) val = 32767.0;
-			else if (val < -32768.0) val = -32768.0;
-
-			out[i] = static_cast<int16_t>(val);
-		}
-
-		return out;
-	}
-
 	/*static std::vector<int16_t> ResampleLinear(const std::vector<int16_t>& in, int inRate, int outRate) {
 		if (in.empty() || inRate <= 0 || outRate <= 0) return {};
 
@@ -639,9 +806,10 @@ struct VoiceStream {
 			return NULL;
 		}
 
-		std::vector<int16_t> monoPCM;
 		const char* input = pcmData.data();
 		int totalFrames = header.dataSize / (inputBytesPerSample * inputChannels);
+		std::vector<int16_t> monoPCM;
+		monoPCM.reserve(totalFrames);
 
 		for (int i = 0; i < totalFrames; ++i) {
 			int64_t left = 0, right = 0;
@@ -695,7 +863,9 @@ struct VoiceStream {
 		}
 
 		if (sampleRate != SAMPLERATE_GMOD_OPUS) {
-			monoPCM = ResampleCubic(LowPassFilter(monoPCM), sampleRate, SAMPLERATE_GMOD_OPUS);
+			std::vector<int16_t> filteredPCM(monoPCM.size());
+			VoiceDSP_LowPassFilter(monoPCM.data(), monoPCM.size(), filteredPCM.data());
+			VoiceDSP_ResampleCubic(filteredPCM.data(), filteredPCM.size(), sampleRate, SAMPLERATE_GMOD_OPUS, monoPCM);
 			sampleRate = SAMPLERATE_GMOD_OPUS;
 		}
 
@@ -738,7 +908,7 @@ struct VoiceStream {
 				continue;
 			}
 			
-			VoiceData* existing = pStream->GetIndex(tickIndex);
+			const VoiceFrame* existing = pStream->GetFrame(tickIndex);
 			if (existing) {
 				std::vector<char> combinedPCM;
 				combinedPCM.resize(32000);
@@ -746,7 +916,7 @@ struct VoiceStream {
 				char* decompressTarget = combinedPCM.data();
 				int maxDecompressed = combinedPCM.size();
 				SteamOpus::Opus_FrameDecoder mergeCodec;
-				int samplesOld = SteamVoice::DecompressIntoBuffer(&mergeCodec, existing->pData, existing->iLength, decompressTarget, maxDecompressed);
+				int samplesOld = SteamVoice::DecompressIntoBuffer(&mergeCodec, pStream->GetFrameData(existing), existing->iLength, decompressTarget, maxDecompressed);
 				if (samplesOld < 0) {
 					if (g_pVoiceChatModule.InDebug() == 1)
 					{
@@ -777,7 +947,7 @@ struct VoiceStream {
 				);
 
 				if (mergedLen > 0) {
-					existing->SetData(mergedCompressed, mergedLen);
+					pStream->SetIndex(tickIndex, mergedCompressed, mergedLen);
 				} else {
 					if (g_pVoiceChatModule.InDebug() == 1)
 					{
@@ -785,9 +955,7 @@ struct VoiceStream {
 					}
 				}
 			} else {
-				VoiceData* voiceData = new VoiceData;
-				voiceData->SetData(recompressBuffer, bytesWritten);
-				pStream->SetIndex(tickIndex, voiceData);
+				pStream->SetIndex(tickIndex, recompressBuffer, bytesWritten);
 			}
 
 			offset += thisChunkSamples;
@@ -798,31 +966,83 @@ struct VoiceStream {
 	}
 
 	/*
-	 * If you push it to Lua, call ->CreateCopy() on the VoiceData,
-	 * we CANT push the VoiceData we store as else the GC will do funnies & crash.
+	 * Returns the frame for the given tick or NULL, it's a binary search so O(log n).
+	 * The returned frame is only valid until the VoiceStream is modified!
+	 */
+	inline const VoiceFrame* GetFrame(int tick)
+	{
+		auto it = std::lower_bound(m_pFrames.begin(), m_pFrames.end(), VoiceFrame{tick});
+		if (it == m_pFrames.end() || it->iTick != tick)
+			return NULL;
+
+		return &(*it);
+	}
+
+	/*
+	 * Returns the first frame with a tick >= the given tick or NULL.
 	 */
-	inline VoiceData* GetIndex(int index)
+	inline const VoiceFrame* GetNextFrame(int tick)
 	{
-		auto it = pVoiceData.find(index);
-		if (it == pVoiceData.end())
+		auto it = std::lower_bound(m_pFrames.begin(), m_pFrames.end(), VoiceFrame{tick});
+		if (it == m_pFrames.end())
 			return NULL;
 
-		return it->second;
+		return &(*it);
+	}
+
+	inline const char* GetFrameData(const VoiceFrame* pFrame)
+	{
+		return m_pArena.data() + pFrame->iOffset;
 	}
 
 	/*
-	 * We assume that the given VoiceData was NEVER pushed to Lua.
+	 * Returns a new VoiceData containing a copy of the given tick which can be pushed to Lua.
 	 */
-	inline void SetIndex(int index, VoiceData* pData)
+	inline VoiceData* CreateVoiceData(int tick)
+	{
+		std::lock_guard<std::mutex> lock(m_pMutex);
+		const VoiceFrame* pFrame = GetFrame(tick);
+		if (!pFrame)
+			return NULL;
+
+		return CreateVoiceData(pFrame);
+	}
+
+	inline void SetIndex(int tick, const char* pData, int iLength, int iPlayerSlot = 0, bool bProximity = true)
 	{
-		auto it = pVoiceData.find(index);
-		if (it != pVoiceData.end())
+		std::lock_guard<std::mutex> lock(m_pMutex);
+		auto it = std::lower_bound(m_pFrames.begin(), m_pFrames.end(), VoiceFrame{tick});
+		if (it != m_pFrames.end() && it->iTick == tick)
 		{
-			delete it->second;
-			pVoiceData.erase(it);
+			it->iPlayerSlot = iPlayerSlot;
+			it->bProximity = bProximity;
+			if (iLength <= it->iLength) // Fits into the old space so we just overwrite it.
+			{
+				memcpy(m_pArena.data() + it->iOffset, pData, iLength);
+				m_iWastedBytes += it->iLength - iLength;
+				it->iLength = iLength;
+				return;
+			}
+
+			m_iWastedBytes += it->iLength;
+			it->iOffset = AppendToArena(pData, iLength);
+			it->iLength = iLength;
+			CompactIfNeeded();
+			return;
 		}
 
-		pVoiceData[index] = pData;
+		VoiceFrame pFrame;
+		pFrame.iTick = tick;
+		pFrame.iOffset = AppendToArena(pData, iLength);
+		pFrame.iLength = iLength;
+		pFrame.iPlayerSlot = iPlayerSlot;
+		pFrame.bProximity = bProximity;
+		m_pFrames.insert(it, pFrame); // Recording appends at the end most of the time so this is normally cheap.
+	}
+
+	inline void SetIndex(int tick, const VoiceData* pData)
+	{
+		SetIndex(tick, pData->pData, pData->iLength, pData->iPlayerSlot, pData->bProximity);
 	}
 
 	/*
@@ -830,23 +1050,76 @@ struct VoiceStream {
 	 */
 	inline void CreateLuaTable(GarrysMod::Lua::ILuaInterface* pLua)
 	{
-		pLua->PreCreateTable(0, pVoiceData.size());
-			for (auto& [tickCount, voiceData] : pVoiceData)
+		std::lock_guard<std::mutex> lock(m_pMutex);
+		pLua->PreCreateTable(0, m_pFrames.size());
+			for (const VoiceFrame& pFrame : m_pFrames)
 			{
-				Push_VoiceData(pLua, voiceData->CreateCopy());
-				Util::RawSetI(pLua, -2, tickCount);
+				Push_VoiceData(pLua, CreateVoiceData(&pFrame));
+				Util::RawSetI(pLua, -2, pFrame.iTick);
 			}
 	}
 
 	inline int GetCount()
 	{
-		return (int)pVoiceData.size();
+		return (int)m_pFrames.size();
 	}
 
 private:
-	// key = tickcount
-	// value = VoiceData
-	std::unordered_map<int, VoiceData*> pVoiceData;
+	inline VoiceData* CreateVoiceData(const VoiceFrame* pFrame)
+	{
+		VoiceData* pData = VoiceData::Acquire();
+		pData->iPlayerSlot = pFrame->iPlayerSlot;
+		pData->bProximity = pFrame->bProximity;
+		pData->SetData(m_pArena.data() + pFrame->iOffset, pFrame->iLength);
+		return pData;
+	}
+
+	inline unsigned int AppendToArena(const char* pData, int iLength)
+	{
+		unsigned int iOffset = (unsigned int)m_pArena.size();
+		m_pArena.insert(m_pArena.end(), pData, pData + iLength);
+		return iOffset;
+	}
+
+	// Once more than half of our arena is unused because of replaced frames we rebuild it.
+	inline void CompactIfNeeded()
+	{
+		if (m_iWastedBytes < 4096 || m_iWastedBytes < m_pArena.size() / 2)
+			return;
+
+		std::vector<char> pNewArena;
+		pNewArena.reserve(m_pArena.size() - m_iWastedBytes);
+		for (VoiceFrame& pFrame : m_pFrames)
+		{
+			unsigned int iOffset = (unsigned int)pNewArena.size();
+			pNewArena.insert(pNewArena.end(), m_pArena.data() + pFrame.iOffset, m_pArena.data() + pFrame.iOffset + pFrame.iLength);
+			pFrame.iOffset = iOffset;
+		}
+
+		m_pArena.swap(pNewArena);
+		m_iWastedBytes = 0;
+	}
+
+	static inline void WriteInt(std::vector<char>& pBuffer, int iValue)
+	{
+		const char* pValue = (const char*)&iValue;
+		pBuffer.insert(pBuffer.end(), pValue, pValue + sizeof(int));
+	}
+
+	static inline bool ReadInt(const char*& pPos, const char* pEnd, int& iValue)
+	{
+		if ((pEnd - pPos) < (int)sizeof(int))
+			return false;
+
+		memcpy(&iValue, pPos, sizeof(int));
+		pPos += sizeof(int);
+		return true;
+	}
+
+	std::vector<VoiceFrame> m_pFrames; // Sorted by tick
+	std::vector<char> m_pArena; // Contains the payload of all frames
+	size_t m_iWastedBytes = 0; // Bytes inside the arena that are no longer used by any frame
+	std::mutex m_pMutex;
 };
 
 Push_LuaClass(VoiceStream)
@@ -913,56 +1186,499 @@ LUA_FUNCTION_STATIC(VoiceStream_SetData)
 
 		if (data)
 		{
-			pStream->SetIndex(tick, data->CreateCopy());
+			pStream->SetIndex(tick, data);
+		}
+
+		LUA->Pop(1);
+	}
+	LUA->Pop(1);
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(VoiceStream_GetCount)
+{
+	VoiceStream* pStream = Get_VoiceStream(LUA, 1, true);
+
+	LUA->PushNumber(pStream->GetCount());
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(VoiceStream_GetIndex)
+{
+	VoiceStream* pStream = Get_VoiceStream(LUA, 1, true);
+	int index = (int)LUA->CheckNumber(2);
+
+	Push_VoiceData(LUA, pStream->CreateVoiceData(index));
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(VoiceStream_SetIndex)
+{
+	VoiceStream* pStream = Get_VoiceStream(LUA, 1, true);
+	int index = (int)LUA->CheckNumber(2);
+	VoiceData* pData = Get_VoiceData(LUA, 3, true);
+
+	pStream->SetIndex(index, pData);
+	return 0;
+}
+
+/*
+ * Native VoiceStream playback.
+ * Each playback sends the frames of its VoiceStream on the server tick they belong to, without going through Lua.
+ * Frames that are late are still sent, frames that are later than holylib_voicechat_playbackmaxdelay are dropped.
+ */
+static ConVar voicechat_playbackmaxdelay("holylib_voicechat_playbackmaxdelay", "4", FCVAR_ARCHIVE, "How many ticks a VoiceStream frame can be late before it's dropped instead of being sent");
+
+struct VoicePlayback
+{
+	~VoicePlayback()
+	{
+		if (iStreamReference != -1)
+		{
+			Util::ReferenceFree(g_Lua, iStreamReference, "VoicePlayback - VoiceStream");
+			iStreamReference = -1;
+		}
+	}
+
+	int iID = 0;
+	VoiceStream* pStream = NULL;
+	int iStreamReference = -1; // A reference to the pStream to stop the GC from kicking in.
+
+	bool bAllRecipients = true;
+	std::vector<int> pRecipients; // Player slots
+
+	int iPlayerSlot = -1; // -1 = Use the slot stored in the frame
+	int iStartTick = 0; // Server tick at which the first frame of the stream is played.
+	int iFirstStreamTick = 0; // Tick of the first frame inside the stream.
+	int iNextStreamTick = 0; // Next stream tick we still need to play.
+	double flScale = 1; // Scales stream ticks to server ticks.
+
+	int iSent = 0;
+	int iLate = 0;
+	int iDropped = 0;
+};
+
+static std::vector<VoicePlayback*> g_pVoicePlaybacks;
+static int g_iNextVoicePlaybackID = 1;
+
+static VoicePlayback* FindVoicePlayback(int iID)
+{
+	for (VoicePlayback* pPlayback : g_pVoicePlaybacks)
+		if (pPlayback->iID == iID)
+			return pPlayback;
+
+	return NULL;
+}
+
+static void PushVoicePlaybackStats(GarrysMod::Lua::ILuaInterface* pLua, VoicePlayback* pPlayback, bool bFinished)
+{
+	pLua->CreateTable();
+		Util::AddValue(pLua, pPlayback->iSent, "sent");
+		Util::AddValue(pLua, pPlayback->iLate, "late");
+		Util::AddValue(pLua, pPlayback->iDropped, "dropped");
+		Util::AddValue(pLua, pPlayback->iStartTick, "startTick");
+		pLua->PushBool(bFinished);
+		pLua->SetField(-2, "finished");
+}
+
+static inline void SendVoicePlaybackFrame(VoicePlayback* pPlayback, const VoiceFrame* pFrame)
+{
+	SVC_VoiceData voiceData;
+	voiceData.m_nFromClient = pPlayback->iPlayerSlot != -1 ? pPlayback->iPlayerSlot : pFrame->iPlayerSlot;
+	voiceData.m_nLength = pFrame->iLength * 8; // In Bits...
+	voiceData.m_DataOut = (void*)pPlayback->pStream->GetFrameData(pFrame);
+	voiceData.m_bProximity = pFrame->bProximity;
+	voiceData.m_xuid = 0;
+
+	if (pPlayback->bAllRecipients)
+	{
+		int iClientCount = Util::server->GetClientCount();
+		for (int i = 0; i < iClientCount; ++i)
+		{
+			IClient* pClient = Util::server->GetClient(i);
+			if (pClient && pClient->IsActive())
+				pClient->SendNetMsg(voiceData);
+		}
+	} else {
+		for (int iSlot : pPlayback->pRecipients)
+		{
+			CBaseClient* pClient = Util::GetClientByIndex(iSlot);
+			if (pClient && pClient->IsActive())
+				pClient->SendNetMsg(voiceData);
+		}
+	}
+}
+
+/*
+ * Returns true once the playback has no more frames left.
+ */
+static bool UpdateVoicePlayback(VoicePlayback* pPlayback, int iServerTick)
+{
+	int iMaxDelay = voicechat_playbackmaxdelay.GetInt();
+	while (true)
+	{
+		const VoiceFrame* pFrame = pPlayback->pStream->GetNextFrame(pPlayback->iNextStreamTick);
+		if (!pFrame)
+			return true;
+
+		int iTargetTick = pPlayback->iStartTick + (int)((pFrame->iTick - pPlayback->iFirstStreamTick) * pPlayback->flScale);
+		if (iTargetTick > iServerTick)
+			return false;
+
+		pPlayback->iNextStreamTick = pFrame->iTick + 1;
+		int iDelay = iServerTick - iTargetTick;
+		if (iDelay > iMaxDelay)
+		{
+			++pPlayback->iDropped;
+			continue;
+		}
+
+		if (iDelay > 0)
+			++pPlayback->iLate;
+
+		++pPlayback->iSent;
+		SendVoicePlaybackFrame(pPlayback, pFrame);
+	}
+}
+
+static void UpdateVoicePlaybacks()
+{
+	if (g_pVoicePlaybacks.empty())
+		return;
+
+	VPROF_BUDGET("HolyLib - VoiceStream Playback", VPROF_BUDGETGROUP_HOLYLIB);
+
+	int iServerTick = gpGlobals->tickcount;
+	std::vector<VoicePlayback*> pFinished;
+	for (auto it = g_pVoicePlaybacks.begin(); it != g_pVoicePlaybacks.end(); )
+	{
+		VoicePlayback* pPlayback = *it;
+		if (!UpdateVoicePlayback(pPlayback, iServerTick))
+		{
+			it++;
+			continue;
+		}
+
+		pFinished.push_back(pPlayback);
+		it = g_pVoicePlaybacks.erase(it);
+	}
+
+	// Called after the loop since Lua could start/stop a playback inside the hook.
+	for (VoicePlayback* pPlayback : pFinished)
+	{
+		if (Lua::PushHook("HolyLib:OnVoiceStreamFinished"))
+		{
+			g_Lua->PushNumber(pPlayback->iID);
+			PushVoicePlaybackStats(g_Lua, pPlayback, true);
+			g_Lua->CallFunctionProtected(3, 0, true);
+		}
+
+		delete pPlayback;
+	}
+}
+
+static void ClearVoicePlaybacks()
+{
+	for (VoicePlayback* pPlayback : g_pVoicePlaybacks)
+		delete pPlayback;
+
+	g_pVoicePlaybacks.clear();
+}
+
+LUA_FUNCTION_STATIC(VoiceStream_Play)
+{
+	VoiceStream* pStream = Get_VoiceStream(LUA, 1, true);
+	if (LUA != g_Lua)
+		LUA->ThrowError("VoiceStream:Play can only be used on the main Lua state!");
+
+	VoicePlayback* pPlayback = new VoicePlayback;
+	if (LUA->IsType(2, GarrysMod::Lua::Type::Table))
+	{
+		pPlayback->bAllRecipients = false;
+		LUA->Push(2);
+		LUA->PushNil();
+		while (LUA->Next(-2))
+		{
+			CBasePlayer* pPlayer = Util::Get_Player(LUA, -1, false);
+			if (pPlayer)
+				pPlayback->pRecipients.push_back(pPlayer->edict()->m_EdictIndex-1);
+
+			LUA->Pop(1);
+		}
+		LUA->Pop(1);
+	} else if (!LUA->IsType(2, GarrysMod::Lua::Type::Nil)) {
+		CBasePlayer* pPlayer = Util::Get_Player(LUA, 2, false);
+		if (!pPlayer)
+		{
+			delete pPlayback;
+			LUA->ThrowError("Invalid recipients! Expected a table, a player or nil");
+		}
+
+		pPlayback->bAllRecipients = false;
+		pPlayback->pRecipients.push_back(pPlayer->edict()->m_EdictIndex-1);
+	}
+
+	pPlayback->iStartTick = (int)LUA->CheckNumberOpt(3, gpGlobals->tickcount);
+	pPlayback->iPlayerSlot = (int)LUA->CheckNumberOpt(4, -1);
+
+	// Same scaling as VoiceStream::Load does for files of a different tickrate.
+	if (LUA->IsType(5, GarrysMod::Lua::Type::Number))
+	{
+		int tickRate = (int)LUA->GetNumber(5);
+		if (tickRate <= 0)
+		{
+			delete pPlayback;
+			LUA->ThrowError("Invalid tickRate!");
+		}
+
+		int serverTickRate = std::ceil(1 / gpGlobals->interval_per_tick);
+		pPlayback->flScale = (double)serverTickRate / tickRate;
+	}
+
+	const VoiceFrame* pFirstFrame = pStream->GetNextFrame(INT_MIN);
+	pPlayback->iFirstStreamTick = pFirstFrame ? pFirstFrame->iTick : 0;
+	pPlayback->iNextStreamTick = pPlayback->iFirstStreamTick;
+	pPlayback->pStream = pStream;
+	pPlayback->iID = g_iNextVoicePlaybackID++;
+
+	LUA->Push(1);
+	pPlayback->iStreamReference = Util::ReferenceCreate(LUA, "VoiceStream:Play - VoiceStream");
+
+	g_pVoicePlaybacks.push_back(pPlayback);
+	LUA->PushNumber(pPlayback->iID);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(voicechat_StopPlayback)
+{
+	int iID = (int)LUA->CheckNumber(1);
+	for (auto it = g_pVoicePlaybacks.begin(); it != g_pVoicePlaybacks.end(); ++it)
+	{
+		if ((*it)->iID != iID)
+			continue;
+
+		delete *it;
+		g_pVoicePlaybacks.erase(it);
+		LUA->PushBool(true);
+		return 1;
+	}
+
+	LUA->PushBool(false);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(voicechat_IsPlaying)
+{
+	LUA->PushBool(FindVoicePlayback((int)LUA->CheckNumber(1)) != NULL);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(voicechat_GetPlaybackStats)
+{
+	VoicePlayback* pPlayback = FindVoicePlayback((int)LUA->CheckNumber(1));
+	if (!pPlayback)
+	{
+		LUA->PushNil();
+		return 1;
+	}
+
+	PushVoicePlaybackStats(LUA, pPlayback, false);
+	return 1;
+}
+
+static CPlayerBitVec* g_PlayerModEnable;
+static CPlayerBitVec* g_BanMasks;
+static CPlayerBitVec* g_SentGameRulesMasks;
+static CPlayerBitVec* g_SentBanMasks;
+static CPlayerBitVec* g_bWantModEnable;
+static double g_fLastPlayerTalked[ABSOLUTE_PLAYER_LIMIT] = {0};
+static double g_fLastPlayerUpdated[ABSOLUTE_PLAYER_LIMIT] = {0};
+static bool g_bIsPlayerTalking[ABSOLUTE_PLAYER_LIMIT] = {0};
+static CVoiceGameMgr* g_pManager = NULL;
+static ConVar voicechat_updateinterval("holylib_voicechat_updateinterval", "0.1", FCVAR_ARCHIVE, "How often we call PlayerCanHearPlayersVoice for the actively talking players. This interval is unique to each player");
+static ConVar voicechat_managerupdateinterval("holylib_voicechat_managerupdateinterval", "0.1", FCVAR_ARCHIVE, "How often we loop through all players to check their voice states. We still check the player's interval to reduce calls if they already have been updated in the last x(your defined interval) seconds.");
+static ConVar voicechat_stopdelay("holylib_voicechat_stopdelay", "1", FCVAR_ARCHIVE, "How many seconds before a player is marked as stopped talking");
+static ConVar voicechat_canhearhimself("holylib_voicechat_canhearhimself", "1", FCVAR_ARCHIVE, "If enabled, we assume the player can always hear himself and thus we save one call for PlayerCanHearPlayersVoice");
+/*
+ * Native proximity voice routing.
+ * If enabled using voicechat.SetProximityRules, we decide who can hear whom in C++ instead of calling GM:PlayerCanHearPlayersVoice.
+ * Each tick a voice update happens, all players are bucketed into a uniform 2D grid (cell size = distance),
+ * so that for a talking player we only need to check the 3x3 cells around him.
+ * Players flagged using voicechat.SetProximityCustom still go through GM:PlayerCanHearPlayersVoice.
+ */
+enum ProximityTeamMode
+{
+	PROXIMITY_TEAM_NONE = 0, // Teams are ignored.
+	PROXIMITY_TEAM_ONLY = 1, // Players can only hear players in the same team.
+	PROXIMITY_TEAM_GLOBAL = 2, // Players can always hear players in the same team, anyone else only by distance.
+};
+
+struct ProximityRules
+{
+	bool bEnabled = false;
+	float flDistance = 0.0f; // 0 = No distance limit
+	bool bProximity = true; // If the voice should be 3D
+	int iTeamMode = PROXIMITY_TEAM_NONE;
+};
+
+struct VoiceGridEntry
+{
+	uint64 iCell;
+	int iClient;
+
+	inline bool operator<(const VoiceGridEntry& other) const { return iCell < other.iCell; }
+};
+
+static ProximityRules g_pProximityRules;
+static bool g_bProximityCustom[ABSOLUTE_PLAYER_LIMIT] = {0};
+static bool g_bVoiceGridValid[ABSOLUTE_PLAYER_LIMIT] = {0};
+static Vector g_vecVoiceGridOrigin[ABSOLUTE_PLAYER_LIMIT];
+static int g_iVoiceGridTeam[ABSOLUTE_PLAYER_LIMIT] = {0};
+static std::vector<VoiceGridEntry> g_pVoiceGrid;
+static int g_iVoiceGridTick = -1;
+static IPlayerInfoManager* g_pPlayerInfoManager = NULL;
+
+static inline uint64 GetVoiceGridCell(int x, int y)
+{
+	return ((uint64)(uint32)x << 32) | (uint32)y;
+}
+
+static inline void GetVoiceGridCoords(const Vector& vecOrigin, int& x, int& y)
+{
+	float flCellSize = g_pProximityRules.flDistance;
+	x = (int)floorf(vecOrigin.x / flCellSize);
+	y = (int)floorf(vecOrigin.y / flCellSize);
+}
+
+static void BuildVoiceGrid()
+{
+	if (g_iVoiceGridTick == gpGlobals->tickcount)
+		return;
+
+	g_iVoiceGridTick = gpGlobals->tickcount;
+	g_pVoiceGrid.clear();
+	bool bUseGrid = g_pProximityRules.flDistance > 0.0f;
+	for (int iClient = 0; iClient < ABSOLUTE_PLAYER_LIMIT; ++iClient)
+	{
+		g_bVoiceGridValid[iClient] = false;
+		if (iClient >= g_pManager->m_nMaxPlayers)
+			continue;
+
+		edict_t* pEdict = Util::engineserver->PEntityOfEntIndex(iClient + 1);
+		CBaseEntity* pEnt = Util::GetCBaseEntityFromEdict(pEdict);
+		if (!pEnt || !pEnt->IsPlayer())
+			continue;
+
+		IPlayerInfo* pInfo = g_pPlayerInfoManager ? g_pPlayerInfoManager->GetPlayerInfo(pEdict) : NULL;
+		g_bVoiceGridValid[iClient] = true;
+		g_vecVoiceGridOrigin[iClient] = pEnt->GetAbsOrigin();
+		g_iVoiceGridTeam[iClient] = pInfo ? pInfo->GetTeamIndex() : 0;
+
+		if (bUseGrid)
+		{
+			int x, y;
+			GetVoiceGridCoords(g_vecVoiceGridOrigin[iClient], x, y);
+			g_pVoiceGrid.push_back({GetVoiceGridCell(x, y), iClient});
+		}
+	}
+
+	std::sort(g_pVoiceGrid.begin(), g_pVoiceGrid.end());
+}
+
+static inline bool CanHearByTeam(int iListener, int iSpeaker)
+{
+	if (g_pProximityRules.iTeamMode == PROXIMITY_TEAM_ONLY)
+		return g_iVoiceGridTeam[iListener] == g_iVoiceGridTeam[iSpeaker];
+
+	return true;
+}
+
+static bool CallCanPlayerHearPlayer(int iListener, CBasePlayer* pSpeaker, bool& bProximity)
+{
+	CBaseEntity* pEnt = Util::GetCBaseEntityFromEdict(Util::engineserver->PEntityOfEntIndex(iListener + 1));
+	if (!pEnt || !pEnt->IsPlayer())
+		return false;
+
+	return g_pManager->m_pHelper->CanPlayerHearPlayer((CBasePlayer*)pEnt, pSpeaker, bProximity);
+}
+
+static void BuildProximityMask(CBasePlayer* pPlayer, int iClient, bool bCanHearHimself, CPlayerBitVec& gameRulesMask, CPlayerBitVec& proximityMask)
+{
+	BuildVoiceGrid();
+	if (!g_bVoiceGridValid[iClient])
+		return;
+
+	bool bUseGrid = g_pProximityRules.flDistance > 0.0f;
+	bool bTeamGlobal = g_pProximityRules.iTeamMode == PROXIMITY_TEAM_GLOBAL;
+	for (int iOtherClient = 0; iOtherClient < g_pManager->m_nMaxPlayers; ++iOtherClient)
+	{
+		if (!g_bVoiceGridValid[iOtherClient])
+			continue;
+
+		if (bCanHearHimself && iOtherClient == iClient)
+		{
+			gameRulesMask[iOtherClient] = true;
+			proximityMask[iOtherClient] = false;
+			continue;
+		}
+
+		if (g_bProximityCustom[iClient] || g_bProximityCustom[iOtherClient])
+		{
+			bool bProximity = false;
+			if (CallCanPlayerHearPlayer(iOtherClient, pPlayer, bProximity))
+			{
+				gameRulesMask[iOtherClient] = true;
+				proximityMask[iOtherClient] = bProximity;
+			}
+			continue;
+		}
+
+		if (!bUseGrid && CanHearByTeam(iOtherClient, iClient))
+		{
+			gameRulesMask[iOtherClient] = true;
+			proximityMask[iOtherClient] = g_pProximityRules.bProximity;
+			continue;
+		}
+
+		if (bTeamGlobal && g_iVoiceGridTeam[iOtherClient] == g_iVoiceGridTeam[iClient])
+		{
+			gameRulesMask[iOtherClient] = true;
+			proximityMask[iOtherClient] = false; // Possibly overridden below if they are also close enough.
 		}
-
-		LUA->Pop(1);
 	}
-	LUA->Pop(1);
-	return 0;
-}
-
-LUA_FUNCTION_STATIC(VoiceStream_GetCount)
-{
-	VoiceStream* pStream = Get_VoiceStream(LUA, 1, true);
 
-	LUA->PushNumber(pStream->GetCount());
-	return 1;
-}
+	if (!bUseGrid)
+		return;
 
-LUA_FUNCTION_STATIC(VoiceStream_GetIndex)
-{
-	VoiceStream* pStream = Get_VoiceStream(LUA, 1, true);
-	int index = (int)LUA->CheckNumber(2);
+	float flMaxDistSqr = g_pProximityRules.flDistance * g_pProximityRules.flDistance;
+	const Vector& vecOrigin = g_vecVoiceGridOrigin[iClient];
+	int x, y;
+	GetVoiceGridCoords(vecOrigin, x, y);
+	for (int dx = -1; dx <= 1; ++dx)
+	{
+		for (int dy = -1; dy <= 1; ++dy)
+		{
+			VoiceGridEntry pKey = {GetVoiceGridCell(x + dx, y + dy), 0};
+			auto it = std::lower_bound(g_pVoiceGrid.begin(), g_pVoiceGrid.end(), pKey);
+			for (; it != g_pVoiceGrid.end() && it->iCell == pKey.iCell; ++it)
+			{
+				int iOtherClient = it->iClient;
+				if (iOtherClient == iClient || g_bProximityCustom[iOtherClient] || g_bProximityCustom[iClient])
+					continue;
 
-	VoiceData* data = pStream->GetIndex(index);
-	Push_VoiceData(LUA, data ? data->CreateCopy() : NULL);
-	return 1;
-}
+				if (!CanHearByTeam(iOtherClient, iClient))
+					continue;
 
-LUA_FUNCTION_STATIC(VoiceStream_SetIndex)
-{
-	VoiceStream* pStream = Get_VoiceStream(LUA, 1, true);
-	int index = (int)LUA->CheckNumber(2);
-	VoiceData* pData = Get_VoiceData(LUA, 3, true);
+				if (vecOrigin.DistToSqr(g_vecVoiceGridOrigin[iOtherClient]) > flMaxDistSqr)
+					continue;
 
-	pStream->SetIndex(index, pData->CreateCopy());
-	return 0;
+				gameRulesMask[iOtherClient] = true;
+				proximityMask[iOtherClient] = g_pProximityRules.bProximity;
+			}
+		}
+	}
 }
 
-static CPlayerBitVec* g_PlayerModEnable;
-static CPlayerBitVec* g_BanMasks;
-static CPlayerBitVec* g_SentGameRulesMasks;
-static CPlayerBitVec* g_SentBanMasks;
-static CPlayerBitVec* g_bWantModEnable;
-static double g_fLastPlayerTalked[ABSOLUTE_PLAYER_LIMIT] = {0};
-static double g_fLastPlayerUpdated[ABSOLUTE_PLAYER_LIMIT] = {0};
-static bool g_bIsPlayerTalking[ABSOLUTE_PLAYER_LIMIT] = {0};
-static CVoiceGameMgr* g_pManager = NULL;
-static ConVar voicechat_updateinterval("holylib_voicechat_updateinterval", "0.1", FCVAR_ARCHIVE, "How often we call PlayerCanHearPlayersVoice for the actively talking players. This interval is unique to each player");
-static ConVar voicechat_managerupdateinterval("holylib_voicechat_managerupdateinterval", "0.1", FCVAR_ARCHIVE, "How often we loop through all players to check their voice states. We still check the player's interval to reduce calls if they already have been updated in the last x(your defined interval) seconds.");
-static ConVar voicechat_stopdelay("holylib_voicechat_stopdelay", "1", FCVAR_ARCHIVE, "How many seconds before a player is marked as stopped talking");
-static ConVar voicechat_canhearhimself("holylib_voicechat_canhearhimself", "1", FCVAR_ARCHIVE, "If enabled, we assume the player can always hear himself and thus we save one call for PlayerCanHearPlayersVoice");
 static void UpdatePlayerTalkingState(CBasePlayer* pPlayer, bool bIsTalking = false)
 {
 	if (!g_pManager) // Skip if we have no manager.
@@ -1022,14 +1738,19 @@ static void UpdatePlayerTalkingState(CBasePlayer* pPlayer, bool bIsTalking = fal
 	{
 		bool bCanHearHimself = voicechat_canhearhimself.GetBool();
 		// Build a mask of who they can hear based on the game rules.
-		for(int iOtherClient=0; iOtherClient < g_pManager->m_nMaxPlayers; iOtherClient++)
+		if (g_pProximityRules.bEnabled && !bAllTalk)
 		{
-			CBaseEntity *pEnt = Util::GetCBaseEntityFromEdict(Util::engineserver->PEntityOfEntIndex(iOtherClient + 1));
-			if(pEnt && pEnt->IsPlayer() && 
-				(bCanHearHimself && (iOtherClient == iClient) || (bAllTalk || g_pManager->m_pHelper->CanPlayerHearPlayer((CBasePlayer*)pEnt, pPlayer, bProximity ))) )
+			BuildProximityMask(pPlayer, iClient, bCanHearHimself, gameRulesMask, ProximityMask);
+		} else {
+			for(int iOtherClient=0; iOtherClient < g_pManager->m_nMaxPlayers; iOtherClient++)
 			{
-				gameRulesMask[iOtherClient] = true;
-				ProximityMask[iOtherClient] = bProximity;
+				CBaseEntity *pEnt = Util::GetCBaseEntityFromEdict(Util::engineserver->PEntityOfEntIndex(iOtherClient + 1));
+				if(pEnt && pEnt->IsPlayer() && 
+					(bCanHearHimself && (iOtherClient == iClient) || (bAllTalk || g_pManager->m_pHelper->CanPlayerHearPlayer((CBasePlayer*)pEnt, pPlayer, bProximity ))) )
+				{
+					gameRulesMask[iOtherClient] = true;
+					ProximityMask[iOtherClient] = bProximity;
+				}
 			}
 		}
 	}
@@ -1131,6 +1852,59 @@ void CVoiceChatModule::LevelShutdown()
 		g_bIsPlayerTalking[i] = false;
 	}
 	g_pManager = NULL;
+	g_iVoiceGridTick = -1;
+}
+
+/*
+ * Native filter for HolyLib:PreProcessVoiceChat.
+ * Only players that have it enabled will have their voice packets pushed to Lua,
+ * everyone else is directly broadcasted without ever touching Lua.
+ */
+static bool g_bVoiceHookDefault = true;
+static bool g_bVoiceHookEnabled[ABSOLUTE_PLAYER_LIMIT];
+static void ResetVoiceHookFilter(bool bEnabled)
+{
+	g_bVoiceHookDefault = bEnabled;
+	for (int i = 0; i < ABSOLUTE_PLAYER_LIMIT; ++i)
+		g_bVoiceHookEnabled[i] = bEnabled;
+}
+
+/*
+ * The VoiceData & userdata we push into the HolyLib:PreProcessVoiceChat hook.
+ * Both are reused for every packet so that we don't allocate anything per voice packet.
+ * After the hook was called the userdata will be invalid, Lua has to use VoiceData:CreateCopy() if it wants to keep it.
+ */
+static VoiceData g_pHookVoiceData;
+static LuaUserData* g_pHookVoiceUserData = NULL;
+static void PushHookVoiceData(GarrysMod::Lua::ILuaInterface* pLua)
+{
+	if (!g_pHookVoiceUserData)
+	{
+		g_pHookVoiceUserData = Push_VoiceData(pLua, &g_pHookVoiceData);
+		g_pHookVoiceUserData->CreateReference();
+		return;
+	}
+
+	g_pHookVoiceUserData->SetData(&g_pHookVoiceData);
+	g_pHookVoiceUserData->Push();
+}
+
+static void InvalidateHookVoiceData()
+{
+	if (!g_pHookVoiceUserData)
+		return;
+
+	g_pHookVoiceUserData->SetData(NULL);
+	g_pHookVoiceUserData->ClearLuaTable(); // Don't let any values leak into the next packet.
+}
+
+static void FreeHookVoiceData()
+{
+	if (!g_pHookVoiceUserData)
+		return;
+
+	delete g_pHookVoiceUserData; // Frees the reference & makes the userdata NULL.
+	g_pHookVoiceUserData = NULL;
 }
 
 static Detouring::Hook detour_SV_BroadcastVoiceData;
@@ -1145,7 +1919,9 @@ static void hook_SV_BroadcastVoiceData(IClient* pClient, int nBytes, char* data,
 	UpdatePlayerTalkingState(Util::GetPlayerByClient((CBaseClient*)pClient), true);
 #endif
 
-	if (!voicechat_hooks.GetBool())
+	int iPlayerSlot = pClient->GetPlayerSlot();
+	bool bFiltered = iPlayerSlot < 0 || iPlayerSlot >= ABSOLUTE_PLAYER_LIMIT || !g_bVoiceHookEnabled[iPlayerSlot];
+	if (!voicechat_hooks.GetBool() || bFiltered)
 	{
 		detour_SV_BroadcastVoiceData.GetTrampoline<Symbols::SV_BroadcastVoiceData>()(pClient, nBytes, data, xuid);
 		return;
@@ -1153,29 +1929,13 @@ static void hook_SV_BroadcastVoiceData(IClient* pClient, int nBytes, char* data,
 
 	if (Lua::PushHook("HolyLib:PreProcessVoiceChat"))
 	{
-		VoiceData* pVoiceData = new VoiceData;
-		pVoiceData->SetData(data, nBytes);
-		pVoiceData->iPlayerSlot = pClient->GetPlayerSlot();
-		LuaUserData* pLuaData = Push_VoiceData(g_Lua, pVoiceData);
-		// Stack: -3 = hook.Run(function) | -2 = hook name(string) | -1 = voicedata(userdata)
-		
-		g_Lua->Push(-3);
-		// Stack: -4 = hook.Run(function) | -3 = hook name(string) | -2 = voicedata(userdata) | -1 = hook.Run(function)
-		
-		g_Lua->Push(-3);
-		// Stack: -5 = hook.Run(function) | -4 = hook name(string) | -3 = voicedata(userdata) | -2 = hook.Run(function) | -1 = hook name(string)
-		
-		g_Lua->Remove(-5);
-		// Stack: -4 = hook name(string) | -3 = voicedata(userdata) | -2 = hook.Run(function) | -1 = hook name(string)
-
-		g_Lua->Remove(-4);
-		// Stack: -3 = voicedata(userdata) | -2 = hook.Run(function) | -1 = hook name(string)
+		g_pHookVoiceData.SetData(data, nBytes);
+		g_pHookVoiceData.iPlayerSlot = iPlayerSlot;
+		g_pHookVoiceData.bProximity = true;
 
 		Util::Push_Entity(g_Lua, (CBaseEntity*)Util::GetPlayerByClient((CBaseClient*)pClient));
-		// Stack: -4 = voicedata(userdata) | -3 = hook.Run(function) | -2 = hook name(string) | -1 = entity(userdata)
-
-		g_Lua->Push(-4);
-		// Stack: -5 = voicedata(userdata) | -4 = hook.Run(function) | -3 = hook name(string) | -2 = entity(userdata) | -1 = voicedata(userdata)
+		PushHookVoiceData(g_Lua);
+		// Stack: -4 = hook.Run(function) | -3 = hook name(string) | -2 = entity(userdata) | -1 = voicedata(userdata)
 
 		bool bHandled = false;
 		if (g_Lua->CallFunctionProtected(3, 1, true))
@@ -1184,16 +1944,7 @@ static void hook_SV_BroadcastVoiceData(IClient* pClient, int nBytes, char* data,
 			g_Lua->Pop(1);
 		}
 
-		// Stack: -1 = voicedata(userdata)
-
-		if (pLuaData)
-		{
-			delete pLuaData;
-		}
-
-		delete pVoiceData;
-		g_Lua->SetUserType(-1, NULL);
-		g_Lua->Pop(1); // The voice data is still there, so now finally remove it.
+		InvalidateHookVoiceData();
 
 		if (bHandled)
 			return;
@@ -1302,7 +2053,7 @@ LUA_FUNCTION_STATIC(voicechat_CreateVoiceData)
 	const char* pStr = LUA->CheckStringOpt(2, NULL);
 	int iLength = (int)LUA->CheckNumberOpt(3, 0);
 
-	VoiceData* pData = new VoiceData;
+	VoiceData* pData = VoiceData::Acquire();
 	pData->iPlayerSlot = iPlayerSlot;
 
 	if (pStr)
@@ -1377,7 +2128,7 @@ enum VoiceStreamTaskType {
 	VoiceStreamTask_LOAD,
 };
 
-struct VoiceStreamTask {
+struct VoiceStreamTask : public IJob {
 	~VoiceStreamTask()
 	{
 		if (iReference != -1)
@@ -1404,12 +2155,51 @@ struct VoiceStreamTask {
 	int iReference = -1; // A reference to the pStream to stop the GC from kicking in.
 	int iCallback = -1;
 	GarrysMod::Lua::ILuaInterface* pLua = NULL;
+
+	virtual void Execute();
+};
+
+enum VoiceCodecTaskType {
+	VoiceCodecTask_DECODE,
+	VoiceCodecTask_ENCODE,
+};
+
+/*
+ * A batch of voice data that is decoded/encoded on the job threads.
+ * Everything is copied in before it's queued so the thread never touches Lua objects.
+ */
+struct VoiceCodecTask : public IJob {
+	~VoiceCodecTask()
+	{
+		if (iCallback != -1)
+		{
+			pLua->ReferenceFree(iCallback);
+			iCallback = -1;
+		}
+	}
+
+	VoiceCodecTaskType iType = VoiceCodecTask_DECODE;
+	VoiceStreamTaskStatus iStatus = VoiceStreamTaskStatus_NONE;
+	int iSampleRate = 44100;
+	int iPlayerSlot = 0;
+	uint64 iSteamID64 = 0;
+
+	std::vector<int> pKeys; // Decode: the keys of the given table | Encode: the tick of each VoiceData
+	std::vector<std::string> pInputs; // Decode: each VoiceData | Encode: only contains the PCM data.
+	std::vector<std::string> pOutputs;
+	std::vector<bool> pSuccess;
+
+	int iCallback = -1;
+	GarrysMod::Lua::ILuaInterface* pLua = NULL;
+
+	virtual void Execute();
 };
 
 class LuaVoiceModuleData : public Lua::ModuleData
 {
 public:
 	std::unordered_set<VoiceStreamTask*> pVoiceStreamTasks;
+	std::unordered_set<VoiceCodecTask*> pVoiceCodecTasks;
 };
 
 static std::string_view getFileExtension(const std::string_view& fileName) {
@@ -1420,7 +2210,7 @@ static std::string_view getFileExtension(const std::string_view& fileName) {
 	return fileName.substr(lastDotPos + 1);
 }
 
-static void VoiceStreamJob(VoiceStreamTask*& task)
+static void VoiceStreamJob(VoiceStreamTask* task)
 {
 	switch(task->iType)
 	{
@@ -1484,15 +2274,132 @@ static void VoiceStreamJob(VoiceStreamTask*& task)
 	}
 }
 
-static void AddVoiceJobToPool(VoiceStreamTask* pTask)
+void VoiceStreamTask::Execute()
+{
+	VoiceStreamJob(this);
+}
+
+static void VoiceCodecJob(VoiceCodecTask* task)
+{
+	if (task->iType == VoiceCodecTask_DECODE)
+	{
+		std::vector<int16_t> pDecompressed;
+		task->pOutputs.resize(task->pInputs.size());
+		task->pSuccess.resize(task->pInputs.size());
+		for (size_t i = 0; i < task->pInputs.size(); ++i)
+		{
+			const std::string& pInput = task->pInputs[i];
+			bool bSuccess = VoiceCodec_Decode(pInput.data(), (int)pInput.length(), task->iSampleRate, pDecompressed);
+			task->pSuccess[i] = bSuccess;
+			if (bSuccess)
+				task->pOutputs[i].assign((const char*)pDecompressed.data(), pDecompressed.size() * sizeof(int16_t));
+		}
+	} else {
+		// We encode it into one VoiceData per tick, like VoiceStream::LoadWave does.
+		VoiceCodecState& pState = GetVoiceCodecState();
+		const std::string& pInput = task->pInputs[0];
+		const int16_t* pSamples = (const int16_t*)pInput.data();
+		size_t nSamples = pInput.length() / sizeof(int16_t);
+		if (task->iSampleRate != SAMPLERATE_GMOD_OPUS)
+		{
+			VoiceDSP_ResampleCubic(pSamples, nSamples, task->iSampleRate, SAMPLERATE_GMOD_OPUS, pState.pResampled);
+			pSamples = pState.pResampled.data();
+			nSamples = pState.pResampled.size();
+		}
+
+		const size_t nSamplesPerTick = MAX((size_t)(SAMPLERATE_GMOD_OPUS * gpGlobals->interval_per_tick), (size_t)1);
+		const int iEmptyPacket = sizeof(uint64_t) + (sizeof(char) + sizeof(uint16_t)) * 2 + sizeof(CRC32_t); // Nothing but our header
+		pState.pCodec.ResetState(); // The codec is kept across all chunks so that left over samples move into the next one.
+		pState.pScratch.resize(64 + ((nSamplesPerTick / FRAME_SIZE_GMOD) + 2) * VOICE_CODEC_MAXFRAMEBYTES);
+		for (size_t iOffset = 0, iTick = 0; iOffset < nSamples; iOffset += nSamplesPerTick, ++iTick)
+		{
+			size_t nChunk = MIN(nSamplesPerTick, nSamples - iOffset);
+			bool bFinal = (iOffset + nChunk) >= nSamples; // Pads & flushes the left over partial frame so that the last ~20ms aren't lost.
+			int iBytes = SteamVoice::CompressIntoBuffer(
+				task->iSteamID64, &pState.pCodec,
+				(const char*)(pSamples + iOffset), (int)(nChunk * sizeof(int16_t)),
+				pState.pScratch.data(), (int)pState.pScratch.size(),
+				SAMPLERATE_GMOD_OPUS, bFinal
+			);
+
+			if (iBytes <= iEmptyPacket) // Failed or the codec only queued the samples.
+				continue;
+
+			task->pKeys.push_back((int)iTick);
+			task->pOutputs.emplace_back(pState.pScratch.data(), iBytes);
+		}
+	}
+
+	task->iStatus = VoiceStreamTaskStatus_DONE;
+}
+
+void VoiceCodecTask::Execute()
+{
+	VoiceCodecJob(this);
+}
+
+LUA_FUNCTION_STATIC(voicechat_AsyncDecode)
 {
-	if (!pVoiceThreadPool)
+	LuaVoiceModuleData* pData = (LuaVoiceModuleData*)Lua::GetLuaData(LUA)->GetModuleData(g_pVoiceChatModule.m_pID);
+
+	LUA->CheckType(1, GarrysMod::Lua::Type::Table);
+	LUA->CheckType(2, GarrysMod::Lua::Type::Function);
+	int iSampleRate = (int)LUA->CheckNumberOpt(3, 44100);
+	if (iSampleRate <= 0)
+		LUA->ThrowError("Invalid sampleRate!");
+
+	VoiceCodecTask* task = new VoiceCodecTask;
+	task->iType = VoiceCodecTask_DECODE;
+	task->iSampleRate = iSampleRate;
+	task->pLua = LUA;
+
+	LUA->Push(1);
+	LUA->PushNil();
+	while (LUA->Next(-2))
 	{
-		pVoiceThreadPool = V_CreateThreadPool();
-		Util::StartThreadPool(pVoiceThreadPool, voicechat_threads.GetInt());
+		VoiceData* pVoiceData = Get_VoiceData(LUA, -1, false);
+		if (pVoiceData && LUA->IsType(-2, GarrysMod::Lua::Type::Number))
+		{
+			task->pKeys.push_back((int)LUA->GetNumber(-2));
+			task->pInputs.emplace_back(pVoiceData->pData ? pVoiceData->pData : "", pVoiceData->pData ? pVoiceData->iLength : 0);
+		}
+
+		LUA->Pop(1);
 	}
+	LUA->Pop(1);
+
+	LUA->Push(2);
+	task->iCallback = Util::ReferenceCreate(LUA, "voicechat.AsyncDecode - callback");
+	pData->pVoiceCodecTasks.insert(task);
+	g_pModuleManager.GetJobSystem().Queue(task, JobPriority_HIGH); // Usually wanted as soon as possible, unlike loading/saving a file.
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(voicechat_AsyncEncode)
+{
+	LuaVoiceModuleData* pData = (LuaVoiceModuleData*)Lua::GetLuaData(LUA)->GetModuleData(g_pVoiceChatModule.m_pID);
+
+	const char* pPCM = LUA->CheckString(1);
+	int iLength = LUA->ObjLen(1);
+	LUA->CheckType(2, GarrysMod::Lua::Type::Function);
+	int iSampleRate = (int)LUA->CheckNumberOpt(3, 44100);
+	int iPlayerSlot = (int)LUA->CheckNumberOpt(4, 0);
+	if (iSampleRate <= 0)
+		LUA->ThrowError("Invalid sampleRate!");
+
+	VoiceCodecTask* task = new VoiceCodecTask;
+	task->iType = VoiceCodecTask_ENCODE;
+	task->iSampleRate = iSampleRate;
+	task->iPlayerSlot = iPlayerSlot;
+	task->iSteamID64 = GetVoiceSteamID(iPlayerSlot);
+	task->pInputs.emplace_back(pPCM, iLength);
+	task->pLua = LUA;
 
-	pVoiceThreadPool->QueueCall(&VoiceStreamJob, pTask);
+	LUA->Push(2);
+	task->iCallback = Util::ReferenceCreate(LUA, "voicechat.AsyncEncode - callback");
+	pData->pVoiceCodecTasks.insert(task);
+	g_pModuleManager.GetJobSystem().Queue(task, JobPriority_HIGH);
+	return 0;
 }
 
 LUA_FUNCTION_STATIC(voicechat_LoadVoiceStream)
@@ -1518,7 +2425,7 @@ LUA_FUNCTION_STATIC(voicechat_LoadVoiceStream)
 		LUA->Push(4);
 		task->iCallback = Util::ReferenceCreate(LUA, "voicechat.LoadVoiceStream - callback");
 		pData->pVoiceStreamTasks.insert(task);
-		AddVoiceJobToPool(task);
+		g_pModuleManager.GetJobSystem().Queue(task);
 		return 0;
 	} else {
 		VoiceStreamJob(task);
@@ -1557,7 +2464,7 @@ LUA_FUNCTION_STATIC(voicechat_SaveVoiceStream)
 		LUA->Push(5);
 		task->iCallback = Util::ReferenceCreate(LUA, "voicechat.SaveVoiceStream - callback");
 		pData->pVoiceStreamTasks.insert(task);
-		AddVoiceJobToPool(task);
+		g_pModuleManager.GetJobSystem().Queue(task);
 		return 0;
 	} else {
 		VoiceStreamJob(task);
@@ -1607,22 +2514,188 @@ LUA_FUNCTION_STATIC(voicechat_LastPlayerTalked)
 	return 1;
 }
 
+static int GetLuaPlayerSlot(GarrysMod::Lua::ILuaInterface* LUA, int iStackPos)
+{
+	int iClient = -1;
+	if (LUA->IsType(iStackPos, GarrysMod::Lua::Type::Number))
+	{
+		iClient = LUA->GetNumber(iStackPos);
+	} else {
+		CBasePlayer* pPlayer = Util::Get_Player(LUA, iStackPos, true);
+		iClient = pPlayer->edict()->m_EdictIndex-1;
+	}
+
+	if (iClient < 0 || iClient >= ABSOLUTE_PLAYER_LIMIT)
+		LUA->ThrowError("Failed to get a valid Client index!");
+
+	return iClient;
+}
+
+LUA_FUNCTION_STATIC(voicechat_SetVoiceHookEnabled)
+{
+	bool bEnabled = LUA->GetBool(2);
+	if (LUA->IsType(1, GarrysMod::Lua::Type::Nil))
+	{
+		ResetVoiceHookFilter(bEnabled);
+		return 0;
+	}
+
+	g_bVoiceHookEnabled[GetLuaPlayerSlot(LUA, 1)] = bEnabled;
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(voicechat_IsVoiceHookEnabled)
+{
+	if (LUA->IsType(1, GarrysMod::Lua::Type::Nil))
+	{
+		LUA->PushBool(g_bVoiceHookDefault);
+		return 1;
+	}
+
+	LUA->PushBool(g_bVoiceHookEnabled[GetLuaPlayerSlot(LUA, 1)]);
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(voicechat_SetProximityRules)
+{
+	if (LUA->IsType(1, GarrysMod::Lua::Type::Nil))
+	{
+		g_pProximityRules.bEnabled = false;
+		return 0;
+	}
+
+	LUA->CheckType(1, GarrysMod::Lua::Type::Table);
+
+	ProximityRules pRules;
+	pRules.bEnabled = true;
+
+	LUA->GetField(1, "distance");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+		pRules.flDistance = (float)LUA->GetNumber(-1);
+	LUA->Pop(1);
+
+	LUA->GetField(1, "proximity");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Bool))
+		pRules.bProximity = LUA->GetBool(-1);
+	LUA->Pop(1);
+
+	LUA->GetField(1, "team");
+	if (LUA->IsType(-1, GarrysMod::Lua::Type::Number))
+		pRules.iTeamMode = (int)LUA->GetNumber(-1);
+	LUA->Pop(1);
+
+	if (pRules.iTeamMode < PROXIMITY_TEAM_NONE || pRules.iTeamMode > PROXIMITY_TEAM_GLOBAL)
+		LUA->ThrowError("Invalid team mode! Use the voicechat.PROXIMITY_TEAM_ enums");
+
+	if (pRules.flDistance < 0.0f)
+		pRules.flDistance = 0.0f;
+	else if (pRules.flDistance > 0.0f && pRules.flDistance < 1.0f)
+		pRules.flDistance = 1.0f; // Too small cells would overflow our grid coordinates.
+
+	g_pProximityRules = pRules;
+	g_iVoiceGridTick = -1; // The cell size could have changed so the grid needs to be rebuild.
+	return 0;
+}
+
+LUA_FUNCTION_STATIC(voicechat_GetProximityRules)
+{
+	if (!g_pProximityRules.bEnabled)
+	{
+		LUA->PushNil();
+		return 1;
+	}
+
+	LUA->CreateTable();
+		Util::AddValue(LUA, g_pProximityRules.flDistance, "distance");
+		LUA->PushBool(g_pProximityRules.bProximity);
+		LUA->SetField(-2, "proximity");
+		Util::AddValue(LUA, g_pProximityRules.iTeamMode, "team");
+	return 1;
+}
+
+LUA_FUNCTION_STATIC(voicechat_SetProximityCustom)
+{
+	g_bProximityCustom[GetLuaPlayerSlot(LUA, 1)] = LUA->GetBool(2);
+	return 0;
+}
+
+void CVoiceChatModule::OnClientDisconnect(CBaseClient* pClient)
+{
+	int iPlayerSlot = pClient->GetPlayerSlot();
+	if (iPlayerSlot >= 0 && iPlayerSlot < ABSOLUTE_PLAYER_LIMIT)
+	{
+		g_bVoiceHookEnabled[iPlayerSlot] = g_bVoiceHookDefault; // Slot gets reused so fall back to the default.
+		g_bProximityCustom[iPlayerSlot] = false;
+	}
+}
+
+static void FinishVoiceCodecTasks(GarrysMod::Lua::ILuaInterface* pLua, LuaVoiceModuleData* pData)
+{
+	for (auto it = pData->pVoiceCodecTasks.begin(); it != pData->pVoiceCodecTasks.end(); )
+	{
+		VoiceCodecTask* pTask = *it;
+		if (!pTask->IsIdle())
+		{
+			it++;
+			continue;
+		}
+
+		if (!Lua::CanRunJobCallback(pLua))
+			break;
+
+		pLua->ReferencePush(pTask->iCallback);
+		pLua->PreCreateTable(pTask->iType == VoiceCodecTask_DECODE ? 0 : (int)pTask->pOutputs.size(), 0);
+			for (size_t i = 0; i < pTask->pOutputs.size(); ++i)
+			{
+				if (pTask->iType == VoiceCodecTask_DECODE)
+				{
+					if (pTask->pSuccess[i])
+						pLua->PushString(pTask->pOutputs[i].data(), (unsigned int)pTask->pOutputs[i].length());
+					else
+						pLua->PushNumber(k_EVoiceResultDataCorrupted);
+				} else {
+					VoiceData* pVoiceData = VoiceData::Acquire();
+					pVoiceData->iPlayerSlot = pTask->iPlayerSlot;
+					pVoiceData->SetData(pTask->pOutputs[i].data(), (int)pTask->pOutputs[i].length());
+					Push_VoiceData(pLua, pVoiceData);
+				}
+
+				Util::RawSetI(pLua, -2, pTask->pKeys[i]);
+			}
+
+		pLua->CallFunctionProtected(2, 0, true);
+		Lua::OnJobCallback(pLua);
+
+		delete pTask;
+		it = pData->pVoiceCodecTasks.erase(it);
+	}
+}
+
 void CVoiceChatModule::LuaThink(GarrysMod::Lua::ILuaInterface* pLua)
 {
 	LuaVoiceModuleData* pData = (LuaVoiceModuleData*)Lua::GetLuaData(pLua)->GetModuleData(m_pID);
 
+	if (pLua == g_Lua)
+		UpdateVoicePlaybacks();
+
+	if (pData->pVoiceCodecTasks.size() > 0)
+		FinishVoiceCodecTasks(pLua, pData);
+
 	if (pData->pVoiceStreamTasks.size() <= 0)
 		return;
 
 	for (auto it = pData->pVoiceStreamTasks.begin(); it != pData->pVoiceStreamTasks.end(); )
 	{
 		VoiceStreamTask* pTask = *it;
-		if (pTask->iStatus == VoiceStreamTaskStatus_NONE)
+		if (!pTask->IsIdle()) // Its status might already be set while it's still running.
 		{
 			it++;
 			continue;
 		}
 
+		if (!Lua::CanRunJobCallback(pLua))
+			break;
+
 		if (pTask->iCallback == -1)
 		{
 			Warning(PROJECT_NAME " - VoiceChat(Think): somehow managed to get a task without a callback!\n");
@@ -1644,7 +2717,8 @@ void CVoiceChatModule::LuaThink(GarrysMod::Lua::ILuaInterface* pLua)
 		pLua->PushBool(pTask->iStatus == VoiceStreamTaskStatus_DONE);
 
 		pLua->CallFunctionProtected(2, 0, true);
-		
+		Lua::OnJobCallback(pLua);
+
 		delete pTask;
 		it = pData->pVoiceStreamTasks.erase(it);
 	}
@@ -1689,6 +2763,7 @@ void CVoiceChatModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServer
 		Util::AddFunc(pLua, VoiceStream_GetCount, "GetCount");
 		Util::AddFunc(pLua, VoiceStream_GetIndex, "GetIndex");
 		Util::AddFunc(pLua, VoiceStream_SetIndex, "SetIndex");
+		Util::AddFunc(pLua, VoiceStream_Play, "Play");
 	pLua->Pop(1);
 
 	/*Lua::GetLuaData(pLua)->RegisterMetaTable(Lua::WavAudioFile, pLua->CreateMetaTable("WavAudioFile"));
@@ -1710,20 +2785,61 @@ void CVoiceChatModule::LuaInit(GarrysMod::Lua::ILuaInterface* pLua, bool bServer
 		Util::AddFunc(pLua, voicechat_CreateVoiceStream, "CreateVoiceStream");
 		Util::AddFunc(pLua, voicechat_LoadVoiceStream, "LoadVoiceStream");
 		Util::AddFunc(pLua, voicechat_SaveVoiceStream, "SaveVoiceStream");
+		Util::AddFunc(pLua, voicechat_AsyncDecode, "AsyncDecode");
+		Util::AddFunc(pLua, voicechat_AsyncEncode, "AsyncEncode");
+		Util::AddFunc(pLua, voicechat_StopPlayback, "StopPlayback");
+		Util::AddFunc(pLua, voicechat_IsPlaying, "IsPlaying");
+		Util::AddFunc(pLua, voicechat_GetPlaybackStats, "GetPlaybackStats");
 		Util::AddFunc(pLua, voicechat_IsPlayerTalking, "IsPlayerTalking");
 		Util::AddFunc(pLua, voicechat_LastPlayerTalked, "LastPlayerTalked");
+		Util::AddFunc(pLua, voicechat_SetVoiceHookEnabled, "SetVoiceHookEnabled");
+		Util::AddFunc(pLua, voicechat_IsVoiceHookEnabled, "IsVoiceHookEnabled");
+		Util::AddFunc(pLua, voicechat_SetProximityRules, "SetProximityRules");
+		Util::AddFunc(pLua, voicechat_GetProximityRules, "GetProximityRules");
+		Util::AddFunc(pLua, voicechat_SetProximityCustom, "SetProximityCustom");
+
+		Util::AddValue(pLua, PROXIMITY_TEAM_NONE, "PROXIMITY_TEAM_NONE");
+		Util::AddValue(pLua, PROXIMITY_TEAM_ONLY, "PROXIMITY_TEAM_ONLY");
+		Util::AddValue(pLua, PROXIMITY_TEAM_GLOBAL, "PROXIMITY_TEAM_GLOBAL");
 	Util::FinishTable(pLua, "voicechat");
 }
 
 void CVoiceChatModule::LuaShutdown(GarrysMod::Lua::ILuaInterface* pLua)
 {
+	LuaVoiceModuleData* pData = (LuaVoiceModuleData*)Lua::GetLuaData(pLua)->GetModuleData(m_pID);
+	for (VoiceCodecTask* pTask : pData->pVoiceCodecTasks)
+	{
+		g_pModuleManager.GetJobSystem().Cancel(pTask);
+		delete pTask;
+	}
+	pData->pVoiceCodecTasks.clear();
+
+	for (VoiceStreamTask* pTask : pData->pVoiceStreamTasks)
+	{
+		if (pTask->iType == VoiceStreamTask_SAVE)
+			g_pModuleManager.GetJobSystem().Wait(pTask); // Still save the file.
+		else
+			g_pModuleManager.GetJobSystem().Cancel(pTask);
+
+		if (pTask->pStream != NULL && pTask->iType != VoiceStreamTask_SAVE)
+			delete pTask->pStream;
+
+		delete pTask;
+	}
+	pData->pVoiceStreamTasks.clear();
+
+	if (pLua == g_Lua)
+	{
+		FreeHookVoiceData();
+		ClearVoicePlaybacks();
+	}
+
 	Util::NukeTable(pLua, "voicechat");
 }
 
 void CVoiceChatModule::Shutdown()
 {
-	V_DestroyThreadPool(pVoiceThreadPool);
-	pVoiceThreadPool = NULL;
+	ClearVoiceDataPool();
 }
 
 IVoiceServer* g_pVoiceServer = NULL;
@@ -1738,6 +2854,18 @@ void CVoiceChatModule::Init(CreateInterfaceFn* appfn, CreateInterfaceFn* gamefn)
 	}
 
 	Detour::CheckValue("get interface", "g_pVoiceServer", g_pVoiceServer != NULL);
+
+	if (gamefn[0])
+	{
+		g_pPlayerInfoManager = (IPlayerInfoManager*)gamefn[0](INTERFACEVERSION_PLAYERINFOMANAGER, NULL);
+	} else {
+		SourceSDK::FactoryLoader server_loader("server");
+		g_pPlayerInfoManager = server_loader.GetInterface<IPlayerInfoManager>(INTERFACEVERSION_PLAYERINFOMANAGER);
+	}
+
+	Detour::CheckValue("get interface", "playerinfomanager", g_pPlayerInfoManager != NULL);
+
+	ResetVoiceHookFilter(true);
 }
 
 void CVoiceChatModule::InitDetour(bool bPreServer)
@@ -54,6 +54,9 @@ namespace SteamOpus {
         virtual bool ResetState() {
             opus_decoder_ctl(dec, OPUS_RESET_STATE);
             opus_encoder_ctl(enc, OPUS_RESET_STATE);
+            sample_buf.clear();
+            m_seq = 0;
+            m_encodeSeq = 0;
             return true;
         }
 
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <algorithm>
 #include <opus/ivoicecodec.h>
 #include <checksum_crc.h>
 
@@ -10,6 +11,10 @@ namespace SteamVoice {
 		OP_SAMPLERATE = 11
 	};
 
+	//Max samples we put into a single OP_CODEC_OPUSPLC operation.
+	//50 frames (+1 left over from the codec) of 480 samples can't exceed its uint16_t length even if every opus frame has its max size of 1275 bytes.
+	constexpr int MAX_OPUSPLC_BLOCK_SAMPLES = 24000;
+
 	//Outputs bytes written or -1 on corruption
 	int DecompressIntoBuffer(IVoiceCodec* codec, const char* compressedData, int compressedLen, char* decompressedOut, int maxDecompressed) {
 		const char* curRead = compressedData;
@@ -76,8 +81,39 @@ namespace SteamVoice {
 		return curWrite - decompressedOut;
 	}
 
+	//Outputs the number of opus frames inside the packet, which can be used to size the buffer for DecompressIntoBuffer
+	int GetFrameCount(const char* compressedData, int compressedLen) {
+		const char* curRead = compressedData + sizeof(uint64_t);
+		const char* maxRead = compressedData + compressedLen - sizeof(uint32_t);
+		int frames = 0;
+
+		while (curRead + sizeof(char) + sizeof(uint16_t) <= maxRead) {
+			char opcode = *curRead;
+			uint16_t opLen = *(uint16_t*)(curRead + sizeof(char));
+			curRead += sizeof(char) + sizeof(uint16_t);
+			if (opcode != OP_CODEC_OPUSPLC)
+				continue;
+
+			//Every frame is its length, its sequence and then its data. A length of 0xFFFF resets the codec.
+			const char* blockEnd = std::min(curRead + opLen, maxRead);
+			while (curRead + sizeof(uint16_t) <= blockEnd) {
+				uint16_t frameLen = *(uint16_t*)curRead;
+				curRead += sizeof(uint16_t);
+				if (frameLen == 0xFFFF)
+					continue;
+
+				curRead += sizeof(uint16_t) + frameLen;
+				++frames;
+			}
+			curRead = blockEnd;
+		}
+
+		return frames;
+	}
+
 	//Outputs number of bytes written or -1 on failure
-	int CompressIntoBuffer(uint64_t steamid, IVoiceCodec* codec, const char* inputData, int inputLen, char* compressedOut, int maxCompressed, int sampleRate) {
+	//If bFinal is set, the codec's left over samples are padded into a last frame instead of being kept for the next call
+	int CompressIntoBuffer(uint64_t steamid, IVoiceCodec* codec, const char* inputData, int inputLen, char* compressedOut, int maxCompressed, int sampleRate, bool bFinal = false) {
 		char* curWrite = compressedOut;
 		char* maxWrite = compressedOut + maxCompressed;
 
@@ -96,24 +132,32 @@ namespace SteamVoice {
 		*(uint16_t*)curWrite = sampleRate;
 		curWrite += sizeof(uint16_t);
 
-		//Write opus codec operation
-		if (curWrite + sizeof(char) + sizeof(uint16_t) > maxWrite)
-			return -1;
+		//Write opus codec operations, long input is split into multiple since their length is only a uint16_t
+		const char* curRead = inputData;
+		const char* maxRead = inputData + (inputLen & ~1);
+		do {
+			int blockLen = (int)std::min<ptrdiff_t>(maxRead - curRead, MAX_OPUSPLC_BLOCK_SAMPLES * sizeof(uint16_t));
+			bool lastBlock = curRead + blockLen >= maxRead;
 
-		*curWrite = OP_CODEC_OPUSPLC;
-		curWrite += sizeof(char);
+			if (curWrite + sizeof(char) + sizeof(uint16_t) > maxWrite)
+				return -1;
 
-		//Setup address to write to with compression length 
-		uint16_t* outLenAddr = (uint16_t*)curWrite;
-		curWrite += sizeof(uint16_t);
+			*curWrite = OP_CODEC_OPUSPLC;
+			curWrite += sizeof(char);
 
-		int compressedBytes = codec->Compress(inputData, inputLen / 2, curWrite, maxWrite - curWrite, false);
+			//Setup address to write to with compression length 
+			uint16_t* outLenAddr = (uint16_t*)curWrite;
+			curWrite += sizeof(uint16_t);
 
-		if (compressedBytes < 0)
-			return -1;
+			int compressedBytes = codec->Compress(curRead, blockLen / 2, curWrite, (int)std::min<ptrdiff_t>(maxWrite - curWrite, UINT16_MAX), bFinal && lastBlock);
+
+			if (compressedBytes < 0)
+				return -1;
 
-		curWrite += compressedBytes;
-		*outLenAddr = compressedBytes;
+			curWrite += compressedBytes;
+			*outLenAddr = compressedBytes;
+			curRead += blockLen;
+		} while (curRead < maxRead);
 
 		if (curWrite + sizeof(CRC32_t) > maxWrite)
 			return -1;
@@ -318,6 +318,10 @@ void CServerPlugin::ClientSettingsChanged(edict_t *pEdict)
 //---------------------------------------------------------------------------------
 PLUGIN_RESULT CServerPlugin::ClientConnect(bool* bAllowConnect, edict_t* pEntity, const char* pszName, const char* pszAddress, char* reject, int maxrejectlen)
 {
+	CBaseClient* pClient = Util::GetClientByUserID(Util::engineserver->GetPlayerUserId(pEntity));
+	if (pClient)
+		g_pModuleManager.OnClientConnect(pClient);
+
 	return PLUGIN_CONTINUE;
 }
 
@@ -102,8 +102,7 @@ public:
 	virtual void OnEntityDeleted(CBaseEntity* pEntity) { (void)pEntity; };
 
 	// Called when a client connects to the server and is assigned a CBaseClient
-	// NOTE: This callback is currently not implemented!
-	// ToDo: Hook into CBaseClient::Connect and call this callback from there!
+	// NOTE: This is called from IServerPluginCallbacks::ClientConnect, the client might not be fully setup yet!
 	virtual void OnClientConnect(CBaseClient* pClient) { (void)pClient; };
 
 	// Called when a client disconnects from the server and their CBaseClient is cleared
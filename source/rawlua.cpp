@@ -86,6 +86,15 @@ uint16_t RawLua::GetCDataType(lua_State* L, int idx)
 	return -1;
 }
 
+const void* RawLua::GetTablePointer(lua_State* L, int idx)
+{
+	cTValue *o = index2adr(L, idx);
+	if (tvistab(o))
+		return tabV(o);
+
+	return NULL;
+}
+
 int table_setreadonly(lua_State* L)
 {
 	GCtab *t = lj_lib_checktab(L, 1);
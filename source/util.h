@@ -8,6 +8,7 @@
 #include "symbols.h"
 #include "unordered_set"
 #include <shared_mutex>
+#include <atomic>
 
 #define DEDICATED
 #include "vstdlib/jobthread.h"
@@ -965,6 +966,83 @@ class bf_write;
 extern LuaUserData* Push_bf_write(GarrysMod::Lua::ILuaInterface* LUA, bf_write* tbl, bool bDeleteUs);
 extern bf_write* Get_bf_write(GarrysMod::Lua::ILuaInterface* LUA, int iStackPos, bool bError);
 
+/*
+ * Reference counted binary data used by ByteBuffer's (util module).
+ * AddRef/Release are safe to call from any thread, the data itself is never modified after creation.
+ * It's allocated using malloc so that it can take ownership of buffers like the ones returned by COM_Compress_LZ4.
+ */
+struct ByteBufferStorage
+{
+	ByteBufferStorage(char* pBuffer, unsigned int iBufferSize) : pData(pBuffer), iSize(iBufferSize) {}
+
+	inline void AddRef()
+	{
+		++iReferences;
+	}
+
+	inline void Release()
+	{
+		if (--iReferences == 0)
+		{
+			free(pData);
+			delete this;
+		}
+	}
+
+	char* pData = NULL;
+	unsigned int iSize = 0;
+	std::atomic<int> iReferences{1};
+};
+
+/*
+ * A view into a ByteBufferStorage, ByteBuffer:Slice creates a new view sharing the same storage.
+ */
+struct ByteBuffer
+{
+	ByteBuffer(ByteBufferStorage* pBufferStorage, unsigned int iBufferOffset, unsigned int iBufferLength) : pStorage(pBufferStorage), iOffset(iBufferOffset), iLength(iBufferLength)
+	{
+		pStorage->AddRef();
+	}
+
+	~ByteBuffer()
+	{
+		pStorage->Release();
+	}
+
+	inline const char* GetData()
+	{
+		return pStorage->pData + iOffset;
+	}
+
+	ByteBufferStorage* pStorage;
+	unsigned int iOffset;
+	unsigned int iLength;
+};
+
+extern LuaUserData* Push_ByteBuffer(GarrysMod::Lua::ILuaInterface* LUA, ByteBuffer* pBuffer); // It will be deleted by Lua GC.
+extern LuaUserData* Push_ByteBuffer(GarrysMod::Lua::ILuaInterface* LUA, void* pData, unsigned int iLength); // Takes ownership of the malloc'd data.
+extern ByteBuffer* Get_ByteBuffer(GarrysMod::Lua::ILuaInterface* LUA, int iStackPos, bool bError);
+
+/*
+ * Returns the data of the string or ByteBuffer at the given stack position or throws an error if it's neither.
+ * Keep the value on the stack/referenced while using the data.
+ */
+extern const char* Get_BinaryData(GarrysMod::Lua::ILuaInterface* LUA, int iStackPos, unsigned int& iLength);
+
+/*
+ * Serializes the table at the given stack position using the format of util.TableToBinary (util module).
+ * If pBuffers is given, ByteBuffers inside the table are added to it as new views instead of being written as nil.
+ * Returns false if the table contains a cyclic reference or if the util module isn't loaded in the given Lua state.
+ */
+extern bool BinaryWriteTable(GarrysMod::Lua::ILuaInterface* LUA, int iStackPos, std::string& strOut, std::vector<ByteBuffer*>* pBuffers = NULL);
+
+/*
+ * Pushes the table of the given util.TableToBinary data.
+ * pBuffers has to be the list filled by BinaryWriteTable if it contains ByteBuffers, they stay owned by the caller.
+ * Returns false and pushes nothing if the data is invalid.
+ */
+extern bool BinaryPushTable(GarrysMod::Lua::ILuaInterface* LUA, const char* pData, unsigned int iLength, std::vector<ByteBuffer*>* pBuffers = NULL);
+
 class IGameEvent;
 extern IGameEvent* Get_IGameEvent(GarrysMod::Lua::ILuaInterface* LUA, int iStackPos, bool bError);
 